@@ -15,169 +15,10 @@
 #include "image.h"
 #include "templates.h"
 #include "patches.h"
-#include "patch_mapper.h"
-#include "bitfun.h"
+#include "nlm.h"
 #include "config.h"
 #include "logging.h"
-
-/*---------------------------------------------------------------------------------------*/
-
-static upixel_t* all_patches;
-
-static upixel_t * extract_patches ( const image_t* img, const patch_template_t* tpl ) {
-    //
-    // determine total number of patches in image
-    //
-    const index_t n = img->info.width;
-    const index_t m = img->info.height;
-    const index_t npatches = m * n;
-    const size_t ki = tpl->k;
-    const size_t ko = compute_binary_mapping_samples ( ki );
-    debug ( "allocating %ld bytes for all %ld patches\n", sizeof( upixel_t ) * ko * npatches, npatches );
-    all_patches = ( upixel_t* ) malloc ( ko * npatches * sizeof( upixel_t ) );
-    patch_t* p = alloc_patch ( ki );
-    patch_t* q = alloc_patch ( ko );
-    linear_template_t* ltpl = linearize_template ( tpl, m, n );
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            get_linear_patch ( img, ltpl, i, j, p );
-            //
-            // binarize
-            //
-            binary_patch_mapper ( p, q );
-            // copy raw bytes: this bypasses sign, which is good for us
-            memcpy ( all_patches + li * ko, q->values, ko * sizeof( upixel_t ) );
-#ifdef INSANE_DEBUG
-            info ( "i %d j %d patch:", i, j );
-            for ( int kk = 0 ; kk < ko ; kk++ ) {
-                info ( "%x ", *( all_patches + li * ko + kk ) );
-            }
-            info ( "\n" );
-#endif
-        }
-    }
-    free_linear_template ( ltpl );
-    free_patch ( q );
-    free_patch ( p );
-    return all_patches;
-}
-
-static float * create_gaussian_weights ( const patch_template_t* tpl, const float sigma ) {
-    const int k = tpl->k;
-    float* weights = ( float* ) malloc ( k * sizeof( float ) );
-    float n = 0.0f;
-    for ( int r = 0 ; r < k ; ++r ) {
-        const float i = fabs ( ( double ) tpl->coords[ r ].i );
-        const float j = fabs ( ( double ) tpl->coords[ r ].j );
-        const float w = exp ( -0.5 * ( i * i + j * j ) / ( sigma * sigma ) );
-        weights[ r ] = w;
-        n += w;
-    }
-    // normalize  so that sum is not 1 but a large integer number
-    for ( int r = 0 ; r < k ; ++r ) {
-        weights[ r ] /= n;
-    }
-    return weights;
-}
-
-/*---------------------------------------------------------------------------------------*/
-
-/**
- * the distance between two patches is computed as the number of different
- * bits between their binary representations.
- * we must handle raw bytes and conver them to the appropriate sizes
- */
-static int patch_dist ( const index_t i, const index_t j, const patch_template_t* tpl ) {
-    const index_t nsamples = compute_binary_mapping_samples ( tpl->k );
-    const upixel_t* samplesi = &all_patches[ nsamples * i ];
-    const upixel_t* samplesj = &all_patches[ nsamples * j ];
-#ifdef INSANE_DEBUG
-    info ( "dist: patch %d:", i );
-    for ( int kk = 0 ; kk < nsamples ; ++kk ) {
-        info ( "%x ", samplesi[ kk ] );
-    }
-    info ( "\n" );
-    info ( "dist: patch %d:", j );
-    for ( int kk = 0 ; kk < nsamples ; ++kk ) {
-        info ( "%x ", samplesj[ kk ] );
-    }
-    info ( "\n" );
-#endif
-    int d = 0;
-    for ( index_t k = 0 ; k < nsamples ; ++k ) {
-        upixel_t bdif = samplesi[ k ] ^ samplesj[ k ];
-        d += block_weight ( bdif );
-    }
-    return d;
-}
-
-/*---------------------------------------------------------------------------------------*/
-
-static index_t apply_denoiser ( image_t* out, const image_t* img,
-                         const patch_template_t* tpl, config_t* cfg ) {
-
-    const index_t R = cfg->search_radius;
-    const double p01 = cfg->p01;
-    const double p10 = cfg->p10;
-    const double pe = p01 + p10;
-
-    const index_t maxd = (int)((double)tpl->k * pe * 2.0 + 0.5) + 1; // make sure that it is never 0
-    const double h = cfg->nlm_weight_scale;
-    const double C = -0.5 / ( h * h );
-    float* w = create_gaussian_weights ( tpl, h );
-    debug("NLM h=%f C=%f p01=%f p10=%f R=%ld maxd=%d\n",h,C,p01,p10,R, maxd);
-
-    //index_t w[ maxd ];
-    //for ( index_t d = 0 ; d < maxd ; ++d ) {
-    //    w[ d ] = 1024 / ( ( d >> cfg->decay ) + 1 );
-    //    info ( "dist %ld weight %ld\n", d, w[ d ] );
-    //}
-
-    const int m = img->info.height;
-    const int n = img->info.width;
-    index_t oned = 0;
-    index_t zeroed = 0;
-
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            double y = 0.0;
-            double norm = 0.0;
-            int di0 = i > R     ? i - R : 0;
-            int di1 = i < ( m - R ) ? i + R : m;
-            int dj0 = j > R     ? j - R : 0;
-            int dj1 = j < ( n - R ) ? j + R : n;
-            for ( int di = di0 ; di < di1 ; ++di ) {
-                for ( int dj = dj0 ; dj < dj1 ; ++dj ) {
-                    const index_t lj = di * n + dj;
-                    const int d = patch_dist ( li, lj, tpl );
-                    if ( d > maxd ) {
-                        continue;
-                    }
-                    if ( get_pixel ( img, di, dj ) ) {
-                        y += w[ d - 1 ];
-                    }
-                    norm += w[ d - 1 ];
-                }
-            }
-	    if (norm == 0.0) 
-		    continue;
-            const pixel_t z = get_linear_pixel ( img, li );
-            const pixel_t x = (2.0*y) > norm ? 1: 0; //cfg->denoiser ( z, y, norm, p01, p10 );
-            if ( z != x ) {
-                set_linear_pixel ( out, li, x );
-                if ( x )
-                    oned++;
-                else
-                    zeroed++;
-            }
-        }
-        if ( cfg->verbose && !( i % 500 ) ) {
-            info ( "| %6d | 1->0 %8ld | 0->1 %8ld |\n", i, zeroed, oned );
-        }
-    }
-    free(w);
-    return zeroed + oned;
-}
+#include "instrument.h"
 
 /*---------------------------------------------------------------------------------------*/
 
@@ -226,20 +67,33 @@ int main ( int argc, char* argv[] ) {
     // non-local means
     // search a window of size R
     //
-    extract_patches ( img, tpl );
-
-    apply_denoiser ( &out, img, tpl, &cfg );
+    nlm_params_t par;
+    par.search_radius = cfg.search_radius;
+    par.p01 = cfg.p01;
+    par.p10 = cfg.p10;
+    par.weight_scale = cfg.nlm_weight_scale;
+    par.window_scale = cfg.nlm_window_scale;
+    par.early_exit = cfg.early_exit;
+    par.visit_all = cfg.visit_all;
+    par.verbose = cfg.verbose;
+    void* workspace = malloc ( bin_nlm_workspace_size ( &img->info, tpl, &par ) );
+    bin_nlm_ctx_t ctx;
+    init_bin_nlm ( &ctx, &img->info, tpl, &par, workspace );
+    bin_nlm_denoise ( &ctx, img, &out );
 
     int res = write_pnm ( cfg.output_file, &out );
     if ( res != RESULT_OK ) {
         fprintf ( stderr, "error writing image %s.\n", cfg.output_file );
     }
 
-    free ( all_patches );
+    free ( workspace );
     free_patch_template ( tpl );
     pixels_free ( img->pixels );
     pixels_free ( out.pixels );
     free ( img );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.input_file ) != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing metrics to %s.\n", cfg.metrics_file );
+    }
     return res;
 }
 
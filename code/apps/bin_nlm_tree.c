@@ -14,62 +14,11 @@
 #include "image.h"
 #include "templates.h"
 #include "patches.h"
-#include "bitfun.h"
 #include "stats.h"
+#include "nlm_tree.h"
 #include "config.h"
 #include "logging.h"
-
-/*---------------------------------------------------------------------------------------*/
-
-index_t apply_denoiser ( image_t* out, const image_t* img,
-                         const patch_template_t* tpl, patch_node_t* stats, config_t* cfg ) {
-
-    const double p01 = cfg->p01;
-    const double p10 = cfg->p10;
-    const double pe = p01 + p10;
-
-    const index_t maxd = (int)((double)tpl->k * pe *2.0 + 0.5);
-
-    double w[ maxd+1 ];
-    for ( index_t d = 0 ; d <= maxd ; ++d ) {
-        w[ d ] = 1.0 / ( d + 1.0 );
-    }
-    patch_t* Pij = alloc_patch ( tpl->k );
-    index_t changed = 0;
-    const int m = img->info.height;
-    const int n = img->info.width;
-    index_t no_neigh = 0;
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            get_patch ( img, tpl, i, j, Pij );
-            double y = 0;
-            double norm = 0;
-            neighbor_list_t neighbors = find_neighbors ( stats, Pij, maxd );
-            if (neighbors.number == 0) {
-                no_neigh ++;
-            }
-            for ( int i = 0 ; i < neighbors.number ; ++i ) {
-                const index_t d = neighbors.neighbors[ i ].dist;
-                const patch_node_t* node = neighbors.neighbors[ i ].patch_node;
-                y += w[ d ] * (double) node->counts;
-                norm += w[ d ] * (double) node->occu;
-            }
-            free ( neighbors.neighbors );
-            const pixel_t z = get_linear_pixel ( img, li );
-            const pixel_t x = (pixel_t) cfg->denoiser ( z, y, norm, p01, p10 );
-            if ( z != x ) {
-                set_linear_pixel ( out, li, x );
-                changed++;
-            }
-        }
-        if ( ( i > 0 ) &&!( i % 1000 ) ) {
-            info ( "row %d changed %ld ( %7.4f%% )\n", i, changed, ( double ) changed * 100.0 / ( double ) li );
-        }
-    }
-    info("no neighbors found in %lu cases.\n",no_neigh);    
-    free_patch ( Pij );
-    return changed;
-}
+#include "instrument.h"
 
 /*---------------------------------------------------------------------------------------*/
 
@@ -130,40 +79,70 @@ int main ( int argc, char* argv[] ) {
     info("Using the following template:\n");
     sort_template(tpl,1);
     //print_template(tpl);
+    nlm_tree_params_t par;
+    par.p01 = cfg.p01;
+    par.p10 = cfg.p10;
+    par.max_dist = cfg.max_dist;
+    par.max_clusters = cfg.max_clusters;
+    par.min_occu = 100;
+    par.denoiser = cfg.denoiser;
+    par.visit_all = cfg.visit_all;
+    void* workspace = malloc ( nlm_tree_workspace_size ( tpl ) );
+    nlm_tree_ctx_t ctx;
+    init_nlm_tree ( &ctx, tpl, &par, workspace );
     //
     // gather patch stats
     //
     patch_node_t* stats;
-    if ( cfg.stats_file ) {
+    if ( cfg.clusters_file ) {
         //
-        // load patches from a file
-        // the patches from this file need not have been
-        // generated from this image, but the template
-        // must have been the same
+        // the clusters were computed beforehand by cluster_stats,
+        // with the same template
         //
-        info ( "loading patch statistics from file....\n" );
-        stats = load_stats ( cfg.stats_file );
+        info ( "loading cluster model from file....\n" );
+        cluster_params_t cpar;
+        stats = load_clusters ( cfg.clusters_file, &cpar );
+        if ( stats && ( cpar.k != tpl->k ) ) {
+            fprintf ( stderr, "cluster model %s is for templates of %ld samples, not %ld.\n",
+                      cfg.clusters_file, cpar.k, tpl->k );
+            free_node ( stats );
+            stats = NULL;
+        }
         if ( !stats ) {
-            fprintf ( stderr, "could not load stats from %s.\n", cfg.stats_file );
+            free ( workspace );
             free_patch_template ( tpl );
             pixels_free ( img->pixels );
             free ( img );
             return RESULT_ERROR;
         }
+        info ( "clusters made with maxdist %ld minoccu %ld maxclusters %ld.\n",
+               cpar.maxd, cpar.minoccu, cpar.maxclusters );
+        info ( "denoising....\n" );
+        nlm_tree_apply ( &ctx, stats, img, &out );
     } else {
-        info ( "gathering patch stats from image....\n" );
-        stats = gather_patch_stats ( img, pre, tpl, NULL, NULL );
+        if ( cfg.stats_file ) {
+            //
+            // load patches from a file
+            // the patches from this file need not have been
+            // generated from this image, but the template
+            // must have been the same
+            //
+            info ( "loading patch statistics from file....\n" );
+            stats = load_stats ( cfg.stats_file );
+            if ( !stats ) {
+                fprintf ( stderr, "could not load stats from %s.\n", cfg.stats_file );
+                free ( workspace );
+                free_patch_template ( tpl );
+                pixels_free ( img->pixels );
+                free ( img );
+                return RESULT_ERROR;
+            }
+        } else {
+            info ( "gathering patch stats from image....\n" );
+            stats = gather_patch_stats ( img, pre, tpl, NULL, NULL );
+        }
+        nlm_tree_denoise ( &ctx, stats, img, &out );
     }
-#if 1
-    const index_t minoccu = 100;
-    info ( "clustering patches....\n" );
-    patch_node_t * clustered = cluster_stats ( stats, tpl->k, cfg.max_dist, minoccu, cfg.max_clusters );
-    //print_patch_stats ( clustered, tpl->k );
-#else
-    patch_node_t* clustered = stats;
-#endif
-    info ( "denoising....\n" );
-    apply_denoiser ( &out, img, tpl, clustered, &cfg );
 
     info ( "saving result...\n" );
     int res = write_pnm ( cfg.output_file, &out );
@@ -172,8 +151,7 @@ int main ( int argc, char* argv[] ) {
     }
 
     info ( "finishing...\n" );
-    if (clustered != stats)
-        free_node ( clustered );
+    free ( workspace );
     free_node ( stats );
     free_patch_template ( tpl );
     pixels_free ( img->pixels );
@@ -183,6 +161,9 @@ int main ( int argc, char* argv[] ) {
         free ( pre );
     }
     free ( img );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.input_file ) != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing metrics to %s.\n", cfg.metrics_file );
+    }
     return res;
 }
 
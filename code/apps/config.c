@@ -26,8 +26,15 @@ static struct argp_option options[] = {
     {"nlmwin",         'h', "scale",   0, "non-local means window scale", 0 },
     {"nlmweight",      'H', "scale",   0, "non-local means weight scale", 0 },
     {"stats",          'S', "stats",   0, "stats filename.", 0 },
+    {"clusters",       'K', "file",    0, "cluster model made by cluster_stats; bin_nlm_tree uses it instead of clustering the stats.", 0 },
     {"denoiser",       'D', "rule",    0, "denoising rule.", 0 },
-    {"iterations",     'I', "number",  0, "number of iterations of denoiser. Default 1 (no iterations).", 0 },
+    {"iterations",     'I', "number",  0, "number of iterations of denoiser. Default 1 (no iterations); 0 iterates quorum_den until nothing changes.", 0 },
+    {"early-exit",     'E', 0,         0, "stop scanning the NLM search window once the decision cannot change.", 0 },
+    {"auto-noise",     'A', 0,         0, "estimate P(0->1) and P(1->0) from the statistics of the input (quorum_den, bin_dude).", 0 },
+    {"fused",          'U', 0,         0, "quorum: recompute the patch sums when applying the rule instead of storing them.", 0 },
+    {"visit-all",      'V', 0,         0, "process every pixel, even those in uniform areas whose result is known; for checking.", 0 },
+    {"sorted-stats",   'B', 0,         0, "bin_dude: gather the statistics into a sorted table (by radix sort) instead of a tree.", 0 },
+    {"metrics",        'M', "file",    0, "append the time spent in each stage and event counts to file as a JSON line (- for stdout).", 0 },
     { 0 } // terminator
 };
 
@@ -58,8 +65,10 @@ config_t parse_opt ( int argc, char* * argv ) {
     cfg.input_file  = NULL;
     cfg.output_file = "denoised.pnm";
     cfg.stats_file = NULL;
+    cfg.clusters_file = NULL;
     cfg.template_file = NULL;
     cfg.prefiltered_file = NULL;
+    cfg.metrics_file = NULL;
     cfg.template_radius = 4;
     cfg.template_norm = 2;
     cfg.template_center = 0;  // exclude center
@@ -76,6 +85,12 @@ config_t parse_opt ( int argc, char* * argv ) {
     cfg.seed = 42;
     cfg.verbose = 0;
     cfg.iterations = 1;
+    cfg.early_exit = 0;
+    cfg.fused = 0;
+    cfg.auto_noise = 0;
+    cfg.visit_all = 0;
+    cfg.sorted_stats = 0;
+    set_log_level ( LOG_INFO );
     argp_parse ( &argp, argc, argv, 0, 0, &cfg );
 
     return cfg;
@@ -88,7 +103,6 @@ static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
     /* Get the input argument from argp_parse,
      * which we know is a pointer to our arguments structure.
      */
-    set_log_level(LOG_INFO);
     config_t * cfg = ( config_t* ) state->input;
     switch ( key ) {
     case 'q':
@@ -107,6 +121,9 @@ static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
     case 'S':
         cfg->stats_file = arg;
         break;
+    case 'K':
+        cfg->clusters_file = arg;
+        break;
     case 'F':
         cfg->prefiltered_file = arg;
         break;
@@ -144,6 +161,24 @@ static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
     case 'I':
         cfg->iterations = atoi ( arg );
         break;
+    case 'E':
+        cfg->early_exit = 1;
+        break;
+    case 'U':
+        cfg->fused = 1;
+        break;
+    case 'A':
+        cfg->auto_noise = 1;
+        break;
+    case 'V':
+        cfg->visit_all = 1;
+        break;
+    case 'B':
+        cfg->sorted_stats = 1;
+        break;
+    case 'M':
+        cfg->metrics_file = arg;
+        break;
     case 'h':
         cfg->nlm_window_scale = atof ( arg );
         break;
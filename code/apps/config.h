@@ -11,8 +11,10 @@ typedef struct config {
     const char * input_file;
     const char * output_file;
     const char * stats_file;
+    const char * clusters_file;
     const char * template_file;
     const char * prefiltered_file;
+    const char * metrics_file;
     int template_radius;
     int template_norm;
     int template_center;
@@ -28,6 +30,11 @@ typedef struct config {
     int seed;
     int verbose;
     int iterations;
+    int early_exit;
+    int fused;
+    int auto_noise;
+    int visit_all;
+    int sorted_stats;
     denoiser_f denoiser;
 } config_t;
 
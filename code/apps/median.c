@@ -7,8 +7,10 @@
 #include "image.h"
 #include "templates.h"
 #include "patches.h"
+#include "median.h"
 #include "config.h"
 #include "logging.h"
+#include "instrument.h"
 
 int main ( int argc, char* argv[] ) {
 
@@ -49,34 +51,12 @@ int main ( int argc, char* argv[] ) {
     out.info = img->info;
     out.pixels = pixels_copy ( &img->info, img->pixels );
     //
-    //
-    //
-    const int m = img->info.height;
-    const int n = img->info.width;
-    //
-    // create template
-    //
-    patch_t* pat, * pot;
-
-
-    pat = alloc_patch ( tpl->k );
-    pot = alloc_patch ( tpl->k );
-    //
     // median of neighborhood
     //
-    const int k = tpl->k;
-    linear_template_t* ltpl = linearize_template ( tpl, m, n );
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            get_linear_patch ( img, ltpl, i, j, pat );
-            long a = 0;
-            for (int r = 0; r < k; ++r) {
-                a += pat->values[r];
-            } 
-            const int x = ((a<<1) >= k) ? 1 : 0;
-            set_linear_pixel ( &out, li, x );
-        }
-    }
+    void* workspace = malloc ( median_workspace_size ( &img->info, tpl ) );
+    median_ctx_t ctx;
+    init_median ( &ctx, &img->info, tpl, workspace );
+    median_filter ( &ctx, img, &out );
     //
     //
     //
@@ -84,12 +64,13 @@ int main ( int argc, char* argv[] ) {
     if ( res != RESULT_OK ) {
         fprintf ( stderr, "error writing image %s.\n", cfg.output_file );
     }
-    free_patch ( pot );
-    free_patch ( pat );
-    free_linear_template ( ltpl );
+    free ( workspace );
     free_patch_template ( tpl );
     pixels_free ( img->pixels );
     pixels_free ( out.pixels );
     free ( img );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.input_file ) != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing metrics to %s.\n", cfg.metrics_file );
+    }
     return res;
 }
@@ -7,37 +7,10 @@
 #include "image.h"
 #include "templates.h"
 #include "patches.h"
+#include "nlm.h"
 #include "config.h"
 #include "logging.h"
-
-static float * create_gaussian_weights ( patch_template_t* tpl, const float sigma ) {
-    const int k = tpl->k;
-    float* weights = ( float* ) malloc ( k * sizeof( float ) );
-    float n = 0.0f;
-    for ( int r = 0 ; r < k ; ++r ) {
-        const float i = fabs ( ( double ) tpl->coords[ r ].i );
-        const float j = fabs ( ( double ) tpl->coords[ r ].j );
-        const float w = exp ( -0.5 * ( i * i + j * j ) / ( sigma * sigma ) );
-        weights[ r ] = w;
-        n += w;
-    }
-    // normalize  so that sum is 1
-    for ( int r = 0 ; r < k ; ++r ) {
-        weights[ r ] /= n;
-    }
-    return weights;
-}
-
-static double patch_dist ( const patch_t* a, const patch_t* b, const float* weights ) {
-    const int k = a->k;
-    double dist = 0;
-    const pixel_t* pa = a->values;
-    const pixel_t* pb = b->values;
-    for ( int r = 0 ; r < k ; ++r ) {
-        dist += weights[ r ] * fabs ( ( double ) ( pa[ r ] - pb[ r ] ) );
-    }
-    return dist;
-}
+#include "instrument.h"
 
 int main ( int argc, char* argv[] ) {
 
@@ -79,54 +52,22 @@ int main ( int argc, char* argv[] ) {
     out.info = img->info;
     out.pixels = pixels_copy ( &img->info, img->pixels );
     //
-    //
-    //
-    const int m = img->info.height;
-    const int n = img->info.width;
-    //
-    // create template
-    //
-    patch_t* pat, * pot;
-    pat = alloc_patch ( tpl->k );
-    pot = alloc_patch ( tpl->k );
-    //
     // non-local means
     // search a window of size R
     //
-    const float sigma = cfg.nlm_window_scale;
-    const int R = cfg.search_radius;
-    const double h = cfg.nlm_weight_scale;
-    const double C = -0.5 / ( h * h );
-    float* weights = create_gaussian_weights ( tpl, sigma );
-    info("NLM; R=%d h=%f C=%f\n",R, h,C);
-
-    linear_template_t* ltpl = linearize_template ( tpl, m, n );
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            double y = 0;
-            double norm = 0;
-            int count = 0;
-            get_linear_patch ( img, ltpl, i, j, pat );
-            int di0 = i > R     ? i - R : 0;
-            int di1 = i < ( m - R ) ? i + R : m;
-            int dj0 = j > R     ? j - R : 0;
-            int dj1 = j < ( n - R ) ? j + R : n;
-            //info("di0 %d di1 %d dj0 %d dj1 %d\n",di0,di1,dj0,dj1);
-            for ( int di = di0 ; di < di1 ; ++di ) {
-                for ( int dj = dj0 ; dj < dj1 ; ++dj ) {
-                    get_linear_patch ( img, ltpl, di, dj, pot );
-                    const double d = patch_dist ( pat, pot, weights );
-                    const double w = exp ( C * d );
-                    y += w * get_pixel ( img, di, dj );
-                    norm += w;
-                    count++;
-                }
-            }
-            const int x = ( int ) ( 0.5 + y / norm );
-            set_linear_pixel ( &out, li, x );
-            //set_linear_pixel(&out,li,count/100);
-        }
-    }
+    nlm_params_t par;
+    par.search_radius = cfg.search_radius;
+    par.p01 = cfg.p01;
+    par.p10 = cfg.p10;
+    par.weight_scale = cfg.nlm_weight_scale;
+    par.window_scale = cfg.nlm_window_scale;
+    par.early_exit = 0;
+    par.visit_all = cfg.visit_all;
+    par.verbose = cfg.verbose;
+    void* workspace = malloc ( original_nlm_workspace_size ( &img->info, tpl ) );
+    original_nlm_ctx_t ctx;
+    init_original_nlm ( &ctx, &img->info, tpl, &par, workspace );
+    original_nlm_denoise ( &ctx, img, &out );
     //
     //
     //
@@ -134,13 +75,13 @@ int main ( int argc, char* argv[] ) {
     if ( res != RESULT_OK ) {
         fprintf ( stderr, "error writing image %s.\n", cfg.output_file );
     }
-    free_patch ( pot );
-    free_patch ( pat );
-    free_linear_template ( ltpl );
+    free ( workspace );
     free_patch_template ( tpl );
     pixels_free ( img->pixels );
     pixels_free ( out.pixels );
     free ( img );
-    free ( weights );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.input_file ) != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing metrics to %s.\n", cfg.metrics_file );
+    }
     return res;
 }
@@ -13,95 +13,10 @@
 #include "image.h"
 #include "templates.h"
 #include "patches.h"
-#include "patch_mapper.h"
-#include "bitfun.h"
+#include "nlm.h"
 #include "config.h"
 #include "logging.h"
-
-pixel_t remove_mean ( patch_t* p ) {
-    int mean = 0;
-    for ( int r = 0 ; r < p->k ; ++r )
-        mean += p->values[ r ];
-    const index_t mu = ( index_t ) ( mean / p->k );
-    for ( int r = 0 ; r < p->k ; ++r )
-        p->values[ r ] -= mu;
-    return mu;
-}
-
-upixel_t* all_patches;
-upixel_t* all_means;
-
-upixel_t * extract_patches ( const image_t* img, const patch_template_t* tpl ) {
-    //
-    // determine total number of patches in image
-    //
-    const index_t n = img->info.width;
-    const index_t m = img->info.height;
-    const index_t npatches = m * n;
-    const size_t ki = tpl->k;
-    const size_t ko = compute_binary_mapping_samples ( ki );
-    info ( "allocating %ld bytes for all %ld patches\n", sizeof( upixel_t ) * ko * npatches, npatches );
-    all_patches = ( upixel_t* ) malloc ( ko * npatches * sizeof( upixel_t ) );
-    all_means   = ( upixel_t* ) malloc ( npatches * sizeof( upixel_t ) );
-    patch_t* p = alloc_patch ( ki );
-    patch_t* q = alloc_patch ( ko );
-    linear_template_t* ltpl = linearize_template ( tpl, m, n );
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            get_linear_patch ( img, ltpl, i, j, p );
-            //
-            // remove mean
-            //
-            all_means[ li ] = remove_mean ( p );
-            //
-            // binarize
-            //
-            binary_patch_mapper ( p, q );
-            // copy raw bytes: this bypasses sign, which is good for us
-            memcpy ( all_patches + li * ko, q->values, ko * sizeof( upixel_t ) );
-#ifdef INSANE_DEBUG
-            info ( "i %d j %d patch:", i, j );
-            for ( int kk = 0 ; kk < ko ; kk++ ) {
-                info ( "%x ", *( all_patches + li * ko + kk ) );
-            }
-            info ( "\n" );
-#endif
-        }
-    }
-    free_linear_template ( ltpl );
-    free_patch ( q );
-    free_patch ( p );
-    return all_patches;
-}
-
-/**
- * the distance between two patches is computed as the number of different
- * bits between their binary representations.
- * we must handle raw bytes and conver them to the appropriate sizes
- */
-int patch_dist ( const index_t i, const index_t j, const patch_template_t* tpl ) {
-    const index_t nsamples = compute_binary_mapping_samples ( tpl->k );
-    const upixel_t* samplesi = &all_patches[ nsamples * i ];
-    const upixel_t* samplesj = &all_patches[ nsamples * j ];
-#ifdef INSANE_DEBUG
-    info ( "dist: patch %d:", i );
-    for ( int kk = 0 ; kk < nsamples ; kk++ ) {
-        info ( "%x ", samplesi[ kk ] );
-    }
-    info ( "\n" );
-    info ( "dist: patch %d:", j );
-    for ( int kk = 0 ; kk < nsamples ; kk++ ) {
-        info ( "%x ", samplesj[ kk ] );
-    }
-    info ( "\n" );
-#endif
-    int d = 0;
-    for ( index_t k = 0 ; k < nsamples ; ++k ) {
-        upixel_t bdif = samplesi[ k ] ^ samplesj[ k ];
-        d += block_weight ( bdif );
-    }
-    return d;
-}
+#include "instrument.h"
 
 int main ( int argc, char* argv[] ) {
 
@@ -143,49 +58,22 @@ int main ( int argc, char* argv[] ) {
     out.info = img->info;
     out.pixels = pixels_copy ( &img->info, img->pixels );
     //
-    //
-    //
-    const int m = img->info.height;
-    const int n = img->info.width;
-    //
     // non-local means
     // search a window of size R
     //
-    info ( "extracting patches....\n" );
-    extract_patches ( img, tpl );
-
-    info ( "denoising....\n" );
-    const int R = cfg.search_radius;
-    const double h = cfg.nlm_window_scale;
-    const double C = -0.5 / ( h * h );
-    info("NLM; R=%d h=%f C=%f\n",R, h, C);
-    
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            //const pixel_t z = get_linear_pixel ( img, li );
-            double y = 0.0;
-            double norm = 0;
-            int di0 = i > R     ? i - R : 0;
-            int di1 = i < ( m - R ) ? i + R : m;
-            int dj0 = j > R     ? j - R : 0;
-            int dj1 = j < ( n - R ) ? j + R : n;
-            for ( int di = di0 ; di < di1 ; ++di ) {
-                for ( int dj = dj0 ; dj < dj1 ; ++dj ) {
-                    const index_t lj = di * n + dj;
-                    const int d = patch_dist ( li, lj, tpl );
-                    const double w = exp ( C * d );
-#ifdef INSANE_DEBUG
-                    info ( "d %d w %f\n", d, w );
-#endif
-                    y += w * ( get_pixel ( img, di, dj ) - all_means[ lj ] );
-                    norm += w;
-                }
-            }
-            const int x = ( int ) ( 0.5 + all_means[ li ] + y / norm );
-            set_linear_pixel ( &out, li, x > 0 ? ( x < 255 ? x : 255 ) : 0 );
-        }
-        //info("line %06d\n",i);
-    }
+    nlm_params_t par;
+    par.search_radius = cfg.search_radius;
+    par.p01 = cfg.p01;
+    par.p10 = cfg.p10;
+    par.weight_scale = cfg.nlm_weight_scale;
+    par.window_scale = cfg.nlm_window_scale;
+    par.early_exit = 0;
+    par.visit_all = cfg.visit_all;
+    par.verbose = cfg.verbose;
+    void* workspace = malloc ( semibin_nlm_workspace_size ( &img->info, tpl ) );
+    semibin_nlm_ctx_t ctx;
+    init_semibin_nlm ( &ctx, &img->info, tpl, &par, workspace );
+    semibin_nlm_denoise ( &ctx, img, &out );
 
     info ( "saving result to %s...\n",cfg.output_file );
     int res = write_pnm ( cfg.output_file, &out );
@@ -195,11 +83,13 @@ int main ( int argc, char* argv[] ) {
 
 
     info ( "finishing...\n" );
-    free ( all_patches );
-    free ( all_means );
+    free ( workspace );
     free_patch_template ( tpl );
     pixels_free ( img->pixels );
     pixels_free ( out.pixels );
     free ( img );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.input_file ) != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing metrics to %s.\n", cfg.metrics_file );
+    }
     return res;
 }
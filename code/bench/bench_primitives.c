@@ -0,0 +1,302 @@
+/**
+ * Micro-benchmarks of the library hot paths on synthetic document-like images.
+ *
+ * usage: bench_primitives [megapixels ...]   (default: 1 5 25)
+ *
+ * For each image size and primitive, reports the time per item (pixel, or
+ * query for find_neighbors and hamming_search), the throughput in millions of items per second,
+ * and the number and size of the heap allocations made by the primitive.
+ * Only the primitive itself is timed: the patches it works on are extracted
+ * beforehand, one row at a time.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link time
+ * (see CMakeLists.txt); without the wrappers they are reported as zero.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "pnm.h"
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+#include "patch_mapper.h"
+#include "stats.h"
+#include "hamming_index.h"
+#include "synthetic.h"
+#include "instrument.h"
+
+/*---------------------------------------------------------------------------------------*/
+/* allocation counters */
+/*---------------------------------------------------------------------------------------*/
+
+static size_t nallocs = 0;
+static size_t alloc_bytes = 0;
+
+#ifdef BENCH_WRAP_MALLOC
+void * __real_malloc ( size_t size );
+void * __real_calloc ( size_t nmemb, size_t size );
+void * __real_realloc ( void * ptr, size_t size );
+
+void * __wrap_malloc ( size_t size ) {
+    nallocs++;
+    alloc_bytes += size;
+    return __real_malloc ( size );
+}
+
+void * __wrap_calloc ( size_t nmemb, size_t size ) {
+    nallocs++;
+    alloc_bytes += nmemb * size;
+    return __real_calloc ( nmemb, size );
+}
+
+void * __wrap_realloc ( void * ptr, size_t size ) {
+    nallocs++;
+    alloc_bytes += size;
+    return __real_realloc ( ptr, size );
+}
+#endif
+
+/*---------------------------------------------------------------------------------------*/
+/* measurements */
+/*---------------------------------------------------------------------------------------*/
+
+typedef struct measure {
+    double seconds;
+    size_t nallocs;
+    size_t alloc_bytes;
+    uint64_t t0;
+} measure_t;
+
+static void measure_reset ( measure_t * m ) {
+    memset ( m, 0, sizeof( measure_t ) );
+}
+
+static void measure_start ( measure_t * m ) {
+    m->nallocs -= nallocs;
+    m->alloc_bytes -= alloc_bytes;
+    m->t0 = instrument_now ( );
+}
+
+static void measure_stop ( measure_t * m ) {
+    m->seconds += 1e-9 * ( double ) ( instrument_now ( ) - m->t0 );
+    m->nallocs += nallocs;
+    m->alloc_bytes += alloc_bytes;
+}
+
+static void report ( const char * name, const double mpix, const index_t nitems, const measure_t * m ) {
+    printf ( "%-20s %6.1f %12ld %12.2f %10.2f %10lu %14lu\n", name, mpix, ( long ) nitems,
+             1e9 * m->seconds / ( double ) nitems, 1e-6 * ( double ) nitems / m->seconds,
+             ( unsigned long ) m->nallocs, ( unsigned long ) m->alloc_bytes );
+    fflush ( stdout );
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* synthetic document */
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * an A4 page of about mpix megapixels, text at about 300 dpi (x-height 20)
+ */
+static image_t * bench_document ( const double mpix, const long seed ) {
+    synth_params_t par;
+    default_synth_params ( &par, 300 );
+    const double aspect = ( double ) par.height / ( double ) par.width;
+    par.width = ( int ) sqrt ( 1e6 * mpix / aspect );
+    par.height = ( int ) ( 1e6 * mpix / par.width );
+    par.seed = seed;
+    return synthetic_document ( &par );
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* benchmarks */
+/*---------------------------------------------------------------------------------------*/
+
+static void bench_pnm ( const image_t * img, const double mpix ) {
+    const index_t npixels = ( index_t ) img->info.width * img->info.height;
+    char fname[ 64 ];
+    snprintf ( fname, sizeof( fname ), "/tmp/bench_%d.pbm", ( int ) getpid ( ) );
+    measure_t m;
+    measure_reset ( &m );
+    measure_start ( &m );
+    write_pnm ( fname, img );
+    measure_stop ( &m );
+    report ( "write_pnm (PBM)", mpix, npixels, &m );
+    measure_reset ( &m );
+    measure_start ( &m );
+    image_t * copy = read_pnm ( fname );
+    measure_stop ( &m );
+    report ( "read_pnm (PBM)", mpix, npixels, &m );
+    pixels_free ( copy->pixels );
+    free ( copy );
+    remove ( fname );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** extract the patches of row i into rowp (n x k samples) */
+static void row_patches ( const image_t * img, const patch_template_t * tpl, const int i, pixel_t * rowp ) {
+    patch_t p;
+    p.k = tpl->k;
+    for ( int j = 0 ; j < img->info.width ; ++j ) {
+        p.values = rowp + ( index_t ) j * tpl->k;
+        get_patch ( img, tpl, i, j, &p );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void bench_patches ( const image_t * img, const patch_template_t * tpl, const double mpix ) {
+    const int m = img->info.height, n = img->info.width;
+    const index_t npixels = ( index_t ) n * m;
+    const int k = tpl->k;
+    patch_t * p = alloc_patch ( k );
+    measure_t meas;
+    //
+    // extraction
+    //
+    measure_reset ( &meas );
+    measure_start ( &meas );
+    for ( int i = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j ) {
+            get_patch ( img, tpl, i, j, p );
+        }
+    }
+    measure_stop ( &meas );
+    report ( "get_patch", mpix, npixels, &meas );
+
+    linear_template_t * ltpl = linearize_template ( tpl, m, n );
+    measure_reset ( &meas );
+    measure_start ( &meas );
+    for ( int i = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j ) {
+            get_linear_patch ( img, ltpl, i, j, p );
+        }
+    }
+    measure_stop ( &meas );
+    report ( "get_linear_patch", mpix, npixels, &meas );
+    free_linear_template ( ltpl );
+    //
+    // primitives on the extracted patches of each row
+    //
+    pixel_t * rowp = ( pixel_t * ) malloc ( ( size_t ) n * k * sizeof( pixel_t ) );
+    patch_t q;
+    q.k = k;
+    patch_t * mapped = alloc_patch ( compute_binary_mapping_samples ( k ) );
+    measure_reset ( &meas );
+    for ( int i = 0 ; i < m ; ++i ) {
+        row_patches ( img, tpl, i, rowp );
+        measure_start ( &meas );
+        for ( int j = 0 ; j < n ; ++j ) {
+            q.values = rowp + ( index_t ) j * k;
+            binary_patch_mapper ( &q, mapped );
+        }
+        measure_stop ( &meas );
+    }
+    report ( "binary_patch_mapper", mpix, npixels, &meas );
+    free_patch ( mapped );
+
+    patch_node_t * stats = NULL;
+    measure_reset ( &meas );
+    measure_start ( &meas );
+    stats = gather_patch_stats ( img, img, tpl, NULL, NULL );
+    measure_stop ( &meas );
+    report ( "gather_patch_stats", mpix, npixels, &meas );
+    free_node ( stats );
+
+    stats = create_stats ( );
+    measure_reset ( &meas );
+    for ( int i = 0 ; i < m ; ++i ) {
+        row_patches ( img, tpl, i, rowp );
+        const pixel_t * z = img->pixels + ( index_t ) i * n;
+        measure_start ( &meas );
+        for ( int j = 0 ; j < n ; ++j ) {
+            q.values = rowp + ( index_t ) j * k;
+            update_patch_stats ( &q, z[ j ], stats );
+        }
+        measure_stop ( &meas );
+    }
+    report ( "update_patch_stats", mpix, npixels, &meas );
+
+    measure_reset ( &meas );
+    for ( int i = 0 ; i < m ; ++i ) {
+        row_patches ( img, tpl, i, rowp );
+        measure_start ( &meas );
+        for ( int j = 0 ; j < n ; ++j ) {
+            q.values = rowp + ( index_t ) j * k;
+            get_patch_node ( stats, &q );
+        }
+        measure_stop ( &meas );
+    }
+    report ( "get_patch_node", mpix, npixels, &meas );
+    //
+    // neighbors within Hamming distance d of the contexts of a sample of pixels,
+    // in the tree and with multi-index hashing
+    //
+    const index_t nqueries = 10000;
+    const index_t step = npixels / nqueries;
+    hamming_index_t * index = create_hamming_index ( stats, k );
+    hamming_query_t hq;
+    void * hq_work = malloc ( hamming_query_workspace_size ( index ) );
+    init_hamming_query ( &hq, index, hq_work );
+    for ( index_t d = 1 ; d <= 3 ; d += 2 ) {
+        char name[ 32 ];
+        measure_reset ( &meas );
+        for ( index_t r = 0 ; r < nqueries ; ++r ) {
+            const index_t li = r * step;
+            get_patch ( img, tpl, ( int ) ( li / n ), ( int ) ( li % n ), p );
+            measure_start ( &meas );
+            neighbor_list_t nl = find_neighbors ( stats, p, d );
+            free ( nl.neighbors );
+            measure_stop ( &meas );
+        }
+        snprintf ( name, sizeof( name ), "find_neighbors (d=%ld)", ( long ) d );
+        report ( name, mpix, nqueries, &meas );
+        measure_reset ( &meas );
+        for ( index_t r = 0 ; r < nqueries ; ++r ) {
+            const index_t li = r * step;
+            get_patch ( img, tpl, ( int ) ( li / n ), ( int ) ( li % n ), p );
+            measure_start ( &meas );
+            hamming_search ( &hq, p, 1, d );
+            measure_stop ( &meas );
+        }
+        snprintf ( name, sizeof( name ), "hamming_search (d=%ld)", ( long ) d );
+        report ( name, mpix, nqueries, &meas );
+    }
+    free ( hq_work );
+    free_hamming_index ( index );
+
+    free_node ( stats );
+    free ( rowp );
+    free_patch ( p );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int main ( int argc, char * argv[] ) {
+    double sizes[ 16 ] = { 1, 5, 25 };
+    int nsizes = 3;
+    if ( argc > 1 ) {
+        nsizes = 0;
+        for ( int a = 1 ; a < argc && nsizes < 16 ; ++a ) {
+            sizes[ nsizes++ ] = atof ( argv[ a ] );
+        }
+    }
+    patch_template_t * tpl = generate_ball_template ( 2, 2, 1 );
+    sort_template ( tpl, 1 );
+    printf ( "template: ball of radius 2, k=%ld\n", ( long ) tpl->k );
+    printf ( "%-20s %6s %12s %12s %10s %10s %14s\n",
+             "primitive", "MPix", "items", "ns/item", "Mitems/s", "allocs", "alloc bytes" );
+    for ( int s = 0 ; s < nsizes ; ++s ) {
+        image_t * img = bench_document ( sizes[ s ], 42 );
+        const double mpix = 1e-6 * img->info.width * img->info.height;
+        bench_pnm ( img, mpix );
+        bench_patches ( img, tpl, mpix );
+        pixels_free ( img->pixels );
+        free ( img );
+    }
+    free_patch_template ( tpl );
+    return 0;
+}
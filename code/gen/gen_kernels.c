@@ -0,0 +1,207 @@
+/**
+ * Build-time generator of the template kernels (see lib/template_kernels.h).
+ *
+ * usage: gen_kernels <output.c> <template.tpl> ...
+ *
+ * For each template, writes a context extractor and a context sums kernel
+ * with the sample offsets as constants, for the samples in file order and,
+ * if different, in the order given by sort_template; then the table of all
+ * the kernels.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "templates.h"
+
+#define MAX_KERNELS 256
+
+typedef struct kernel {
+    char id[ 128 ];
+    char name[ 256 ];
+    patch_template_t * tpl;
+} kernel_t;
+
+/*---------------------------------------------------------------------------------------*/
+
+/** C identifier from the base name of the template file, without extension */
+static void make_id ( const char * path, const char * suffix, char * id, const size_t size ) {
+    const char * base = strrchr ( path, '/' );
+    base = base ? base + 1 : path;
+    size_t len = 0;
+    for ( const char * c = base ; *c && ( *c != '.' ) && ( len + 1 < size ) ; ++c ) {
+        id[ len++ ] = isalnum ( ( unsigned char ) *c ) ? *c : '_';
+    }
+    id[ len ] = 0;
+    strncat ( id, suffix, size - len - 1 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void template_extent ( const patch_template_t * tpl, index_t * imin, index_t * imax,
+                              index_t * jmin, index_t * jmax ) {
+    *imin = *imax = *jmin = *jmax = 0;
+    for ( index_t r = 0 ; r < tpl->k ; ++r ) {
+        const coord_t c = tpl->coords[ r ];
+        if ( c.i < *imin ) *imin = c.i;
+        if ( c.i > *imax ) *imax = c.i;
+        if ( c.j < *jmin ) *jmin = c.j;
+        if ( c.j > *jmax ) *jmax = c.j;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** one term of an offset, with its sign; the first term of an expression has no leading + */
+static void print_term ( FILE * out, const long a, const char * unit, const int first ) {
+    const long b = a < 0 ? -a : a;
+    if ( first ) {
+        fprintf ( out, "%s", a < 0 ? "-" : "" );
+    } else {
+        fprintf ( out, " %c ", a < 0 ? '-' : '+' );
+    }
+    if ( !*unit ) {
+        fprintf ( out, "%ld", b );
+    } else if ( b == 1 ) {
+        fprintf ( out, "%s", unit );
+    } else {
+        fprintf ( out, "%ld * %s", b, unit );
+    }
+}
+
+/**
+ * offset of a sample from the current pixel, as a C expression of the width n;
+ * if first is zero the expression follows another term
+ */
+static void print_offset ( FILE * out, const coord_t c, int first ) {
+    if ( ( c.i == 0 ) && ( c.j == 0 ) ) {
+        fprintf ( out, first ? "0" : "" );
+        return;
+    }
+    if ( c.i != 0 ) {
+        print_term ( out, ( long ) c.i, "n", first );
+        first = 0;
+    }
+    if ( c.j != 0 ) {
+        print_term ( out, ( long ) c.j, "", first );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void write_kernel ( FILE * out, const kernel_t * kern ) {
+    const patch_template_t * tpl = kern->tpl;
+    const index_t k = tpl->k;
+    index_t imin, imax, jmin, jmax;
+    template_extent ( tpl, &imin, &imax, &jmin, &jmax );
+
+    fprintf ( out, "/*---------------------------------------------------------------------------------------*/\n" );
+    fprintf ( out, "/* %s */\n\n", kern->name );
+    fprintf ( out, "static const coord_t coords_%s[ %ld ] = {", kern->id, ( long ) k );
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        fprintf ( out, "%s{ %ld, %ld }", r == 0 ? "\n    " : ( r % 8 ? ", " : ",\n    " ),
+                  ( long ) tpl->coords[ r ].i, ( long ) tpl->coords[ r ].j );
+    }
+    fprintf ( out, "\n};\n\n" );
+
+    fprintf ( out, "static void get_patch_%s ( const image_t * img, const patch_template_t * tpl, int i, int j, patch_t * p ) {\n", kern->id );
+    fprintf ( out, "    const index_t m = img->info.height;\n" );
+    fprintf ( out, "    const index_t n = img->info.width;\n" );
+    fprintf ( out, "    if ( ( i < %ld ) || ( i >= m - %ld ) || ( j < %ld ) || ( j >= n - %ld ) ) {\n",
+              ( long ) -imin, ( long ) imax, ( long ) -jmin, ( long ) jmax );
+    fprintf ( out, "        get_patch ( img, tpl, i, j, p );\n" );
+    fprintf ( out, "        return;\n" );
+    fprintf ( out, "    }\n" );
+    fprintf ( out, "    const pixel_t * x = img->pixels + ( index_t ) i * n + j;\n" );
+    fprintf ( out, "    pixel_t * v = p->values;\n" );
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        fprintf ( out, "    v[ %ld ] = x[ ", ( long ) r );
+        print_offset ( out, tpl->coords[ r ], 1 );
+        fprintf ( out, " ];\n" );
+    }
+    fprintf ( out, "}\n\n" );
+
+    fprintf ( out, "static void sums_row_%s ( const image_t * img, const index_t i, uint32_t * sums ) {\n", kern->id );
+    fprintf ( out, "    const index_t m = img->info.height;\n" );
+    fprintf ( out, "    const index_t n = img->info.width;\n" );
+    fprintf ( out, "    const pixel_t * x = img->pixels + i * n;\n" );
+    fprintf ( out, "    // all the samples of the pixels in [j0,j1) are inside the image\n" );
+    fprintf ( out, "    index_t j0 = %ld, j1 = n - %ld;\n", ( long ) -jmin, ( long ) jmax );
+    fprintf ( out, "    if ( ( i < %ld ) || ( i >= m - %ld ) || ( j1 < j0 ) ) {\n", ( long ) -imin, ( long ) imax );
+    fprintf ( out, "        j0 = j1 = n;\n" );
+    fprintf ( out, "    }\n" );
+    fprintf ( out, "    for ( index_t j = 0 ; j < j0 ; ++j ) {\n" );
+    fprintf ( out, "        sums[ j ] = linear_template_sum ( img, i * n + j, coords_%s, %ld );\n", kern->id, ( long ) k );
+    fprintf ( out, "    }\n" );
+    fprintf ( out, "    for ( index_t j = j0 ; j < j1 ; ++j ) {\n" );
+    fprintf ( out, "        sums[ j ] = ( uint32_t ) (" );
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        fprintf ( out, "%s x[ j", r % 4 ? " +" : ( r ? "\n            +" : "" ) );
+        print_offset ( out, tpl->coords[ r ], 0 );
+        fprintf ( out, " ]" );
+    }
+    fprintf ( out, " );\n" );
+    fprintf ( out, "    }\n" );
+    fprintf ( out, "    for ( index_t j = j1 ; j < n ; ++j ) {\n" );
+    fprintf ( out, "        sums[ j ] = linear_template_sum ( img, i * n + j, coords_%s, %ld );\n", kern->id, ( long ) k );
+    fprintf ( out, "    }\n" );
+    fprintf ( out, "}\n\n" );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int main ( int argc, char * argv[] ) {
+    if ( argc < 2 ) {
+        fprintf ( stderr, "usage: %s <output.c> <template.tpl> ...\n", argv[ 0 ] );
+        return 1;
+    }
+    kernel_t kernels[ MAX_KERNELS ];
+    int nkernels = 0;
+    for ( int a = 2 ; ( a < argc ) && ( nkernels + 2 <= MAX_KERNELS ) ; ++a ) {
+        patch_template_t * tpl = read_template ( argv[ a ] );
+        if ( !tpl ) {
+            return 1;
+        }
+        patch_template_t * sorted = sort_template ( tpl, 0 );
+        const char * base = strrchr ( argv[ a ], '/' ) ? strrchr ( argv[ a ], '/' ) + 1 : argv[ a ];
+        kernel_t * kern = &kernels[ nkernels++ ];
+        make_id ( argv[ a ], "", kern->id, sizeof( kern->id ) );
+        snprintf ( kern->name, sizeof( kern->name ), "%.200s", base );
+        kern->tpl = tpl;
+        if ( memcmp ( sorted->coords, tpl->coords, tpl->k * sizeof( coord_t ) ) ) {
+            kern = &kernels[ nkernels++ ];
+            make_id ( argv[ a ], "_sorted", kern->id, sizeof( kern->id ) );
+            snprintf ( kern->name, sizeof( kern->name ), "%.200s, sorted", base );
+            kern->tpl = sorted;
+        } else {
+            free_patch_template ( sorted );
+        }
+    }
+
+    FILE * out = fopen ( argv[ 1 ], "w" );
+    if ( !out ) {
+        fprintf ( stderr, "cannot write %s\n", argv[ 1 ] );
+        return 1;
+    }
+    fprintf ( out, "/* generated by gen_kernels; do not edit */\n" );
+    fprintf ( out, "#include \"template_kernels.h\"\n\n" );
+    for ( int t = 0 ; t < nkernels ; ++t ) {
+        write_kernel ( out, &kernels[ t ] );
+    }
+    fprintf ( out, "/*---------------------------------------------------------------------------------------*/\n\n" );
+    fprintf ( out, "const template_kernel_t template_kernels[ %d ] = {\n", nkernels > 0 ? nkernels : 1 );
+    for ( int t = 0 ; t < nkernels ; ++t ) {
+        fprintf ( out, "    { \"%s\", %ld, coords_%s, get_patch_%s, sums_row_%s },\n", kernels[ t ].name,
+                  ( long ) kernels[ t ].tpl->k, kernels[ t ].id, kernels[ t ].id, kernels[ t ].id );
+    }
+    if ( !nkernels ) {
+        fprintf ( out, "    { NULL, 0, NULL, NULL, NULL }\n" );
+    }
+    fprintf ( out, "};\n\n" );
+    fprintf ( out, "const int ntemplate_kernels = %d;\n", nkernels );
+    for ( int t = 0 ; t < nkernels ; ++t ) {
+        free_patch_template ( kernels[ t ].tpl );
+    }
+    return fclose ( out ) ? 1 : 0;
+}
@@ -0,0 +1,220 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "context_sums.h"
+#include "template_kernels.h"
+#include "workspace.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+static int compare_coords ( const void * pa, const void * pb ) {
+    const coord_t * a = ( const coord_t * ) pa;
+    const coord_t * b = ( const coord_t * ) pb;
+    if ( a->i != b->i ) {
+        return a->i < b->i ? -1 : 1;
+    }
+    return a->j < b->j ? -1 : ( a->j > b->j ? 1 : 0 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t context_sums_workspace_size ( const image_info_t * info, const patch_template_t * tpl ) {
+    const size_t n = info->width;
+    const size_t k = tpl->k;
+    index_t imin = 0, imax = 0;
+    for ( index_t r = 0 ; r < tpl->k ; ++r ) {
+        if ( tpl->coords[ r ].i < imin ) imin = tpl->coords[ r ].i;
+        if ( tpl->coords[ r ].i > imax ) imax = tpl->coords[ r ].i;
+    }
+    const size_t nring = imax - imin + 4;
+    return 2 * workspace_round ( k * sizeof( template_rect_t ) )
+         + workspace_round ( k * sizeof( coord_t ) )
+         + workspace_round ( nring * ( n + 1 ) * sizeof( uint32_t ) )
+         + workspace_round ( n * sizeof( uint32_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_context_sums ( context_sums_t * cs, const image_info_t * info, const patch_template_t * tpl,
+                         void * workspace ) {
+    const index_t k = tpl->k;
+    char * pos = ( char * ) workspace;
+    cs->m = info->height;
+    cs->n = info->width;
+    cs->runs  = ( template_rect_t * ) workspace_take ( &pos, k * sizeof( template_rect_t ) );
+    cs->rects = ( template_rect_t * ) workspace_take ( &pos, k * sizeof( template_rect_t ) );
+    coord_t * coords = ( coord_t * ) workspace_take ( &pos, k * sizeof( coord_t ) );
+    //
+    // template runs: consecutive samples in the same row.
+    // Repeated samples start a run of their own, so that they are counted twice.
+    //
+    memcpy ( coords, tpl->coords, k * sizeof( coord_t ) );
+    qsort ( coords, k, sizeof( coord_t ), compare_coords );
+    cs->imin = cs->imax = cs->jmin = cs->jmax = 0;
+    cs->nruns = 0;
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        const coord_t c = coords[ r ];
+        template_rect_t * last = cs->nruns ? &cs->runs[ cs->nruns - 1 ] : NULL;
+        if ( last && ( last->i0 == c.i ) && ( last->j1 + 1 == c.j ) ) {
+            last->j1 = c.j;
+        } else {
+            template_rect_t run = { c.i, c.i, c.j, c.j };
+            cs->runs[ cs->nruns++ ] = run;
+        }
+        if ( c.i < cs->imin ) cs->imin = c.i;
+        if ( c.i > cs->imax ) cs->imax = c.i;
+        if ( c.j < cs->jmin ) cs->jmin = c.j;
+        if ( c.j > cs->jmax ) cs->jmax = c.j;
+    }
+    //
+    // rectangles: runs with the same extent in consecutive rows
+    //
+    cs->nrects = 0;
+    for ( index_t r = 0 ; r < cs->nruns ; ++r ) {
+        const template_rect_t * run = &cs->runs[ r ];
+        index_t q;
+        for ( q = 0 ; q < cs->nrects ; ++q ) {
+            template_rect_t * rect = &cs->rects[ q ];
+            if ( ( rect->i1 + 1 == run->i0 ) && ( rect->j0 == run->j0 ) && ( rect->j1 == run->j1 ) ) {
+                rect->i1 = run->i1;
+                break;
+            }
+        }
+        if ( q == cs->nrects ) {
+            cs->rects[ cs->nrects++ ] = *run;
+        }
+    }
+    //
+    // the ring holds the summed-area table rows from i+imin-2 to i+imax+1:
+    // runs crossing the left or right borders wrap to the previous or next rows,
+    // and each row of the table is needed along with the previous one
+    //
+    cs->nring = cs->imax - cs->imin + 4;
+    cs->ring = ( uint32_t * ) workspace_take ( &pos, cs->nring * ( cs->n + 1 ) * sizeof( uint32_t ) );
+    cs->acc  = ( uint32_t * ) workspace_take ( &pos, cs->n * sizeof( uint32_t ) );
+    //
+    // the kernel adds k samples per pixel, the table does four lookups per rectangle
+    //
+    cs->kernel = k <= 4 * cs->nrects ? find_sums_kernel ( tpl ) : NULL;
+    cs->in_place = 0;
+    reset_context_sums ( cs );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void reset_context_sums ( context_sums_t * cs ) {
+    cs->first_row = 0;
+    cs->last_row = -1;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** summed-area table row for image row r, which must be in the ring */
+static inline uint32_t * table_row ( const context_sums_t * cs, const index_t r ) {
+    index_t slot = r % cs->nring;
+    if ( slot < 0 ) {
+        slot += cs->nring;
+    }
+    return cs->ring + slot * ( cs->n + 1 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** add image row r to the table; rows outside the image are all zeros */
+static void push_row ( context_sums_t * cs, const image_t * img, const index_t r ) {
+    const index_t n = cs->n;
+    const uint32_t * prev = table_row ( cs, r - 1 );
+    uint32_t * cur = table_row ( cs, r );
+    if ( ( r < 0 ) || ( r >= cs->m ) ) {
+        memmove ( cur, prev, ( n + 1 ) * sizeof( uint32_t ) );
+    } else {
+        const pixel_t * x = img->pixels + r * n;
+        uint32_t a = 0;
+        cur[ 0 ] = prev[ 0 ];
+        for ( index_t c = 0 ; c < n ; ++c ) {
+            a += x[ c ];
+            cur[ c + 1 ] = prev[ c + 1 ] + a;
+        }
+    }
+    cs->last_row = r;
+    if ( cs->last_row - cs->first_row >= cs->nring ) {
+        cs->first_row = cs->last_row - cs->nring + 1;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * sum of the samples of the linear image before position u = r*n + c, plus
+ * the (unknown) base of the table. Positions outside the image add nothing.
+ */
+static inline uint32_t linear_prefix ( const context_sums_t * cs, index_t r, index_t c ) {
+    if ( c < 0 ) {
+        c += cs->n;
+        r--;
+    } else if ( c >= cs->n ) {
+        c -= cs->n;
+        r++;
+    }
+    const uint32_t * prev = table_row ( cs, r - 1 );
+    const uint32_t * cur = table_row ( cs, r );
+    return prev[ cs->n ] + ( cur[ c ] - prev[ c ] );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** sums of the pixels in columns [j0,j1) of row i, one run at a time */
+static void border_sums ( const context_sums_t * cs, const index_t i, const index_t j0, const index_t j1,
+                          uint32_t * sums ) {
+    for ( index_t j = j0 ; j < j1 ; ++j ) {
+        uint32_t s = 0;
+        for ( index_t q = 0 ; q < cs->nruns ; ++q ) {
+            const template_rect_t * run = &cs->runs[ q ];
+            const index_t r = i + run->i0;
+            s += linear_prefix ( cs, r, j + run->j1 + 1 ) - linear_prefix ( cs, r, j + run->j0 );
+        }
+        sums[ j ] = s;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void context_sums_row ( context_sums_t * cs, const image_t * img, const index_t i, uint32_t * sums ) {
+    if ( cs->kernel && !cs->in_place ) {
+        cs->kernel->sums_row ( img, i, sums );
+        return;
+    }
+    const index_t n = cs->n;
+    const index_t lo = i + cs->imin - 2;
+    const index_t hi = i + cs->imax + 1;
+    if ( ( cs->last_row < cs->first_row ) || ( lo < cs->first_row ) || ( lo > cs->last_row ) ) {
+        //
+        // start a new table at row lo
+        //
+        memset ( table_row ( cs, lo ), 0, ( n + 1 ) * sizeof( uint32_t ) );
+        cs->first_row = cs->last_row = lo;
+    }
+    while ( cs->last_row < hi ) {
+        push_row ( cs, img, cs->last_row + 1 );
+    }
+    //
+    // columns [jl,jr), where no run crosses the borders: four lookups per rectangle
+    //
+    const index_t jl = -cs->jmin < n ? -cs->jmin : n;
+    const index_t jr = n - cs->jmax > jl ? n - cs->jmax : jl;
+    uint32_t * acc = cs->acc;
+    memset ( acc + jl, 0, ( jr - jl ) * sizeof( uint32_t ) );
+    for ( index_t q = 0 ; q < cs->nrects ; ++q ) {
+        const template_rect_t * rect = &cs->rects[ q ];
+        const uint32_t * top = table_row ( cs, i + rect->i0 - 1 );
+        const uint32_t * bot = table_row ( cs, i + rect->i1 );
+        const index_t a = rect->j0;
+        const index_t b = rect->j1 + 1;
+        for ( index_t j = jl ; j < jr ; ++j ) {
+            acc[ j ] += ( bot[ j + b ] - bot[ j + a ] ) - ( top[ j + b ] - top[ j + a ] );
+        }
+    }
+    memcpy ( sums + jl, acc + jl, ( jr - jl ) * sizeof( uint32_t ) );
+    border_sums ( cs, i, 0, jl, sums );
+    border_sums ( cs, i, jr, n, sums );
+}
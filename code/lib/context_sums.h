@@ -0,0 +1,92 @@
+/**
+ * \file context_sums.h
+ * \brief Fast computation of the sum of the samples in the context of each pixel
+ *
+ * The template is broken into horizontal runs of consecutive samples, and
+ * runs with the same horizontal extent in consecutive rows are merged into
+ * rectangles. A summed-area table is kept for the rows currently under the
+ * template, so that the sum of each rectangle costs four lookups no matter
+ * its size. Rectangular and ball templates are thus summed in O(1) and O(height)
+ * operations per pixel instead of O(k).
+ *
+ * The sums are exactly those obtained by adding the samples of get_linear_patch,
+ * including the way in which the linear templates wrap around the left and
+ * right borders of the image.
+ *
+ * Sparse templates with a generated kernel (see template_kernels.h) are summed
+ * directly by the kernel, which is faster than the table for them. The kernel
+ * reads the image as it is when each row is requested, whereas the table has
+ * read every row before it is summed, so callers that change the image while
+ * summing it must set in_place.
+ */
+#ifndef CONTEXT_SUMS_H
+#define CONTEXT_SUMS_H
+
+#include <stdint.h>
+
+#include "image.h"
+#include "templates.h"
+
+/**
+ * a rectangle of template samples, rows [i0,i1] and columns [j0,j1] relative
+ * to the center; horizontal runs are rectangles with i0 = i1
+ */
+typedef struct template_rect {
+    index_t i0, i1, j0, j1;
+} template_rect_t;
+
+/**
+ * context sums engine; all buffers point into the caller's workspace
+ */
+typedef struct context_sums {
+    index_t m, n;
+    /** template runs, used near the left and right borders */
+    template_rect_t * runs;
+    index_t nruns;
+    /** runs merged vertically, used elsewhere */
+    template_rect_t * rects;
+    index_t nrects;
+    /** template extent */
+    index_t imin, imax, jmin, jmax;
+    /**
+     * ring of summed-area table rows, (n+1) entries each. The table
+     * starts at an arbitrary row and is kept modulo 2^32: only differences
+     * between its entries are meaningful.
+     */
+    uint32_t * ring;
+    index_t nring;
+    /** first and last rows currently held in the ring */
+    index_t first_row, last_row;
+    /** row accumulator */
+    uint32_t * acc;
+    /** generated kernel for the template, if any; replaces the table */
+    const struct template_kernel * kernel;
+    /** the rows already summed are changed while summing the rest: do not use the kernel */
+    int in_place;
+} context_sums_t;
+
+/**
+ * size in bytes of the workspace required for images of the given size
+ */
+size_t context_sums_workspace_size ( const image_info_t * info, const patch_template_t * tpl );
+
+/**
+ * prepare an engine for images of the given size;
+ * the workspace must outlive the engine
+ */
+void init_context_sums ( context_sums_t * cs, const image_info_t * info, const patch_template_t * tpl,
+                         void * workspace );
+
+/**
+ * compute the context sums of the n pixels in row i of the image.
+ * Rows are cheapest when requested in increasing order, one after the other;
+ * any other order (or a different image) requires a call to reset_context_sums first.
+ */
+void context_sums_row ( context_sums_t * cs, const image_t * img, const index_t i, uint32_t * sums );
+
+/**
+ * forget the rows held by the engine
+ */
+void reset_context_sums ( context_sums_t * cs );
+
+#endif
@@ -0,0 +1,462 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef PARALLEL
+#include <omp.h>
+#endif
+
+#include "context_table.h"
+#include "logging.h"
+#include "instrument.h"
+#include "template_kernels.h"
+#include "tile_map.h"
+
+/** bits sorted by each pass of the radix sort */
+#define RADIX_BITS 8
+#define RADIX_SIZE ( 1 << RADIX_BITS )
+
+/*---------------------------------------------------------------------------------------*/
+
+static inline int popcount64 ( const uint64_t x ) {
+#ifdef __GNUC__
+    return __builtin_popcountll ( x );
+#else
+    int c = 0;
+    for ( uint64_t y = x ; y ; y &= y - 1 ) {
+        c++;
+    }
+    return c;
+#endif
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * key of the samples of a patch: key[ 0 ] has the most significant bits
+ * (0 if k < 64), key[ 1 ] the 64 least significant ones. Each word is
+ * packed by a loop of its own, which the compiler can vectorize.
+ */
+static inline void pack_key ( const pixel_t * v, const int k, uint64_t * key ) {
+    const int split = k > 64 ? k - 64 : 0; // samples in key[ 0 ]
+    uint64_t w = 0;
+    for ( int r = 0 ; r < split ; ++r ) {
+        w |= ( uint64_t ) v[ r ] << ( k - 65 - r );
+    }
+    key[ 0 ] = w;
+    w = 0;
+    for ( int r = split ; r < k ; ++r ) {
+        w |= ( uint64_t ) v[ r ] << ( k - 1 - r );
+    }
+    key[ 1 ] = w;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static inline int compare_keys ( const uint64_t * a, const uint64_t * b, const int words ) {
+    for ( int w = 0 ; w < words ; ++w ) {
+        if ( a[ w ] != b[ w ] ) {
+            return a[ w ] < b[ w ] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static context_table_t * alloc_context_table ( const index_t k, const index_t capacity ) {
+    context_table_t * t = ( context_table_t * ) malloc ( sizeof( context_table_t ) );
+    t->k = k;
+    t->words = k < 64 ? 1 : 2;
+    t->n = 0;
+    t->keys = ( uint64_t * ) malloc ( ( capacity + 1 ) * t->words * sizeof( uint64_t ) );
+    t->occu = ( index_t * ) malloc ( ( capacity + 1 ) * sizeof( index_t ) );
+    t->counts = ( index_t * ) malloc ( ( capacity + 1 ) * sizeof( index_t ) );
+    return t;
+}
+
+/**
+ * add the counts of a context after the last entry, or to it if it is the
+ * same context; key as given by pack_key
+ */
+static inline void append_entry ( context_table_t * t, const uint64_t * key, const index_t occu, const index_t counts ) {
+    const int words = t->words;
+    const uint64_t * k = key + 2 - words;
+    if ( t->n && !compare_keys ( t->keys + ( t->n - 1 ) * words, k, words ) ) {
+        t->occu[ t->n - 1 ] += occu;
+        t->counts[ t->n - 1 ] += counts;
+        return;
+    }
+    memcpy ( t->keys + t->n * words, k, words * sizeof( uint64_t ) );
+    t->occu[ t->n ] = occu;
+    t->counts[ t->n ] = counts;
+    t->n++;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void free_context_table ( context_table_t * table ) {
+    if ( table ) {
+        free ( table->counts );
+        free ( table->occu );
+        free ( table->keys );
+        free ( table );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * stable sort of n records by the least significant bits of the 128 bit
+ * numbers (hi,lo); hi may be NULL if bits <= 64. Least significant digit
+ * first, RADIX_BITS at a time; with -DPARALLEL, each thread counts and
+ * scatters its own part of the records.
+ */
+static void radix_sort ( uint64_t * lo, uint64_t * hi, const index_t n, const int bits ) {
+    uint64_t * lo2 = ( uint64_t * ) malloc ( ( n + 1 ) * sizeof( uint64_t ) );
+    uint64_t * hi2 = hi ? ( uint64_t * ) malloc ( ( n + 1 ) * sizeof( uint64_t ) ) : NULL;
+    int nthreads = 1;
+#ifdef PARALLEL
+    nthreads = omp_get_max_threads ( );
+#endif
+    index_t * hist = ( index_t * ) malloc ( nthreads * RADIX_SIZE * sizeof( index_t ) );
+    for ( int shift = 0 ; shift < bits ; shift += RADIX_BITS ) {
+        const uint64_t * src = shift < 64 ? lo : hi;
+        const int s = shift & 63;
+        int skip = 0;
+#ifdef PARALLEL
+        #pragma omp parallel num_threads ( nthreads )
+#endif
+        {
+            int t = 0, nt = 1;
+#ifdef PARALLEL
+            t = omp_get_thread_num ( );
+            nt = omp_get_num_threads ( );
+#endif
+            const index_t i0 = n * t / nt, i1 = n * ( t + 1 ) / nt;
+            index_t * h = hist + t * RADIX_SIZE;
+            memset ( h, 0, RADIX_SIZE * sizeof( index_t ) );
+            for ( index_t i = i0 ; i < i1 ; ++i ) {
+                h[ ( src[ i ] >> s ) & ( RADIX_SIZE - 1 ) ]++;
+            }
+#ifdef PARALLEL
+            #pragma omp barrier
+            #pragma omp single
+#endif
+            {
+                //
+                // where each thread puts each digit; nothing to do if all
+                // the records have the same digit
+                //
+                index_t pos = 0;
+                for ( int d = 0 ; d < RADIX_SIZE ; ++d ) {
+                    index_t total = 0;
+                    for ( int u = 0 ; u < nt ; ++u ) {
+                        const index_t c = hist[ u * RADIX_SIZE + d ];
+                        hist[ u * RADIX_SIZE + d ] = pos;
+                        pos += c;
+                        total += c;
+                    }
+                    skip |= total == n;
+                }
+            }
+            if ( !skip ) {
+                for ( index_t i = i0 ; i < i1 ; ++i ) {
+                    const index_t p = h[ ( src[ i ] >> s ) & ( RADIX_SIZE - 1 ) ]++;
+                    lo2[ p ] = lo[ i ];
+                    if ( hi ) {
+                        hi2[ p ] = hi[ i ];
+                    }
+                }
+            }
+        }
+        if ( !skip ) {
+            memcpy ( lo, lo2, n * sizeof( uint64_t ) );
+            if ( hi ) {
+                memcpy ( hi, hi2, n * sizeof( uint64_t ) );
+            }
+        }
+    }
+    free ( hist );
+    free ( hi2 );
+    free ( lo2 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+context_table_t * gather_context_table ( const image_t * pnoisy, const image_t * pctximg, const patch_template_t * ptpl ) {
+    const int k = ptpl->k;
+    if ( k + 1 > CONTEXT_TABLE_BITS ) {
+        return NULL;
+    }
+    const uint64_t t0 = instrument_now ( );
+    const int m = pnoisy->info.height;
+    const int n = pnoisy->info.width;
+    const patch_extractor_f extract = select_patch_extractor ( ptpl );
+    //
+    // as in gather_patch_stats, the pixels of uniform tiles are counted by
+    // context and center value, and added at the end
+    //
+    index_t reach_i, reach_j;
+    template_reach ( ptpl, &reach_i, &reach_j );
+    tile_map_t * tiles = create_tile_map ( pctximg, reach_i, reach_j );
+    tile_map_t * ztiles = pnoisy == pctximg ? tiles : create_tile_map ( pnoisy, 0, 0 );
+    index_t bulk[ 2 ][ 2 ] = { { 0, 0 }, { 0, 0 } };
+    index_t * first = ( index_t * ) malloc ( ( m + 1 ) * sizeof( index_t ) ); // first record of each row
+    first[ 0 ] = 0;
+    for ( int i = 0 ; i < m ; ++i ) {
+        first[ i + 1 ] = first[ i ];
+        for ( int j = 0 ; j < n ; ) {
+            const int j1 = tile_end ( tiles, j );
+            const int v = uniform_value ( tiles, i, j );
+            const int z = uniform_value ( ztiles, i, j );
+            if ( ( v >= 0 ) && ( z >= 0 ) ) {
+                bulk[ v ][ z ] += j1 - j;
+            } else {
+                first[ i + 1 ] += j1 - j;
+            }
+            j = j1;
+        }
+    }
+    //
+    // records: ( key << 1 ) | center value
+    //
+    const index_t nrec = first[ m ];
+    uint64_t * lo = ( uint64_t * ) malloc ( ( nrec + 1 ) * sizeof( uint64_t ) );
+    uint64_t * hi = k + 1 > 64 ? ( uint64_t * ) malloc ( ( nrec + 1 ) * sizeof( uint64_t ) ) : NULL;
+#ifdef PARALLEL
+    #pragma omp parallel
+#endif
+    {
+        pixel_t * values = ( pixel_t * ) malloc ( k * sizeof( pixel_t ) );
+        patch_t ctx;
+        ctx.k = k;
+        ctx.values = values;
+#ifdef PARALLEL
+        #pragma omp for schedule(dynamic,16)
+#endif
+        for ( int i = 0 ; i < m ; ++i ) {
+            index_t r = first[ i ];
+            for ( int j = 0 ; j < n ; ) {
+                const int j1 = tile_end ( tiles, j );
+                if ( ( uniform_value ( tiles, i, j ) >= 0 ) && ( uniform_value ( ztiles, i, j ) >= 0 ) ) {
+                    j = j1;
+                    continue;
+                }
+                for ( ; j < j1 ; ++j, ++r ) {
+                    uint64_t key[ 2 ];
+                    extract ( pctximg, ptpl, i, j, &ctx );
+                    pack_key ( values, k, key );
+                    lo[ r ] = ( key[ 1 ] << 1 ) | ( uint64_t ) get_pixel ( pnoisy, i, j );
+                    if ( hi ) {
+                        hi[ r ] = ( key[ 0 ] << 1 ) | ( key[ 1 ] >> 63 );
+                    }
+                }
+            }
+        }
+        free ( values );
+    }
+    free ( first );
+    if ( ztiles != tiles ) {
+        free_tile_map ( ztiles );
+    }
+    free_tile_map ( tiles );
+    radix_sort ( lo, hi, nrec, k + 1 );
+    //
+    // run-length reduction; the all-zeros context is the first one and the
+    // all-ones context the last one
+    //
+    context_table_t * table = alloc_context_table ( k, nrec + 2 );
+    uint64_t key[ 2 ] = { 0, 0 };
+    if ( bulk[ 0 ][ 0 ] + bulk[ 0 ][ 1 ] ) {
+        append_entry ( table, key, bulk[ 0 ][ 0 ] + bulk[ 0 ][ 1 ], bulk[ 0 ][ 1 ] );
+    }
+    for ( index_t r = 0 ; r < nrec ; ) {
+        const uint64_t klo = lo[ r ] >> 1, khi = hi ? hi[ r ] : 0;
+        index_t occu = 0, ones = 0;
+        for ( ; ( r < nrec ) && ( ( lo[ r ] >> 1 ) == klo ) && ( !hi || ( hi[ r ] == khi ) ) ; ++r ) {
+            occu++;
+            ones += lo[ r ] & 1;
+        }
+        key[ 0 ] = khi >> 1;
+        key[ 1 ] = klo | ( khi << 63 );
+        append_entry ( table, key, occu, ones );
+    }
+    if ( bulk[ 1 ][ 0 ] + bulk[ 1 ][ 1 ] ) {
+        key[ 0 ] = k > 64 ? ~( uint64_t ) 0 >> ( 128 - k ) : 0;
+        key[ 1 ] = k >= 64 ? ~( uint64_t ) 0 : ( ( uint64_t ) 1 << k ) - 1;
+        append_entry ( table, key, bulk[ 1 ][ 0 ] + bulk[ 1 ][ 1 ], bulk[ 1 ][ 1 ] );
+    }
+    free ( hi );
+    free ( lo );
+    stage_done ( STAGE_STATS, t0 );
+    return table;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t context_table_find ( const context_table_t * table, const patch_t * p ) {
+    const int words = table->words;
+    uint64_t key[ 2 ];
+    pack_key ( p->values, table->k, key );
+    const uint64_t * k = key + 2 - words;
+    index_t a = 0, b = table->n; // the entry is in [a,b) if anywhere
+    while ( a < b ) {
+        const index_t c = a + ( b - a ) / 2;
+        const int cmp = compare_keys ( table->keys + c * words, k, words );
+        if ( !cmp ) {
+            return c;
+        }
+        if ( cmp < 0 ) {
+            a = c + 1;
+        } else {
+            b = c;
+        }
+    }
+    return -1;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void context_table_patch ( const context_table_t * table, const index_t e, patch_t * p ) {
+    const int k = table->k;
+    const uint64_t * key = table->keys + e * table->words;
+    const uint64_t * low = key + table->words - 1;
+    for ( int r = 0 ; r < k ; ++r ) {
+        const int b = k - 1 - r; // bit of sample r
+        p->values[ r ] = ( b < 64 ? *low >> b : key[ 0 ] >> ( b - 64 ) ) & 1;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+context_table_t * merge_context_tables ( const context_table_t * a, const context_table_t * b ) {
+    const int words = a->words;
+    context_table_t * t = alloc_context_table ( a->k, a->n + b->n );
+    index_t i = 0, j = 0;
+    while ( ( i < a->n ) || ( j < b->n ) ) {
+        const int cmp = i == a->n ? 1 : ( j == b->n ? -1 : compare_keys ( a->keys + i * words, b->keys + j * words, words ) );
+        const uint64_t * key = cmp <= 0 ? a->keys + i * words : b->keys + j * words;
+        memcpy ( t->keys + t->n * words, key, words * sizeof( uint64_t ) );
+        t->occu[ t->n ] = 0;
+        t->counts[ t->n ] = 0;
+        if ( cmp <= 0 ) {
+            t->occu[ t->n ] += a->occu[ i ];
+            t->counts[ t->n ] += a->counts[ i ];
+            i++;
+        }
+        if ( cmp >= 0 ) {
+            t->occu[ t->n ] += b->occu[ j ];
+            t->counts[ t->n ] += b->counts[ j ];
+            j++;
+        }
+        t->n++;
+    }
+    return t;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void context_table_weights ( const context_table_t * table, index_t * freq, index_t * freq1 ) {
+    for ( index_t e = 0 ; e < table->n ; ++e ) {
+        int w = 0;
+        for ( int u = 0 ; u < table->words ; ++u ) {
+            w += popcount64 ( table->keys[ e * table->words + u ] );
+        }
+        freq[ w ] += table->occu[ e ];
+        freq1[ w ] += table->counts[ e ];
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+patch_node_t * context_table_to_stats ( const context_table_t * table ) {
+    patch_node_t * stats = create_stats ( );
+    patch_t * p = alloc_patch ( table->k );
+    for ( index_t e = 0 ; e < table->n ; ++e ) {
+        context_table_patch ( table, e, p );
+        add_context_stats ( p, table->occu[ e ], table->counts[ e ], stats );
+    }
+    free_patch ( p );
+    return stats;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+context_table_t * stats_to_context_table ( const patch_node_t * stats, const index_t k ) {
+    if ( k + 1 > CONTEXT_TABLE_BITS ) {
+        return NULL;
+    }
+    index_t nleaves = 0, totoccu = 0, totcount = 0, pos = 0;
+    summarize_stats ( ( patch_node_t * ) stats, &nleaves, &totoccu, &totcount );
+    patch_node_t * * leaves = ( patch_node_t * * ) malloc ( ( nleaves + 1 ) * sizeof( patch_node_t * ) );
+    flatten_stats ( ( patch_node_t * ) stats, leaves, &pos );
+    context_table_t * t = alloc_context_table ( k, nleaves );
+    patch_t * p = alloc_patch ( k );
+    for ( index_t l = 0 ; l < pos ; ++l ) {
+        uint64_t key[ 2 ];
+        get_leaf_patch ( p, leaves[ l ] );
+        pack_key ( p->values, k, key );
+        append_entry ( t, key, leaves[ l ]->occu, leaves[ l ]->counts );
+    }
+    free_patch ( p );
+    free ( leaves );
+    return t;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int save_context_table ( const char * fname, const context_table_t * table ) {
+    const uint64_t t0 = instrument_now ( );
+    stats_writer_t * w = open_stats_writer ( fname, table->k );
+    if ( !w ) {
+        return -1;
+    }
+    patch_t * p = alloc_patch ( table->k );
+    for ( index_t e = 0 ; e < table->n ; ++e ) {
+        context_table_patch ( table, e, p );
+        stats_writer_add ( w, p->values, table->occu[ e ], table->counts[ e ] );
+    }
+    free_patch ( p );
+    const int res = close_stats_writer ( w );
+    stage_done ( STAGE_WRITE, t0 );
+    return res;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+context_table_t * load_context_table ( const char * fname ) {
+    const uint64_t t0 = instrument_now ( );
+    stats_reader_t * r = open_stats_reader ( fname );
+    if ( !r ) {
+        return NULL;
+    }
+    context_table_t * t = NULL;
+    index_t capacity = 0;
+    while ( stats_reader_next ( r ) ) {
+        if ( !t ) {
+            if ( r->k + 1 > CONTEXT_TABLE_BITS ) {
+                error ( "contexts of %s are too long for a table.\n", fname );
+                break;
+            }
+            capacity = 1024;
+            t = alloc_context_table ( r->k, capacity );
+        }
+        if ( t->n == capacity ) {
+            capacity *= 2;
+            t->keys = ( uint64_t * ) realloc ( t->keys, ( capacity + 1 ) * t->words * sizeof( uint64_t ) );
+            t->occu = ( index_t * ) realloc ( t->occu, ( capacity + 1 ) * sizeof( index_t ) );
+            t->counts = ( index_t * ) realloc ( t->counts, ( capacity + 1 ) * sizeof( index_t ) );
+        }
+        uint64_t key[ 2 ];
+        pack_key ( r->key, r->k, key );
+        append_entry ( t, key, r->occu, r->counts );
+    }
+    if ( close_stats_reader ( r ) || ( t && ( t->k + 1 > CONTEXT_TABLE_BITS ) ) ) {
+        free_context_table ( t );
+        return NULL;
+    }
+    if ( !t ) { // no contexts
+        t = alloc_context_table ( 0, 0 );
+    }
+    stage_done ( STAGE_READ, t0 );
+    return t;
+}
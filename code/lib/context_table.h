@@ -0,0 +1,93 @@
+/**
+ * \file context_table.h
+ * \brief Context statistics as a sorted flat table, built by radix sort
+ *
+ * Instead of walking a tree for each pixel, the context of each pixel is
+ * packed into an integer key, with the first sample of the template as the
+ * most significant bit, followed by the value of the pixel itself. The
+ * (key, value) records of the image are radix sorted (in parallel with
+ * -DPARALLEL), and each run of records with the same key becomes one entry
+ * (key, occurrences, ones) of the table.
+ *
+ * The entries are thus in the order of the leaves of a stats tree, and of
+ * the contexts of a stats file: tables are saved and loaded in the format
+ * of save_stats and load_stats, can be turned into trees and back, merged
+ * by a linear pass, and searched by bisection.
+ *
+ * Keys are up to CONTEXT_TABLE_BITS - 1 samples long; larger templates
+ * need a tree.
+ */
+#ifndef CONTEXT_TABLE_H
+#define CONTEXT_TABLE_H
+
+#include <stdint.h>
+
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+#include "stats.h"
+
+#define CONTEXT_TABLE_BITS 128
+
+typedef struct context_table {
+    index_t k;          // samples per context
+    int words;          // 64 bit words per key: 1 if k < 64, 2 otherwise
+    index_t n;          // number of entries
+    uint64_t * keys;    // words per entry, most significant first
+    index_t * occu;
+    index_t * counts;
+} context_table_t;
+
+/**
+ * gather the statistics of the contexts (taken from pctx) of the pixels of
+ * pnoisy, as gather_patch_stats does
+ * @return NULL if the template has CONTEXT_TABLE_BITS samples or more
+ */
+context_table_t * gather_context_table ( const image_t * pnoisy, const image_t * pctx, const patch_template_t * tpl );
+
+void free_context_table ( context_table_t * table );
+
+/**
+ * position of the entry for the context of a patch, -1 if there is none
+ */
+index_t context_table_find ( const context_table_t * table, const patch_t * p );
+
+/**
+ * samples of the context of an entry
+ */
+void context_table_patch ( const context_table_t * table, const index_t e, patch_t * p );
+
+/**
+ * table with the contexts of both tables, adding up the counts of those they share
+ */
+context_table_t * merge_context_tables ( const context_table_t * a, const context_table_t * b );
+
+/**
+ * same as summarize_stats_weights on the equivalent tree
+ */
+void context_table_weights ( const context_table_t * table, index_t * freq, index_t * freq1 );
+
+/**
+ * stats tree with the same contexts and counts
+ */
+patch_node_t * context_table_to_stats ( const context_table_t * table );
+
+/**
+ * table with the leaves of a stats tree of contexts of k samples
+ * @return NULL if k is CONTEXT_TABLE_BITS or more
+ */
+context_table_t * stats_to_context_table ( const patch_node_t * stats, const index_t k );
+
+/**
+ * save the table as a stats file, the same save_stats would write for the
+ * equivalent tree
+ */
+int save_context_table ( const char * fname, const context_table_t * table );
+
+/**
+ * load a stats file into a table
+ * @return NULL if the file cannot be read or its contexts are too long
+ */
+context_table_t * load_context_table ( const char * fname );
+
+#endif
@@ -0,0 +1,245 @@
+#include <string.h>
+
+#include "dude.h"
+#include "noise.h"
+#include "workspace.h"
+#include "logging.h"
+#include "instrument.h"
+#include "template_kernels.h"
+#include "tile_map.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t dude_workspace_size ( const patch_template_t * tpl ) {
+    return workspace_round ( tpl->k * sizeof( pixel_t ) )
+         + 2 * workspace_round ( ( tpl->k + 1 ) * sizeof( index_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_dude ( dude_ctx_t * ctx, const patch_template_t * tpl, const dude_params_t * par, void * workspace ) {
+    char * pos = ( char * ) workspace;
+    ctx->par = *par;
+    ctx->tpl = tpl;
+    ctx->patch.k = tpl->k;
+    ctx->patch.values = ( pixel_t * ) workspace_take ( &pos, tpl->k * sizeof( pixel_t ) );
+    ctx->weight_freq   = ( index_t * ) workspace_take ( &pos, ( tpl->k + 1 ) * sizeof( index_t ) );
+    ctx->weight_freq_1 = ( index_t * ) workspace_take ( &pos, ( tpl->k + 1 ) * sizeof( index_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * estimate the noise from the weight histograms, already filled in
+ */
+static void estimate_noise_from_weights ( dude_ctx_t * ctx ) {
+    const index_t k = ctx->tpl->k;
+    index_t total = 0;
+    for ( index_t s = 0 ; s <= k ; ++s ) {
+        total += ctx->weight_freq[ s ];
+    }
+    estimate_noise_params ( ctx->weight_freq, ctx->weight_freq_1, total, k,
+                            template_includes_center ( ctx->tpl ), NOISE_DEFAULT_MAXS, NOISE_DEFAULT_TOL,
+                            &ctx->par.p01, &ctx->par.p10 );
+    info ( "estimated P(0->1)=%f P(1->0)=%f\n", ctx->par.p01, ctx->par.p10 );
+}
+
+void dude_estimate_noise ( dude_ctx_t * ctx, const patch_node_t * stats ) {
+    const index_t k = ctx->tpl->k;
+    memset ( ctx->weight_freq,   0, ( k + 1 ) * sizeof( index_t ) );
+    memset ( ctx->weight_freq_1, 0, ( k + 1 ) * sizeof( index_t ) );
+    summarize_stats_weights ( stats, 0, ctx->weight_freq, ctx->weight_freq_1 );
+    estimate_noise_from_weights ( ctx );
+}
+
+void dude_estimate_noise_table ( dude_ctx_t * ctx, const context_table_t * table ) {
+    const index_t k = ctx->tpl->k;
+    memset ( ctx->weight_freq,   0, ( k + 1 ) * sizeof( index_t ) );
+    memset ( ctx->weight_freq_1, 0, ( k + 1 ) * sizeof( index_t ) );
+    context_table_weights ( table, ctx->weight_freq, ctx->weight_freq_1 );
+    estimate_noise_from_weights ( ctx );
+}
+
+void dude_estimate_noise_image ( dude_ctx_t * ctx, const image_t * in ) {
+    const index_t k = ctx->tpl->k;
+    const int m = in->info.height;
+    const int n = in->info.width;
+    const patch_extractor_f extract = select_patch_extractor ( ctx->tpl );
+    patch_t * Pij = &ctx->patch;
+    memset ( ctx->weight_freq,   0, ( k + 1 ) * sizeof( index_t ) );
+    memset ( ctx->weight_freq_1, 0, ( k + 1 ) * sizeof( index_t ) );
+    //
+    // the contexts of a uniform tile weigh 0 or k, as do their centers
+    //
+    index_t reach_i, reach_j;
+    template_reach ( ctx->tpl, &reach_i, &reach_j );
+    tile_map_t * tiles = create_tile_map ( in, reach_i, reach_j );
+    for ( int i = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ) {
+            const int j1 = tile_end ( tiles, j );
+            const int v = uniform_value ( tiles, i, j );
+            if ( v >= 0 ) {
+                ctx->weight_freq[ v * k ] += j1 - j;
+                ctx->weight_freq_1[ v * k ] += v * ( j1 - j );
+                j = j1;
+                continue;
+            }
+            for ( ; j < j1 ; ++j ) {
+                extract ( in, ctx->tpl, i, j, Pij );
+                index_t w = 0;
+                for ( index_t r = 0 ; r < k ; ++r ) {
+                    w += Pij->values[ r ];
+                }
+                ctx->weight_freq[ w ]++;
+                ctx->weight_freq_1[ w ] += get_pixel ( in, i, j );
+            }
+        }
+    }
+    free_tile_map ( tiles );
+    estimate_noise_from_weights ( ctx );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * the rule, with the counts of each context taken from the tree, or from
+ * the table if stats is NULL
+ */
+static index_t apply_rule ( dude_ctx_t * ctx, const patch_node_t * stats, const context_table_t * table,
+                            const image_t * in, const image_t * pre, image_t * out ) {
+    const uint64_t t_start = instrument_now ( );
+
+    const double p0 = ctx->par.p01;
+    const double p1 = ctx->par.p10;
+    const double pe = p0 + p1;
+    /*
+    * we define the thresholds:
+    *  t0 = 2p1(1-p0)/(1+p1-p0)
+    *  t1 = 2p0(1-p1)/(1+p0-p1)
+    * so that
+    *
+    * if z = 0:
+    * x = 0 if n_0/n >= t0
+    * x = 1 otherwise
+    *
+    * if z = 1:
+    * x = 1 if n_1/n >= t1
+    * x = 0 otherwise
+    *
+    */
+    const double t0 = 2.0*p1*(1.0-p0) / ( 1.0+p1-p0);
+    const double t1 = 2.0*p0*(1.0-p1) / ( 1.0+p0-p1);
+    const int m = in->info.height;
+    const int n = in->info.width;
+    const index_t total = m * n;
+
+    index_t zeroed = 0, oned = 0;
+    const patch_template_t* tpl = ctx->tpl;
+    patch_t* Pij = &ctx->patch;
+    const patch_extractor_f extract = select_patch_extractor ( tpl );
+    tile_map_t * tiles = NULL, * ztiles = NULL;
+    if ( !ctx->par.visit_all ) {
+        index_t reach_i, reach_j;
+        template_reach ( tpl, &reach_i, &reach_j );
+        tiles = create_tile_map ( pre, reach_i, reach_j );
+        ztiles = in == pre ? tiles : create_tile_map ( in, 0, 0 );
+    }
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ) {
+            //
+            // in a uniform tile, the pixels up to the end of the tile have
+            // the same context and noisy value, and thus the same decision
+            //
+            int len = 1;
+            if ( tiles && ( uniform_value ( tiles, i, j ) >= 0 ) && ( uniform_value ( ztiles, i, j ) >= 0 ) ) {
+                len = tile_end ( tiles, j ) - j;
+            }
+            //
+            // denoising rule:
+            //
+            extract ( pre, tpl, i, j, Pij );
+            const pixel_t z = get_linear_pixel ( in, li );
+            index_t occu, counts;
+            if ( stats ) {
+                const patch_node_t* patch_stats  = get_patch_node_const ( stats, Pij );
+                occu = patch_stats->occu;
+                counts = patch_stats->counts;
+            } else {
+                const index_t e = context_table_find ( table, Pij );
+                occu = e >= 0 ? table->occu[ e ] : 0; // unseen: keep z
+                counts = e >= 0 ? table->counts[ e ] : 0;
+            }
+            pixel_t x = z;
+            if ( !z ) { // z = 0
+                const double n0 = (double)(occu-counts);
+                if (n0 < (t0 * (double)occu)) {
+                    oned += len;
+                    x = 1;
+                }
+            } else { // z = 1
+                const double n1 = (double)counts;
+                if (n1 < (t1 * (double)occu)) {
+                    zeroed += len;
+                    x = 0;
+                }
+            }
+            if ( x != z ) {
+                for ( int s = 0 ; s < len ; ++s ) {
+                    set_linear_pixel ( out, li + s, x );
+                }
+            }
+            j += len;
+            li += len;
+        }
+    }
+    if ( ztiles != tiles ) {
+        free_tile_map ( ztiles );
+    }
+    free_tile_map ( tiles );
+    info ( "changed : 0->1 (%8.4f%%) 1->0 (%8.4f%%) total (%8.4f%%) pixels\n",
+        100.0*((double)oned)/((double)total),
+        100.0*((double)zeroed)/((double)total),
+        100.0*((double)(zeroed+oned))/((double)total));
+    info ( "expected: 0->1 (%8.4f%%) 1->0 (%8.4f%%) total (%8.4f%%) pixels\n",
+        100.0*p0, 100.0*p1, 100.0*pe);
+    count_events ( COUNTER_PIXELS_CHANGED, oned + zeroed );
+    stage_done ( STAGE_APPLY, t_start );
+    return (oned+zeroed);
+}
+
+index_t dude_apply ( dude_ctx_t * ctx, const patch_node_t * stats,
+                     const image_t * in, const image_t * pre, image_t * out ) {
+    return apply_rule ( ctx, stats, NULL, in, pre, out );
+}
+
+index_t dude_apply_table ( dude_ctx_t * ctx, const context_table_t * table,
+                           const image_t * in, const image_t * pre, image_t * out ) {
+    return apply_rule ( ctx, NULL, table, in, pre, out );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t dude_denoise ( dude_ctx_t * ctx, const image_t * in, image_t * pre, image_t * out, const int iterations ) {
+    index_t changed = 0;
+    for (int i = 0; i < iterations; i++) {
+        info ("iteration %d\n",i);
+        context_table_t * table = ctx->par.sorted ? gather_context_table ( in, pre, ctx->tpl ) : NULL;
+        if ( table ) {
+            if ( ctx->par.auto_noise && ( i == 0 ) ) {
+                dude_estimate_noise_table ( ctx, table );
+            }
+            changed = dude_apply_table ( ctx, table, in, pre, out );
+            free_context_table ( table );
+        } else { // tree, also for templates too large for a table
+            patch_node_t* stats = gather_patch_stats ( in, pre, ctx->tpl, NULL, NULL );
+            if ( ctx->par.auto_noise && ( i == 0 ) ) {
+                dude_estimate_noise ( ctx, stats );
+            }
+            changed = dude_apply ( ctx, stats, in, pre, out );
+            free_node ( stats );
+        }
+        // prefiltered for next iter is output from this iter
+        pixels_copyto ( pre, out );
+    }
+    return changed;
+}
@@ -0,0 +1,104 @@
+/**
+ * \file dude.h
+ * \brief Discrete Universal DEnoiser for binary images
+ *
+ * the statistics of each context (as given by a template) are gathered
+ * in a patch tree, and the DUDE rule for the binary asymmetric channel
+ * is applied to each pixel given the counts of its context.
+ */
+#ifndef DUDE_H
+#define DUDE_H
+
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+#include "stats.h"
+#include "context_table.h"
+
+typedef struct dude_params {
+    double p01; // P(0->1)
+    double p10; // P(1->0)
+    int auto_noise; // estimate p01 and p10 from the statistics of the first iteration
+    int visit_all; // apply the rule to every pixel, even in uniform tiles (see tile_map.h)
+    int sorted; // gather the statistics into a context table (see context_table.h) instead of a tree
+} dude_params_t;
+
+/**
+ * denoising context; all buffers point into the caller's workspace
+ */
+typedef struct dude_ctx {
+    dude_params_t par;
+    const patch_template_t * tpl;
+    /** scratch patch */
+    patch_t patch;
+    /** histograms of the context weights, for estimating the noise (size k + 1) */
+    index_t * weight_freq;
+    index_t * weight_freq_1;
+} dude_ctx_t;
+
+/**
+ * size in bytes of the workspace required by a context
+ */
+size_t dude_workspace_size ( const patch_template_t * tpl );
+
+/**
+ * prepare a context; the template and the workspace must outlive the context
+ */
+void init_dude ( dude_ctx_t * ctx, const patch_template_t * tpl, const dude_params_t * par, void * workspace );
+
+/**
+ * estimate the noise parameters of the context from the histograms of the
+ * weights of the contexts in the statistics
+ */
+void dude_estimate_noise ( dude_ctx_t * ctx, const patch_node_t * stats );
+
+/**
+ * same as dude_estimate_noise, from a context table
+ */
+void dude_estimate_noise_table ( dude_ctx_t * ctx, const context_table_t * table );
+
+/**
+ * same as dude_estimate_noise, from the contexts of the image itself; for
+ * when the statistics come from elsewhere (e.g. a stats file)
+ */
+void dude_estimate_noise_image ( dude_ctx_t * ctx, const image_t * in );
+
+/**
+ * @brief DUDE denoiser for binary asymmetric channel
+ *
+ * given p0 = P(0->1) and p1 = P(1->0)
+ *  the counts of 0s,n0,  1s, n1, and the total occurrences of the context, n
+ * the rule is given by:
+ *
+ * if z = 0:
+ * x = 0 if n_0/n >= 2p1(1-p0)/(1+p1-p0)
+ * x = 1 otherwise
+ *
+ * if z = 1:
+ * x = 1 if n_1/n >= 2p0(1-p1)/(1+p0-p1)
+ * x = 0 otherwise
+ *
+ * @param stats context statistics; every context of ctximg must be present
+ * @param in noisy image
+ * @param ctximg image from which the contexts are taken
+ * @param out denoised image; must be a copy of in
+ * @return index_t number of changed pixels
+ */
+index_t dude_apply ( dude_ctx_t * ctx, const patch_node_t * stats,
+                     const image_t * in, const image_t * ctximg, image_t * out );
+
+/**
+ * same as dude_apply, with the statistics in a context table
+ */
+index_t dude_apply_table ( dude_ctx_t * ctx, const context_table_t * table,
+                           const image_t * in, const image_t * ctximg, image_t * out );
+
+/**
+ * gather the statistics from the image itself and apply the rule, several times;
+ * after each iteration, the output becomes the context image of the next one
+ * @param ctximg (prefiltered) image from which contexts are taken; overwritten
+ * @return number of pixels changed in the last iteration
+ */
+index_t dude_denoise ( dude_ctx_t * ctx, const image_t * in, image_t * ctximg, image_t * out, const int iterations );
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hamming_index.h"
+#include "workspace.h"
+#include "instrument.h"
+#include "logging.h"
+
+/** state of a query while the buckets are probed */
+typedef struct search {
+    hamming_query_t * q;
+    index_t nhits;
+    uint64_t code[ HAMMING_WORDS ];
+    index_t mind, maxd;
+    int nearest;        // keep only the leaves at the smallest distance, which then bounds maxd
+} search_t;
+
+/*---------------------------------------------------------------------------------------*/
+
+static void pack_code ( const patch_t * p, uint64_t * code ) {
+    memset ( code, 0, HAMMING_WORDS * sizeof( uint64_t ) );
+    for ( index_t r = 0 ; r < p->k ; ++r ) {
+        if ( p->values[ r ] ) {
+            code[ r >> 6 ] |= ( uint64_t ) 1 << ( r & 63 );
+        }
+    }
+}
+
+/** bits [b0,b1) of a code, at most 64 of them */
+static inline uint64_t substring ( const uint64_t * code, const int b0, const int b1 ) {
+    const int len = b1 - b0, w = b0 >> 6, o = b0 & 63;
+    uint64_t v = code[ w ] >> o;
+    if ( o && ( o + len > 64 ) ) {
+        v |= code[ w + 1 ] << ( 64 - o );
+    }
+    return len < 64 ? v & ( ( ( uint64_t ) 1 << len ) - 1 ) : v;
+}
+
+static inline index_t popcount64 ( uint64_t x ) {
+#ifdef __GNUC__
+    return __builtin_popcountll ( x );
+#else
+    x = x - ( ( x >> 1 ) & 0x5555555555555555ULL );
+    x = ( x & 0x3333333333333333ULL ) + ( ( x >> 2 ) & 0x3333333333333333ULL );
+    x = ( x + ( x >> 4 ) ) & 0x0F0F0F0F0F0F0F0FULL;
+    return ( index_t ) ( ( x * 0x0101010101010101ULL ) >> 56 );
+#endif
+}
+
+/** position of the lowest bit set in a nonzero word */
+static inline index_t lowest_bit ( const uint64_t x ) {
+#ifdef __GNUC__
+    return __builtin_ctzll ( x );
+#else
+    return popcount64 ( ( x & -x ) - 1 );
+#endif
+}
+
+static inline index_t code_distance ( const uint64_t * a, const uint64_t * b ) {
+    index_t d = 0;
+    for ( int w = 0 ; w < HAMMING_WORDS ; ++w ) {
+        d += popcount64 ( a[ w ] ^ b[ w ] );
+    }
+    return d;
+}
+
+static inline index_t hash_slot ( const uint64_t key, const index_t mask ) {
+    return ( index_t ) ( ( key * 0x9E3779B97F4A7C15ULL ) >> 32 ) & mask;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static int compare_hits_leaf ( const void * pa, const void * pb ) {
+    const hamming_hit_t * a = ( const hamming_hit_t * ) pa;
+    const hamming_hit_t * b = ( const hamming_hit_t * ) pb;
+    return a->leaf < b->leaf ? -1 : ( a->leaf > b->leaf );
+}
+
+typedef struct keyed_leaf {
+    uint64_t key;
+    index_t leaf;
+} keyed_leaf_t;
+
+static int compare_keyed ( const void * pa, const void * pb ) {
+    const keyed_leaf_t * a = ( const keyed_leaf_t * ) pa;
+    const keyed_leaf_t * b = ( const keyed_leaf_t * ) pb;
+    if ( a->key != b->key ) {
+        return a->key < b->key ? -1 : 1;
+    }
+    return a->leaf < b->leaf ? -1 : ( a->leaf > b->leaf );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void build_table ( hamming_index_t * idx, const int j ) {
+    hamming_table_t * t = &idx->tables[ j ];
+    const index_t n = idx->n;
+    keyed_leaf_t * kl = ( keyed_leaf_t * ) malloc ( ( n + 1 ) * sizeof( keyed_leaf_t ) );
+    index_t nkeys = 0;
+    for ( index_t l = 0 ; l < n ; ++l ) {
+        kl[ l ].key = substring ( idx->codes + l * HAMMING_WORDS, idx->start[ j ], idx->start[ j + 1 ] );
+        kl[ l ].leaf = l;
+    }
+    qsort ( kl, n, sizeof( keyed_leaf_t ), compare_keyed );
+    for ( index_t l = 0 ; l < n ; ++l ) {
+        nkeys += ( l == 0 ) || ( kl[ l ].key != kl[ l - 1 ].key );
+    }
+    index_t slots = 2;
+    while ( slots < 2 * nkeys ) {
+        slots <<= 1;
+    }
+    t->mask = slots - 1;
+    t->keys = ( uint64_t * ) malloc ( slots * sizeof( uint64_t ) );
+    t->first = ( index_t * ) malloc ( slots * sizeof( index_t ) );
+    t->count = ( index_t * ) malloc ( slots * sizeof( index_t ) );
+    t->postings = ( index_t * ) malloc ( ( n + 1 ) * sizeof( index_t ) );
+    for ( index_t s = 0 ; s < slots ; ++s ) {
+        t->first[ s ] = -1;
+    }
+    for ( index_t l = 0 ; l < n ; ) {
+        const uint64_t key = kl[ l ].key;
+        index_t s = hash_slot ( key, t->mask );
+        while ( t->first[ s ] >= 0 ) {
+            s = ( s + 1 ) & t->mask;
+        }
+        t->keys[ s ] = key;
+        t->first[ s ] = l;
+        for ( ; ( l < n ) && ( kl[ l ].key == key ) ; ++l ) {
+            t->postings[ l ] = kl[ l ].leaf;
+        }
+        t->count[ s ] = l - t->first[ s ];
+    }
+    free ( kl );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+hamming_index_t * create_hamming_index ( patch_node_t * tree, const index_t k ) {
+    if ( ( k < 1 ) || ( k > HAMMING_MAX_BITS ) ) {
+        return NULL;
+    }
+    hamming_index_t * idx = ( hamming_index_t * ) calloc ( 1, sizeof( hamming_index_t ) );
+    index_t nleaves = 0, totoccu = 0, totcount = 0;
+    summarize_stats ( tree, &nleaves, &totoccu, &totcount );
+    idx->k = k;
+    idx->leaves = ( patch_node_t * * ) malloc ( ( nleaves + 1 ) * sizeof( patch_node_t * ) );
+    flatten_stats ( tree, idx->leaves, &idx->n );
+    idx->codes = ( uint64_t * ) malloc ( ( idx->n + 1 ) * HAMMING_WORDS * sizeof( uint64_t ) );
+    patch_t * p = alloc_patch ( k );
+    for ( index_t l = 0 ; l < idx->n ; ++l ) {
+        get_leaf_patch ( p, idx->leaves[ l ] );
+        pack_code ( p, idx->codes + l * HAMMING_WORDS );
+    }
+    free_patch ( p );
+    //
+    // substrings of about log2(n) bits, which leaves about one leaf per bucket
+    //
+    int bits = 1;
+    while ( ( bits < 64 ) && ( ( ( index_t ) 1 << bits ) < idx->n ) ) {
+        bits++;
+    }
+    int m = ( int ) ( ( k + bits - 1 ) / bits );
+    if ( m < ( k + 63 ) / 64 ) {
+        m = ( int ) ( ( k + 63 ) / 64 );
+    }
+    idx->m = m;
+    for ( int j = 0 ; j <= m ; ++j ) {
+        idx->start[ j ] = ( int ) ( ( j * k ) / m );
+    }
+    idx->tables = ( hamming_table_t * ) calloc ( m, sizeof( hamming_table_t ) );
+    for ( int j = 0 ; j < m ; ++j ) {
+        build_table ( idx, j );
+    }
+    debug ( "hamming index: %ld leaves of %ld bits in %d substrings\n", idx->n, idx->k, idx->m );
+    return idx;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void free_hamming_index ( hamming_index_t * idx ) {
+    if ( !idx ) {
+        return;
+    }
+    for ( int j = 0 ; j < idx->m ; ++j ) {
+        free ( idx->tables[ j ].keys );
+        free ( idx->tables[ j ].first );
+        free ( idx->tables[ j ].count );
+        free ( idx->tables[ j ].postings );
+    }
+    free ( idx->tables );
+    free ( idx->codes );
+    free ( idx->leaves );
+    free ( idx );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t hamming_query_workspace_size ( const hamming_index_t * idx ) {
+    const size_t n = idx->n + 1;
+    return workspace_round ( n * sizeof( uint32_t ) )
+         + workspace_round ( n * sizeof( hamming_hit_t ) )
+         + workspace_round ( ( n / 64 + 1 ) * sizeof( uint64_t ) )
+         + workspace_round ( n * sizeof( neighbor_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_hamming_query ( hamming_query_t * q, const hamming_index_t * idx, void * workspace ) {
+    char * pos = ( char * ) workspace;
+    const size_t n = idx->n + 1;
+    q->idx = idx;
+    q->marks = ( uint32_t * ) workspace_take ( &pos, n * sizeof( uint32_t ) );
+    memset ( q->marks, 0, n * sizeof( uint32_t ) );
+    q->stamp = 0;
+    q->hits = ( hamming_hit_t * ) workspace_take ( &pos, n * sizeof( hamming_hit_t ) );
+    q->found = ( uint64_t * ) workspace_take ( &pos, ( n / 64 + 1 ) * sizeof( uint64_t ) );
+    memset ( q->found, 0, ( n / 64 + 1 ) * sizeof( uint64_t ) );
+    q->neighbors.neighbors = ( neighbor_t * ) workspace_take ( &pos, n * sizeof( neighbor_t ) );
+    q->neighbors.maxnumber = n;
+    q->neighbors.number = 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void begin_search ( search_t * s, hamming_query_t * q, const patch_t * center,
+                           const index_t mind, const index_t maxd, const int nearest ) {
+    const size_t n = q->idx->n + 1;
+    if ( ++q->stamp == 0 ) {
+        memset ( q->marks, 0, n * sizeof( uint32_t ) );
+        q->stamp = 1;
+    }
+    s->q = q;
+    s->nhits = 0;
+    pack_code ( center, s->code );
+    s->mind = mind;
+    s->maxd = maxd;
+    s->nearest = nearest;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static inline void check_leaf ( search_t * s, const index_t l ) {
+    hamming_query_t * q = s->q;
+    if ( q->marks[ l ] == q->stamp ) {
+        return;
+    }
+    q->marks[ l ] = q->stamp;
+    const index_t d = code_distance ( s->code, q->idx->codes + l * HAMMING_WORDS );
+    if ( ( d < s->mind ) || ( d > s->maxd ) ) {
+        return;
+    }
+    if ( s->nearest && ( d < s->maxd ) ) {
+        s->maxd = d;
+        s->nhits = 0;
+    }
+    q->hits[ s->nhits ].leaf = l;
+    q->hits[ s->nhits++ ].dist = d;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void check_bucket ( search_t * s, const int j, const uint64_t key ) {
+    const hamming_table_t * t = &s->q->idx->tables[ j ];
+    for ( index_t slot = hash_slot ( key, t->mask ) ; t->first[ slot ] >= 0 ; slot = ( slot + 1 ) & t->mask ) {
+        if ( t->keys[ slot ] == key ) {
+            const index_t * post = t->postings + t->first[ slot ];
+            for ( index_t c = 0 ; c < t->count[ slot ] ; ++c ) {
+                check_leaf ( s, post[ c ] );
+            }
+            return;
+        }
+    }
+}
+
+/** probe the buckets of substring j that are exactly 'left' bits away from key, flipping bits from 'from' on */
+static void probe_flips ( search_t * s, const int j, const uint64_t key, const int len, const int from, const int left ) {
+    if ( left == 0 ) {
+        check_bucket ( s, j, key );
+        return;
+    }
+    for ( int b = from ; b <= len - left ; ++b ) {
+        probe_flips ( s, j, key ^ ( ( uint64_t ) 1 << b ), len, b + 1, left - 1 );
+    }
+}
+
+/** probe all the substrings with exactly r bits flipped */
+static void probe_level ( search_t * s, const int r ) {
+    const hamming_index_t * idx = s->q->idx;
+    for ( int j = 0 ; j < idx->m ; ++j ) {
+        const int len = idx->start[ j + 1 ] - idx->start[ j ];
+        if ( r <= len ) {
+            probe_flips ( s, j, substring ( s->code, idx->start[ j ], idx->start[ j + 1 ] ), len, 0, r );
+        }
+    }
+}
+
+/** number of buckets probed for substring distances up to r */
+static double probe_count ( const hamming_index_t * idx, const index_t r ) {
+    double total = 0;
+    for ( int j = 0 ; j < idx->m ; ++j ) {
+        const int len = idx->start[ j + 1 ] - idx->start[ j ];
+        double c = 1;
+        for ( index_t i = 0 ; ( i <= r ) && ( i <= len ) ; ++i ) {
+            total += c;
+            c = c * ( len - i ) / ( i + 1 );
+        }
+    }
+    return total;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * put the hits in the order of the tree: a few are sorted, many are
+ * read back in order from a bitmap of the leaves
+ */
+static const neighbor_list_t * end_search ( search_t * s ) {
+    hamming_query_t * q = s->q;
+    const hamming_index_t * idx = q->idx;
+    hamming_hit_t * hits = q->hits;
+    const index_t nhits = s->nhits;
+    neighbor_t * out = q->neighbors.neighbors;
+    if ( nhits * 256 < idx->n ) {
+        if ( nhits > 16 ) {
+            qsort ( hits, nhits, sizeof( hamming_hit_t ), compare_hits_leaf );
+        } else {
+            for ( index_t h = 1 ; h < nhits ; ++h ) {
+                const hamming_hit_t x = hits[ h ];
+                index_t g = h;
+                for ( ; ( g > 0 ) && ( hits[ g - 1 ].leaf > x.leaf ) ; --g ) {
+                    hits[ g ] = hits[ g - 1 ];
+                }
+                hits[ g ] = x;
+            }
+        }
+        for ( index_t h = 0 ; h < nhits ; ++h ) {
+            out[ h ].patch_node = idx->leaves[ hits[ h ].leaf ];
+            out[ h ].dist = hits[ h ].dist;
+        }
+    } else {
+        // the distances are recomputed, which is cheaper than looking them up
+        for ( index_t h = 0 ; h < nhits ; ++h ) {
+            q->found[ hits[ h ].leaf >> 6 ] |= ( uint64_t ) 1 << ( hits[ h ].leaf & 63 );
+        }
+        index_t h = 0;
+        for ( index_t w = 0 ; w <= idx->n / 64 ; ++w ) {
+            uint64_t bits = q->found[ w ];
+            q->found[ w ] = 0;
+            while ( bits ) {
+                const index_t l = ( w << 6 ) + lowest_bit ( bits );
+                bits &= bits - 1;
+                out[ h ].patch_node = idx->leaves[ l ];
+                out[ h++ ].dist = code_distance ( s->code, idx->codes + l * HAMMING_WORDS );
+            }
+        }
+    }
+    q->neighbors.number = nhits;
+    count_events ( COUNTER_NEIGHBOR_VISITS, s->nhits );
+    return &q->neighbors;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+const neighbor_list_t * hamming_search ( hamming_query_t * q, const patch_t * center,
+                                         const index_t mind, const index_t maxd ) {
+    search_t s;
+    begin_search ( &s, q, center, mind, maxd, 0 );
+    const hamming_index_t * idx = q->idx;
+    const index_t rmax = maxd / idx->m;
+    if ( probe_count ( idx, rmax ) >= ( double ) idx->n ) {
+        for ( index_t l = 0 ; l < idx->n ; ++l ) {
+            check_leaf ( &s, l );
+        }
+    } else {
+        for ( index_t r = 0 ; r <= rmax ; ++r ) {
+            probe_level ( &s, ( int ) r );
+        }
+    }
+    return end_search ( &s );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+const neighbor_list_t * hamming_nearest ( hamming_query_t * q, const patch_t * center,
+                                          const index_t mind, const index_t maxd ) {
+    search_t s;
+    begin_search ( &s, q, center, mind, maxd, 1 );
+    const hamming_index_t * idx = q->idx;
+    const index_t rmax = maxd / idx->m;
+    if ( probe_count ( idx, rmax ) >= ( double ) idx->n ) {
+        for ( index_t l = 0 ; l < idx->n ; ++l ) {
+            check_leaf ( &s, l );
+        }
+    } else {
+        //
+        // after probing up to r bits per substring, every leaf closer than
+        // m * ( r + 1 ) has been seen
+        //
+        for ( index_t r = 0 ; r <= rmax ; ++r ) {
+            probe_level ( &s, ( int ) r );
+            if ( s.nhits && ( s.maxd < idx->m * ( r + 1 ) ) ) {
+                break;
+            }
+        }
+    }
+    return end_search ( &s );
+}
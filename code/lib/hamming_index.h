@@ -0,0 +1,93 @@
+/**
+ * \file hamming_index.h
+ * \brief Multi-index hashing of binary patches for Hamming range queries
+ *
+ * The leaves of a stats tree (typically the cluster centers) are packed
+ * into codes of up to HAMMING_MAX_BITS bits, which are split into m
+ * substrings of about log2(number of leaves) bits each. Each substring has
+ * a hash table from its value to the leaves that have it.
+ *
+ * If two codes are at most r bits apart, at least one of their substrings
+ * is at most floor(r/m) bits apart, so a query only probes the buckets of
+ * the substrings of the center with up to that many bits flipped, and
+ * checks the full distance of the leaves found there. When that would
+ * take more probes than there are leaves, the query scans them all instead.
+ *
+ * The results are the same as those of find_neighbors on the tree, and
+ * in the same order.
+ */
+#ifndef HAMMING_INDEX_H
+#define HAMMING_INDEX_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define HAMMING_MAX_BITS 128
+#define HAMMING_WORDS ( HAMMING_MAX_BITS / 64 )
+
+/** leaves that have each value of one substring */
+typedef struct hamming_table {
+    index_t mask;       // number of slots - 1
+    uint64_t * keys;
+    index_t * first;    // position of the first leaf in postings, -1 for an empty slot
+    index_t * count;
+    index_t * postings; // leaves, grouped by value of the substring
+} hamming_table_t;
+
+typedef struct hamming_index {
+    index_t k;          // bits per code
+    index_t n;          // number of leaves
+    int m;              // number of substrings
+    int start[ HAMMING_MAX_BITS + 1 ]; // first bit of each substring; start[ m ] = k
+    uint64_t * codes;   // HAMMING_WORDS words per leaf
+    patch_node_t * * leaves; // in the order of flatten_stats
+    hamming_table_t * tables;
+} hamming_index_t;
+
+/** a leaf found by a query, by its position in the index */
+typedef struct hamming_hit {
+    index_t leaf;
+    index_t dist;
+} hamming_hit_t;
+
+/**
+ * scratch space of a query; all buffers point into the caller's workspace,
+ * so that each thread can query the same index with its own
+ */
+typedef struct hamming_query {
+    const hamming_index_t * idx;
+    uint32_t * marks;   // leaves already checked by the current query
+    uint32_t stamp;
+    hamming_hit_t * hits;
+    uint64_t * found;   // bitmap of the hits, to list many of them in order
+    neighbor_list_t neighbors;
+} hamming_query_t;
+
+/**
+ * index the leaves of a tree of patches of k samples
+ * @return NULL if k is larger than HAMMING_MAX_BITS
+ */
+hamming_index_t * create_hamming_index ( patch_node_t * tree, const index_t k );
+
+void free_hamming_index ( hamming_index_t * idx );
+
+size_t hamming_query_workspace_size ( const hamming_index_t * idx );
+
+void init_hamming_query ( hamming_query_t * q, const hamming_index_t * idx, void * workspace );
+
+/**
+ * leaves whose distance to the center is between mind and maxd, in the order
+ * of the tree; the list is valid until the next query
+ */
+const neighbor_list_t * hamming_search ( hamming_query_t * q, const patch_t * center,
+                                         const index_t mind, const index_t maxd );
+
+/**
+ * leaves at the smallest distance to the center that is between mind and maxd,
+ * in the order of the tree; the list is valid until the next query
+ */
+const neighbor_list_t * hamming_nearest ( hamming_query_t * q, const patch_t * center,
+                                          const index_t mind, const index_t maxd );
+
+#endif
@@ -0,0 +1,149 @@
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "instrument.h"
+#include "pnm.h" // RESULT_OK
+
+static uint64_t stage_ns[ NSTAGES ];
+static uint64_t counters[ NCOUNTERS ];
+
+static const char * stage_names[ NSTAGES ] = {
+    "read", "template", "stats", "cluster", "apply", "write"
+};
+
+static const char * counter_names[ NCOUNTERS ] = {
+    "trie_nodes", "neighbor_visits", "pixels_changed", "bytes_read", "bytes_written"
+};
+
+/*---------------------------------------------------------------------------------------*/
+
+static inline void atomic_add ( uint64_t * x, const uint64_t n ) {
+#if defined( __GNUC__ )
+    __atomic_fetch_add ( x, n, __ATOMIC_RELAXED );
+#else
+    *x += n;
+#endif
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+uint64_t instrument_now ( void ) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency ( &freq );
+    QueryPerformanceCounter ( &t );
+    return ( uint64_t ) ( ( double ) t.QuadPart * 1e9 / ( double ) freq.QuadPart );
+#else
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t ) ts.tv_sec * 1000000000ULL + ( uint64_t ) ts.tv_nsec;
+#endif
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void stage_done ( const instrument_stage_t stage, const uint64_t start ) {
+    atomic_add ( &stage_ns[ stage ], instrument_now ( ) - start );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void count_events ( const instrument_counter_t counter, const uint64_t n ) {
+    atomic_add ( &counters[ counter ], n );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+double stage_seconds ( const instrument_stage_t stage ) {
+    return 1e-9 * ( double ) stage_ns[ stage ];
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+uint64_t counter_value ( const instrument_counter_t counter ) {
+    return counters[ counter ];
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+uint64_t peak_rss ( void ) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if ( getrusage ( RUSAGE_SELF, &usage ) ) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return ( uint64_t ) usage.ru_maxrss;
+#else
+    return ( uint64_t ) usage.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void reset_instrument ( void ) {
+    memset ( stage_ns, 0, sizeof( stage_ns ) );
+    memset ( counters, 0, sizeof( counters ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** a JSON string, escaping quotes, backslashes and control characters */
+static void write_json_string ( FILE * out, const char * s ) {
+    fputc ( '"', out );
+    for ( ; s && *s ; ++s ) {
+        const unsigned char c = ( unsigned char ) *s;
+        if ( ( c == '"' ) || ( c == '\\' ) ) {
+            fprintf ( out, "\\%c", c );
+        } else if ( c < 0x20 ) {
+            fprintf ( out, "\\u%04x", c );
+        } else {
+            fputc ( c, out );
+        }
+    }
+    fputc ( '"', out );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void write_instrument_json ( FILE * out, const char * program, const char * input ) {
+    const char * base = program ? strrchr ( program, '/' ) : NULL;
+    fprintf ( out, "{\"program\":" );
+    write_json_string ( out, base ? base + 1 : program );
+    fprintf ( out, ",\"input\":" );
+    write_json_string ( out, input );
+    fprintf ( out, ",\"stages\":{" );
+    for ( int s = 0 ; s < NSTAGES ; ++s ) {
+        fprintf ( out, "%s\"%s\":%.6f", s ? "," : "", stage_names[ s ], stage_seconds ( ( instrument_stage_t ) s ) );
+    }
+    fprintf ( out, "},\"counters\":{" );
+    for ( int c = 0 ; c < NCOUNTERS ; ++c ) {
+        fprintf ( out, "%s\"%s\":%llu", c ? "," : "", counter_names[ c ],
+                  ( unsigned long long ) counters[ c ] );
+    }
+    fprintf ( out, "},\"peak_rss\":%llu}\n", ( unsigned long long ) peak_rss ( ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int save_instrument_json ( const char * fname, const char * program, const char * input ) {
+    if ( !strcmp ( fname, "-" ) ) {
+        write_instrument_json ( stdout, program, input );
+        return RESULT_OK;
+    }
+    FILE * out = fopen ( fname, "a" );
+    if ( !out ) {
+        return RESULT_ERROR;
+    }
+    write_instrument_json ( out, program, input );
+    fclose ( out );
+    return RESULT_OK;
+}
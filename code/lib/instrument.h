@@ -0,0 +1,77 @@
+/**
+ * \file instrument.h
+ * \brief Per-stage timers and event counters
+ *
+ * The library functions that make up each stage of a method (reading,
+ * building templates, gathering statistics, clustering, applying the rule,
+ * writing) add the time they take to the timer of their stage, and count
+ * events such as trie nodes created or pixels changed. Timers are monotonic
+ * wall-clock time; calls made concurrently from several threads add up.
+ *
+ * The totals are process-wide, and are meant to be dumped once at the end of
+ * a program as a single JSON line.
+ */
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum instrument_stage {
+    STAGE_READ = 0,
+    STAGE_TEMPLATE,
+    STAGE_STATS,
+    STAGE_CLUSTER,
+    STAGE_APPLY,
+    STAGE_WRITE,
+    NSTAGES
+} instrument_stage_t;
+
+typedef enum instrument_counter {
+    COUNTER_TRIE_NODES = 0,  // statistics tree nodes allocated
+    COUNTER_NEIGHBOR_VISITS, // neighbors found in the tree, candidates scanned by NLM
+    COUNTER_PIXELS_CHANGED,  // pixels that differ from the noisy input, summed over passes
+    COUNTER_BYTES_READ,      // images and statistics files
+    COUNTER_BYTES_WRITTEN,
+    NCOUNTERS
+} instrument_counter_t;
+
+/**
+ * monotonic clock, in nanoseconds
+ */
+uint64_t instrument_now ( void );
+
+/**
+ * add the time elapsed since start (as given by instrument_now) to a stage
+ */
+void stage_done ( const instrument_stage_t stage, const uint64_t start );
+
+/**
+ * add n events to a counter
+ */
+void count_events ( const instrument_counter_t counter, const uint64_t n );
+
+double stage_seconds ( const instrument_stage_t stage );
+
+uint64_t counter_value ( const instrument_counter_t counter );
+
+/**
+ * largest resident set size of the process so far, in bytes (0 if unknown)
+ */
+uint64_t peak_rss ( void );
+
+void reset_instrument ( void );
+
+/**
+ * write the timers and counters as one line of JSON:
+ * {"program":...,"input":...,"stages":{"read":seconds,...},"counters":{"trie_nodes":n,...},"peak_rss":bytes}
+ */
+void write_instrument_json ( FILE * out, const char * program, const char * input );
+
+/**
+ * append the JSON line to a file, or write it to stdout if fname is "-"
+ * @return RESULT_OK or RESULT_ERROR
+ */
+int save_instrument_json ( const char * fname, const char * program, const char * input );
+
+#endif
@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include "median.h"
+#include "workspace.h"
+#include "bitfun.h"
+#include "instrument.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * words of zero padding on each side of the packed image: reads may go
+ * as far as the largest template offset plus two words
+ */
+static index_t packed_padding ( const image_info_t * info, const patch_template_t * tpl ) {
+    index_t reach = 0;
+    for ( index_t r = 0 ; r < tpl->k ; ++r ) {
+        index_t o = tpl->coords[ r ].i * info->width + tpl->coords[ r ].j;
+        if ( o < 0 ) o = -o;
+        if ( o > reach ) reach = o;
+    }
+    return reach / PACKED_BITS + 3;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t median_workspace_size ( const image_info_t * info, const patch_template_t * tpl ) {
+    const size_t k = tpl->k;
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const size_t nwords = npixels / PACKED_BITS + 2 + 2 * packed_padding ( info, tpl );
+    return workspace_round ( k * sizeof( index_t ) )
+         + workspace_round ( nwords * sizeof( packed_word_t ) )
+         + 2 * workspace_round ( k * sizeof( packed_word_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_median ( median_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl, void * workspace ) {
+    const index_t k = tpl->k;
+    const index_t pad = packed_padding ( info, tpl );
+    char * pos = ( char * ) workspace;
+    ctx->tpl = tpl;
+    ctx->k = k;
+    ctx->npixels = ( index_t ) info->width * ( index_t ) info->height;
+    ctx->offsets = ( index_t * ) workspace_take ( &pos, k * sizeof( index_t ) );
+    ctx->packed  = ( packed_word_t * ) workspace_take ( &pos,
+                   ( ctx->npixels / PACKED_BITS + 2 + 2 * pad ) * sizeof( packed_word_t ) ) + pad;
+    ctx->planes  = ( packed_word_t * ) workspace_take ( &pos, k * sizeof( packed_word_t ) );
+    ctx->carries = ( packed_word_t * ) workspace_take ( &pos, k * sizeof( packed_word_t ) );
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        ctx->offsets[ r ] = tpl->coords[ r ].i * info->width + tpl->coords[ r ].j;
+    }
+    ctx->threshold = ( k + 1 ) / 2;
+    ctx->nbits = 1;
+    while ( ( ( index_t ) 1 << ctx->nbits ) <= k ) {
+        ctx->nbits++;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * add the k words in x bitwise, using full adders on pairs of words at each
+ * weight; the carries are added in the same way at the next weight.
+ * Destroys x.
+ * @param sum receives the bit-sliced sums, least significant first
+ * @return number of bits in sum
+ */
+static int carry_save_sum ( packed_word_t * x, index_t k, packed_word_t * carries, packed_word_t * sum ) {
+    int nbits = 0;
+    while ( k > 0 ) {
+        packed_word_t acc = x[ 0 ];
+        index_t nc = 0;
+        index_t t = 1;
+        for ( ; t + 1 < k ; t += 2 ) {
+            const packed_word_t u = acc ^ x[ t ];
+            carries[ nc++ ] = ( acc & x[ t ] ) | ( u & x[ t + 1 ] );
+            acc = u ^ x[ t + 1 ];
+        }
+        if ( t < k ) {
+            carries[ nc++ ] = acc & x[ t ];
+            acc ^= x[ t ];
+        }
+        sum[ nbits++ ] = acc;
+        packed_word_t * tmp = x;
+        x = carries;
+        carries = tmp;
+        k = nc;
+    }
+    return nbits;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t median_filter_rows ( median_ctx_t * ctx, const image_t * in, image_t * out, const int i0, const int i1 ) {
+    const uint64_t t0 = instrument_now ( );
+    const index_t n = in->info.width;
+    const index_t k = ctx->k;
+    const index_t * offsets = ctx->offsets;
+    packed_word_t * packed = ctx->packed;
+    packed_word_t sum[ 64 ];
+    index_t omin = 0, omax = 0;
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        if ( offsets[ r ] < omin ) omin = offsets[ r ];
+        if ( offsets[ r ] > omax ) omax = offsets[ r ];
+    }
+    //
+    // pack the part of the input under the template, clear the padding around it
+    //
+    const index_t u0 = ( index_t ) i0 * n;
+    const index_t u1 = ( index_t ) i1 * n;
+    if ( u1 <= u0 ) {
+        return 0;
+    }
+    const index_t lo = u0 + omin - PACKED_BITS;
+    const index_t hi = u1 + omax + 2 * PACKED_BITS;
+    memset ( packed + ( lo >> 6 ), 0, ( ( hi >> 6 ) - ( lo >> 6 ) + 1 ) * sizeof( packed_word_t ) );
+    pack_linear_range ( in, lo > 0 ? lo : 0, hi < ctx->npixels ? hi : ctx->npixels, packed );
+    //
+    // 64 pixels at a time
+    //
+    index_t changed = 0;
+    for ( index_t u = u0 ; u < u1 ; u += PACKED_BITS ) {
+        packed_word_t any = 0, all = ~( packed_word_t ) 0;
+        for ( index_t r = 0 ; r < k ; ++r ) {
+            ctx->planes[ r ] = packed_get64 ( packed, u + offsets[ r ] );
+            any |= ctx->planes[ r ];
+            all &= ctx->planes[ r ];
+        }
+        packed_word_t x = any;
+        if ( any != all ) {
+            //
+            // not uniform: sum >= threshold, most significant bits first
+            //
+            const int nsum = carry_save_sum ( ctx->planes, k, ctx->carries, sum );
+            packed_word_t gt = 0, eq = ~( packed_word_t ) 0;
+            for ( int b = ctx->nbits - 1 ; b >= 0 ; --b ) {
+                const packed_word_t sb = b < nsum ? sum[ b ] : 0;
+                if ( ( ctx->threshold >> b ) & 1 ) {
+                    eq &= sb;
+                } else {
+                    gt |= eq & sb;
+                }
+            }
+            x = gt | eq;
+        }
+        const packed_word_t z = packed_get64 ( packed, u );
+        const int len = u1 - u < PACKED_BITS ? ( int ) ( u1 - u ) : PACKED_BITS;
+        const packed_word_t mask = len < PACKED_BITS ? ( ( packed_word_t ) 1 << len ) - 1 : ~( packed_word_t ) 0;
+        changed += block_weight ( ( x ^ z ) & mask );
+        pixel_t * o = out->pixels + u;
+        for ( int s = 0 ; s < len ; ++s ) {
+            o[ s ] = ( x >> s ) & 1;
+        }
+    }
+    count_events ( COUNTER_PIXELS_CHANGED, changed );
+    stage_done ( STAGE_APPLY, t0 );
+    return changed;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t median_filter ( median_ctx_t * ctx, const image_t * in, image_t * out ) {
+    return median_filter_rows ( ctx, in, out, 0, in->info.height );
+}
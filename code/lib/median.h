@@ -0,0 +1,63 @@
+/**
+ * \file median.h
+ * \brief Binary median (majority) filter
+ *
+ * each output pixel is 1 if at least half of the samples in its
+ * neighborhood, as given by the template, are 1.
+ *
+ * The filter works on the packed image, 64 pixels at a time: the k samples
+ * of 64 consecutive pixels are k words read from the packed image at the
+ * template offsets, which are added bitwise by a carry-save adder network.
+ * The resulting bit-sliced counts are compared against k/2 with bitwise logic.
+ */
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include "image.h"
+#include "templates.h"
+#include "packed.h"
+
+/**
+ * filtering context; all buffers point into the caller's workspace
+ */
+typedef struct median_ctx {
+    const patch_template_t * tpl;
+    index_t k;
+    /** linear offsets of the template samples */
+    index_t * offsets;
+    /** smallest sum for which the median is 1, ceil(k/2) */
+    index_t threshold;
+    /** number of bits needed to hold the sums, 0 to k */
+    int nbits;
+    /** packed image, with zero padding around (m x n bits) */
+    packed_word_t * packed;
+    index_t npixels;
+    /** shifted samples and carry-save adder scratch (k words each) */
+    packed_word_t * planes;
+    packed_word_t * carries;
+} median_ctx_t;
+
+/**
+ * size in bytes of the workspace required to filter images of the given size
+ */
+size_t median_workspace_size ( const image_info_t * info, const patch_template_t * tpl );
+
+/**
+ * prepare a context for filtering images of the given size;
+ * the template and the workspace must outlive the context
+ */
+void init_median ( median_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl, void * workspace );
+
+/**
+ * apply the median filter to the rows [i0,i1) of the input image
+ * @return number of changed pixels
+ */
+index_t median_filter_rows ( median_ctx_t * ctx, const image_t * in, image_t * out, const int i0, const int i1 );
+
+/**
+ * apply the median filter to the whole image
+ * @return number of changed pixels
+ */
+index_t median_filter ( median_ctx_t * ctx, const image_t * in, image_t * out );
+
+#endif
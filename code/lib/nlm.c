@@ -0,0 +1,591 @@
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "nlm.h"
+#include "patch_mapper.h"
+#include "bitfun.h"
+#include "workspace.h"
+#include "logging.h"
+#include "instrument.h"
+#include "tile_map.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+static void fill_linear_template ( linear_template_t * ltpl, const patch_template_t * tpl, const index_t ncols ) {
+    for ( index_t r = 0 ; r < tpl->k ; ++r ) {
+        ltpl->li[ r ] = tpl->coords[ r ].i * ncols + tpl->coords[ r ].j;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void fill_gaussian_weights ( float * weights, const patch_template_t* tpl, const float sigma ) {
+    const int k = tpl->k;
+    float n = 0.0f;
+    for ( int r = 0 ; r < k ; ++r ) {
+        const float i = fabs ( ( double ) tpl->coords[ r ].i );
+        const float j = fabs ( ( double ) tpl->coords[ r ].j );
+        const float w = exp ( -0.5 * ( i * i + j * j ) / ( sigma * sigma ) );
+        weights[ r ] = w;
+        n += w;
+    }
+    // normalize  so that sum is 1
+    for ( int r = 0 ; r < k ; ++r ) {
+        weights[ r ] /= n;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * the distance between two patches is computed as the number of different
+ * bits between their binary representations.
+ */
+static inline int binary_patch_dist ( const upixel_t* samplesi, const upixel_t* samplesj, const index_t nsamples ) {
+    int d = 0;
+    for ( index_t k = 0 ; k < nsamples ; ++k ) {
+        upixel_t bdif = samplesi[ k ] ^ samplesj[ k ];
+        d += block_weight ( bdif );
+    }
+    return d;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * binarize the patches of all the pixels in the image, optionally removing
+ * their means first, and store them contiguously.
+ * The pixels of uniform tiles (within the reach of the template), if given,
+ * take the patch of their left neighbor in the tile.
+ */
+static void extract_binary_patches ( const image_t* img, const linear_template_t* ltpl,
+                                     patch_t* p, patch_t* q,
+                                     upixel_t* all_patches, upixel_t* all_means,
+                                     const tile_map_t* tiles ) {
+    const index_t n = img->info.width;
+    const index_t m = img->info.height;
+    const size_t ko = q->k;
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j, ++li ) {
+            if ( tiles && ( j % TILE_SIZE ) && ( uniform_value ( tiles, i, j ) >= 0 ) ) {
+                memcpy ( all_patches + li * ko, all_patches + ( li - 1 ) * ko, ko * sizeof( upixel_t ) );
+                if ( all_means != NULL ) {
+                    all_means[ li ] = all_means[ li - 1 ];
+                }
+                continue;
+            }
+            get_linear_patch ( img, ltpl, i, j, p );
+            if ( all_means != NULL ) {
+                //
+                // remove mean
+                //
+                int mean = 0;
+                for ( int r = 0 ; r < p->k ; ++r )
+                    mean += p->values[ r ];
+                const index_t mu = ( index_t ) ( mean / p->k );
+                for ( int r = 0 ; r < p->k ; ++r )
+                    p->values[ r ] -= mu;
+                all_means[ li ] = ( pixel_t ) mu;
+            }
+            //
+            // binarize
+            //
+            binary_patch_mapper ( p, q );
+            // copy raw bytes: this bypasses sign, which is good for us
+            memcpy ( all_patches + li * ko, q->values, ko * sizeof( upixel_t ) );
+        }
+    }
+}
+
+/**
+ * tiles uniform within the reach of the template, plus that of the search
+ * window if R > 0; NULL if the parameters ask to visit all the pixels.
+ * In a tile uniform within the reach of the window, all the patches in the
+ * window are the same as that of the pixel and have the same center value,
+ * so every variant of NLM leaves the pixel as it is.
+ */
+static tile_map_t* nlm_tile_map ( const image_t* img, const patch_template_t* tpl,
+                                  const nlm_params_t* par, const index_t R ) {
+    if ( par->visit_all ) {
+        return NULL;
+    }
+    index_t reach_i, reach_j;
+    template_reach ( tpl, &reach_i, &reach_j );
+    return create_tile_map ( img, reach_i + R, reach_j + R );
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* binary NLM                                                                            */
+/*---------------------------------------------------------------------------------------*/
+
+static int compare_offsets ( const void* pa, const void* pb ) {
+    const coord_t* a = ( const coord_t* ) pa;
+    const coord_t* b = ( const coord_t* ) pb;
+    const index_t na = a->i * a->i + a->j * a->j;
+    const index_t nb = b->i * b->i + b->j * b->j;
+    return na < nb ? -1 : ( na > nb ? 1 : 0 );
+}
+
+/**
+ * relative offsets of the search window, [-R,R) x [-R,R),
+ * sorted by distance to the center so that the closest (and
+ * most likely similar) patches are visited first
+ */
+static index_t fill_search_offsets ( coord_t* offsets, const index_t R ) {
+    index_t t = 0;
+    for ( index_t di = -R ; di < R ; ++di ) {
+        for ( index_t dj = -R ; dj < R ; ++dj, ++t ) {
+            offsets[ t ].i = di;
+            offsets[ t ].j = dj;
+        }
+    }
+    qsort ( offsets, t, sizeof( coord_t ), compare_offsets );
+    return t;
+}
+
+/**
+ * weight given to a patch at distance d from the target one.
+ * weights are indexed by template position, so that the closest
+ * patches (d=0 and d=1) both get the largest weight.
+ */
+static inline float dist_weight ( const float* w, const int d ) {
+    return d > 0 ? w[ d - 1 ] : w[ 0 ];
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t bin_nlm_workspace_size ( const image_info_t * info, const patch_template_t * tpl, const nlm_params_t * par ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const size_t k = tpl->k;
+    const size_t ko = compute_binary_mapping_samples ( k );
+    const size_t L = 2 * par->search_radius;
+    return workspace_round ( ko * npixels * sizeof( upixel_t ) )
+         + workspace_round ( k * sizeof( float ) )
+         + workspace_round ( L * L * sizeof( coord_t ) )
+         + workspace_round ( k * sizeof( index_t ) )
+         + workspace_round ( k * sizeof( pixel_t ) )
+         + workspace_round ( ko * sizeof( pixel_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_bin_nlm ( bin_nlm_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                    const nlm_params_t * par, void * workspace ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const index_t k = tpl->k;
+    const index_t ko = compute_binary_mapping_samples ( k );
+    const index_t L = 2 * par->search_radius;
+    char * pos = ( char * ) workspace;
+    ctx->par = *par;
+    ctx->tpl = tpl;
+    ctx->nsamples = ko;
+    ctx->all_patches = ( upixel_t * ) workspace_take ( &pos, ko * npixels * sizeof( upixel_t ) );
+    ctx->weights = ( float * ) workspace_take ( &pos, k * sizeof( float ) );
+    ctx->offsets = ( coord_t * ) workspace_take ( &pos, L * L * sizeof( coord_t ) );
+    ctx->ltpl.k  = k;
+    ctx->ltpl.li = ( index_t * ) workspace_take ( &pos, k * sizeof( index_t ) );
+    ctx->patch.k = k;
+    ctx->patch.values = ( pixel_t * ) workspace_take ( &pos, k * sizeof( pixel_t ) );
+    ctx->mapped.k = ko;
+    ctx->mapped.values = ( pixel_t * ) workspace_take ( &pos, ko * sizeof( pixel_t ) );
+    fill_linear_template ( &ctx->ltpl, tpl, info->width );
+    fill_gaussian_weights ( ctx->weights, tpl, par->weight_scale );
+    ctx->noffsets = fill_search_offsets ( ctx->offsets, par->search_radius );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void bin_nlm_extract_patches ( bin_nlm_ctx_t * ctx, const image_t * img ) {
+    const uint64_t t0 = instrument_now ( );
+    tile_map_t* tiles = nlm_tile_map ( img, ctx->tpl, &ctx->par, 0 );
+    extract_binary_patches ( img, &ctx->ltpl, &ctx->patch, &ctx->mapped, ctx->all_patches, NULL, tiles );
+    free_tile_map ( tiles );
+    stage_done ( STAGE_STATS, t0 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static index_t bin_nlm_apply_full ( bin_nlm_ctx_t * ctx, const image_t* img, image_t* out,
+                                    const tile_map_t* tiles ) {
+
+    const index_t R = ctx->par.search_radius;
+    const double p01 = ctx->par.p01;
+    const double p10 = ctx->par.p10;
+    const double pe = p01 + p10;
+    const patch_template_t* tpl = ctx->tpl;
+
+    const index_t maxd = (int)((double)tpl->k * pe * 2.0 + 0.5) + 1; // make sure that it is never 0
+    const double h = ctx->par.weight_scale;
+    const double C = -0.5 / ( h * h );
+    const float* w = ctx->weights;
+    const index_t nsamples = ctx->nsamples;
+    const upixel_t* all_patches = ctx->all_patches;
+    debug("NLM h=%f C=%f p01=%f p10=%f R=%ld maxd=%d\n",h,C,p01,p10,R, maxd);
+
+    const int m = img->info.height;
+    const int n = img->info.width;
+    index_t oned = 0;
+    index_t zeroed = 0;
+    index_t visited = 0;
+
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j, ++li ) {
+            if ( tiles && ( uniform_value ( tiles, i, j ) >= 0 ) ) {
+                continue;
+            }
+            double y = 0.0;
+            double norm = 0.0;
+            int di0 = i > R     ? i - R : 0;
+            int di1 = i < ( m - R ) ? i + R : m;
+            int dj0 = j > R     ? j - R : 0;
+            int dj1 = j < ( n - R ) ? j + R : n;
+            visited += ( index_t ) ( di1 - di0 ) * ( dj1 - dj0 );
+            for ( int di = di0 ; di < di1 ; ++di ) {
+                for ( int dj = dj0 ; dj < dj1 ; ++dj ) {
+                    const index_t lj = di * n + dj;
+                    const int d = binary_patch_dist ( &all_patches[ nsamples * li ], &all_patches[ nsamples * lj ], nsamples );
+                    if ( d > maxd ) {
+                        continue;
+                    }
+                    const float wd = dist_weight ( w, d );
+                    if ( get_pixel ( img, di, dj ) ) {
+                        y += wd;
+                    }
+                    norm += wd;
+                }
+            }
+            if (norm == 0.0)
+                continue;
+            const pixel_t z = get_linear_pixel ( img, li );
+            const pixel_t x = (2.0*y) > norm ? 1: 0;
+            if ( z != x ) {
+                set_linear_pixel ( out, li, x );
+                if ( x )
+                    oned++;
+                else
+                    zeroed++;
+            }
+        }
+        if ( ctx->par.verbose && !( i % 500 ) ) {
+            info ( "| %6d | 1->0 %8ld | 0->1 %8ld |\n", i, zeroed, oned );
+        }
+    }
+    count_events ( COUNTER_NEIGHBOR_VISITS, visited );
+    return zeroed + oned;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * same rule as bin_nlm_apply_full, but the search window is scanned nearest-first
+ * and the scan stops as soon as the remaining candidates cannot flip the
+ * majority decision (2y > norm). Each remaining candidate can move 2y-norm
+ * by at most the largest weight, in either direction.
+ */
+static index_t bin_nlm_apply_early_exit ( bin_nlm_ctx_t * ctx, const image_t* img, image_t* out,
+                                          const tile_map_t* tiles ) {
+
+    const index_t R = ctx->par.search_radius;
+    const double p01 = ctx->par.p01;
+    const double p10 = ctx->par.p10;
+    const double pe = p01 + p10;
+    const patch_template_t* tpl = ctx->tpl;
+
+    const index_t maxd = (int)((double)tpl->k * pe * 2.0 + 0.5) + 1; // make sure that it is never 0
+    const double h = ctx->par.weight_scale;
+    const float* w = ctx->weights;
+    float wmax = 0.0f;
+    for ( int d = 0 ; d <= maxd && d <= tpl->k ; ++d ) {
+        const float wd = dist_weight ( w, d );
+        if ( wd > wmax ) wmax = wd;
+    }
+    const coord_t* offsets = ctx->offsets;
+    const index_t noffsets = ctx->noffsets;
+    const index_t nsamples = ctx->nsamples;
+    const upixel_t* all_patches = ctx->all_patches;
+    debug("NLM (early exit) h=%f p01=%f p10=%f R=%ld maxd=%d offsets=%ld\n",h,p01,p10,R,maxd,noffsets);
+
+    const int m = img->info.height;
+    const int n = img->info.width;
+    index_t oned = 0;
+    index_t zeroed = 0;
+    index_t visited = 0;
+
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j, ++li ) {
+            if ( tiles && ( uniform_value ( tiles, i, j ) >= 0 ) ) {
+                continue;
+            }
+            double y = 0.0;
+            double norm = 0.0;
+            for ( index_t t = 0 ; t < noffsets ; ++t ) {
+                const int di = i + offsets[ t ].i;
+                const int dj = j + offsets[ t ].j;
+                if ( ( di < 0 ) || ( di >= m ) || ( dj < 0 ) || ( dj >= n ) ) {
+                    continue;
+                }
+                visited++;
+                const index_t lj = di * n + dj;
+                const int d = binary_patch_dist ( &all_patches[ nsamples * li ], &all_patches[ nsamples * lj ], nsamples );
+                if ( d > maxd ) {
+                    continue;
+                }
+                const float wd = dist_weight ( w, d );
+                if ( get_pixel ( img, di, dj ) ) {
+                    y += wd;
+                }
+                norm += wd;
+                //
+                // bound on how much the rest of the window can move 2y-norm
+                //
+                const double margin = 2.0 * y - norm;
+                const double rest = ( double ) wmax * ( double ) ( noffsets - t - 1 );
+                if ( ( margin > rest ) || ( margin + rest <= 0.0 ) ) {
+                    break;
+                }
+            }
+            if (norm == 0.0)
+                continue;
+            const pixel_t z = get_linear_pixel ( img, li );
+            const pixel_t x = (2.0*y) > norm ? 1: 0;
+            if ( z != x ) {
+                set_linear_pixel ( out, li, x );
+                if ( x )
+                    oned++;
+                else
+                    zeroed++;
+            }
+        }
+        if ( ctx->par.verbose && !( i % 500 ) ) {
+            info ( "| %6d | 1->0 %8ld | 0->1 %8ld |\n", i, zeroed, oned );
+        }
+    }
+    debug ( "early exit: visited %8.4f candidates per pixel (window has %ld)\n",
+            ( double ) visited / ( double ) ( ( index_t ) m * n ), noffsets );
+    count_events ( COUNTER_NEIGHBOR_VISITS, visited );
+    return zeroed + oned;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t bin_nlm_apply ( bin_nlm_ctx_t * ctx, const image_t * img, image_t * out ) {
+    const uint64_t t0 = instrument_now ( );
+    tile_map_t* tiles = nlm_tile_map ( img, ctx->tpl, &ctx->par, ctx->par.search_radius );
+    index_t changed;
+    if ( ctx->par.early_exit ) {
+        changed = bin_nlm_apply_early_exit ( ctx, img, out, tiles );
+    } else {
+        changed = bin_nlm_apply_full ( ctx, img, out, tiles );
+    }
+    free_tile_map ( tiles );
+    count_events ( COUNTER_PIXELS_CHANGED, changed );
+    stage_done ( STAGE_APPLY, t0 );
+    return changed;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t bin_nlm_denoise ( bin_nlm_ctx_t * ctx, const image_t * img, image_t * out ) {
+    bin_nlm_extract_patches ( ctx, img );
+    return bin_nlm_apply ( ctx, img, out );
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* semi-binary NLM                                                                       */
+/*---------------------------------------------------------------------------------------*/
+
+size_t semibin_nlm_workspace_size ( const image_info_t * info, const patch_template_t * tpl ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const size_t k = tpl->k;
+    const size_t ko = compute_binary_mapping_samples ( k );
+    return workspace_round ( ko * npixels * sizeof( upixel_t ) )
+         + workspace_round ( npixels * sizeof( upixel_t ) )
+         + workspace_round ( k * sizeof( index_t ) )
+         + workspace_round ( k * sizeof( pixel_t ) )
+         + workspace_round ( ko * sizeof( pixel_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_semibin_nlm ( semibin_nlm_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                        const nlm_params_t * par, void * workspace ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const index_t k = tpl->k;
+    const index_t ko = compute_binary_mapping_samples ( k );
+    char * pos = ( char * ) workspace;
+    ctx->par = *par;
+    ctx->tpl = tpl;
+    ctx->nsamples = ko;
+    ctx->all_patches = ( upixel_t * ) workspace_take ( &pos, ko * npixels * sizeof( upixel_t ) );
+    ctx->all_means   = ( upixel_t * ) workspace_take ( &pos, npixels * sizeof( upixel_t ) );
+    ctx->ltpl.k  = k;
+    ctx->ltpl.li = ( index_t * ) workspace_take ( &pos, k * sizeof( index_t ) );
+    ctx->patch.k = k;
+    ctx->patch.values = ( pixel_t * ) workspace_take ( &pos, k * sizeof( pixel_t ) );
+    ctx->mapped.k = ko;
+    ctx->mapped.values = ( pixel_t * ) workspace_take ( &pos, ko * sizeof( pixel_t ) );
+    fill_linear_template ( &ctx->ltpl, tpl, info->width );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t semibin_nlm_denoise ( semibin_nlm_ctx_t * ctx, const image_t * img, image_t * out ) {
+    const int m = img->info.height;
+    const int n = img->info.width;
+    const index_t nsamples = ctx->nsamples;
+    const upixel_t* all_patches = ctx->all_patches;
+    const upixel_t* all_means = ctx->all_means;
+
+    info ( "extracting patches....\n" );
+    const uint64_t t0 = instrument_now ( );
+    tile_map_t* tiles = nlm_tile_map ( img, ctx->tpl, &ctx->par, 0 );
+    extract_binary_patches ( img, &ctx->ltpl, &ctx->patch, &ctx->mapped, ctx->all_patches, ctx->all_means, tiles );
+    free_tile_map ( tiles );
+    stage_done ( STAGE_STATS, t0 );
+    const uint64_t t1 = instrument_now ( );
+
+    info ( "denoising....\n" );
+    const int R = ctx->par.search_radius;
+    const double h = ctx->par.window_scale;
+    const double C = -0.5 / ( h * h );
+    info("NLM; R=%d h=%f C=%f\n",R, h, C);
+
+    tiles = nlm_tile_map ( img, ctx->tpl, &ctx->par, R );
+    index_t changed = 0;
+    index_t visited = 0;
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j, ++li ) {
+            if ( tiles && ( uniform_value ( tiles, i, j ) >= 0 ) ) {
+                set_linear_pixel ( out, li, get_linear_pixel ( img, li ) );
+                continue;
+            }
+            double y = 0.0;
+            double norm = 0;
+            int di0 = i > R     ? i - R : 0;
+            int di1 = i < ( m - R ) ? i + R : m;
+            int dj0 = j > R     ? j - R : 0;
+            int dj1 = j < ( n - R ) ? j + R : n;
+            visited += ( index_t ) ( di1 - di0 ) * ( dj1 - dj0 );
+            for ( int di = di0 ; di < di1 ; ++di ) {
+                for ( int dj = dj0 ; dj < dj1 ; ++dj ) {
+                    const index_t lj = di * n + dj;
+                    const int d = binary_patch_dist ( &all_patches[ nsamples * li ], &all_patches[ nsamples * lj ], nsamples );
+                    const double w = exp ( C * d );
+                    y += w * ( get_pixel ( img, di, dj ) - all_means[ lj ] );
+                    norm += w;
+                }
+            }
+            const int x = ( int ) ( 0.5 + all_means[ li ] + y / norm );
+            const pixel_t v = x > 0 ? ( x < 255 ? x : 255 ) : 0;
+            if ( v != get_linear_pixel ( img, li ) ) {
+                changed++;
+            }
+            set_linear_pixel ( out, li, v );
+        }
+    }
+    free_tile_map ( tiles );
+    count_events ( COUNTER_NEIGHBOR_VISITS, visited );
+    count_events ( COUNTER_PIXELS_CHANGED, changed );
+    stage_done ( STAGE_APPLY, t1 );
+    return changed;
+}
+
+/*---------------------------------------------------------------------------------------*/
+/* original NLM                                                                          */
+/*---------------------------------------------------------------------------------------*/
+
+static double weighted_patch_dist ( const patch_t* a, const patch_t* b, const float* weights ) {
+    const int k = a->k;
+    double dist = 0;
+    const pixel_t* pa = a->values;
+    const pixel_t* pb = b->values;
+    for ( int r = 0 ; r < k ; ++r ) {
+        dist += weights[ r ] * fabs ( ( double ) ( pa[ r ] - pb[ r ] ) );
+    }
+    return dist;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t original_nlm_workspace_size ( const image_info_t * info, const patch_template_t * tpl ) {
+    ( void ) info; // same arguments as init_original_nlm, as the other *_workspace_size functions
+    const size_t k = tpl->k;
+    return workspace_round ( k * sizeof( float ) )
+         + workspace_round ( k * sizeof( index_t ) )
+         + 2 * workspace_round ( k * sizeof( pixel_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_original_nlm ( original_nlm_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                         const nlm_params_t * par, void * workspace ) {
+    const index_t k = tpl->k;
+    char * pos = ( char * ) workspace;
+    ctx->par = *par;
+    ctx->tpl = tpl;
+    ctx->weights = ( float * ) workspace_take ( &pos, k * sizeof( float ) );
+    ctx->ltpl.k  = k;
+    ctx->ltpl.li = ( index_t * ) workspace_take ( &pos, k * sizeof( index_t ) );
+    ctx->patch.k = k;
+    ctx->patch.values = ( pixel_t * ) workspace_take ( &pos, k * sizeof( pixel_t ) );
+    ctx->other.k = k;
+    ctx->other.values = ( pixel_t * ) workspace_take ( &pos, k * sizeof( pixel_t ) );
+    fill_linear_template ( &ctx->ltpl, tpl, info->width );
+    fill_gaussian_weights ( ctx->weights, tpl, par->window_scale );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t original_nlm_denoise ( original_nlm_ctx_t * ctx, const image_t * img, image_t * out ) {
+    const int m = img->info.height;
+    const int n = img->info.width;
+    const int R = ctx->par.search_radius;
+    const double h = ctx->par.weight_scale;
+    const double C = -0.5 / ( h * h );
+    const float* weights = ctx->weights;
+    const linear_template_t* ltpl = &ctx->ltpl;
+    patch_t* pat = &ctx->patch;
+    patch_t* pot = &ctx->other;
+    info("NLM; R=%d h=%f C=%f\n",R, h,C);
+
+    const uint64_t t0 = instrument_now ( );
+    tile_map_t* tiles = nlm_tile_map ( img, ctx->tpl, &ctx->par, R );
+    index_t changed = 0;
+    index_t visited = 0;
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j, ++li ) {
+            if ( tiles && ( uniform_value ( tiles, i, j ) >= 0 ) ) {
+                set_linear_pixel ( out, li, get_linear_pixel ( img, li ) );
+                continue;
+            }
+            double y = 0;
+            double norm = 0;
+            get_linear_patch ( img, ltpl, i, j, pat );
+            int di0 = i > R     ? i - R : 0;
+            int di1 = i < ( m - R ) ? i + R : m;
+            int dj0 = j > R     ? j - R : 0;
+            int dj1 = j < ( n - R ) ? j + R : n;
+            visited += ( index_t ) ( di1 - di0 ) * ( dj1 - dj0 );
+            for ( int di = di0 ; di < di1 ; ++di ) {
+                for ( int dj = dj0 ; dj < dj1 ; ++dj ) {
+                    get_linear_patch ( img, ltpl, di, dj, pot );
+                    const double d = weighted_patch_dist ( pat, pot, weights );
+                    const double w = exp ( C * d );
+                    y += w * get_pixel ( img, di, dj );
+                    norm += w;
+                }
+            }
+            const int x = ( int ) ( 0.5 + y / norm );
+            if ( x != get_linear_pixel ( img, li ) ) {
+                changed++;
+            }
+            set_linear_pixel ( out, li, x );
+        }
+    }
+    free_tile_map ( tiles );
+    count_events ( COUNTER_NEIGHBOR_VISITS, visited );
+    count_events ( COUNTER_PIXELS_CHANGED, changed );
+    stage_done ( STAGE_APPLY, t0 );
+    return changed;
+}
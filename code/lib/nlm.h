@@ -0,0 +1,119 @@
+/**
+ * \file nlm.h
+ * \brief Non-local means variants for binary images
+ *
+ * - binary NLM: patches are binarized and compared as bit fields;
+ *   the output is the weighted majority of the window (bin_nlm_*)
+ * - semi-binary NLM: binarized patches with their means removed;
+ *   the center values are treated as signed integers (semibin_nlm_*)
+ * - original NLM: patches compared sample by sample (original_nlm_*)
+ */
+#ifndef NLM_H
+#define NLM_H
+
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+
+typedef struct nlm_params {
+    index_t search_radius; // the search window is [-R,R) x [-R,R) around each pixel
+    double p01;            // P(0->1)
+    double p10;            // P(1->0)
+    double weight_scale;   // scale of the Gaussian weights (h)
+    double window_scale;   // scale of the Gaussian window on the template (sigma)
+    int early_exit;        // binary NLM only: stop scanning once the decision is settled
+    int visit_all;         // scan the window of every pixel, even in uniform tiles (see tile_map.h)
+    int verbose;
+} nlm_params_t;
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * binary NLM context; all buffers point into the caller's workspace
+ */
+typedef struct bin_nlm_ctx {
+    nlm_params_t par;
+    const patch_template_t * tpl;
+    linear_template_t ltpl;
+    /** number of pixel_t words in a binarized patch */
+    index_t nsamples;
+    /** binarized patches of all the pixels of the image (m x n x nsamples) */
+    upixel_t * all_patches;
+    /** Gaussian weights, one per template position */
+    float * weights;
+    /** search window offsets, sorted by distance to the center */
+    coord_t * offsets;
+    index_t noffsets;
+    /** scratch patches */
+    patch_t patch;
+    patch_t mapped;
+} bin_nlm_ctx_t;
+
+size_t bin_nlm_workspace_size ( const image_info_t * info, const patch_template_t * tpl, const nlm_params_t * par );
+
+void init_bin_nlm ( bin_nlm_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                    const nlm_params_t * par, void * workspace );
+
+/**
+ * binarize and store the patches of all the pixels in the image
+ */
+void bin_nlm_extract_patches ( bin_nlm_ctx_t * ctx, const image_t * img );
+
+/**
+ * weighted majority over the search window; patches must have been extracted
+ * @param out must be a copy of img
+ * @return number of changed pixels
+ */
+index_t bin_nlm_apply ( bin_nlm_ctx_t * ctx, const image_t * img, image_t * out );
+
+/**
+ * extract patches and apply
+ */
+index_t bin_nlm_denoise ( bin_nlm_ctx_t * ctx, const image_t * img, image_t * out );
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * semi-binary NLM context; all buffers point into the caller's workspace
+ */
+typedef struct semibin_nlm_ctx {
+    nlm_params_t par;
+    const patch_template_t * tpl;
+    linear_template_t ltpl;
+    index_t nsamples;
+    upixel_t * all_patches;
+    /** mean of the patch of each pixel (m x n) */
+    upixel_t * all_means;
+    patch_t patch;
+    patch_t mapped;
+} semibin_nlm_ctx_t;
+
+size_t semibin_nlm_workspace_size ( const image_info_t * info, const patch_template_t * tpl );
+
+void init_semibin_nlm ( semibin_nlm_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                        const nlm_params_t * par, void * workspace );
+
+index_t semibin_nlm_denoise ( semibin_nlm_ctx_t * ctx, const image_t * img, image_t * out );
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * original NLM context; all buffers point into the caller's workspace
+ */
+typedef struct original_nlm_ctx {
+    nlm_params_t par;
+    const patch_template_t * tpl;
+    linear_template_t ltpl;
+    float * weights;
+    patch_t patch;
+    patch_t other;
+} original_nlm_ctx_t;
+
+size_t original_nlm_workspace_size ( const image_info_t * info, const patch_template_t * tpl );
+
+void init_original_nlm ( original_nlm_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                         const nlm_params_t * par, void * workspace );
+
+index_t original_nlm_denoise ( original_nlm_ctx_t * ctx, const image_t * img, image_t * out );
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+
+#include "nlm_tree.h"
+#include "workspace.h"
+#include "logging.h"
+#include "instrument.h"
+#include "template_kernels.h"
+#include "tile_map.h"
+#include "hamming_index.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t nlm_tree_workspace_size ( const patch_template_t * tpl ) {
+    return workspace_round ( tpl->k * sizeof( pixel_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_nlm_tree ( nlm_tree_ctx_t * ctx, const patch_template_t * tpl, const nlm_tree_params_t * par, void * workspace ) {
+    char * pos = ( char * ) workspace;
+    ctx->par = *par;
+    ctx->tpl = tpl;
+    ctx->patch.k = tpl->k;
+    ctx->patch.values = ( pixel_t * ) workspace_take ( &pos, tpl->k * sizeof( pixel_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t nlm_tree_apply ( nlm_tree_ctx_t * ctx, patch_node_t * stats, const image_t * img, image_t * out ) {
+    const uint64_t t0 = instrument_now ( );
+
+    const double p01 = ctx->par.p01;
+    const double p10 = ctx->par.p10;
+    const double pe = p01 + p10;
+    const patch_template_t* tpl = ctx->tpl;
+
+    const index_t maxd = (int)((double)tpl->k * pe *2.0 + 0.5);
+
+    double w[ maxd+1 ];
+    for ( index_t d = 0 ; d <= maxd ; ++d ) {
+        w[ d ] = 1.0 / ( d + 1.0 );
+    }
+    patch_t* Pij = &ctx->patch;
+    index_t changed = 0;
+    const int m = img->info.height;
+    const int n = img->info.width;
+    index_t no_neigh = 0;
+    const patch_extractor_f extract = select_patch_extractor ( tpl );
+    tile_map_t * tiles = NULL;
+    if ( !ctx->par.visit_all ) {
+        index_t reach_i, reach_j;
+        template_reach ( tpl, &reach_i, &reach_j );
+        tiles = create_tile_map ( img, reach_i, reach_j );
+    }
+    //
+    // the clusters within maxd are found by multi-index hashing, unless
+    // the template is too large for it
+    //
+    hamming_index_t * index = create_hamming_index ( stats, tpl->k );
+    hamming_query_t query;
+    void * query_work = NULL;
+    if ( index ) {
+        query_work = malloc ( hamming_query_workspace_size ( index ) );
+        init_hamming_query ( &query, index, query_work );
+    }
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ) {
+            // same context and value up to the end of a uniform tile
+            const int len = tiles && ( uniform_value ( tiles, i, j ) >= 0 ) ? tile_end ( tiles, j ) - j : 1;
+            extract ( img, tpl, i, j, Pij );
+            double y = 0;
+            double norm = 0;
+            neighbor_list_t neighbors = index ? *hamming_search ( &query, Pij, 1, maxd ) : find_neighbors ( stats, Pij, maxd );
+            if (neighbors.number == 0) {
+                no_neigh ++;
+            }
+            for ( int i = 0 ; i < neighbors.number ; ++i ) {
+                const index_t d = neighbors.neighbors[ i ].dist;
+                const patch_node_t* node = neighbors.neighbors[ i ].patch_node;
+                y += w[ d ] * (double) node->counts;
+                norm += w[ d ] * (double) node->occu;
+            }
+            if ( !index ) {
+                free ( neighbors.neighbors );
+            }
+            const pixel_t z = get_linear_pixel ( img, li );
+            const pixel_t x = (pixel_t) ctx->par.denoiser ( z, y, norm, p01, p10 );
+            if ( z != x ) {
+                for ( int s = 0 ; s < len ; ++s ) {
+                    set_linear_pixel ( out, li + s, x );
+                }
+                changed += len;
+            }
+            j += len;
+            li += len;
+        }
+        if ( ( i > 0 ) &&!( i % 1000 ) ) {
+            info ( "row %d changed %ld ( %7.4f%% )\n", i, changed, ( double ) changed * 100.0 / ( double ) li );
+        }
+    }
+    free ( query_work );
+    free_hamming_index ( index );
+    free_tile_map ( tiles );
+    info("no neighbors found in %lu cases.\n",no_neigh);
+    count_events ( COUNTER_PIXELS_CHANGED, changed );
+    stage_done ( STAGE_APPLY, t0 );
+    return changed;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t nlm_tree_denoise ( nlm_tree_ctx_t * ctx, patch_node_t * stats, const image_t * img, image_t * out ) {
+    info ( "clustering patches....\n" );
+    patch_node_t * clustered = cluster_stats ( stats, ctx->tpl->k, ctx->par.max_dist, ctx->par.min_occu, ctx->par.max_clusters );
+    info ( "denoising....\n" );
+    const index_t changed = nlm_tree_apply ( ctx, clustered, img, out );
+    free_node ( clustered );
+    return changed;
+}
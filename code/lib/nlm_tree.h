@@ -0,0 +1,56 @@
+/**
+ * \file nlm_tree.h
+ * \brief Full binary version of non-local means, using a patch tree
+ *
+ * input and output images are binary, patches are binary and
+ * distances are binary, with some weights. The patches are clustered
+ * in a tree, and each pixel is decided from the clusters that are
+ * close to its context.
+ */
+#ifndef NLM_TREE_H
+#define NLM_TREE_H
+
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+#include "stats.h"
+#include "denoiser.h"
+
+typedef struct nlm_tree_params {
+    double p01;            // P(0->1)
+    double p10;            // P(1->0)
+    index_t max_dist;      // maximum distance to a cluster center
+    index_t max_clusters;  // maximum number of clusters
+    index_t min_occu;      // minimum occurences for a patch to become a cluster center
+    denoiser_f denoiser;   // decision rule
+    int visit_all;         // apply the rule to every pixel, even in uniform tiles (see tile_map.h)
+} nlm_tree_params_t;
+
+/**
+ * denoising context; all buffers point into the caller's workspace
+ */
+typedef struct nlm_tree_ctx {
+    nlm_tree_params_t par;
+    const patch_template_t * tpl;
+    /** scratch patch */
+    patch_t patch;
+} nlm_tree_ctx_t;
+
+size_t nlm_tree_workspace_size ( const patch_template_t * tpl );
+
+void init_nlm_tree ( nlm_tree_ctx_t * ctx, const patch_template_t * tpl, const nlm_tree_params_t * par, void * workspace );
+
+/**
+ * decide each pixel from the clusters close to its context
+ * @param out must be a copy of img
+ * @return number of changed pixels
+ */
+index_t nlm_tree_apply ( nlm_tree_ctx_t * ctx, patch_node_t * clusters, const image_t * img, image_t * out );
+
+/**
+ * cluster the given statistics and apply
+ * @return number of changed pixels
+ */
+index_t nlm_tree_denoise ( nlm_tree_ctx_t * ctx, patch_node_t * stats, const image_t * img, image_t * out );
+
+#endif
@@ -0,0 +1,256 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "noise.h"
+#include "context_sums.h"
+#include "logging.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t add_channel_noise ( const image_t * in, image_t * out, const double p01, const double p10, rand48_t * rng ) {
+    const index_t npixels = ( index_t ) in->info.width * in->info.height;
+    index_t flipped = 0;
+    for ( index_t li = 0 ; li < npixels ; ++li ) {
+        const pixel_t x = in->pixels[ li ];
+        const double coin = next_rand48 ( rng );
+        const pixel_t y = x ? ( coin >= p10 ) : ( coin < p01 );
+        out->pixels[ li ] = y;
+        flipped += ( y != x );
+    }
+    return flipped;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * @brief approximate log-likelihood of all-zeros patches w.r.t. noise parameter
+ *        assuming ones are noise
+ * @param ns   number of occurences of S=s
+ * @param ns1  number of occurences of S=s,z=1
+ * @param n    total length of signal
+ * @param k    context size
+ * @param maxs maximum number of terms
+ * @param p0   noise parameter
+ * @return double likelihood
+ */
+static double loglik0(
+        const index_t* ns,
+        const index_t* ns1,
+        const index_t n,
+        const index_t k,
+        const index_t maxs,
+        const double p0) {
+    const double logp = log10(p0);
+    const double log1mp = log10(1.0-p0);
+    double a = 0.0;
+    for ( int r = 0 ; r <= maxs && r <= k ; ++r ) {
+      a += ns[r]*(ns1[r]*logp + (ns[r]-ns1[r])*log1mp + r*logp + (k-r)*log1mp);
+    }
+    return -a/(double)n; // just a normalization
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * @brief approximate log-likelihood of all-ONES patches w.r.t. noise parameter
+ *        assuming ZEROS are noise
+ * @param ns   number of occurences of S=s
+ * @param ns1  number of occurences of S=s,z=1
+ * @param n    total length of signal
+ * @param k    context size
+ * @param maxs maximum number of terms
+ * @param p0   noise parameter
+ * @return double likelihood
+ */
+static double loglik1(
+        const index_t* ns,
+        const index_t* ns1,
+        const index_t n,
+        const index_t k,
+        const index_t maxs,
+        const double p0) {
+    const double logp = log10(p0);
+    const double log1mp = log10(1.0-p0);
+    double a = 0.0;
+    for ( int r = k ; r >= (k-maxs) && r >= 0 ; --r ) {
+      a += ns[r]*((ns[r]-ns1[r])*logp + ns1[r]*log1mp + (k-r)*logp + r*log1mp);
+    }
+    return -a/(double)n; // just a normalization
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+typedef double (*loglik_f)( const index_t*, const index_t*, const index_t, const index_t, const index_t, const double );
+
+/**
+ * golden ratio search of the minimum of the negative log-likelihood in [0,0.5]
+ */
+static double golden_section ( loglik_f loglik, const index_t* ns, const index_t* ns1,
+                               const index_t n, const index_t k, const index_t maxs, const double tol ) {
+    const double phi = (1.0+sqrt(5.0))/2.0;
+    const double r = 1.0/(1.0+phi);
+    double left   = 0.0;
+    double right  = 0.5;
+    while ( (right-left) >= tol) {
+        const double midleft    = left  + r*(right-left);
+        const double midright   = right - r*(right-left);
+        const double fmidleft   = loglik(ns, ns1, n, k, maxs, midleft);
+        const double fmidright  = loglik(ns, ns1, n, k, maxs, midright);
+        if (fmidleft < fmidright) {
+            right    = midright;
+            debug ( "left=%f right=%f p=%8.6f -log P()=%12.10f\n", left,right,midleft,fmidleft);
+        } else {
+            left = midleft;
+            debug ( "left=%f right=%f p=%8.6f -log P()=%12.10f\n", left,right, midright,fmidright);
+        }
+    }
+    return (right+left)/2.0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void estimate_noise_params ( const index_t * freq, const index_t * freq1, const index_t total,
+                             const index_t k, const int center, const index_t maxs, const double tol,
+                             double * p01, double * p10 ) {
+    if ( center && ( k > 0 ) ) {
+        //
+        // histograms of the sums without the center, S' = S - z:
+        // the contexts with S'=s are those with S=s and z=0, and those with S=s+1 and z=1
+        //
+        index_t cfreq[ k ], cfreq1[ k ];
+        for ( index_t s = 0 ; s < k ; ++s ) {
+            cfreq1[ s ] = freq1[ s + 1 ];
+            cfreq[ s ]  = ( freq[ s ] - freq1[ s ] ) + freq1[ s + 1 ];
+        }
+        estimate_noise_params ( cfreq, cfreq1, total, k - 1, 0, maxs, tol, p01, p10 );
+        return;
+    }
+    // compute p1 and p0 using maximum likelihood on the pairs of statistics (n_s, n_s1), s=0,...,k
+    // we cannot do this for the whole range s=0,...,k, otherwise we end up with a global estimate
+    // which is not what we want. WE only want to evaluate this on "very white" and "very black"
+    // contexts. So, assuming a maximum value of 0.2 (quite high), we can discard all terms above
+    // s=4 or so.
+    *p01 = golden_section ( loglik0, freq, freq1, total, k, maxs, tol );
+    *p10 = golden_section ( loglik1, freq, freq1, total, k, maxs, tol );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static uint64_t next_random ( uint64_t * state ) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static int settled ( const double prev, const double cur, const noise_sampling_t * sp ) {
+    return fabs ( cur - prev ) <= sp->rel_tol * ( cur > sp->floor ? cur : sp->floor );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t estimate_noise_sampled ( const mapped_pbm_t * pbm, const patch_template_t * tpl,
+                                 const index_t maxs, const double tol, const noise_sampling_t * sp,
+                                 double * p01, double * p10 ) {
+    const index_t m = pbm->info.height;
+    const index_t n = pbm->info.width;
+    const index_t k = tpl->k;
+    const index_t T = sp->tile_size;
+    const int center = template_includes_center ( tpl );
+    index_t imin = 0, imax = 0, jmin = 0, jmax = 0;
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        if ( tpl->coords[ r ].i < imin ) imin = tpl->coords[ r ].i;
+        if ( tpl->coords[ r ].i > imax ) imax = tpl->coords[ r ].i;
+        if ( tpl->coords[ r ].j < jmin ) jmin = tpl->coords[ r ].j;
+        if ( tpl->coords[ r ].j > jmax ) jmax = tpl->coords[ r ].j;
+    }
+    //
+    // tiles are visited in random order
+    //
+    const index_t ntr = ( m + T - 1 ) / T;
+    const index_t ntc = ( n + T - 1 ) / T;
+    const index_t ntiles = ntr * ntc;
+    index_t * order = ( index_t * ) malloc ( ntiles * sizeof( index_t ) );
+    uint64_t state = sp->seed ? sp->seed : 1;
+    for ( index_t t = 0 ; t < ntiles ; ++t ) {
+        order[ t ] = t;
+    }
+    for ( index_t t = ntiles - 1 ; t > 0 ; --t ) {
+        const index_t u = next_random ( &state ) % ( t + 1 );
+        const index_t aux = order[ t ];
+        order[ t ] = order[ u ];
+        order[ u ] = aux;
+    }
+    //
+    // each tile is decoded along with the margin needed by the contexts of its pixels
+    //
+    image_t tile;
+    tile.info = pbm->info;
+    tile.info.width  = T + jmax - jmin;
+    tile.info.height = T + imax - imin;
+    tile.pixels = ( pixel_t * ) malloc ( tile.info.width * tile.info.height * sizeof( pixel_t ) );
+    void * work = malloc ( context_sums_workspace_size ( &tile.info, tpl ) );
+    uint32_t * sums_row = ( uint32_t * ) malloc ( tile.info.width * sizeof( uint32_t ) );
+    index_t * freq  = ( index_t * ) calloc ( k + 1, sizeof( index_t ) );
+    index_t * freq1 = ( index_t * ) calloc ( k + 1, sizeof( index_t ) );
+    context_sums_t cs;
+    init_context_sums ( &cs, &tile.info, tpl, work );
+
+    index_t total = 0;
+    index_t t;
+    double prev01 = -1.0, prev10 = -1.0;
+    *p01 = *p10 = 0.0;
+    for ( t = 0 ; t < ntiles ; ) {
+        const index_t i0 = ( order[ t ] / ntc ) * T;
+        const index_t j0 = ( order[ t ] % ntc ) * T;
+        for ( index_t a = 0, la = 0 ; a < tile.info.height ; ++a ) {
+            const index_t i = i0 + imin + a;
+            for ( index_t b = 0 ; b < tile.info.width ; ++b, ++la ) {
+                const index_t j = j0 + jmin + b;
+                tile.pixels[ la ] = ( i >= 0 ) && ( i < m ) && ( j >= 0 ) && ( j < n ) ?
+                                    mapped_pbm_pixel ( pbm, i, j ) : 0;
+            }
+        }
+        reset_context_sums ( &cs );
+        for ( index_t i = i0 ; ( i < i0 + T ) && ( i < m ) ; ++i ) {
+            if ( ( i + imin < 0 ) || ( i + imax >= m ) ) {
+                continue;
+            }
+            context_sums_row ( &cs, &tile, i - i0 - imin, sums_row );
+            for ( index_t j = j0 ; ( j < j0 + T ) && ( j < n ) ; ++j ) {
+                if ( ( j + jmin < 0 ) || ( j + jmax >= n ) ) {
+                    continue;
+                }
+                const index_t a = sums_row[ j - j0 - jmin ];
+                freq[ a ]++;
+                if ( mapped_pbm_pixel ( pbm, i, j ) ) {
+                    freq1[ a ]++;
+                }
+                total++;
+            }
+        }
+        t++;
+        if ( ( ( t % sp->batch ) == 0 ) || ( t == ntiles ) ) {
+            if ( total == 0 ) {
+                continue;
+            }
+            estimate_noise_params ( freq, freq1, total, k, center, maxs, tol, p01, p10 );
+            debug ( "%ld tiles: P(0->1)=%f P(1->0)=%f\n", ( long ) t, *p01, *p10 );
+            if ( ( prev01 >= 0.0 ) && settled ( prev01, *p01, sp ) && settled ( prev10, *p10, sp ) ) {
+                break;
+            }
+            prev01 = *p01;
+            prev10 = *p10;
+        }
+    }
+    free ( freq1 );
+    free ( freq );
+    free ( sums_row );
+    free ( work );
+    free ( tile.pixels );
+    free ( order );
+    return t;
+}
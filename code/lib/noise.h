@@ -0,0 +1,76 @@
+/**
+ * \file noise.h
+ * \brief The binary asymmetric channel: simulation, and estimation of its parameters
+ *
+ * P(0->1) and P(1->0) are estimated by maximum likelihood from the histograms
+ * of the context sums S (quorums), and of the context sums given that the center
+ * is 1, using only the nearly all-zeros (S <= maxs) and nearly all-ones
+ * (S >= k - maxs) contexts. These are the same histograms gathered by the quorum
+ * denoiser, so that the estimation costs no additional pass over the image.
+ *
+ * For very large images, the histograms can also be gathered from a random
+ * sample of tiles read directly from a mapped PBM file, adding tiles until
+ * the estimates settle.
+ */
+#ifndef NOISE_H
+#define NOISE_H
+
+#include "types.h"
+#include "templates.h"
+#include "pnm.h"
+#include "image.h"
+#include "rand48.h"
+
+/**
+ * pass a binary image through the channel: each 0 becomes 1 with probability p01
+ * and each 1 becomes 0 with probability p10, drawing one number from rng per
+ * pixel in raster order (as add_noise does). out may be the same as in.
+ * @return number of flipped pixels
+ */
+index_t add_channel_noise ( const image_t * in, image_t * out, const double p01, const double p10, rand48_t * rng );
+
+/** default number of terms in the approximate likelihood */
+#define NOISE_DEFAULT_MAXS 5
+
+/** default golden section search tolerance */
+#define NOISE_DEFAULT_TOL 1e-6
+
+/**
+ * estimate P(0->1) and P(1->0)
+ * @param freq   number of contexts with each sum (size k + 1)
+ * @param freq1  number of contexts with each sum whose center is 1 (size k + 1)
+ * @param total  number of contexts
+ * @param k      context size
+ * @param center 1 if the contexts include the center pixel, which is then left out
+ * @param maxs   number of terms in the approximate likelihood
+ * @param tol    golden section search tolerance
+ */
+void estimate_noise_params ( const index_t * freq, const index_t * freq1, const index_t total,
+                             const index_t k, const int center, const index_t maxs, const double tol,
+                             double * p01, double * p10 );
+
+/** parameters of the sampled estimation */
+typedef struct noise_sampling {
+    index_t tile_size;   // side of the square tiles
+    index_t batch;       // tiles added between two successive estimates
+    double rel_tol;      // stop when two successive estimates differ by less than this fraction of the estimate
+    double floor;        // estimates smaller than this are compared as if they were this large
+    unsigned long seed;  // for the order in which tiles are visited
+} noise_sampling_t;
+
+#define NOISE_SAMPLE_TILE    64
+#define NOISE_SAMPLE_BATCH   16
+#define NOISE_SAMPLE_REL_TOL 0.05
+#define NOISE_SAMPLE_FLOOR   1e-3
+
+/**
+ * estimate P(0->1) and P(1->0) from the contexts of the pixels in a random
+ * sample of tiles of a mapped PBM image. Pixels whose context is not fully
+ * inside the image are not used.
+ * @return number of tiles used
+ */
+index_t estimate_noise_sampled ( const mapped_pbm_t * pbm, const patch_template_t * tpl,
+                                 const index_t maxs, const double tol, const noise_sampling_t * sp,
+                                 double * p01, double * p10 );
+
+#endif
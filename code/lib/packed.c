@@ -0,0 +1,40 @@
+#include "packed.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+void pack_linear_range ( const image_t * img, const index_t u0, const index_t u1, packed_word_t * bits ) {
+    if ( u1 <= u0 ) {
+        return;
+    }
+    const pixel_t * x = img->pixels;
+    index_t u = u0;
+    index_t w = u0 / PACKED_BITS;
+    //
+    // first word, possibly partial
+    //
+    packed_word_t a = 0;
+    for ( int s = ( int ) ( u0 % PACKED_BITS ) ; ( s < PACKED_BITS ) && ( u < u1 ) ; ++s, ++u ) {
+        a |= ( packed_word_t ) ( x[ u ] != 0 ) << s;
+    }
+    bits[ w++ ] = a;
+    //
+    // full words
+    //
+    for ( ; u + PACKED_BITS <= u1 ; u += PACKED_BITS, ++w ) {
+        a = 0;
+        for ( int s = 0 ; s < PACKED_BITS ; ++s ) {
+            a |= ( packed_word_t ) ( x[ u + s ] != 0 ) << s;
+        }
+        bits[ w ] = a;
+    }
+    //
+    // last word, possibly partial
+    //
+    if ( u < u1 ) {
+        a = 0;
+        for ( int s = 0 ; u < u1 ; ++s, ++u ) {
+            a |= ( packed_word_t ) ( x[ u ] != 0 ) << s;
+        }
+        bits[ w ] = a;
+    }
+}
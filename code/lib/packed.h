@@ -0,0 +1,38 @@
+/**
+ * \file packed.h
+ * \brief Binary images packed 64 pixels per word
+ *
+ * The image is seen as one linear bit stream of m x n bits, as with
+ * linear templates: bit u of the stream is pixel u = i*n + j, stored in bit
+ * u % 64 of word u / 64. Reading the stream at an offset thus yields the
+ * samples of 64 consecutive pixels at the same template position.
+ */
+#ifndef PACKED_H
+#define PACKED_H
+
+#include <stdint.h>
+
+#include "image.h"
+
+typedef uint64_t packed_word_t;
+
+#define PACKED_BITS 64
+
+/**
+ * the 64 bits starting at position u, which need not be aligned;
+ * the words containing positions u to u + 63 must be readable.
+ */
+static inline packed_word_t packed_get64 ( const packed_word_t * bits, const index_t u ) {
+    const index_t w = u >> 6; // rounds towards minus infinity
+    const int s = ( int ) ( u & 63 );
+    return s ? ( bits[ w ] >> s ) | ( bits[ w + 1 ] << ( PACKED_BITS - s ) ) : bits[ w ];
+}
+
+/**
+ * pack the pixels [u0,u1) of a binary image into bits, which must be
+ * indexable at least from u0/64 to (u1-1)/64. Bits of the first and last
+ * words outside the range are set to zero.
+ */
+void pack_linear_range ( const image_t * img, const index_t u0, const index_t u1, packed_word_t * bits );
+
+#endif
@@ -3,7 +3,11 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "pnm.h"
+#include "instrument.h"
 //
 //---------------------------------------------------------------------------------------------
 // forward declaration of non-public functions used in this module
@@ -157,6 +161,7 @@ int write_pnm_info ( const image_info_t * info, FILE * fhandle ) {
 //---------------------------------------------------------------------------------------------
 //
 image_t * read_pnm ( const char * fname ) {
+    const uint64_t t0 = instrument_now ( );
     FILE * fhandle = fopen ( fname, "r" );
     if ( !fhandle ) {
         fprintf ( stderr, "pnm: error opening file %s for reading.\n", fname );
@@ -177,13 +182,16 @@ image_t * read_pnm ( const char * fname ) {
         fclose ( fhandle );
         return NULL;
     }
+    count_events ( COUNTER_BYTES_READ, ftell ( fhandle ) );
     fclose ( fhandle );
+    stage_done ( STAGE_READ, t0 );
     return img;
 }
 //
 //---------------------------------------------------------------------------------------------
 //
 int write_pnm ( const char * fname, const image_t * img ) {
+    const uint64_t t0 = instrument_now ( );
     int res;
     FILE * fhandle = fopen ( fname, "w" );
     if ( fhandle == NULL ) {
@@ -200,7 +208,9 @@ int write_pnm ( const char * fname, const image_t * img ) {
         fclose ( fhandle );
         return RESULT_ERROR;
     }
+    count_events ( COUNTER_BYTES_WRITTEN, ftell ( fhandle ) );
     fclose ( fhandle );
+    stage_done ( STAGE_WRITE, t0 );
     return RESULT_OK;
 }
 //
@@ -443,3 +453,55 @@ static int write_sample_1 ( int v, FILE * fhandle, unsigned char* pbuffer, unsig
 static int write_sample_ascii ( int c, FILE * fhandle ) {
     return fprintf ( fhandle, " %d", c ) <= 0 ? RESULT_ERROR : RESULT_OK;
 }
+//
+//---------------------------------------------------------------------------------------------
+//
+int map_pbm ( const char * fname, mapped_pbm_t * pbm ) {
+    memset ( pbm, 0, sizeof( mapped_pbm_t ) );
+#ifdef _WIN32
+    fprintf ( stderr, "pnm: mapped files not supported on this platform.\n" );
+    return RESULT_ERROR;
+#else
+    FILE * fhandle = fopen ( fname, "r" );
+    if ( !fhandle ) {
+        fprintf ( stderr, "pnm: error opening file %s for reading.\n", fname );
+        return RESULT_ERROR;
+    }
+    pbm->info = read_pnm_info ( fhandle );
+    if ( ( pbm->info.result != RESULT_OK ) || ( pbm->info.type != 4 ) ) {
+        fclose ( fhandle );
+        return RESULT_ERROR;
+    }
+    const long offset = ftell ( fhandle );
+    fseek ( fhandle, 0, SEEK_END );
+    const long length = ftell ( fhandle );
+    pbm->row_bytes = ( pbm->info.width + 7 ) / 8;
+    if ( ( offset < 0 ) || ( length - offset < pbm->row_bytes * pbm->info.height ) ) {
+        fprintf ( stderr, "pnm: file %s is truncated.\n", fname );
+        fclose ( fhandle );
+        return RESULT_ERROR;
+    }
+    void * base = mmap ( NULL, length, PROT_READ, MAP_PRIVATE, fileno ( fhandle ), 0 );
+    fclose ( fhandle );
+    if ( base == MAP_FAILED ) {
+        fprintf ( stderr, "pnm: error mapping file %s.\n", fname );
+        return RESULT_ERROR;
+    }
+    pbm->base = base;
+    pbm->length = length;
+    pbm->raster = ( const unsigned char * ) base + offset;
+    return RESULT_OK;
+#endif
+}
+//
+//---------------------------------------------------------------------------------------------
+//
+void unmap_pbm ( mapped_pbm_t * pbm ) {
+#ifndef _WIN32
+    if ( pbm->base ) {
+        munmap ( pbm->base, pbm->length );
+    }
+#endif
+    pbm->base = NULL;
+    pbm->raster = NULL;
+}
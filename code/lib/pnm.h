@@ -66,5 +66,32 @@ int write_rows ( const image_info_t * info, const int nrows, const pixel_t * pix
 //---------------------------------------------------------------------------------------------
 //
 int write_all ( const image_info_t * info, const pixel_t * pixels, FILE * fhandle );
+//
+//---------------------------------------------------------------------------------------------
+// memory-mapped raw PBM (P4) files: pixels are read straight from the packed
+// raster, without decoding the whole image
+//---------------------------------------------------------------------------------------------
+//
+typedef struct mapped_pbm {
+    image_info_t info;
+    const unsigned char * raster; // first byte of the first row
+    index_t row_bytes;            // rows are padded to a whole number of bytes
+    void * base;                  // mapping
+    size_t length;
+} mapped_pbm_t;
+//
+//---------------------------------------------------------------------------------------------
+//
+int map_pbm ( const char * fname, mapped_pbm_t * pbm );
+//
+//---------------------------------------------------------------------------------------------
+//
+void unmap_pbm ( mapped_pbm_t * pbm );
+//
+//---------------------------------------------------------------------------------------------
+//
+static inline pixel_t mapped_pbm_pixel ( const mapped_pbm_t * pbm, const index_t i, const index_t j ) {
+    return ( pbm->raster[ i * pbm->row_bytes + ( j >> 3 ) ] >> ( 7 - ( j & 7 ) ) ) & 1;
+}
 
 #endif
@@ -0,0 +1,433 @@
+#include <string.h>
+
+#include "quorum.h"
+#include "noise.h"
+#include "workspace.h"
+#include "logging.h"
+#include "instrument.h"
+#include "tile_map.h"
+
+/*
+ * The decisions for a whole row are looked up in the table 16 at a time with
+ * byte shuffles (pshufb on x86), one per block of 16 table entries. This needs
+ * the lookup indexes 2q+z to fit in a byte, that is, k < 128; larger templates
+ * are looked up one pixel at a time.
+ */
+#if defined( __GNUC__ ) && !defined( __clang__ )
+#define HAVE_BYTE_SHUFFLE 1
+typedef uint8_t byte16_t __attribute__ ( ( vector_size ( 16 ) ) );
+#endif
+
+#define QUORUM_MAX_SHUFFLED 127
+
+/*---------------------------------------------------------------------------------------*/
+
+static int quorum_mapped ( const patch_template_t * tpl, const quorum_params_t * par ) {
+    return !par->fused && ( tpl->k <= QUORUM_MAX_MAPPED );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static int quorum_nblocks ( const patch_template_t * tpl ) {
+    return tpl->k <= QUORUM_MAX_SHUFFLED ? ( int ) ( 2 * ( tpl->k + 1 ) + 15 ) / 16 : 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t quorum_workspace_size ( const image_info_t * info, const patch_template_t * tpl,
+                               const quorum_params_t * par ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const size_t k = tpl->k;
+    return ( quorum_mapped ( tpl, par ) ? workspace_round ( npixels * sizeof( uint8_t ) ) : 0 )
+         + 2 * workspace_round ( ( k + 1 ) * sizeof( index_t ) )
+         + workspace_round ( 2 * ( k + 1 ) * sizeof( char ) )
+         + workspace_round ( 16 * quorum_nblocks ( tpl ) * sizeof( uint8_t ) )
+         + workspace_round ( info->width * sizeof( uint32_t ) )
+         + 2 * workspace_round ( info->width * sizeof( uint8_t ) )
+         + workspace_round ( k * sizeof( index_t ) )
+         + workspace_round ( 2 * ( k + 1 ) * sizeof( char ) )
+         + ( quorum_mapped ( tpl, par ) ? 2 * workspace_round ( ( npixels / PACKED_BITS + 1 ) * sizeof( packed_word_t ) ) : 0 )
+         + context_sums_workspace_size ( info, tpl );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_quorum ( quorum_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                   const quorum_params_t * par, void * workspace ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    const index_t k = tpl->k;
+    char * pos = ( char * ) workspace;
+    ctx->par = *par;
+    ctx->tpl = tpl;
+    ctx->k = k;
+    ctx->quorum_map    = quorum_mapped ( tpl, par ) ?
+                         ( uint8_t * ) workspace_take ( &pos, npixels * sizeof( uint8_t ) ) : NULL;
+    ctx->quorum_freq   = ( index_t * ) workspace_take ( &pos, ( k + 1 ) * sizeof( index_t ) );
+    ctx->quorum_freq_1 = ( index_t * ) workspace_take ( &pos, ( k + 1 ) * sizeof( index_t ) );
+    ctx->lookup_table  = ( char * ) workspace_take ( &pos, 2 * ( k + 1 ) * sizeof( char ) );
+    ctx->nblocks       = quorum_nblocks ( tpl );
+    ctx->lookup_blocks = ( uint8_t * ) workspace_take ( &pos, 16 * ctx->nblocks * sizeof( uint8_t ) );
+    ctx->sums_row      = ( uint32_t * ) workspace_take ( &pos, info->width * sizeof( uint32_t ) );
+    ctx->index_row     = ( uint8_t * ) workspace_take ( &pos, info->width * sizeof( uint8_t ) );
+    ctx->decision_row  = ( uint8_t * ) workspace_take ( &pos, info->width * sizeof( uint8_t ) );
+    ctx->offsets       = ( index_t * ) workspace_take ( &pos, k * sizeof( index_t ) );
+    ctx->previous_table = ( char * ) workspace_take ( &pos, 2 * ( k + 1 ) * sizeof( char ) );
+    if ( ctx->quorum_map ) {
+        const size_t nwords = npixels / PACKED_BITS + 1;
+        ctx->dirty          = ( packed_word_t * ) workspace_take ( &pos, nwords * sizeof( packed_word_t ) );
+        ctx->dirty_previous = ( packed_word_t * ) workspace_take ( &pos, nwords * sizeof( packed_word_t ) );
+    } else {
+        ctx->dirty = ctx->dirty_previous = NULL;
+    }
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        ctx->offsets[ r ] = tpl->coords[ r ].i * info->width + tpl->coords[ r ].j;
+    }
+    ctx->nflipped = ctx->nchanged = 0;
+    init_context_sums ( &ctx->sums, info, tpl, pos );
+    memset ( ctx->quorum_freq,   0, ( k + 1 ) * sizeof( index_t ) );
+    memset ( ctx->quorum_freq_1, 0, ( k + 1 ) * sizeof( index_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t quorum_sums ( quorum_ctx_t * ctx, const image_t * img, const image_t * ctximg ) {
+    const uint64_t t0 = instrument_now ( );
+    if ( ctximg == NULL ) {
+        ctximg = img;
+    }
+    const index_t n = img->info.width;
+    const index_t m = img->info.height;
+    const uint32_t * sums_row = ctx->sums_row;
+    uint8_t * quorum_map = ctx->quorum_map;
+    index_t * quorum_freq = ctx->quorum_freq;
+    index_t * quorum_freq_1 = ctx->quorum_freq_1;
+    index_t total = 0;
+    memset ( quorum_freq,   0, ( ctx->k + 1 ) * sizeof( index_t ) );
+    memset ( quorum_freq_1, 0, ( ctx->k + 1 ) * sizeof( index_t ) );
+    //
+    // the patches of the pixels in uniform tiles sum 0 or k, and are counted
+    // one tile row at a time
+    //
+    tile_map_t * tiles = NULL, * ztiles = NULL;
+    if ( !ctx->par.visit_all ) {
+        index_t reach_i, reach_j;
+        template_reach ( ctx->tpl, &reach_i, &reach_j );
+        tiles = create_tile_map ( ctximg, reach_i, reach_j );
+        ztiles = img == ctximg ? tiles : create_tile_map ( img, 0, 0 );
+    }
+    reset_context_sums ( &ctx->sums );
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        context_sums_row ( &ctx->sums, ctximg, i, ctx->sums_row );
+        for ( int j = 0 ; j < n ; ) {
+            const int j1 = tiles ? tile_end ( tiles, j ) : n;
+            const int v = tiles ? uniform_value ( tiles, i, j ) : -1;
+            const int z = tiles ? uniform_value ( ztiles, i, j ) : -1;
+            if ( ( v >= 0 ) && ( z >= 0 ) ) {
+                const index_t a = v * ctx->k;
+                if ( quorum_map ) {
+                    memset ( quorum_map + li, a, j1 - j );
+                }
+                quorum_freq[ a ] += j1 - j;
+                quorum_freq_1[ a ] += z * ( j1 - j );
+                total += j1 - j;
+                li += j1 - j;
+                j = j1;
+                continue;
+            }
+            for ( ; j < j1 ; ++j, ++li ) {
+                const index_t a = sums_row[ j ];
+                if ( quorum_map ) {
+                    quorum_map[ li ] = a;
+                }
+                quorum_freq[ a ]++;
+                if ( get_linear_pixel ( img, li ) ) {
+                    quorum_freq_1[ a ]++;
+                }
+                total++;
+            }
+        }
+    }
+    if ( ztiles != tiles ) {
+        free_tile_map ( ztiles );
+    }
+    free_tile_map ( tiles );
+    stage_done ( STAGE_STATS, t0 );
+    return total;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void quorum_estimate_noise ( quorum_ctx_t * ctx, const index_t total ) {
+    estimate_noise_params ( ctx->quorum_freq, ctx->quorum_freq_1, total, ctx->k,
+                            template_includes_center ( ctx->tpl ), NOISE_DEFAULT_MAXS, NOISE_DEFAULT_TOL,
+                            &ctx->par.p01, &ctx->par.p10 );
+    info ( "estimated P(0->1)=%f P(1->0)=%f\n", ctx->par.p01, ctx->par.p10 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void quorum_lookup_table ( const index_t * quorum_freq, const index_t * quorum_freq_1, const index_t k,
+                           const index_t total, const double p01, const double p10, char * lookup_table ) {
+    const double p0 = p01;
+    const double p1 = p10;
+    /*
+    * we define the thresholds:
+    *  t0 = 2p1(1-p0)/(1+p1-p0)
+    *  t1 = 2p0(1-p1)/(1+p0-p1)
+    * so that
+    *
+    * if z = 0:
+    * x = 0 if n_0/n >= t0
+    * x = 1 otherwise
+    *
+    * if z = 1:
+    * x = 1 if n_1/n >= t1
+    * x = 0 otherwise
+    *
+    */
+    const double t0 = 2.0*p1*(1.0-p0) / ( 1.0+p1-p0);
+    const double t1 = 2.0*p0*(1.0-p1) / ( 1.0+p0-p1);
+    debug( "Lookup table:\n");
+    for ( int r = 0 ; r <= k  ; ++r ) {
+        const double n  = ( double ) quorum_freq[ r ]  / ( double ) total;
+        const double q1 = ( ( double ) quorum_freq_1[ r ] ) / ( ( double ) quorum_freq[ r ] );
+        const double q0 = 1.0 - q1;
+        const char x0 = q0 >= t0 ? 0 : 1;
+        const char x1 = q1 >= t1 ? 1 : 0;
+        lookup_table[2*r]  = x0;
+        lookup_table[2*r+1] = x1;
+        debug ( "S=%3d P(S)=%8.6f P(0|S) %8.6f t0 %8.6f x(0,S) %d P(1|S) %8.6f t1 %8.6f x(1,S) %d\n", r, n, q0, t0, x0, q1, t1, x1 );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void quorum_decide ( quorum_ctx_t * ctx, const index_t total ) {
+    const index_t k = ctx->k;
+    quorum_lookup_table ( ctx->quorum_freq, ctx->quorum_freq_1, k, total,
+                          ctx->par.p01, ctx->par.p10, ctx->lookup_table );
+    if ( ctx->nblocks ) {
+        memset ( ctx->lookup_blocks, 0, 16 * ctx->nblocks );
+        memcpy ( ctx->lookup_blocks, ctx->lookup_table, 2 * ( k + 1 ) );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * res[j] = blocks[idx[j]] for j = 0..n-1, where blocks holds nblocks blocks of 16 entries
+ */
+static void lookup_bytes ( const uint8_t * blocks, const int nblocks, const uint8_t * idx,
+                           uint8_t * res, const index_t n ) {
+    index_t j = 0;
+#ifdef HAVE_BYTE_SHUFFLE
+    for ( ; j + 16 <= n ; j += 16 ) {
+        byte16_t v, r = { 0 };
+        memcpy ( &v, idx + j, 16 );
+        const byte16_t lo = v & 15;
+        const byte16_t hi = v >> 4;
+        for ( int b = 0 ; b < nblocks ; ++b ) {
+            byte16_t tbl;
+            memcpy ( &tbl, blocks + 16 * b, 16 );
+            r |= __builtin_shuffle ( tbl, lo ) & ( byte16_t ) ( hi == ( uint8_t ) b );
+        }
+        memcpy ( res + j, &r, 16 );
+    }
+#endif
+    for ( ; j < n ; ++j ) {
+        res[ j ] = blocks[ idx[ j ] ];
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t quorum_apply ( quorum_ctx_t * ctx, const image_t * in, const image_t * ctximg, image_t * out ) {
+    const uint64_t t0 = instrument_now ( );
+    const double p0 = ctx->par.p01;
+    const double p1 = ctx->par.p10;
+    const double pe = p0 + p1;
+    const int m = in->info.height;
+    const int n = in->info.width;
+    const index_t total = m * n;
+    const uint8_t* quorum_map = ctx->quorum_map;
+    const char* lookup_table = ctx->lookup_table;
+    const uint32_t* sums_row = ctx->sums_row;
+    uint8_t* index_row = ctx->index_row;
+    uint8_t* decision_row = ctx->decision_row;
+    if ( ctximg == NULL ) {
+        ctximg = in;
+    }
+
+    quorum_decide ( ctx, total );
+
+    //
+    // when the sums are recomputed from out itself, each row of out is read by the
+    // sums engine before it is changed, so the result is the same as with the map
+    //
+    reset_context_sums ( &ctx->sums );
+    ctx->sums.in_place = ( ctximg == out );
+    if ( ctx->dirty ) {
+        memset ( ctx->dirty, 0, ( total / PACKED_BITS + 1 ) * sizeof( packed_word_t ) );
+    }
+    index_t oned = 0, zeroed = 0, flipped = 0;
+    for ( int i = 0 ; i < m ; ++i ) {
+        const pixel_t* z = in->pixels + ( index_t ) i * n;
+        pixel_t* x = out->pixels + ( index_t ) i * n;
+        const uint8_t* map_row = quorum_map ? quorum_map + ( index_t ) i * n : NULL;
+        if ( !quorum_map ) {
+            context_sums_row ( &ctx->sums, ctximg, i, ctx->sums_row );
+        }
+        //
+        // denoising rule:
+        //
+        if ( ctx->nblocks ) {
+            if ( map_row ) {
+                for ( int j = 0 ; j < n ; ++j ) {
+                    index_row[ j ] = ( map_row[ j ] << 1 ) + z[ j ];
+                }
+            } else {
+                for ( int j = 0 ; j < n ; ++j ) {
+                    index_row[ j ] = ( sums_row[ j ] << 1 ) + z[ j ];
+                }
+            }
+            lookup_bytes ( ctx->lookup_blocks, ctx->nblocks, index_row, decision_row, n );
+        } else {
+            for ( int j = 0 ; j < n ; ++j ) {
+                const int S = map_row ? map_row[ j ] : ( int ) sums_row[ j ];
+                decision_row[ j ] = lookup_table[ ( S << 1 ) + z[ j ] ];
+            }
+        }
+        for ( int j = 0 ; j < n ; ++j ) {
+            if ( decision_row[ j ] != z[ j ] ) {
+                if ( decision_row[ j ] ) oned++; else zeroed++;
+            }
+            if ( decision_row[ j ] != x[ j ] ) {
+                x[ j ] = decision_row[ j ];
+                flipped++;
+                if ( ctx->dirty ) {
+                    const index_t li = ( index_t ) i * n + j;
+                    ctx->dirty[ li / PACKED_BITS ] |= ( packed_word_t ) 1 << ( li % PACKED_BITS );
+                }
+            }
+        }
+    }
+    ctx->nflipped = flipped;
+    ctx->nchanged = oned + zeroed;
+    info ( "changed : 0->1 (%8.4f%%) 1->0 (%8.4f%%) total (%8.4f%%) pixels\n",
+        100.0*((double)oned)/((double)total),
+        100.0*((double)zeroed)/((double)total),
+        100.0*((double)(zeroed+oned))/((double)total));
+    info ( "expected: 0->1 (%8.4f%%) 1->0 (%8.4f%%) total (%8.4f%%) pixels\n",
+        100.0*p0, 100.0*p1, 100.0*pe);
+    count_events ( COUNTER_PIXELS_CHANGED, oned + zeroed );
+    stage_done ( STAGE_APPLY, t0 );
+    return (oned+zeroed);
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t quorum_update ( quorum_ctx_t * ctx, const image_t * in, image_t * out ) {
+    const uint64_t t0 = instrument_now ( );
+    const index_t npixels = ( index_t ) in->info.width * in->info.height;
+    const index_t nwords = npixels / PACKED_BITS + 1;
+    const index_t k = ctx->k;
+    const index_t * offsets = ctx->offsets;
+    const pixel_t * z = in->pixels;
+    pixel_t * x = out->pixels;
+    uint8_t * quorum_map = ctx->quorum_map;
+    index_t * quorum_freq = ctx->quorum_freq;
+    index_t * quorum_freq_1 = ctx->quorum_freq_1;
+    //
+    // the pixels changed by the last iteration become the previous ones
+    //
+    packed_word_t * dirty = ctx->dirty_previous;
+    packed_word_t * previous = ctx->dirty;
+    ctx->dirty = dirty;
+    ctx->dirty_previous = previous;
+    //
+    // each changed pixel q is in the patch of the pixels q - offset
+    //
+    for ( index_t w = 0 ; w < nwords ; ++w ) {
+        for ( packed_word_t bits = previous[ w ] ; bits ; bits &= bits - 1 ) {
+            const index_t q = w * PACKED_BITS + __builtin_ctzll ( bits );
+            const int d = x[ q ] ? 1 : -1;
+            for ( index_t r = 0 ; r < k ; ++r ) {
+                const index_t p = q - offsets[ r ];
+                if ( ( p < 0 ) || ( p >= npixels ) ) {
+                    continue;
+                }
+                const int a = quorum_map[ p ];
+                quorum_freq[ a ]--;
+                quorum_freq[ a + d ]++;
+                if ( z[ p ] ) {
+                    quorum_freq_1[ a ]--;
+                    quorum_freq_1[ a + d ]++;
+                }
+                quorum_map[ p ] = a + d;
+            }
+        }
+    }
+    memcpy ( ctx->previous_table, ctx->lookup_table, 2 * ( k + 1 ) );
+    quorum_decide ( ctx, npixels );
+    if ( memcmp ( ctx->previous_table, ctx->lookup_table, 2 * ( k + 1 ) ) ) {
+        debug ( "lookup table changed, deciding on all pixels.\n" );
+        stage_done ( STAGE_APPLY, t0 );
+        return quorum_apply ( ctx, in, out, out );
+    }
+    //
+    // same table: only the pixels whose sums changed can change
+    //
+    const char * lookup_table = ctx->lookup_table;
+    index_t flipped = 0;
+    index_t nchanged = ctx->nchanged;
+    memset ( dirty, 0, nwords * sizeof( packed_word_t ) );
+    for ( index_t w = 0 ; w < nwords ; ++w ) {
+        for ( packed_word_t bits = previous[ w ] ; bits ; bits &= bits - 1 ) {
+            const index_t q = w * PACKED_BITS + __builtin_ctzll ( bits );
+            for ( index_t r = 0 ; r < k ; ++r ) {
+                const index_t p = q - offsets[ r ];
+                if ( ( p < 0 ) || ( p >= npixels ) ) {
+                    continue;
+                }
+                const pixel_t v = lookup_table[ ( quorum_map[ p ] << 1 ) + z[ p ] ];
+                if ( v != x[ p ] ) {
+                    nchanged += ( v != z[ p ] ) ? 1 : -1;
+                    x[ p ] = v;
+                    flipped++;
+                    dirty[ p / PACKED_BITS ] |= ( packed_word_t ) 1 << ( p % PACKED_BITS );
+                }
+            }
+        }
+    }
+    ctx->nflipped = flipped;
+    ctx->nchanged = nchanged;
+    info ( "changed : total (%8.4f%%) pixels, %ld since the last iteration\n",
+        100.0*((double)nchanged)/((double)npixels), ( long ) flipped );
+    count_events ( COUNTER_PIXELS_CHANGED, nchanged );
+    stage_done ( STAGE_APPLY, t0 );
+    return nchanged;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+index_t quorum_denoise ( quorum_ctx_t * ctx, const image_t * in, image_t * out, const int iterations ) {
+    const int maxit = iterations > 0 ? iterations : QUORUM_MAX_ITERATIONS;
+    index_t changed = 0;
+    for ( int it = 0 ; it < maxit ; ++it ) {
+        debug ( "iteration %d\n", it );
+        if ( ( it > 0 ) && ctx->quorum_map ) {
+            changed = quorum_update ( ctx, in, out );
+        } else {
+            const index_t total = quorum_sums ( ctx, in, out );
+            if ( ctx->par.auto_noise && ( it == 0 ) ) {
+                quorum_estimate_noise ( ctx, total );
+            }
+            changed = quorum_apply ( ctx, in, out, out );
+        }
+        if ( ctx->nflipped == 0 ) {
+            info ( "converged after %d iterations.\n", it + 1 );
+            break;
+        }
+    }
+    return changed;
+}
@@ -0,0 +1,146 @@
+/**
+ * \file quorum.h
+ * \brief Quorum denoiser
+ *
+ * given a template, patches are classified according to their
+ * sum. Statistics are gathered for each sum value, and
+ * then a Bayesian minimum-risk rule is used to decide upon
+ * each center pixel.
+ *
+ * The sums are kept in an 8-bit quorum map between the statistics and the
+ * decision passes. In fused mode (or if k > 255) there is no map: the sums
+ * are computed again while applying the rule, which is cheap with
+ * context_sums and saves one byte per pixel.
+ *
+ * When iterating with a quorum map, only the first iteration computes all
+ * the sums. Later iterations update the sums and histograms around the pixels
+ * that changed in the previous one, and decide again only on those pixels,
+ * unless the lookup table itself changed.
+ */
+#ifndef QUORUM_H
+#define QUORUM_H
+
+#include "image.h"
+#include "templates.h"
+#include "context_sums.h"
+#include "packed.h"
+
+typedef struct quorum_params {
+    double p01; // P(0->1)
+    double p10; // P(1->0)
+    int fused;  // recompute the sums when applying the rule instead of storing them
+    int auto_noise; // estimate p01 and p10 from the histograms of the first iteration
+    int visit_all; // gather the histograms pixel by pixel, even in uniform tiles (see tile_map.h)
+} quorum_params_t;
+
+/** largest template size for which sums are stored in the quorum map */
+#define QUORUM_MAX_MAPPED 255
+
+/** iterations run by quorum_denoise when asked to iterate until convergence */
+#define QUORUM_MAX_ITERATIONS 100
+
+/**
+ * denoising context; all buffers point into the caller's workspace
+ */
+typedef struct quorum_ctx {
+    quorum_params_t par;
+    const patch_template_t * tpl;
+    index_t k;
+    /** pseudo-image where each pixel's value contains the sum of its patch samples (m x n); NULL in fused mode */
+    uint8_t * quorum_map;
+    /** frequency of each quorum value P(Q=q) (size k + 1) */
+    index_t * quorum_freq;
+    /** frequency of each quorum value given that the center is 1 (size k + 1) */
+    index_t * quorum_freq_1;
+    /** decision for each (quorum value, noisy value) pair (size 2(k + 1)), at index 2q + z */
+    char * lookup_table;
+    /** the lookup table in blocks of 16 entries, padded with zeros */
+    uint8_t * lookup_blocks;
+    int nblocks;
+    /** patch sums engine and one row of sums */
+    context_sums_t sums;
+    uint32_t * sums_row;
+    /** lookup indexes and decisions for one row */
+    uint8_t * index_row;
+    uint8_t * decision_row;
+    /** linear offsets of the template samples */
+    index_t * offsets;
+    /** lookup table of the previous iteration */
+    char * previous_table;
+    /** output pixels changed by the last iteration (m x n bits), and by the one before; NULL in fused mode */
+    packed_word_t * dirty;
+    packed_word_t * dirty_previous;
+    /** output pixels changed by the last iteration */
+    index_t nflipped;
+    /** output pixels that differ from the noisy input */
+    index_t nchanged;
+} quorum_ctx_t;
+
+/**
+ * size in bytes of the workspace required to denoise images of the given size
+ */
+size_t quorum_workspace_size ( const image_info_t * info, const patch_template_t * tpl,
+                               const quorum_params_t * par );
+
+/**
+ * prepare a context for denoising images of the given size;
+ * the template and the workspace must outlive the context
+ */
+void init_quorum ( quorum_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                   const quorum_params_t * par, void * workspace );
+
+/**
+ * compute the quorum (patch sum) of every pixel of ctximg and the
+ * histograms of the quorum values, and of the quorum values given that
+ * the corresponding pixel of img is 1; the sums are stored in the quorum map
+ * unless in fused mode
+ * @return number of pixels
+ */
+index_t quorum_sums ( quorum_ctx_t * ctx, const image_t * img, const image_t * ctximg );
+
+/**
+ * estimate the noise parameters of the context from the current histograms
+ */
+void quorum_estimate_noise ( quorum_ctx_t * ctx, const index_t total );
+
+/**
+ * decision for each (quorum value, noisy value) pair, at index 2q + z of
+ * lookup_table (size 2(k + 1)), given the quorum histograms and the channel parameters
+ */
+void quorum_lookup_table ( const index_t * quorum_freq, const index_t * quorum_freq_1, const index_t k,
+                           const index_t total, const double p01, const double p10, char * lookup_table );
+
+/**
+ * fill the lookup table from the current histograms
+ */
+void quorum_decide ( quorum_ctx_t * ctx, const index_t total );
+
+/**
+ * apply the lookup table to the noisy image, using the current quorum map,
+ * or, in fused mode, the sums of ctximg, which may be the same as out.
+ * Marks the output pixels that change.
+ * @return number of pixels of out that differ from in
+ */
+index_t quorum_apply ( quorum_ctx_t * ctx, const image_t * in, const image_t * ctximg, image_t * out );
+
+/**
+ * next iteration after quorum_apply with ctximg = out, with a quorum map:
+ * propagates the pixels that changed in the last iteration to the sums of their
+ * neighbors and to the histograms, and applies the new lookup table to the pixels
+ * whose sums changed (or to all, if the table changed).
+ * @return number of pixels of out that differ from in
+ */
+index_t quorum_update ( quorum_ctx_t * ctx, const image_t * in, image_t * out );
+
+/**
+ * full quorum denoising: each iteration computes the statistics on the
+ * current output and applies the decision rule to the noisy input.
+ * Stops early when an iteration changes nothing.
+ * @param out must be a copy of in
+ * @param iterations maximum number of iterations; 0 iterates until convergence,
+ *        up to QUORUM_MAX_ITERATIONS
+ * @return number of pixels of out that differ from in
+ */
+index_t quorum_denoise ( quorum_ctx_t * ctx, const image_t * in, image_t * out, const int iterations );
+
+#endif
@@ -172,3 +172,21 @@ lrand48(void)
 {
     return (long)(((ulong)mrand48())>>1);
 }
+
+/*---------------------------------------------------------------------------------------*/
+
+#define MASK48 ((((uint64_t)1)<<48)-1)
+
+void
+seed_rand48 ( rand48_t * r, long seedval )
+{
+    const uint64_t s = (uint64_t)(ulong)seedval;
+    r->x = ( ( ( s >> 16 ) << 32 ) | ( ( s & 0xFFFF ) << 16 ) | SEED0 ) & MASK48;
+}
+
+double
+next_rand48 ( rand48_t * r )
+{
+    r->x = ( r->x * 0x5DEECE66DULL + C ) & MASK48;
+    return (double)r->x/D_2_48;
+}
@@ -1,3 +1,22 @@
+#ifndef RAND48_H
+#define RAND48_H
+
+#include <stdint.h>
+
 void srand48(long seed);
 long mrand48(), lrand48();
 double drand48();
+
+/**
+ * generator with its own state, for use from several threads at once;
+ * produces the same sequence as srand48/drand48 with the same seed
+ */
+typedef struct rand48 {
+    uint64_t x;
+} rand48_t;
+
+void seed_rand48 ( rand48_t * r, long seedval );
+
+double next_rand48 ( rand48_t * r );
+
+#endif
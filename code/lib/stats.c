@@ -4,19 +4,73 @@
 
 #include "stats.h"
 #include "logging.h"
+#include "instrument.h"
+#include "template_kernels.h"
+#include "hamming_index.h"
+#include "tile_map.h"
 
+/*
+ * memory held by all the stats trees of the process
+ */
+static index_t live_nodes = 0;
+static index_t live_bytes = 0;
+static index_t peak_bytes = 0;
+
+/*---------------------------------------------------------------------------------------*/
+
+static void account_memory ( const index_t nodes, const index_t bytes ) {
+#if defined( __GNUC__ )
+    __atomic_add_fetch ( &live_nodes, nodes, __ATOMIC_RELAXED );
+    const index_t now = __atomic_add_fetch ( &live_bytes, bytes, __ATOMIC_RELAXED );
+    index_t peak = __atomic_load_n ( &peak_bytes, __ATOMIC_RELAXED );
+    while ( ( now > peak ) &&
+            !__atomic_compare_exchange_n ( &peak_bytes, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+    }
+#else
+    live_nodes += nodes;
+    live_bytes += bytes;
+    if ( live_bytes > peak_bytes ) {
+        peak_bytes = live_bytes;
+    }
+#endif
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+stats_memory_t get_stats_memory ( void ) {
+    stats_memory_t mem;
+    mem.nodes = live_nodes;
+    mem.bytes = live_bytes;
+    mem.peak_bytes = peak_bytes;
+    return mem;
+}
 
 /*---------------------------------------------------------------------------------------*/
 static patch_node_t * alloc_node( ) {
     patch_node_t* pnode =  ( patch_node_t * ) calloc ( 1, sizeof( patch_node_t ) );
     if ( !pnode ) {
-        fprintf ( stderr, "Out of memory." );
+        //
+        // every caller writes to the node right away; stop here with
+        // a useful message rather than crash on a NULL pointer
+        //
+        error ( "out of memory allocating a stats node: %ld nodes, %ld bytes in use. "
+                "Consider setting a memory budget.\n", ( long ) live_nodes, ( long ) live_bytes );
+        exit ( 1 );
     }
+    account_memory ( 1, sizeof( patch_node_t ) );
+    count_events ( COUNTER_TRIE_NODES, 1 );
     return pnode;
 }
 
 /*---------------------------------------------------------------------------------------*/
 
+static void release_node ( patch_node_t * pnode ) {
+    account_memory ( -1, -( index_t ) sizeof( patch_node_t ) );
+    free ( pnode );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
 static patch_node_t * create_node ( patch_node_t* parent, const pixel_t val, char is_leaf ) {
     patch_node_t * pnode = alloc_node( );
     pnode->parent = parent;
@@ -28,6 +82,12 @@ static patch_node_t * create_node ( patch_node_t* parent, const pixel_t val, cha
 
 /*---------------------------------------------------------------------------------------*/
 
+patch_node_t * create_stats ( void ) {
+    return alloc_node ( );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
 static patch_node_t * create_inner_node ( patch_node_t* parent, const pixel_t val ) {
     return create_node ( parent, val, 0 );
 }
@@ -60,8 +120,9 @@ void free_node ( patch_node_t * pnode ) {
         } else if ( pnode->diff != NULL ) {
             free ( pnode->diff );
             pnode->diff = 0;
+            account_memory ( 0, -( index_t ) ( pnode->diff_size * sizeof( index_t ) ) );
         }
-        free ( pnode );
+        release_node ( pnode );
     }
 }
 
@@ -70,7 +131,7 @@ void free_node ( patch_node_t * pnode ) {
 void delete_node ( patch_node_t * node ) {
     patch_node_t* parent = node->parent;
     pixel_t val = node->value;
-    free ( node );
+    release_node ( node );
     if ( parent != NULL ) {
         parent->children[ val ] = NULL; // remove from parent
         for ( int i = 0 ; i < ALPHA ; ++i ) {
@@ -208,14 +269,19 @@ void free_stats ( patch_node_t * pnode ) {
 /*---------------------------------------------------------------------------------------*/
 
 
-static patch_node_t * update_patch_stats ( const patch_t * pctx, const pixel_t z, patch_node_t * ptree ) {
+/**
+ * add count occurrences of pctx, ones of them with center 1; if used is
+ * not NULL, the bytes of the nodes created are added to it
+ */
+static inline patch_node_t * add_occurrences_counted ( const patch_t * pctx, const index_t count, const index_t ones,
+                                                      patch_node_t * ptree, index_t * used ) {
     patch_node_t * pnode = ptree, * nnode = NULL;
     const int k = pctx->k;
     const pixel_t * const cv = pctx->values;
     register int j;
     /* traverse tree, creating nodes if necessary, and update counts */
     for ( j = 0 ; j < k ; ++j ) {
-        pnode->occu++;
+        pnode->occu += count;
         const pixel_t cj = cv[ j ];
         assert ( cj < ALPHA );
         nnode = pnode->children[ cj ];
@@ -225,23 +291,333 @@ static patch_node_t * update_patch_stats ( const patch_t * pctx, const pixel_t z
             else { // is a leaf.
                 nnode = pnode->children[ cj ] = create_leaf_node ( pnode, cj );
             }
+            if ( used ) {
+                *used += sizeof( patch_node_t );
+            }
         }
         pnode = nnode;
     }
     // this one is always a leaf, and the contents of the node are the average
-    pnode->occu++;
-    pnode->counts += z;
+    pnode->occu += count;
+    pnode->counts += ones;
     return pnode;
 }
 
+static inline patch_node_t * add_occurrences ( const patch_t * pctx, const index_t count, const index_t ones,
+                                              patch_node_t * ptree ) {
+    return add_occurrences_counted ( pctx, count, ones, ptree, NULL );
+}
+
+patch_node_t * update_patch_stats ( const patch_t * pctx, const pixel_t z, patch_node_t * ptree ) {
+    return add_occurrences ( pctx, 1, z, ptree );
+}
+
+patch_node_t * add_patch_stats ( const patch_t * pctx, const pixel_t z, const index_t count, patch_node_t * ptree ) {
+    return add_occurrences ( pctx, count, z * count, ptree );
+}
+
+patch_node_t * add_context_stats ( const patch_t * pctx, const index_t occu, const index_t counts, patch_node_t * ptree ) {
+    return add_occurrences ( pctx, occu, counts, ptree );
+}
 
 /*---------------------------------------------------------------------------------------*/
+/*
+ * Concurrent insertion. A thread that finds a child missing links a node of
+ * its own with a compare-and-swap; if another thread got there first, it
+ * follows that thread's node and keeps its own as the spare of its
+ * inserter. Nodes are published with release semantics once their fields
+ * are set, and read with acquire semantics. Without GNU atomics, the whole
+ * insertion is a critical section.
+ */
 
-patch_node_t * gather_patch_stats ( const image_t * pnoisy,
-                                    const image_t * pctximg,
-                                    const patch_template_t * ptpl,
-                                    patch_mapper_t mapper,
-                                    patch_node_t * ptree ) {
+static inline patch_node_t * add_occurrences_shared ( const patch_t * pctx, const index_t count, const index_t ones,
+                                                     patch_node_t * ptree, stats_inserter_t * ins ) {
+#if defined( __GNUC__ )
+    patch_node_t * pnode = ptree;
+    const int k = pctx->k;
+    const pixel_t * const cv = pctx->values;
+    for ( int j = 0 ; j < k ; ++j ) {
+        __atomic_add_fetch ( &pnode->occu, count, __ATOMIC_RELAXED );
+        const pixel_t cj = cv[ j ];
+        assert ( cj < ALPHA );
+        patch_node_t * nnode = __atomic_load_n ( &pnode->children[ cj ], __ATOMIC_ACQUIRE );
+        if ( nnode == NULL ) {
+            patch_node_t * fresh = ins->spare ? ins->spare : alloc_node ( );
+            ins->spare = NULL;
+            fresh->parent = pnode;
+            fresh->value = cj;
+            fresh->leaf = j == ( k - 1 );
+            if ( __atomic_compare_exchange_n ( &pnode->children[ cj ], &nnode, fresh, 0,
+                                               __ATOMIC_RELEASE, __ATOMIC_ACQUIRE ) ) {
+                nnode = fresh;
+            } else { // nnode is now the winner's node
+                ins->spare = fresh;
+            }
+        }
+        pnode = nnode;
+    }
+    __atomic_add_fetch ( &pnode->occu, count, __ATOMIC_RELAXED );
+    __atomic_add_fetch ( &pnode->counts, ones, __ATOMIC_RELAXED );
+    return pnode;
+#else
+    patch_node_t * pnode;
+    ( void ) ins;
+#ifdef PARALLEL
+    #pragma omp critical ( shared_stats )
+#endif
+    pnode = add_occurrences ( pctx, count, ones, ptree );
+    return pnode;
+#endif
+}
+
+patch_node_t * update_patch_stats_shared ( const patch_t * pctx, const pixel_t z, patch_node_t * ptree,
+                                          stats_inserter_t * ins ) {
+    return add_occurrences_shared ( pctx, 1, z, ptree, ins );
+}
+
+patch_node_t * add_context_stats_shared ( const patch_t * pctx, const index_t occu, const index_t counts,
+                                         patch_node_t * ptree, stats_inserter_t * ins ) {
+    return add_occurrences_shared ( pctx, occu, counts, ptree, ins );
+}
+
+void release_stats_inserter ( stats_inserter_t * ins ) {
+    if ( ins->spare ) {
+        release_node ( ins->spare );
+        ins->spare = NULL;
+    }
+}
+
+/**
+ * add the occurrences to the tree, shared with other threads if ins is not
+ * NULL; otherwise, the bytes of new nodes are added to used if not NULL
+ */
+static inline void insert_occurrences ( const patch_t * pctx, const index_t count, const index_t ones,
+                                        patch_node_t * ptree, stats_inserter_t * ins, index_t * used ) {
+    if ( ins ) {
+        add_occurrences_shared ( pctx, count, ones, ptree, ins );
+    } else {
+        add_occurrences_counted ( pctx, count, ones, ptree, used );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+/*
+ * Pre-aggregation of contexts. Most of the pixels of a page share a few
+ * contexts, so gather_patch_stats first counts them in a small hash table
+ * keyed by the packed context, and walks the tree once per distinct context
+ * when the table fills up and at the end of the image (of each row with a
+ * memory budget, which is checked there). The tree is then the same as when
+ * adding the pixels one by one. On very noisy images few contexts repeat,
+ * and the buffer is dropped after the first time it fills up.
+ */
+
+#define CONTEXT_BUFFER_BITS  128
+#define CONTEXT_BUFFER_SLOTS 4096 // power of 2; 128 KiB
+#define CONTEXT_BUFFER_FILL  ( CONTEXT_BUFFER_SLOTS / 2 )
+#define CONTEXT_BUFFER_REUSE 2    // pixels per distinct context below which the buffer is dropped
+
+typedef struct context_count {
+    uint64_t key[ CONTEXT_BUFFER_BITS / 64 ];
+    index_t occu;   // 0 for an empty slot
+    index_t ones;
+} context_count_t;
+
+typedef struct context_buffer {
+    context_count_t * slots;
+    index_t * used; // slots in use, in order of arrival
+    index_t nused;
+    index_t npixels; // pixels buffered since the last flush
+    int off;        // set when too few contexts repeat for the buffer to pay off
+    patch_t patch;  // scratch, to unpack the contexts
+} context_buffer_t;
+
+static context_buffer_t * create_context_buffer ( const index_t k ) {
+    context_buffer_t * b = ( context_buffer_t * ) malloc ( sizeof( context_buffer_t ) );
+    b->slots = ( context_count_t * ) calloc ( CONTEXT_BUFFER_SLOTS, sizeof( context_count_t ) );
+    b->used = ( index_t * ) malloc ( CONTEXT_BUFFER_FILL * sizeof( index_t ) );
+    b->nused = 0;
+    b->npixels = 0;
+    b->off = 0;
+    b->patch.k = k;
+    b->patch.values = ( pixel_t * ) malloc ( k * sizeof( pixel_t ) );
+    return b;
+}
+
+static void free_context_buffer ( context_buffer_t * b ) {
+    if ( b ) {
+        free ( b->patch.values );
+        free ( b->used );
+        free ( b->slots );
+        free ( b );
+    }
+}
+
+/** add the buffered counts to the tree and empty the buffer */
+static void flush_context_buffer ( context_buffer_t * b, patch_node_t * ptree, stats_inserter_t * shared,
+                                   index_t * used ) {
+    const index_t k = b->patch.k;
+    for ( index_t u = 0 ; u < b->nused ; ++u ) {
+        context_count_t * c = &b->slots[ b->used[ u ] ];
+        for ( index_t r = 0 ; r < k ; ++r ) {
+            b->patch.values[ r ] = ( c->key[ r >> 6 ] >> ( r & 63 ) ) & 1;
+        }
+        insert_occurrences ( &b->patch, c->occu, c->ones, ptree, shared, used );
+        c->occu = 0;
+    }
+    b->nused = 0;
+    b->npixels = 0;
+}
+
+static inline void buffer_context ( context_buffer_t * b, const patch_t * pctx, const pixel_t z, patch_node_t * ptree,
+                                    stats_inserter_t * shared, index_t * used ) {
+    //
+    // one word at a time, so that the compiler can vectorize the loops
+    //
+    uint64_t key[ CONTEXT_BUFFER_BITS / 64 ];
+    const pixel_t * v = pctx->values;
+    const int k = pctx->k, k0 = k < 64 ? k : 64;
+    uint64_t w = 0;
+    for ( int r = 0 ; r < k0 ; ++r ) {
+        w |= ( uint64_t ) v[ r ] << r;
+    }
+    key[ 0 ] = w;
+    w = 0;
+    for ( int r = k0 ; r < k ; ++r ) {
+        w |= ( uint64_t ) v[ r ] << ( r - 64 );
+    }
+    key[ 1 ] = w;
+    b->npixels++;
+    const uint64_t h = ( key[ 0 ] ^ ( key[ 1 ] * 0xC2B2AE3D27D4EB4FULL ) ) * 0x9E3779B97F4A7C15ULL;
+    index_t s = ( index_t ) ( h >> 32 ) & ( CONTEXT_BUFFER_SLOTS - 1 );
+    while ( 1 ) {
+        context_count_t * c = &b->slots[ s ];
+        if ( !c->occu ) {
+            c->key[ 0 ] = key[ 0 ];
+            c->key[ 1 ] = key[ 1 ];
+            c->occu = 1;
+            c->ones = z;
+            b->used[ b->nused++ ] = s;
+            if ( b->nused == CONTEXT_BUFFER_FILL ) {
+                b->off = b->npixels < CONTEXT_BUFFER_REUSE * CONTEXT_BUFFER_FILL;
+                flush_context_buffer ( b, ptree, shared, used );
+            }
+            return;
+        }
+        if ( ( c->key[ 0 ] == key[ 0 ] ) && ( c->key[ 1 ] == key[ 1 ] ) ) {
+            c->occu++;
+            c->ones += z;
+            return;
+        }
+        s = ( s + 1 ) & ( CONTEXT_BUFFER_SLOTS - 1 );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** bytes held by a node itself */
+static inline index_t node_bytes ( const patch_node_t * pnode ) {
+    return sizeof( patch_node_t ) + ( pnode->diff ? pnode->diff_size * sizeof( index_t ) : 0 );
+}
+
+index_t stats_bytes ( const patch_node_t * pnode ) {
+    index_t bytes = node_bytes ( pnode );
+    if ( !pnode->leaf ) {
+        for ( int i = 0 ; i < ALPHA ; ++i ) {
+            if ( pnode->children[ i ] ) {
+                bytes += stats_bytes ( pnode->children[ i ] );
+            }
+        }
+    }
+    return bytes;
+}
+
+/**
+ * prune_rare_stats, adding the bytes released to freed
+ */
+static index_t drop_rare_stats ( patch_node_t * pnode, const index_t minoccu, index_t * freed ) {
+    if ( pnode->leaf ) {
+        return 0;
+    }
+    index_t removed = 0;
+    for ( int i = 0 ; i < ALPHA ; ++i ) {
+        patch_node_t * child = pnode->children[ i ];
+        if ( child == NULL ) {
+            continue;
+        }
+        if ( child->leaf ) {
+            if ( child->occu >= minoccu ) {
+                continue;
+            }
+            removed += child->occu;
+        } else {
+            removed += drop_rare_stats ( child, minoccu, freed );
+            if ( child->children[ 0 ] || child->children[ 1 ] ) {
+                continue;
+            }
+        }
+        *freed += node_bytes ( child );
+        free_node ( child );
+        pnode->children[ i ] = NULL;
+    }
+    pnode->occu -= removed;
+    return removed;
+}
+
+index_t prune_rare_stats ( patch_node_t * pnode, const index_t minoccu ) {
+    index_t freed = 0;
+    return drop_rare_stats ( pnode, minoccu, &freed );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_stats_budget ( stats_budget_t * budget, const index_t bytes, const patch_node_t * ptree ) {
+    budget->bytes = bytes > 0 ? bytes : 0;
+    budget->used = ptree ? stats_bytes ( ptree ) : 0;
+    budget->threshold = 2;
+    budget->dropped = 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * drop rare contexts from ptree until it is back to half its budget
+ */
+static void enforce_stats_budget ( patch_node_t * ptree, stats_budget_t * budget ) {
+    const index_t low = budget->bytes / 2;
+    if ( !budget->dropped ) {
+        warn ( "stats over the budget of %ld bytes: dropping contexts seen fewer than %ld times.\n",
+               ( long ) budget->bytes, ( long ) budget->threshold );
+    }
+    while ( ( budget->used > low ) && ( ptree->children[ 0 ] || ptree->children[ 1 ] ) ) {
+        const index_t before = budget->used;
+        index_t freed = 0;
+        const index_t removed = drop_rare_stats ( ptree, budget->threshold, &freed );
+        budget->used -= freed;
+        budget->dropped += removed;
+        debug ( "dropped contexts seen fewer than %ld times (%ld occurrences), %ld -> %ld bytes\n",
+                ( long ) budget->threshold, ( long ) removed, ( long ) before, ( long ) budget->used );
+        if ( budget->used > low ) {
+            budget->threshold *= 2;
+            warn ( "stats still over half the budget: dropping contexts seen fewer than %ld times.\n",
+                   ( long ) budget->threshold );
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * gather_patch_stats, inserting as update_patch_stats_shared if shared is
+ * not NULL, or within a budget if budget is not NULL (not both)
+ */
+static patch_node_t * gather_stats_into ( const image_t * pnoisy,
+                                          const image_t * pctximg,
+                                          const patch_template_t * ptpl,
+                                          patch_mapper_t mapper,
+                                          patch_node_t * ptree,
+                                          stats_inserter_t * shared,
+                                          stats_budget_t * budget ) {
+    const uint64_t t0 = instrument_now ( );
     register int i, j;
     const int m = pnoisy->info.height;
     const int n = pnoisy->info.width;
@@ -257,27 +633,115 @@ patch_node_t * gather_patch_stats ( const image_t * pnoisy,
     mctx.values = mctxval;
 
     linear_template_t * ltpl = linearize_template ( ptpl, m, n );
+    const patch_extractor_f extract = select_patch_extractor ( ptpl );
     if ( ptree == NULL ) {
         ptree = alloc_node( );
+        if ( budget ) {
+            budget->used += sizeof( patch_node_t );
+        }
+    }
+    index_t * used = budget ? &budget->used : NULL;
+    //
+    // the contexts of the pixels in uniform tiles are all zeros or all ones:
+    // they are counted by context and center value, and added at the end
+    //
+    tile_map_t * tiles = NULL, * ztiles = NULL;
+    index_t bulk[ 2 ][ 2 ] = { { 0, 0 }, { 0, 0 } };
+    if ( mapper == NULL ) {
+        index_t reach_i, reach_j;
+        template_reach ( ptpl, &reach_i, &reach_j );
+        tiles = create_tile_map ( pctximg, reach_i, reach_j );
+        ztiles = pnoisy == pctximg ? tiles : create_tile_map ( pnoisy, 0, 0 );
+    }
+    context_buffer_t * buffer = NULL;
+    if ( ( mapper == NULL ) && ( ptpl->k <= CONTEXT_BUFFER_BITS ) ) {
+        buffer = create_context_buffer ( ptpl->k );
     }
     for ( i = 0 ; i <  m ; ++i ) {
         //if (!(i % 500)) printf("%7d/%7d, #ctx=%ld avgcounts=%ld\n",i,m,num_ctx,(i*n+1)/(num_ctx+1));
-        for ( j = 0 ; j <  n ; ++j ) {
+        for ( j = 0 ; j <  n ; ) {
+            const int j1 = tiles ? tile_end ( tiles, j ) : n;
+            if ( tiles ) {
+                const int v = uniform_value ( tiles, i, j );
+                const int z = uniform_value ( ztiles, i, j );
+                if ( ( v >= 0 ) && ( z >= 0 ) ) {
+                    bulk[ v ][ z ] += j1 - j;
+                    j = j1;
+                    continue;
+                }
+            }
+            for ( ; j < j1 ; ++j ) {
 #if LINEARIZE
-            get_linear_patch ( pctximg, &ltpl, i, j, mapper, &ctx );
+                get_linear_patch ( pctximg, &ltpl, i, j, mapper, &ctx );
 #else
-            if ( mapper == NULL ) {
-                get_patch ( pctximg, ptpl, i, j, &mctx );
-            } else {
-                get_mapped_patch ( pctximg, ptpl, i, j, mapper, &ctx, &mctx );
+                if ( mapper == NULL ) {
+                    extract ( pctximg, ptpl, i, j, &mctx );
+                } else {
+                    get_mapped_patch ( pctximg, ptpl, i, j, mapper, &ctx, &mctx );
 
-            }
+                }
 #endif
-            const int z = get_pixel ( pnoisy, i, j );
-            update_patch_stats ( &mctx, z, ptree );
+                const int z = get_pixel ( pnoisy, i, j );
+                if ( buffer && !buffer->off ) {
+                    buffer_context ( buffer, &mctx, z, ptree, shared, used );
+                } else {
+                    insert_occurrences ( &mctx, 1, z, ptree, shared, used );
+                }
+            }
+        }
+        if ( buffer && budget ) {
+            flush_context_buffer ( buffer, ptree, shared, used );
+        }
+        if ( budget && budget->bytes && ( budget->used > budget->bytes ) ) {
+            enforce_stats_budget ( ptree, budget );
         }
     }
+    for ( int v = 0 ; v < 2 ; ++v ) {
+        for ( int z = 0 ; z < 2 ; ++z ) {
+            if ( bulk[ v ][ z ] ) {
+                for ( int r = 0 ; r < ptpl->k ; ++r ) {
+                    mctxval[ r ] = v;
+                }
+                insert_occurrences ( &mctx, bulk[ v ][ z ], z * bulk[ v ][ z ], ptree, shared, used );
+            }
+        }
+    }
+    if ( ztiles != tiles ) {
+        free_tile_map ( ztiles );
+    }
+    if ( buffer ) {
+        flush_context_buffer ( buffer, ptree, shared, used );
+    }
+    free_context_buffer ( buffer );
+    free_tile_map ( tiles );
     free_linear_template ( ltpl );
+    stage_done ( STAGE_STATS, t0 );
+    return ptree;
+}
+
+patch_node_t * gather_patch_stats ( const image_t * pnoisy,
+                                    const image_t * pctximg,
+                                    const patch_template_t * ptpl,
+                                    patch_mapper_t mapper,
+                                    patch_node_t * ptree ) {
+    return gather_stats_into ( pnoisy, pctximg, ptpl, mapper, ptree, NULL, NULL );
+}
+
+patch_node_t * gather_patch_stats_budget ( const image_t * pnoisy,
+                                           const image_t * pctximg,
+                                           const patch_template_t * ptpl,
+                                           patch_node_t * ptree,
+                                           stats_budget_t * budget ) {
+    return gather_stats_into ( pnoisy, pctximg, ptpl, NULL, ptree, NULL, budget );
+}
+
+patch_node_t * gather_patch_stats_shared ( const image_t * pnoisy,
+                                           const image_t * pctximg,
+                                           const patch_template_t * ptpl,
+                                           patch_node_t * ptree ) {
+    stats_inserter_t ins = { NULL };
+    ptree = gather_stats_into ( pnoisy, pctximg, ptpl, NULL, ptree, &ins, NULL );
+    release_stats_inserter ( &ins );
     return ptree;
 }
 
@@ -323,6 +787,35 @@ void summarize_stats ( patch_node_t * pnode, index_t* nleaves,  index_t* totoccu
 
 /*---------------------------------------------------------------------------------------*/
 
+void summarize_stats_weights ( const patch_node_t * pnode, const index_t weight, index_t* freq, index_t* freq1 ) {
+    if ( pnode->leaf ) {
+        freq[ weight ] += pnode->occu;
+        freq1[ weight ] += pnode->counts;
+    } else {
+        for ( int i = 0 ; i < ALPHA ; ++i ) {
+            if ( pnode->children[ i ] )  {
+                summarize_stats_weights ( pnode->children[ i ], weight + i, freq, freq1 );
+            }
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static index_t count_nodes ( const patch_node_t * pnode ) {
+    index_t n = 1;
+    if ( !pnode->leaf ) {
+        for ( int i = 0 ; i < ALPHA ; ++i ) {
+            if ( pnode->children[ i ] ) {
+                n += count_nodes ( pnode->children[ i ] );
+            }
+        }
+    }
+    return n;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
 void print_stats_summary ( patch_node_t * pnode, const char* prefix ) {
     index_t nleaves   = 0;
     index_t totoccu  = 0;
@@ -331,7 +824,9 @@ void print_stats_summary ( patch_node_t * pnode, const char* prefix ) {
     //
     //
     summarize_stats ( pnode, &nleaves, &totoccu, &totcount );
-    printf ( "%s leaves %10ld totoccu %10ld totcount %10ld\n", prefix, nleaves, totoccu, totcount );
+    const index_t nnodes = count_nodes ( pnode );
+    printf ( "%s leaves %10ld totoccu %10ld totcount %10ld nodes %10ld bytes %12ld\n", prefix, nleaves, totoccu, totcount,
+             nnodes, nnodes * ( index_t ) sizeof( patch_node_t ) );
     //
     //
     //
@@ -399,21 +894,67 @@ neighbor_list_t find_neighbors (
     const index_t ini_dist = 0;
     const index_t ini_pos  = 0;
     find_neighbors_inner ( &neighbors, ini_dist, ptree,  center, ini_pos, maxd );
+    count_events ( COUNTER_NEIGHBOR_VISITS, neighbors.number );
     return neighbors;
 }
 
 /*---------------------------------------------------------------------------------------*/
 
-static int comp_neigh ( const void* pa, const void* pb ) {
-    const neighbor_t* na = ( const neighbor_t* ) pa;
-    const neighbor_t* nb = ( const neighbor_t* ) pb;
-    return ( na->dist - nb->dist );
+/**
+ * like find_neighbors_inner, but keeps only the patches at the smallest distance
+ * found so far, which also bounds the search; the branch that agrees with the
+ * center is explored first so that close patches are found early
+ */
+static void find_nearest_inner (
+    neighbor_list_t* nlist,
+    const index_t dist,
+    patch_node_t* ptree,
+    const patch_t* center,
+    const index_t patch_pos,
+    index_t* best ) {
+    if ( ptree->leaf ) {
+        if ( dist == 0 ) { return; }
+        if ( dist < *best ) {
+            *best = dist;
+            nlist->number = 0;
+        }
+        nlist->neighbors[ nlist->number ].patch_node = ptree;
+        nlist->neighbors[ nlist->number++ ].dist = dist;
+        if ( nlist->number >= nlist->maxnumber ) {
+            nlist->maxnumber *= 2;
+            nlist->neighbors = ( neighbor_t* ) realloc ( nlist->neighbors, nlist->maxnumber * sizeof( neighbor_t ) );
+        }
+    } else {
+        const pixel_t val = center->values[ patch_pos ];
+        for ( int c = 0 ; c < ALPHA ; ++c ) {
+            const int i = c ? ( c == val ? 0 : c ) : val;
+            if ( !ptree->children[ i ] ) {
+                continue;
+            }
+            const index_t downdist = ( i == val ) ? dist : ( dist + 1 );
+            if ( downdist > *best )
+                continue;
+            find_nearest_inner ( nlist, downdist, ptree->children[ i ], center, patch_pos + 1, best );
+        }
+    }
 }
 
-/*---------------------------------------------------------------------------------------*/
-
-static void sort_neighbors ( neighbor_list_t ng ) {
-    qsort ( ng.neighbors, ng.number, sizeof( neighbor_t ), comp_neigh );
+/**
+ * the patches closest to the center (excluding itself), if they are
+ * at most maxd away
+ */
+static neighbor_list_t find_nearest (
+    patch_node_t* ptree,
+    const patch_t* center,
+    const index_t maxd ) {
+    neighbor_list_t neighbors;
+    neighbors.number = 0;
+    neighbors.maxnumber = 64; // starting size
+    neighbors.neighbors = ( neighbor_t* ) calloc ( neighbors.maxnumber, sizeof( neighbor_t ) );
+    index_t best = maxd;
+    find_nearest_inner ( &neighbors, 0, ptree, center, 0, &best );
+    count_events ( COUNTER_NEIGHBOR_VISITS, neighbors.number );
+    return neighbors;
 }
 
 /*---------------------------------------------------------------------------------------*/
@@ -580,19 +1121,23 @@ int save_stats ( const char * fname, const patch_node_t * ptree ) {
     //   encode occurences using 64 bits (pending: use Golomb)
     //   encode counts using 64 bits (pending: use Golomb)
     //
+    const uint64_t t0 = instrument_now ( );
     FILE* handle = fopen ( fname, "wb" );
     if ( !handle ) {
         fprintf ( stderr, "Error writing stats file %s.", fname );
         return -1;
     }
     save_node ( handle, ptree );
+    count_events ( COUNTER_BYTES_WRITTEN, ftell ( handle ) );
     fclose ( handle );
+    stage_done ( STAGE_WRITE, t0 );
     return 0;
 }
 
 /*---------------------------------------------------------------------------------------*/
 
 patch_node_t * load_stats ( const char * fname ) {
+    const uint64_t t0 = instrument_now ( );
     FILE* handle = fopen ( fname, "rb" );
     if ( !handle ) {
         fprintf ( stderr, "Error opening stats file %s.", fname );
@@ -600,12 +1145,361 @@ patch_node_t * load_stats ( const char * fname ) {
     }
     patch_node_t* ptree = alloc_node( );
     read_node ( handle, ptree );
+    count_events ( COUNTER_BYTES_READ, ftell ( handle ) );
     fclose ( handle );
+    stage_done ( STAGE_READ, t0 );
     return ptree;
 }
 
 /*---------------------------------------------------------------------------------------*/
 
+stats_reader_t * open_stats_reader ( const char * fname ) {
+    FILE* handle = fopen ( fname, "rb" );
+    if ( !handle ) {
+        error ( "could not open stats file %s.\n", fname );
+        return NULL;
+    }
+    stats_reader_t* r = ( stats_reader_t* ) calloc ( 1, sizeof( stats_reader_t ) );
+    r->handle = handle;
+    r->capacity = 64;
+    r->key = ( pixel_t* ) malloc ( r->capacity * sizeof( pixel_t ) );
+    r->next = ( int* ) malloc ( r->capacity * sizeof( int ) );
+    r->next[ 0 ] = 0;
+    r->depth = 0;
+    if ( read_bool ( handle ) ) { // the root must be an inner node
+        error ( "%s is not a stats file.\n", fname );
+        r->failed = 1;
+        r->depth = -1;
+    }
+    return r;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int stats_reader_next ( stats_reader_t * r ) {
+    FILE* handle = r->handle;
+    while ( r->depth >= 0 ) {
+        const index_t d = r->depth;
+        if ( r->next[ d ] == ALPHA ) { // done with this node
+            r->depth--;
+            continue;
+        }
+        const int i = r->next[ d ]++;
+        if ( !read_bool ( handle ) ) { // child not present
+            continue;
+        }
+        r->key[ d ] = i;
+        if ( read_bool ( handle ) ) { // leaf
+            if ( !r->k ) {
+                r->k = d + 1;
+            }
+            if ( r->k != d + 1 ) {
+                error ( "stats file mixes contexts of %ld and %ld samples.\n", ( long ) r->k, ( long ) d + 1 );
+                break;
+            }
+            r->occu   = read_count ( handle );
+            r->counts = read_count ( handle );
+            if ( feof ( handle ) || ferror ( handle ) ) {
+                break;
+            }
+            return 1;
+        }
+        if ( r->k && ( d + 1 >= r->k ) ) {
+            error ( "stats file has contexts longer than %ld samples.\n", ( long ) r->k );
+            break;
+        }
+        if ( d + 1 >= r->capacity ) {
+            r->capacity *= 2;
+            r->key = ( pixel_t* ) realloc ( r->key, r->capacity * sizeof( pixel_t ) );
+            r->next = ( int* ) realloc ( r->next, r->capacity * sizeof( int ) );
+        }
+        r->depth = d + 1;
+        r->next[ d + 1 ] = 0;
+    }
+    if ( r->depth >= 0 ) {
+        r->failed = 1;
+        r->depth = -1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int close_stats_reader ( stats_reader_t * r ) {
+    if ( !r ) {
+        return -1;
+    }
+    // a truncated file looks like absent children until the end
+    const int res = ( r->failed || ferror ( r->handle ) || feof ( r->handle ) ) ? -1 : 0;
+    count_events ( COUNTER_BYTES_READ, ftell ( r->handle ) );
+    fclose ( r->handle );
+    free ( r->next );
+    free ( r->key );
+    free ( r );
+    return res;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+stats_writer_t * open_stats_writer ( const char * fname, const index_t k ) {
+    FILE* handle = fopen ( fname, "wb" );
+    if ( !handle ) {
+        error ( "could not write stats file %s.\n", fname );
+        return NULL;
+    }
+    stats_writer_t* w = ( stats_writer_t* ) calloc ( 1, sizeof( stats_writer_t ) );
+    w->handle = handle;
+    w->k = k;
+    w->key = ( pixel_t* ) calloc ( k + 1, sizeof( pixel_t ) );
+    w->next = ( int* ) calloc ( k + 1, sizeof( int ) );
+    write_bool ( handle, 0 ); // root
+    return w;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** mark the children of the inner node at depth d that were not written as absent */
+static void close_writer_node ( stats_writer_t * w, const index_t d ) {
+    for ( ; w->next[ d ] < ALPHA ; w->next[ d ]++ ) {
+        write_bool ( w->handle, 0 );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int stats_writer_add ( stats_writer_t * w, const pixel_t * key, const index_t occu, const index_t counts ) {
+    const index_t k = w->k;
+    //
+    // the contexts share the path down to the depth c where they first differ
+    //
+    index_t c = 0;
+    if ( w->ncontexts ) {
+        while ( ( c < k ) && ( key[ c ] == w->key[ c ] ) ) {
+            c++;
+        }
+        if ( ( c == k ) || ( key[ c ] < w->key[ c ] ) ) {
+            error ( "stats contexts out of order.\n" );
+            w->failed = 1;
+            return -1;
+        }
+        for ( index_t d = k - 1 ; d > c ; --d ) {
+            close_writer_node ( w, d );
+        }
+    }
+    for ( index_t d = c ; d < k ; ++d ) {
+        if ( d > c ) {
+            write_bool ( w->handle, 0 ); // new inner node
+            w->next[ d ] = 0;
+        }
+        for ( ; w->next[ d ] < key[ d ] ; w->next[ d ]++ ) {
+            write_bool ( w->handle, 0 );
+        }
+        write_bool ( w->handle, 1 );
+        w->next[ d ]++;
+        w->key[ d ] = key[ d ];
+    }
+    write_bool ( w->handle, 1 ); // leaf
+    write_count ( w->handle, occu );
+    write_count ( w->handle, counts );
+    w->ncontexts++;
+    return 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int close_stats_writer ( stats_writer_t * w ) {
+    if ( !w ) {
+        return -1;
+    }
+    for ( index_t d = w->ncontexts ? w->k - 1 : 0 ; d >= 0 ; --d ) {
+        close_writer_node ( w, d );
+    }
+    count_events ( COUNTER_BYTES_WRITTEN, ftell ( w->handle ) );
+    int res = ferror ( w->handle ) || w->failed ? -1 : 0;
+    if ( fclose ( w->handle ) ) {
+        res = -1;
+    }
+    free ( w->next );
+    free ( w->key );
+    free ( w );
+    return res;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** -1, 0 or 1 as the current context of a is before, the same as or after that of b */
+static int compare_readers ( const stats_reader_t * a, const stats_reader_t * b ) {
+    for ( index_t d = 0 ; d < a->k ; ++d ) {
+        if ( a->key[ d ] != b->key[ d ] ) {
+            return a->key[ d ] < b->key[ d ] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * restore the order of a binary heap of readers (smallest context first)
+ * after its element at position i went up
+ */
+static void sift_readers ( stats_reader_t * * heap, const int n, int i ) {
+    while ( 1 ) {
+        const int l = 2 * i + 1, r = l + 1;
+        int m = i;
+        if ( ( l < n ) && ( compare_readers ( heap[ l ], heap[ m ] ) < 0 ) ) m = l;
+        if ( ( r < n ) && ( compare_readers ( heap[ r ], heap[ m ] ) < 0 ) ) m = r;
+        if ( m == i ) {
+            return;
+        }
+        stats_reader_t* t = heap[ i ];
+        heap[ i ] = heap[ m ];
+        heap[ m ] = t;
+        i = m;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int merge_stats_files ( const char * out, const char * const * in, const int nin ) {
+    const uint64_t t0 = instrument_now ( );
+    stats_reader_t* * readers = ( stats_reader_t* * ) calloc ( nin + 1, sizeof( stats_reader_t* ) );
+    stats_reader_t* * heap = ( stats_reader_t* * ) calloc ( nin + 1, sizeof( stats_reader_t* ) );
+    int res = 0, n = 0;
+    index_t k = 0;
+    //
+    // open all the inputs and read their first context; empty ones are left out
+    //
+    for ( int f = 0 ; f < nin ; ++f ) {
+        readers[ f ] = open_stats_reader ( in[ f ] );
+        if ( !readers[ f ] ) {
+            res = -1;
+            continue;
+        }
+        if ( !stats_reader_next ( readers[ f ] ) ) {
+            continue;
+        }
+        if ( k && ( readers[ f ]->k != k ) ) {
+            error ( "%s has contexts of %ld samples, not %ld.\n", in[ f ], ( long ) readers[ f ]->k, ( long ) k );
+            res = -1;
+            continue;
+        }
+        k = readers[ f ]->k;
+        heap[ n++ ] = readers[ f ];
+    }
+    stats_writer_t* w = res ? NULL : open_stats_writer ( out, k );
+    if ( w ) {
+        for ( int i = n / 2 - 1 ; i >= 0 ; --i ) {
+            sift_readers ( heap, n, i );
+        }
+        pixel_t* key = ( pixel_t* ) malloc ( ( k + 1 ) * sizeof( pixel_t ) );
+        while ( n > 0 ) {
+            //
+            // add up the smallest context over all the inputs that have it
+            //
+            memcpy ( key, heap[ 0 ]->key, k * sizeof( pixel_t ) );
+            index_t occu = 0, counts = 0;
+            do {
+                stats_reader_t* r = heap[ 0 ];
+                occu += r->occu;
+                counts += r->counts;
+                if ( !stats_reader_next ( r ) ) {
+                    heap[ 0 ] = heap[ --n ];
+                }
+                sift_readers ( heap, n, 0 );
+            } while ( ( n > 0 ) && !memcmp ( heap[ 0 ]->key, key, k * sizeof( pixel_t ) ) );
+            if ( stats_writer_add ( w, key, occu, counts ) ) {
+                break;
+            }
+        }
+        free ( key );
+        if ( close_stats_writer ( w ) ) {
+            res = -1;
+        }
+    } else {
+        res = -1;
+    }
+    for ( int f = 0 ; f < nin ; ++f ) {
+        if ( readers[ f ] && close_stats_reader ( readers[ f ] ) ) {
+            error ( "error reading stats file %s.\n", in[ f ] );
+            res = -1;
+        }
+    }
+    free ( heap );
+    free ( readers );
+    stage_done ( STAGE_STATS, t0 );
+    return res;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void stats_checkpoint_name ( char * name, const size_t size, const char * stats_file, const int full, const int done ) {
+    snprintf ( name, size, "%s.%s%07d", stats_file, full ? "checkpoint" : "delta", done );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void remove_stats_checkpoints ( const char * stats_file, const int period ) {
+    // resuming stops at the first missing one, so nothing past it is ever read
+    int removed = 1;
+    for ( int done = period ; removed ; done += period ) {
+        char full[ 1024 ], delta[ 1024 ];
+        stats_checkpoint_name ( full, 1024, stats_file, 1, done );
+        stats_checkpoint_name ( delta, 1024, stats_file, 0, done );
+        removed = !remove ( full );
+        removed = !remove ( delta ) || removed;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** 1 if the contexts of a stats file are of length k (or it has none) */
+static int stats_file_has_length ( const char * fname, const index_t k ) {
+    stats_reader_t* r = open_stats_reader ( fname );
+    if ( !r ) {
+        return 0;
+    }
+    const int ok = !stats_reader_next ( r ) ? !r->failed : ( r->k == k );
+    close_stats_reader ( r );
+    return ok;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int resume_stats_checkpoints ( const char * stats_file, const int period, const int npaths, const index_t k,
+                               patch_node_t * * stats ) {
+    int done = 0;
+    while ( done + period <= npaths ) {
+        char full[ 1024 ], delta[ 1024 ];
+        stats_checkpoint_name ( full, 1024, stats_file, 1, done + period );
+        stats_checkpoint_name ( delta, 1024, stats_file, 0, done + period );
+        FILE* f = NULL;
+        const char* fname = ( f = fopen ( full, "rb" ) ) ? full : ( ( f = fopen ( delta, "rb" ) ) ? delta : NULL );
+        if ( !fname ) {
+            break;
+        }
+        fclose ( f );
+        if ( !stats_file_has_length ( fname, k ) ) {
+            warn ( "checkpoint %s is not of this template; not resuming from it.\n", fname );
+            break;
+        }
+        patch_node_t* loaded = load_stats ( fname );
+        if ( !loaded ) {
+            break;
+        }
+        debug ( "resuming from %s\n", fname );
+        if ( fname == full ) {
+            free_stats ( *stats );
+            *stats = loaded;
+        } else {
+            merge_stats ( *stats, loaded, 1 );
+            free_stats ( loaded );
+        }
+        done += period;
+    }
+    return done;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
 patch_node_t * merge_stats ( patch_node_t* dest, const patch_node_t * src,
                              const int in_place ) {
     //printf("merge stats\n");
@@ -661,7 +1555,8 @@ void flatten_stats ( patch_node_t* node, patch_node_t* * node_list, index_t* pos
         node_list[ ( *pos )++ ] = node;
     } else {
         for ( int i = 0 ; i < ALPHA ; ++i )
-            flatten_stats ( node->children[ i ], node_list, pos );
+            if ( node->children[ i ] )
+                flatten_stats ( node->children[ i ], node_list, pos );
     }
 }
 
@@ -695,14 +1590,38 @@ patch_node_t * clone_stats ( patch_node_t* src ) {
 
 /*---------------------------------------------------------------------------------------*/
 
+/**
+ * add a cluster center with the given statistics to a tree of clusters,
+ * with room for its probability information (diff)
+ */
+static patch_node_t * add_cluster ( patch_node_t* clusters, const patch_t* center,
+                                    const index_t occu, const index_t counts ) {
+    patch_node_t* leaf = update_patch_stats ( center, 0, clusters );
+    leaf->occu = occu;
+    leaf->counts = counts;
+    leaf->diff = ( index_t* ) calloc ( center->k, sizeof( index_t ) );
+    leaf->diff_size = center->k;
+    account_memory ( 0, center->k * sizeof( index_t ) );
+    return leaf;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
 patch_node_t * cluster_stats (
     patch_node_t* in,
     const index_t K,
     const index_t maxd,
     const index_t minoccu,
     const index_t maxclusters ) {
-    // working copy; nodes get removed from it
-    patch_node_t* work = clone_stats ( in );
+    const uint64_t t0 = instrument_now ( );
+    //
+    // all the patches, in the order of the stats iterator
+    //
+    index_t nleaves = 0, totoccu = 0, totcount = 0;
+    summarize_stats ( in, &nleaves, &totoccu, &totcount );
+    patch_node_t* * leaves = ( patch_node_t* * ) malloc ( ( nleaves + 1 ) * sizeof( patch_node_t* ) );
+    index_t pos = 0;
+    flatten_stats ( in, leaves, &pos );
     // clusters are saved here
     patch_node_t* clusters = create_node ( NULL, 0, 0 );
     //
@@ -711,87 +1630,203 @@ patch_node_t * cluster_stats (
     // the expected value under a uniform distribution
     //  this is simply total_counts/2^{patch size}
     //
+    // they are taken in order in a single pass; the ones selected are
+    // marked by clearing their entry in the list
+    //
     //const index_t thres = noccu >> K;
     const index_t thres = minoccu;
     index_t nclusters = 0;
-    stats_iter_t* iter = stats_iter_create ( K );
-    stats_iter_begin ( iter, work );
-
-    while ( iter->node != NULL ) {
-        if ( nclusters > maxclusters ) {
-            break;
-        }
-        if ( iter->node->occu > thres ) {
+    patch_t* seed = alloc_patch ( K );
+    for ( index_t l = 0 ; ( l < nleaves ) && ( nclusters <= maxclusters ) ; ++l ) {
+        if ( leaves[ l ]->occu > thres ) {
             //
             // add to clusters
             //
-            patch_node_t* leaf = update_patch_stats ( iter->patch, 0, clusters );
-            leaf->occu = iter->node->occu;
-            leaf->counts = iter->node->counts;
+            get_leaf_patch ( seed, leaves[ l ] );
+            add_cluster ( clusters, seed, leaves[ l ]->occu, leaves[ l ]->counts );
             nclusters++;
-            //
-            // add probability information to node
-            //
-            leaf->diff = ( index_t* ) calloc ( K, sizeof( index_t ) );
-            //
-            // remove from candidates
-            // this invalidates the iterator
-            //
-            delete_node ( iter->node );
-            //
-            // restart iterator!
-            //
-            stats_iter_begin ( iter, work );
-        } else {
-            stats_iter_next ( iter );
+            leaves[ l ] = NULL;
         }
     }
-    patch_t* cluster_center = alloc_patch ( K );
+    free_patch ( seed );
     //
-    // now we assign the rest of the patches to the closest one in the cluster centers
+    // now we assign the rest of the patches to the closest one in the cluster centers;
+    // the cluster tree does not change shape, so this can be done concurrently;
+    // the closest clusters are found by multi-index hashing when K allows
     //
+    hamming_index_t* index = create_hamming_index ( clusters, K );
     index_t npoints = 0, nassigned = 0, ndiscarded = 0;
-    stats_iter_begin ( iter, work );
-    while ( iter->node != NULL ) {
-        npoints++;
-        neighbor_list_t ng = find_neighbors ( clusters, iter->patch, maxd ); // maximum distance: may need tuning
-        if ( ng.number > 0 ) {
-            nassigned++;
-            sort_neighbors ( ng );
-            const int min_dist = ng.neighbors[ 0 ].dist;
-            int nmin;
-            for ( nmin = 1 ; nmin < ng.number ; ++nmin ) {
-                if ( ng.neighbors[ nmin ].dist > min_dist ) {
-                    break;
-                }
+#ifdef PARALLEL
+    #pragma omp parallel reduction(+:npoints,nassigned,ndiscarded)
+#endif
+    {
+        patch_t* point = alloc_patch ( K );
+        patch_t* cluster_center = alloc_patch ( K );
+        hamming_query_t query;
+        void* query_work = NULL;
+        if ( index ) {
+            query_work = malloc ( hamming_query_workspace_size ( index ) );
+            init_hamming_query ( &query, index, query_work );
+        }
+#ifdef PARALLEL
+        #pragma omp for schedule(dynamic,256)
+#endif
+        for ( index_t l = 0 ; l < nleaves ; ++l ) {
+            const patch_node_t* node = leaves[ l ];
+            if ( node == NULL ) {
+                continue;
             }
-            //
-            // share stats with all the clusters at min distance
-            //
-            iter->node->occu /= nmin;
-            iter->node->counts /= nmin;
-            for ( int i = 0 ; i < nmin ; ++i ) {
-                patch_node_t* cluster_node = ng.neighbors[ i ].patch_node;
-                get_leaf_patch ( cluster_center, cluster_node );
-                patch_t* target_node = iter->patch;
-                cluster_node->occu += iter->node->occu;
-                cluster_node->counts += iter->node->counts;
-                for ( int r = 0 ; r < K ; ++r ) {
-                    if ( target_node->values[ r ] == cluster_center->values[ r ] ) {
-                        cluster_node->diff[ r ] += iter->node->occu;
+            npoints++;
+            get_leaf_patch ( point, node );
+            neighbor_list_t ng = index ? *hamming_nearest ( &query, point, 1, maxd ) // maximum distance: may need tuning
+                                       : find_nearest ( clusters, point, maxd );
+            if ( ng.number > 0 ) {
+                nassigned++;
+                const int nmin = ng.number;
+                //
+                // share stats with all the clusters at min distance
+                //
+                const index_t occu = node->occu / nmin;
+                const index_t counts = node->counts / nmin;
+                for ( int i = 0 ; i < nmin ; ++i ) {
+                    patch_node_t* cluster_node = ng.neighbors[ i ].patch_node;
+                    get_leaf_patch ( cluster_center, cluster_node );
+#ifdef PARALLEL
+                    #pragma omp atomic
+#endif
+                    cluster_node->occu += occu;
+#ifdef PARALLEL
+                    #pragma omp atomic
+#endif
+                    cluster_node->counts += counts;
+                    for ( int r = 0 ; r < K ; ++r ) {
+                        if ( point->values[ r ] == cluster_center->values[ r ] ) {
+#ifdef PARALLEL
+                            #pragma omp atomic
+#endif
+                            cluster_node->diff[ r ] += occu;
+                        }
                     }
                 }
+            } else {
+                ndiscarded++;
+            }
+            if ( !index ) {
+                free ( ng.neighbors );
             }
-        } else {
-            ndiscarded++;
         }
-        free ( ng.neighbors );
-        stats_iter_next ( iter );
+        free ( query_work );
+        free_patch ( cluster_center );
+        free_patch ( point );
     }
     printf ( "points %12ld assigned %12ld discarded %12ld\n", npoints, nassigned, ndiscarded );
-    free_patch ( cluster_center );
-    free_stats_iter ( iter );
-    free_node ( work );
+    free_hamming_index ( index );
+    free ( leaves );
+    stage_done ( STAGE_CLUSTER, t0 );
+    return clusters;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+#define CLUSTER_MAGIC "BDCLUST1"
+
+int save_clusters ( const char * fname, const patch_node_t * clusters, const cluster_params_t * par ) {
+    const uint64_t t0 = instrument_now ( );
+    FILE* handle = fopen ( fname, "wb" );
+    if ( !handle ) {
+        error ( "could not write cluster model %s.\n", fname );
+        return -1;
+    }
+    const index_t K = par->k;
+    index_t nclusters = 0, totoccu = 0, totcount = 0;
+    summarize_stats ( ( patch_node_t* ) clusters, &nclusters, &totoccu, &totcount );
+    patch_node_t* * leaves = ( patch_node_t* * ) malloc ( ( nclusters + 1 ) * sizeof( patch_node_t* ) );
+    index_t pos = 0;
+    flatten_stats ( ( patch_node_t* ) clusters, leaves, &pos );
+    fwrite ( CLUSTER_MAGIC, 1, 8, handle );
+    write_count ( handle, K );
+    write_count ( handle, par->maxd );
+    write_count ( handle, par->minoccu );
+    write_count ( handle, par->maxclusters );
+    write_count ( handle, nclusters );
+    patch_t* center = alloc_patch ( K );
+    unsigned char* bits = ( unsigned char* ) malloc ( ( K + 7 ) / 8 );
+    for ( index_t c = 0 ; c < nclusters ; ++c ) {
+        const patch_node_t* leaf = leaves[ c ];
+        get_leaf_patch ( center, leaf );
+        memset ( bits, 0, ( K + 7 ) / 8 );
+        for ( index_t r = 0 ; r < K ; ++r ) {
+            bits[ r >> 3 ] |= ( center->values[ r ] ? 1 : 0 ) << ( r & 7 );
+        }
+        fwrite ( bits, 1, ( K + 7 ) / 8, handle );
+        write_count ( handle, leaf->occu );
+        write_count ( handle, leaf->counts );
+        for ( index_t r = 0 ; r < K ; ++r ) {
+            write_count ( handle, ( leaf->diff && ( r < leaf->diff_size ) ) ? leaf->diff[ r ] : 0 );
+        }
+    }
+    free ( bits );
+    free_patch ( center );
+    free ( leaves );
+    count_events ( COUNTER_BYTES_WRITTEN, ftell ( handle ) );
+    const int res = fclose ( handle ) ? -1 : 0;
+    stage_done ( STAGE_WRITE, t0 );
+    return res;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+patch_node_t * load_clusters ( const char * fname, cluster_params_t * par ) {
+    const uint64_t t0 = instrument_now ( );
+    FILE* handle = fopen ( fname, "rb" );
+    if ( !handle ) {
+        error ( "could not open cluster model %s.\n", fname );
+        return NULL;
+    }
+    //
+    // the whole file is read at once
+    //
+    fseek ( handle, 0, SEEK_END );
+    const long size = ftell ( handle );
+    fseek ( handle, 0, SEEK_SET );
+    unsigned char* data = ( unsigned char* ) malloc ( size > 0 ? size : 1 );
+    const size_t nread = size > 0 ? fread ( data, 1, size, handle ) : 0;
+    fclose ( handle );
+    uint64_t head[ 5 ];
+    if ( ( size < 48 ) || ( nread != ( size_t ) size ) || memcmp ( data, CLUSTER_MAGIC, 8 ) ) {
+        error ( "%s is not a cluster model.\n", fname );
+        free ( data );
+        return NULL;
+    }
+    memcpy ( head, data + 8, sizeof( head ) );
+    const index_t K = head[ 0 ];
+    const index_t nclusters = head[ 4 ];
+    const size_t record = ( K + 7 ) / 8 + ( K + 2 ) * sizeof( uint64_t );
+    if ( ( K < 1 ) || ( ( size_t ) size != 48 + nclusters * record ) ) {
+        error ( "cluster model %s is truncated or corrupt.\n", fname );
+        free ( data );
+        return NULL;
+    }
+    par->k = K;
+    par->maxd = head[ 1 ];
+    par->minoccu = head[ 2 ];
+    par->maxclusters = head[ 3 ];
+    patch_node_t* clusters = create_node ( NULL, 0, 0 );
+    patch_t* center = alloc_patch ( K );
+    const unsigned char* p = data + 48;
+    for ( index_t c = 0 ; c < nclusters ; ++c, p += record ) {
+        for ( index_t r = 0 ; r < K ; ++r ) {
+            center->values[ r ] = ( p[ r >> 3 ] >> ( r & 7 ) ) & 1;
+        }
+        uint64_t v[ 2 ];
+        memcpy ( v, p + ( K + 7 ) / 8, sizeof( v ) );
+        patch_node_t* leaf = add_cluster ( clusters, center, v[ 0 ], v[ 1 ] );
+        memcpy ( leaf->diff, p + ( K + 7 ) / 8 + sizeof( v ), K * sizeof( uint64_t ) );
+    }
+    free_patch ( center );
+    free ( data );
+    count_events ( COUNTER_BYTES_READ, size );
+    stage_done ( STAGE_READ, t0 );
     return clusters;
 }
 
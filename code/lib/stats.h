@@ -1,5 +1,7 @@
 #ifndef STATS_H
 #define STATS_H
+#include <stdio.h>
+
 #include "patches.h"
 
 #define ALPHA 2
@@ -18,8 +20,35 @@ typedef struct patch_node {
     // in other points that now belong to this cluster
     index_t* diff;
     char leaf;  // 1 if this node is a leaf
+    int diff_size; // number of elements in diff (fits in the padding after leaf)
 } patch_node_t;
 
+/**
+ * memory held by the stats trees of the process
+ */
+typedef struct stats_memory {
+    index_t nodes;      // nodes alive in all the trees
+    index_t bytes;      // bytes held by those nodes and their cluster data
+    index_t peak_bytes; // largest value of bytes so far
+} stats_memory_t;
+
+/**
+ * memory budget of a stats tree gathered by gather_patch_stats_budget. Once
+ * the tree holds more than bytes, the contexts seen fewer than threshold
+ * times are dropped from it until it is back to half the budget; the
+ * threshold starts at 2 and doubles each time that is not enough. Only the
+ * bytes of that tree count, whatever other trees the process holds.
+ * Dropped contexts are missing from the tree afterwards, so this is only
+ * meant for building large models (e.g. gather_stats), not for methods
+ * that look up the context of every pixel.
+ */
+typedef struct stats_budget {
+    index_t bytes;      // 0: no limit
+    index_t used;       // bytes held by the tree
+    index_t threshold;  // contexts seen fewer times are dropped
+    index_t dropped;    // occurrences dropped so far
+} stats_budget_t;
+
 
 typedef struct neighbor {
     patch_node_t* patch_node;
@@ -37,6 +66,32 @@ typedef struct neighbor_list {
  * Flat structure to efficiently store and search for patches
  */
 
+stats_memory_t get_stats_memory ( void );
+
+/**
+ * an empty stats tree (just the root)
+ */
+patch_node_t * create_stats ( void );
+
+/**
+ * budget of about bytes (0: no limit) for the tree ptree, which may be NULL
+ * or already hold statistics. The tree must not change other than through
+ * gather_patch_stats_budget with this budget while it is in use.
+ */
+void init_stats_budget ( stats_budget_t * budget, const index_t bytes, const patch_node_t * ptree );
+
+/**
+ * bytes held by the nodes of a tree and their cluster data
+ */
+index_t stats_bytes ( const patch_node_t * ptree );
+
+/**
+ * remove the leaves seen fewer than minoccu times, and the inner nodes
+ * left without children. The occurrences of the ancestors are updated.
+ * @return number of occurrences removed
+ */
+index_t prune_rare_stats ( patch_node_t * ptree, const index_t minoccu );
+
 void free_node ( patch_node_t * node );
 
 void delete_node ( patch_node_t * node );
@@ -61,6 +116,72 @@ patch_node_t * gather_patch_stats ( const image_t * pnoisy,
                                     patch_mapper_t mapper,
                                     patch_node_t * ptree );
 
+/**
+ * same as gather_patch_stats without a mapper, keeping the tree within a
+ * budget (see stats_budget_t)
+ */
+patch_node_t * gather_patch_stats_budget ( const image_t * pnoisy,
+                                           const image_t * pctx,
+                                           const patch_template_t * ptpl,
+                                           patch_node_t * ptree,
+                                           stats_budget_t * budget );
+
+/**
+ * same as gather_patch_stats without a mapper, inserting with
+ * update_patch_stats_shared, so that several threads can gather their
+ * images into the same tree at once.
+ */
+patch_node_t * gather_patch_stats_shared ( const image_t * pnoisy,
+                                           const image_t * pctx,
+                                           const patch_template_t * ptpl,
+                                           patch_node_t * ptree );
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * add one occurrence of the context pctx, with center z, to the tree, creating
+ * its nodes if needed
+ * @return the leaf of the context
+ */
+patch_node_t * update_patch_stats ( const patch_t * pctx, const pixel_t z, patch_node_t * ptree );
+
+/**
+ * same as count calls to update_patch_stats
+ */
+patch_node_t * add_patch_stats ( const patch_t * pctx, const pixel_t z, const index_t count, patch_node_t * ptree );
+
+/**
+ * add occu occurrences of the context pctx, counts of them with center 1
+ */
+patch_node_t * add_context_stats ( const patch_t * pctx, const index_t occu, const index_t counts, patch_node_t * ptree );
+
+/**
+ * state of a thread inserting into a tree shared with other threads: the
+ * node it allocated but lost to another thread, to be used for its next
+ * new node. Starts zeroed; release_stats_inserter frees the node.
+ */
+typedef struct stats_inserter {
+    patch_node_t * spare;
+} stats_inserter_t;
+
+/**
+ * same as update_patch_stats, but safe to call from several threads on the
+ * same tree, each with its own inserter. Children are linked by atomic
+ * compare-and-swap and the counts are added atomically, so the tree ends up
+ * the same as if the calls had been made one after the other. No other
+ * operation may use the tree meanwhile.
+ */
+patch_node_t * update_patch_stats_shared ( const patch_t * pctx, const pixel_t z, patch_node_t * ptree,
+                                          stats_inserter_t * ins );
+
+/**
+ * same as add_context_stats, as update_patch_stats_shared
+ */
+patch_node_t * add_context_stats_shared ( const patch_t * pctx, const index_t occu, const index_t counts,
+                                         patch_node_t * ptree, stats_inserter_t * ins );
+
+void release_stats_inserter ( stats_inserter_t * ins );
+
 /*---------------------------------------------------------------------------------------*/
 
 index_t get_patch_stats ( const patch_node_t * ptree, const patch_t * pctx );
@@ -103,6 +224,15 @@ void summarize_stats ( patch_node_t * pnode, index_t* nleaves, index_t* totoccu,
 
 /*---------------------------------------------------------------------------------------*/
 
+/**
+ * add the occurences of the contexts of each weight (number of 1s) to freq,
+ * and the number of those in which the center was 1 to freq1; both of size k + 1.
+ * Call with weight = 0 on the root.
+ */
+void summarize_stats_weights ( const patch_node_t * pnode, const index_t weight, index_t* freq, index_t* freq1 );
+
+/*---------------------------------------------------------------------------------------*/
+
 /**
  * Print a patch tree with its counts
  */
@@ -125,6 +255,101 @@ int save_stats ( const char * fname, const patch_node_t * stats );
 
 patch_node_t * merge_stats ( patch_node_t* dest, const patch_node_t * src, const int in_place );
 
+/*---------------------------------------------------------------------------------------*/
+/*
+ * streaming access to stats files
+ *
+ * save_stats writes the tree depth first, children in increasing order of
+ * their value, so the contexts of a stats file come in increasing
+ * lexicographic order of their samples (the order of their keys, packing
+ * the first sample in the most significant bit). The readers and the
+ * writer below go through the contexts in that order keeping only the
+ * path to the current one, which lets stats files of any size be merged
+ * in bounded memory; the writer produces the same bytes as save_stats.
+ */
+
+/** reads the contexts of a stats file one at a time, in order */
+typedef struct stats_reader {
+    FILE * handle;
+    index_t k;          // depth of the contexts, known after the first one
+    index_t depth;      // depth of the inner node being read, -1 at the end
+    index_t capacity;   // size of key and next
+    pixel_t * key;      // samples of the current context
+    int * next;         // next child to read at each depth
+    index_t occu;       // occurrences and counts of the current context
+    index_t counts;
+    int failed;
+} stats_reader_t;
+
+stats_reader_t * open_stats_reader ( const char * fname );
+
+/**
+ * advance to the next context
+ * @return 1 if there is one, 0 at the end of the file or on error (see failed)
+ */
+int stats_reader_next ( stats_reader_t * r );
+
+/** @return 0 if the whole file was read without errors */
+int close_stats_reader ( stats_reader_t * r );
+
+/** writes contexts of k samples, given in increasing order, as a stats file */
+typedef struct stats_writer {
+    FILE * handle;
+    index_t k;
+    index_t ncontexts;
+    pixel_t * key;      // last context written
+    int * next;         // next child to write at each depth
+    int failed;
+} stats_writer_t;
+
+stats_writer_t * open_stats_writer ( const char * fname, const index_t k );
+
+/**
+ * append a context; it must come after the previous one
+ * @return 0 on success
+ */
+int stats_writer_add ( stats_writer_t * w, const pixel_t * key, const index_t occu, const index_t counts );
+
+/** @return 0 if the whole file was written without errors */
+int close_stats_writer ( stats_writer_t * w );
+
+/**
+ * merge any number of stats files into one, adding the occurrences and
+ * counts of the contexts they share; the result is the same as saving the
+ * merge_stats of all of them, but only one context of each file is held
+ * in memory at a time
+ * @return 0 on success
+ */
+int merge_stats_files ( const char * out, const char * const * in, const int nin );
+
+/*---------------------------------------------------------------------------------------*/
+/*
+ * checkpoints of a stats file gathered from a file list in batches of
+ * period entries: <stats>.checkpoint%07d holds all the stats after that
+ * many entries, <stats>.delta%07d those of the batch ending there. A run
+ * writes them one after the other, so they always start at period and
+ * have no gaps.
+ */
+
+/** name of the checkpoint of stats_file after done entries (full or delta) */
+void stats_checkpoint_name ( char * name, const size_t size, const char * stats_file, const int full, const int done );
+
+/**
+ * remove the checkpoints of stats_file, so that a new run does not resume
+ * from those of another one
+ */
+void remove_stats_checkpoints ( const char * stats_file, const int period );
+
+/**
+ * rebuild the stats of an interrupted run from its checkpoints: a full one
+ * replaces the stats, a delta is added to them. Stops at the first missing
+ * one, at one past the npaths entries of the list, and at one whose
+ * contexts are not of length k.
+ * @return number of entries of the file list the checkpoints cover
+ */
+int resume_stats_checkpoints ( const char * stats_file, const int period, const int npaths, const index_t k,
+                               patch_node_t * * stats );
+
 /*---------------------------------------------------------------------------------------*/
 
 /** strategy for pruning a node */
@@ -148,6 +373,34 @@ patch_node_t * cluster_stats (
 
 /*---------------------------------------------------------------------------------------*/
 
+/** parameters cluster_stats was called with, as kept in a cluster model file */
+typedef struct cluster_params {
+    index_t k;
+    index_t maxd;
+    index_t minoccu;
+    index_t maxclusters;
+} cluster_params_t;
+
+/**
+ * save the output of cluster_stats, with the diff counts of each cluster,
+ * to a cluster model file:
+ *
+ *   "BDCLUST1", then k, maxd, minoccu, maxclusters and the number of
+ *   clusters as 64 bit integers; then, for each cluster in the order of
+ *   the tree, its center with one bit per sample (k/8 bytes, rounded up),
+ *   occurrences, counts and the k diff counts as 64 bit integers.
+ */
+int save_clusters ( const char * fname, const patch_node_t * clusters, const cluster_params_t * par );
+
+/**
+ * load a cluster model file written by save_clusters
+ * @param par filled with the parameters the clusters were computed with
+ * @return NULL if the file cannot be read
+ */
+patch_node_t * load_clusters ( const char * fname, cluster_params_t * par );
+
+/*---------------------------------------------------------------------------------------*/
+
 void test_stats_iter ( index_t k, patch_node_t* tree );
 
 #endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "context_sums.h"
+#include "quorum.h"
+#include "patches.h"
+#include "workspace.h"
+#include "instrument.h"
+#include "template_kernels.h"
+#include "tile_map.h"
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t sweep_workspace_size ( const image_info_t * info, const patch_template_t * tpl, const sweep_method_t method ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    if ( method == SWEEP_DUDE ) {
+        return workspace_round ( npixels * sizeof( const patch_node_t * ) );
+    }
+    return workspace_round ( npixels * sizeof( uint32_t ) )
+         + 2 * workspace_round ( ( tpl->k + 1 ) * sizeof( index_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_sweep ( sweep_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                  const sweep_method_t method, void * workspace ) {
+    const size_t npixels = ( size_t ) info->width * ( size_t ) info->height;
+    char * pos = ( char * ) workspace;
+    ctx->method = method;
+    ctx->tpl = tpl;
+    ctx->npixels = npixels;
+    ctx->sums = NULL;
+    ctx->quorum_freq = ctx->quorum_freq_1 = NULL;
+    ctx->stats = NULL;
+    ctx->nodes = NULL;
+    if ( method == SWEEP_DUDE ) {
+        ctx->nodes = ( const patch_node_t ** ) workspace_take ( &pos, npixels * sizeof( const patch_node_t * ) );
+    } else {
+        ctx->sums          = ( uint32_t * ) workspace_take ( &pos, npixels * sizeof( uint32_t ) );
+        ctx->quorum_freq   = ( index_t * ) workspace_take ( &pos, ( tpl->k + 1 ) * sizeof( index_t ) );
+        ctx->quorum_freq_1 = ( index_t * ) workspace_take ( &pos, ( tpl->k + 1 ) * sizeof( index_t ) );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** quorum of every pixel, and histograms of the quorum values */
+static void gather_quorum ( sweep_ctx_t * ctx, const image_t * in ) {
+    const uint64_t t0 = instrument_now ( );
+    const index_t n = in->info.width;
+    const index_t m = in->info.height;
+    const index_t k = ctx->tpl->k;
+    char * work = ( char * ) malloc ( workspace_round ( n * sizeof( uint32_t ) )
+                                    + context_sums_workspace_size ( &in->info, ctx->tpl ) );
+    char * pos = work;
+    uint32_t * sums_row = ( uint32_t * ) workspace_take ( &pos, n * sizeof( uint32_t ) );
+    context_sums_t cs;
+    init_context_sums ( &cs, &in->info, ctx->tpl, pos );
+    memset ( ctx->quorum_freq,   0, ( k + 1 ) * sizeof( index_t ) );
+    memset ( ctx->quorum_freq_1, 0, ( k + 1 ) * sizeof( index_t ) );
+    for ( index_t i = 0, li = 0 ; i < m ; ++i ) {
+        context_sums_row ( &cs, in, i, sums_row );
+        for ( index_t j = 0 ; j < n ; ++j, ++li ) {
+            const uint32_t a = sums_row[ j ];
+            ctx->sums[ li ] = a;
+            ctx->quorum_freq[ a ]++;
+            if ( in->pixels[ li ] ) {
+                ctx->quorum_freq_1[ a ]++;
+            }
+        }
+    }
+    free ( work );
+    stage_done ( STAGE_STATS, t0 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** context statistics, and the node of the context of every pixel */
+static void gather_nodes ( sweep_ctx_t * ctx, const image_t * in ) {
+    const int m = in->info.height;
+    const int n = in->info.width;
+    ctx->stats = gather_patch_stats ( in, in, ctx->tpl, NULL, NULL );
+    const uint64_t t0 = instrument_now ( );
+    patch_t * p = alloc_patch ( ctx->tpl->k );
+    const patch_extractor_f extract = select_patch_extractor ( ctx->tpl );
+    index_t reach_i, reach_j;
+    template_reach ( ctx->tpl, &reach_i, &reach_j );
+    tile_map_t * tiles = create_tile_map ( in, reach_i, reach_j );
+    for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        for ( int j = 0 ; j < n ; ++j, ++li ) {
+            if ( ( j % TILE_SIZE ) && ( uniform_value ( tiles, i, j ) >= 0 ) ) {
+                ctx->nodes[ li ] = ctx->nodes[ li - 1 ]; // same context as the left neighbor
+                continue;
+            }
+            extract ( in, ctx->tpl, i, j, p );
+            ctx->nodes[ li ] = get_patch_node_const ( ctx->stats, p );
+        }
+    }
+    free_tile_map ( tiles );
+    free_patch ( p );
+    stage_done ( STAGE_STATS, t0 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void sweep_gather ( sweep_ctx_t * ctx, const image_t * in ) {
+    sweep_release ( ctx );
+    if ( ctx->method == SWEEP_DUDE ) {
+        gather_nodes ( ctx, in );
+    } else {
+        gather_quorum ( ctx, in );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** tally one decision x on noisy pixel z, against clean pixel c if there is one */
+static inline void tally ( const pixel_t x, const pixel_t z, const image_t * clean, const index_t li,
+                           sweep_result_t * res ) {
+    res->changed += ( x != z );
+    if ( clean ) {
+        const pixel_t c = clean->pixels[ li ];
+        res->errors01 += ( c == 0 ) && ( x != 0 );
+        res->errors10 += ( c != 0 ) && ( x == 0 );
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void sweep_apply ( const sweep_ctx_t * ctx, const sweep_point_t * point, const image_t * in,
+                   image_t * out, const image_t * clean, sweep_result_t * res ) {
+    const index_t npixels = ctx->npixels;
+    const pixel_t * z = in->pixels;
+    const uint64_t t_start = instrument_now ( );
+    memset ( res, 0, sizeof( sweep_result_t ) );
+    if ( ctx->method == SWEEP_DUDE ) {
+        //
+        // same thresholds and comparisons as dude_apply
+        //
+        const double p0 = point->p01;
+        const double p1 = point->p10;
+        const double t0 = 2.0*p1*(1.0-p0) / ( 1.0+p1-p0);
+        const double t1 = 2.0*p0*(1.0-p1) / ( 1.0+p0-p1);
+        for ( index_t li = 0 ; li < npixels ; ++li ) {
+            const patch_node_t * node = ctx->nodes[ li ];
+            pixel_t x = z[ li ];
+            if ( !x ) {
+                const double n0 = (double)(node->occu-node->counts);
+                x = n0 < (t0 * (double)node->occu);
+            } else {
+                const double n1 = (double)node->counts;
+                x = !(n1 < (t1 * (double)node->occu));
+            }
+            if ( out ) {
+                out->pixels[ li ] = x;
+            }
+            tally ( x, z[ li ], clean, li, res );
+        }
+    } else {
+        const index_t k = ctx->tpl->k;
+        char * lookup_table = ( char * ) malloc ( 2 * ( k + 1 ) * sizeof( char ) );
+        quorum_lookup_table ( ctx->quorum_freq, ctx->quorum_freq_1, k, npixels,
+                              point->p01, point->p10, lookup_table );
+        for ( index_t li = 0 ; li < npixels ; ++li ) {
+            const pixel_t x = lookup_table[ ( ctx->sums[ li ] << 1 ) + z[ li ] ];
+            if ( out ) {
+                out->pixels[ li ] = x;
+            }
+            tally ( x, z[ li ], clean, li, res );
+        }
+        free ( lookup_table );
+    }
+    res->errors = res->errors01 + res->errors10;
+    count_events ( COUNTER_PIXELS_CHANGED, res->changed );
+    stage_done ( STAGE_APPLY, t_start );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void sweep_release ( sweep_ctx_t * ctx ) {
+    if ( ctx->stats ) {
+        free_node ( ctx->stats );
+        ctx->stats = NULL;
+    }
+}
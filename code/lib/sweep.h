@@ -0,0 +1,97 @@
+/**
+ * \file sweep.h
+ * \brief Evaluation of a grid of channel parameters on the same statistics
+ *
+ * The context statistics of a noisy image depend only on the image and the
+ * template; the channel parameters p01 and p10 only move the thresholds of
+ * the decision rule. A sweep therefore makes a single context pass over the
+ * image, keeping for each pixel what the rule needs (its quorum for the
+ * quorum denoiser, its context node for DUDE), and then denoises the image
+ * for each pair of parameters with one cheap pass over those values.
+ *
+ * Each point of the sweep corresponds to a single iteration of quorum_den or
+ * bin_dude on the noisy image.
+ */
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdint.h>
+
+#include "image.h"
+#include "templates.h"
+#include "stats.h"
+
+typedef enum sweep_method {
+    SWEEP_QUORUM = 0,
+    SWEEP_DUDE   = 1
+} sweep_method_t;
+
+/**
+ * channel parameters of one point of the sweep
+ */
+typedef struct sweep_point {
+    double p01; // P(0->1)
+    double p10; // P(1->0)
+} sweep_point_t;
+
+/**
+ * outcome of one point of the sweep
+ */
+typedef struct sweep_result {
+    /** pixels changed with respect to the noisy image */
+    index_t changed;
+    /** pixels that differ from the clean image, if given: total, clean 0 denoised as 1, clean 1 denoised as 0 */
+    index_t errors;
+    index_t errors01;
+    index_t errors10;
+} sweep_result_t;
+
+/**
+ * sweep context; the per-pixel buffers point into the caller's workspace
+ */
+typedef struct sweep_ctx {
+    sweep_method_t method;
+    const patch_template_t * tpl;
+    index_t npixels;
+    /** quorum of each pixel (m x n), and histograms of the quorum values (size k + 1); quorum only */
+    uint32_t * sums;
+    index_t * quorum_freq;
+    index_t * quorum_freq_1;
+    /** context statistics, and the context node of each pixel (m x n); DUDE only */
+    patch_node_t * stats;
+    const patch_node_t ** nodes;
+} sweep_ctx_t;
+
+/**
+ * size in bytes of the workspace required for images of the given size
+ */
+size_t sweep_workspace_size ( const image_info_t * info, const patch_template_t * tpl, const sweep_method_t method );
+
+/**
+ * prepare a context for images of the given size;
+ * the template and the workspace must outlive the context
+ */
+void init_sweep ( sweep_ctx_t * ctx, const image_info_t * info, const patch_template_t * tpl,
+                  const sweep_method_t method, void * workspace );
+
+/**
+ * the context pass: gather the statistics of the noisy image
+ * and record what each pixel needs for the decision rule
+ */
+void sweep_gather ( sweep_ctx_t * ctx, const image_t * in );
+
+/**
+ * denoise the image with the given parameters using the gathered statistics.
+ * Safe to call concurrently on the same context.
+ * @param out denoised image, or NULL if only the result is wanted
+ * @param clean clean image against which errors are counted, or NULL
+ */
+void sweep_apply ( const sweep_ctx_t * ctx, const sweep_point_t * point, const image_t * in,
+                   image_t * out, const image_t * clean, sweep_result_t * res );
+
+/**
+ * free the statistics gathered by sweep_gather
+ */
+void sweep_release ( sweep_ctx_t * ctx );
+
+#endif
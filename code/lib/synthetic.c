@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "synthetic.h"
+#include "pnm.h"
+#include "workspace.h"
+
+/* paragraphs have 3 to MAX_LINES lines */
+#define MAX_LINES 12
+
+/*---------------------------------------------------------------------------------------*/
+
+void default_synth_params ( synth_params_t * par, const int dpi ) {
+    par->width = ( int ) ( 8.27 * dpi + 0.5 );   // A4
+    par->height = ( int ) ( 11.69 * dpi + 0.5 );
+    par->seed = 42;
+    par->xheight = dpi / 15 > 2 ? dpi / 15 : 2;
+    par->p_rule = 0.1;
+    par->p_halftone = 0.15;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/** tallest block: a paragraph of MAX_LINES lines plus the space after it */
+static int band_capacity ( const synth_params_t * par ) {
+    return ( 3 * MAX_LINES + 1 ) * par->xheight;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+size_t synth_workspace_size ( const synth_params_t * par ) {
+    return workspace_round ( ( size_t ) band_capacity ( par ) * par->width * sizeof( pixel_t ) );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void init_synth_page ( synth_page_t * page, const synth_params_t * par, void * workspace ) {
+    char * pos = ( char * ) workspace;
+    page->par = *par;
+    seed_rand48 ( &page->rng, par->seed );
+    page->margin = par->width / 12;
+    page->row = 0;
+    page->band_capacity = band_capacity ( par );
+    page->band = ( pixel_t * ) workspace_take ( &pos, ( size_t ) page->band_capacity * par->width * sizeof( pixel_t ) );
+    page->band_rows = 0;
+    page->band_pos = 0;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static void fill_rect ( synth_page_t * page, int i0, int j0, int h, int w ) {
+    const int n = page->par.width;
+    const int i1 = i0 + h < page->band_rows ? i0 + h : page->band_rows;
+    const int j1 = j0 + w < n ? j0 + w : n;
+    for ( int i = i0 > 0 ? i0 : 0 ; i < i1 ; ++i ) {
+        pixel_t * row = page->band + ( index_t ) i * n;
+        for ( int j = j0 > 0 ? j0 : 0 ; j < j1 ; ++j ) {
+            row[ j ] = 1;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * one line of words with its baseline at row base, between columns j0 and j1;
+ * glyphs are random combinations of stems, bars, ascenders and descenders
+ */
+static void draw_text_line ( synth_page_t * page, const int base, const int j0, const int j1 ) {
+    rand48_t * rng = &page->rng;
+    const int xh = page->par.xheight;
+    const double s = xh / 20.0;
+    const int stem = s * 3 > 1 ? ( int ) ( s * 3 + 0.5 ) : 1;
+    const int gap = s * 3 > 1 ? ( int ) ( s * 3 + 0.5 ) : 1;
+    int j = j0;
+    while ( j < j1 ) {
+        const int nglyphs = 2 + ( int ) ( 8 * next_rand48 ( rng ) );
+        for ( int g = 0 ; ( g < nglyphs ) && ( j < j1 ) ; ++g ) {
+            const int w = ( int ) ( ( 10 + 6 * next_rand48 ( rng ) ) * s ) + stem;
+            const int top = next_rand48 ( rng ) < 0.3 ? base - 2 * xh : base - xh;
+            const int bot = next_rand48 ( rng ) < 0.1 ? base + xh / 2 : base;
+            fill_rect ( page, top, j, bot - top, stem );
+            if ( next_rand48 ( rng ) < 0.6 ) {
+                fill_rect ( page, base - xh, j + w - stem, xh, stem );
+            }
+            if ( next_rand48 ( rng ) < 0.5 ) {
+                fill_rect ( page, base - xh, j, stem, w );
+            }
+            if ( next_rand48 ( rng ) < 0.4 ) {
+                fill_rect ( page, base - stem, j, stem, w );
+            }
+            j += w + gap;
+        }
+        j += 4 * gap; // space between words
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * clustered-dot halftone of a smoothly varying gray: one dot per cell,
+ * with an area proportional to the gray level
+ */
+static void draw_halftone ( synth_page_t * page, const int i0, const int j0, const int h, const int w ) {
+    rand48_t * rng = &page->rng;
+    const int n = page->par.width;
+    const int cell = page->par.xheight / 3 > 4 ? page->par.xheight / 3 : 4;
+    const double fi = ( 1.0 + 2.0 * next_rand48 ( rng ) ) * M_PI / h;
+    const double fj = ( 1.0 + 2.0 * next_rand48 ( rng ) ) * M_PI / w;
+    const double ph_i = 2.0 * M_PI * next_rand48 ( rng );
+    const double ph_j = 2.0 * M_PI * next_rand48 ( rng );
+    for ( int i = 0 ; i < h ; ++i ) {
+        pixel_t * row = page->band + ( index_t ) ( i0 + i ) * n + j0;
+        const int ci = i / cell;
+        const double di = i - ( ci + 0.5 ) * cell;
+        for ( int j = 0 ; j < w ; ++j ) {
+            const int cj = j / cell;
+            const double dj = j - ( cj + 0.5 ) * cell;
+            // gray level of the cell, in [0,1]
+            const double gray = 0.5 + 0.25 * cos ( fi * ( ci + 0.5 ) * cell + ph_i )
+                                    + 0.25 * cos ( fj * ( cj + 0.5 ) * cell + ph_j );
+            row[ j ] = ( di * di + dj * dj ) < gray * cell * cell / M_PI;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * lay out and draw the next block of the page in the band
+ */
+static void next_block ( synth_page_t * page ) {
+    rand48_t * rng = &page->rng;
+    const int n = page->par.width;
+    const int xh = page->par.xheight;
+    const int margin = page->margin;
+    const int left = margin;
+    const int right = n - margin;
+    const int remaining = page->par.height - margin - page->row; // rows left for content
+    page->band_pos = 0;
+    if ( page->row < margin ) {
+        page->band_rows = margin - page->row < page->band_capacity ? margin - page->row : page->band_capacity;
+        memset ( page->band, 0, ( size_t ) page->band_rows * n * sizeof( pixel_t ) );
+        return;
+    }
+    //
+    // block type and height, including the space after it
+    //
+    const double u = next_rand48 ( rng );
+    int type = 0, h = 0, nlines = 0;
+    if ( u < page->par.p_rule ) {
+        type = 1;
+        h = 3 * xh;
+    } else if ( u < page->par.p_rule + page->par.p_halftone ) {
+        type = 2;
+        h = ( int ) ( ( 6 + 18 * next_rand48 ( rng ) ) * xh );
+        if ( h + 2 * xh > remaining ) {
+            h = remaining - 2 * xh;
+        }
+        if ( h < 4 * xh ) {
+            h = 0;
+        } else {
+            h += 2 * xh;
+        }
+    } else {
+        nlines = 3 + ( int ) ( ( MAX_LINES - 2 ) * next_rand48 ( rng ) );
+        if ( nlines * 3 * xh + xh > remaining ) {
+            nlines = ( remaining - xh ) / ( 3 * xh );
+        }
+        h = nlines > 0 ? nlines * 3 * xh + xh : 0;
+    }
+    if ( ( h <= 0 ) || ( h > remaining ) ) {
+        // nothing else fits: blank up to the end of the page
+        const int rest = page->par.height - page->row;
+        page->band_rows = rest < page->band_capacity ? rest : page->band_capacity;
+        memset ( page->band, 0, ( size_t ) page->band_rows * n * sizeof( pixel_t ) );
+        return;
+    }
+    page->band_rows = h;
+    memset ( page->band, 0, ( size_t ) h * n * sizeof( pixel_t ) );
+    if ( type == 1 ) {
+        const int thick = 1 + ( int ) ( xh / 10 + next_rand48 ( rng ) * xh / 5 );
+        const int w = ( int ) ( ( 0.3 + 0.7 * next_rand48 ( rng ) ) * ( right - left ) );
+        fill_rect ( page, xh, left, thick, w );
+    } else if ( type == 2 ) {
+        const int w = ( int ) ( ( 0.3 + 0.7 * next_rand48 ( rng ) ) * ( right - left ) );
+        const int j0 = left + ( int ) ( next_rand48 ( rng ) * ( right - left - w ) );
+        draw_halftone ( page, xh, j0, h - 2 * xh, w );
+    } else {
+        for ( int l = 0 ; l < nlines ; ++l ) {
+            const int j0 = l == 0 ? left + 3 * xh : left;
+            const int j1 = l == nlines - 1 ? left + ( int ) ( ( 0.3 + 0.6 * next_rand48 ( rng ) ) * ( right - left ) ) : right;
+            draw_text_line ( page, l * 3 * xh + 2 * xh, j0, j1 );
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+int synth_rows ( synth_page_t * page, const int nrows, pixel_t * rows ) {
+    const int n = page->par.width;
+    int r = 0;
+    while ( ( r < nrows ) && ( page->row < page->par.height ) ) {
+        if ( page->band_pos == page->band_rows ) {
+            next_block ( page );
+        }
+        int take = page->band_rows - page->band_pos;
+        if ( take > nrows - r ) {
+            take = nrows - r;
+        }
+        if ( take > page->par.height - page->row ) {
+            take = page->par.height - page->row;
+        }
+        memcpy ( rows + ( index_t ) r * n, page->band + ( index_t ) page->band_pos * n,
+                 ( size_t ) take * n * sizeof( pixel_t ) );
+        page->band_pos += take;
+        page->row += take;
+        r += take;
+    }
+    return r;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+image_t * synthetic_document ( const synth_params_t * par ) {
+    image_t * img = ( image_t * ) malloc ( sizeof( image_t ) );
+    img->info.width = par->width;
+    img->info.height = par->height;
+    img->info.channels = 1;
+    img->info.type = 4;
+    img->info.depth = 1;
+    img->info.maxval = 1;
+    img->info.result = RESULT_OK;
+    img->info.encoding = PNM_BINARY;
+    img->pixels = pixels_alloc ( &img->info );
+    void * workspace = malloc ( synth_workspace_size ( par ) );
+    synth_page_t page;
+    init_synth_page ( &page, par, workspace );
+    synth_rows ( &page, par->height, img->pixels );
+    free ( workspace );
+    return img;
+}
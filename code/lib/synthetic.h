@@ -0,0 +1,71 @@
+/**
+ * \file synthetic.h
+ * \brief Synthetic bilevel document pages
+ *
+ * Pages are laid out top to bottom as a sequence of blocks within the
+ * margins: paragraphs of text-like glyphs (stems, bars, ascenders and
+ * descenders grouped into words), horizontal rules, and halftone patches
+ * (clustered dots of a smoothly varying gray). The same seed and parameters
+ * always produce the same page.
+ *
+ * Pages are produced a few rows at a time, so that pages of any size,
+ * up to gigapixels, can be written without holding them in memory.
+ */
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "image.h"
+#include "rand48.h"
+
+typedef struct synth_params {
+    int width;
+    int height;
+    long seed;
+    /** height of lower-case glyphs in pixels; 20 is about 10 points at 300 dpi */
+    int xheight;
+    /** probability that a block is a rule, or a halftone patch, instead of a paragraph */
+    double p_rule;
+    double p_halftone;
+} synth_params_t;
+
+/**
+ * an A4 page at the given resolution, in dots per inch, with text of
+ * about 10 points, and seed 42
+ */
+void default_synth_params ( synth_params_t * par, const int dpi );
+
+/**
+ * generator state; the block being emitted lives in the caller's workspace
+ */
+typedef struct synth_page {
+    synth_params_t par;
+    rand48_t rng;
+    int margin;
+    /** next row of the page to emit */
+    int row;
+    /** rows of the current block: band_rows x width pixels */
+    pixel_t * band;
+    int band_capacity;
+    int band_rows;
+    int band_pos;
+} synth_page_t;
+
+/**
+ * size in bytes of the workspace required to generate pages with these parameters
+ */
+size_t synth_workspace_size ( const synth_params_t * par );
+
+void init_synth_page ( synth_page_t * page, const synth_params_t * par, void * workspace );
+
+/**
+ * fill rows with the next nrows rows of the page (nrows x width pixels)
+ * @return number of rows produced, less than nrows at the end of the page
+ */
+int synth_rows ( synth_page_t * page, const int nrows, pixel_t * rows );
+
+/**
+ * a whole page as a binary image (PBM)
+ */
+image_t * synthetic_document ( const synth_params_t * par );
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "template_kernels.h"
+
+#ifdef NO_TEMPLATE_KERNELS
+const template_kernel_t template_kernels[ 1 ] = { { NULL, 0, NULL, NULL, NULL } };
+const int ntemplate_kernels = 0;
+#endif
+
+/*---------------------------------------------------------------------------------------*/
+
+const template_kernel_t * find_template_kernel ( const patch_template_t * tpl ) {
+    for ( int t = 0 ; t < ntemplate_kernels ; ++t ) {
+        const template_kernel_t * kern = &template_kernels[ t ];
+        if ( ( kern->k == tpl->k ) && !memcmp ( kern->coords, tpl->coords, tpl->k * sizeof( coord_t ) ) ) {
+            return kern;
+        }
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+static int same_samples ( const coord_t * a, const coord_t * b, const index_t k ) {
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        index_t na = 0, nb = 0; // repeated samples count as many times as they appear
+        for ( index_t s = 0 ; s < k ; ++s ) {
+            na += ( a[ s ].i == a[ r ].i ) && ( a[ s ].j == a[ r ].j );
+            nb += ( b[ s ].i == a[ r ].i ) && ( b[ s ].j == a[ r ].j );
+        }
+        if ( na != nb ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+const template_kernel_t * find_sums_kernel ( const patch_template_t * tpl ) {
+    for ( int t = 0 ; t < ntemplate_kernels ; ++t ) {
+        const template_kernel_t * kern = &template_kernels[ t ];
+        if ( ( kern->k == tpl->k ) && same_samples ( kern->coords, tpl->coords, tpl->k ) ) {
+            return kern;
+        }
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+patch_extractor_f select_patch_extractor ( const patch_template_t * tpl ) {
+    const template_kernel_t * kern = find_template_kernel ( tpl );
+    return kern ? kern->get_patch : get_patch;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+uint32_t linear_template_sum ( const image_t * img, const index_t u, const coord_t * coords, const index_t k ) {
+    const index_t n = img->info.width;
+    const index_t npixels = n * img->info.height;
+    uint32_t s = 0;
+    for ( index_t r = 0 ; r < k ; ++r ) {
+        const index_t li = u + coords[ r ].i * n + coords[ r ].j;
+        if ( ( li >= 0 ) && ( li < npixels ) ) {
+            s += img->pixels[ li ];
+        }
+    }
+    return s;
+}
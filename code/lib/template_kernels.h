@@ -0,0 +1,63 @@
+/**
+ * \file template_kernels.h
+ * \brief Context extraction and context sums specialized for fixed templates
+ *
+ * The templates used in production (see TEMPLATE_KERNELS in CMakeLists.txt)
+ * are turned at build time by gen/gen_kernels into fully unrolled kernels
+ * with constant offsets. Each template gets kernels for its samples in file
+ * order and in the order left by sort_template, which is what the programs use.
+ *
+ * The kernels give exactly the same results as the generic functions they
+ * replace; near the borders of the image they fall back to them.
+ */
+#ifndef TEMPLATE_KERNELS_H
+#define TEMPLATE_KERNELS_H
+
+#include <stdint.h>
+
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+
+/** same as get_patch */
+typedef void ( *patch_extractor_f ) ( const image_t * img, const patch_template_t * tpl, int i, int j, patch_t * p );
+
+/** same as context_sums_row: sums of the linear template samples of the pixels of row i */
+typedef void ( *sums_row_f ) ( const image_t * img, const index_t i, uint32_t * sums );
+
+typedef struct template_kernel {
+    /** template file the kernel was generated from */
+    const char * name;
+    index_t k;
+    const coord_t * coords;
+    patch_extractor_f get_patch;
+    sums_row_f sums_row;
+} template_kernel_t;
+
+/** generated kernels (template_kernels_gen.c) */
+extern const template_kernel_t template_kernels[];
+extern const int ntemplate_kernels;
+
+/**
+ * the kernel for a template with exactly these samples in this order, or NULL
+ */
+const template_kernel_t * find_template_kernel ( const patch_template_t * tpl );
+
+/**
+ * the kernel for a template with the same samples in any order, or NULL;
+ * good for sums, which do not depend on the order
+ */
+const template_kernel_t * find_sums_kernel ( const patch_template_t * tpl );
+
+/**
+ * the specialized extractor for the template if there is one, get_patch otherwise
+ */
+patch_extractor_f select_patch_extractor ( const patch_template_t * tpl );
+
+/**
+ * sum of the samples of the linear template at position u of the linear image,
+ * as get_linear_patch would read them; used by the kernels near the borders
+ */
+uint32_t linear_template_sum ( const image_t * img, const index_t u, const coord_t * coords, const index_t k );
+
+#endif
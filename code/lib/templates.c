@@ -4,6 +4,7 @@
 
 #include "templates.h"
 #include "ascmat.h"
+#include "instrument.h"
 /*---------------------------------------------------------------------------------------*/
 
 linear_template_t * linearize_template ( const patch_template_t * pt, index_t nrows, index_t ncols ) {
@@ -183,6 +184,7 @@ patch_template_t * read_one_template ( FILE* fh ) {
 /*---------------------------------------------------------------------------------------*/
 
 patch_template_t * read_template ( const char * fname ) {
+    const uint64_t t0 = instrument_now ( );
     FILE* fh = fopen ( fname, "r" );
     if ( !fh ) {
         fprintf ( stderr, "Cannot open template file %s\n", fname );
@@ -190,6 +192,7 @@ patch_template_t * read_template ( const char * fname ) {
     }
     patch_template_t* pt = read_one_template ( fh );
     fclose ( fh );
+    stage_done ( STAGE_TEMPLATE, t0 );
     return pt;
 
 }
@@ -284,6 +287,7 @@ patch_template_t * symmetrize_template ( const patch_template_t * in ) {
 
 patch_template_t * generate_ball_template ( index_t radius, index_t norm, index_t exclude_center ) {
     assert ( radius > 0 );
+    const uint64_t t0 = instrument_now ( );
     patch_template_t * pt = alloc_patch_template ( ( 2 * radius + 1 ) * ( 2 * radius + 1 ) ); // largest possible context
     index_t i, j;
     index_t k = 0;
@@ -307,6 +311,7 @@ patch_template_t * generate_ball_template ( index_t radius, index_t norm, index_
         }
     }
     pt->k = k;
+    stage_done ( STAGE_TEMPLATE, t0 );
     return pt;
 }
 
@@ -394,3 +399,14 @@ patch_template_t * dilate_template ( patch_template_t* in, index_t scale, index_
     }
     return out;
 }
+
+/*---------------------------------------------------------------------------------------*/
+
+int template_includes_center ( const patch_template_t * ptpl ) {
+    for ( index_t r = 0 ; r < ptpl->k ; ++r ) {
+        if ( ( ptpl->coords[ r ].i == 0 ) && ( ptpl->coords[ r ].j == 0 ) ) {
+            return 1;
+        }
+    }
+    return 0;
+}
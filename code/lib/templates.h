@@ -49,6 +49,9 @@ patch_template_t * symmetrize_template ( const patch_template_t * in );
 
 void print_template ( const patch_template_t * ptpl );
 
+/** 1 if the template contains the center, (0,0) */
+int template_includes_center ( const patch_template_t * ptpl );
+
 void dump_template ( const patch_template_t * ptpl, FILE * ft );
 
 void read_template_multi ( const char * fname, patch_template_t * * ptpls, index_t * ntemplates );
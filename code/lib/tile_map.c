@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "tile_map.h"
+#include "logging.h"
+
+/** four pixels of value 1 in a 64 bit word */
+#define ONES4 0x0001000100010001ULL
+
+/** mixed tiles with at most one pixel in SPECKLE_RATIO set are speckle */
+#define SPECKLE_RATIO 64
+
+/*---------------------------------------------------------------------------------------*/
+
+void template_reach ( const patch_template_t * tpl, index_t * reach_i, index_t * reach_j ) {
+    *reach_i = *reach_j = 0;
+    for ( index_t r = 0 ; r < tpl->k ; ++r ) {
+        const index_t di = tpl->coords[ r ].i < 0 ? -tpl->coords[ r ].i : tpl->coords[ r ].i;
+        const index_t dj = tpl->coords[ r ].j < 0 ? -tpl->coords[ r ].j : tpl->coords[ r ].j;
+        if ( di > *reach_i ) *reach_i = di;
+        if ( dj > *reach_j ) *reach_j = dj;
+    }
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * OR and AND of the pixels of a part of a row, four at a time, and the number
+ * of ones; the result is meaningful only for binary images
+ */
+static void scan_span ( const pixel_t * x, const index_t len, uint64_t * any, uint64_t * all, index_t * ones ) {
+    uint64_t o = 0, a = ~( uint64_t ) 0, s = 0;
+    index_t j = 0;
+    for ( ; j + 4 <= len ; j += 4 ) {
+        uint64_t w;
+        memcpy ( &w, x + j, sizeof( w ) );
+        o |= w;
+        a &= w;
+        s += w; // at most TILE_SIZE / 4 per lane
+    }
+    for ( ; j < len ; ++j ) {
+        o |= ( uint16_t ) x[ j ];
+        a &= x[ j ] == 1 ? ~( uint64_t ) 0 : 0;
+        s += ( uint16_t ) x[ j ];
+    }
+    *any |= o;
+    *all &= a;
+    *ones += ( s & 0xffff ) + ( ( s >> 16 ) & 0xffff ) + ( ( s >> 32 ) & 0xffff ) + ( s >> 48 );
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * 1 if all the pixels of rows [i0,i1) and columns [j0,j1), clipped to the
+ * image, have value v
+ */
+static int region_is ( const image_t * img, index_t i0, index_t i1, index_t j0, index_t j1, const int v ) {
+    const index_t m = img->info.height, n = img->info.width;
+    if ( i0 < 0 ) i0 = 0;
+    if ( j0 < 0 ) j0 = 0;
+    if ( i1 > m ) i1 = m;
+    if ( j1 > n ) j1 = n;
+    if ( ( i0 >= i1 ) || ( j0 >= j1 ) ) {
+        return 1;
+    }
+    uint64_t any = 0, all = ~( uint64_t ) 0;
+    index_t ones = 0;
+    for ( index_t i = i0 ; i < i1 ; ++i ) {
+        scan_span ( img->pixels + i * n + j0, j1 - j0, &any, &all, &ones );
+        if ( v ? ( any & ~ONES4 ) || ( ( all & ONES4 ) != ONES4 ) : any != 0 ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+/**
+ * value of the tile if it is uniform within the reach of the map, -1 otherwise;
+ * only the pixels around the tile need to be looked at
+ */
+static int uniform_tile ( const tile_map_t * map, const image_t * img, const index_t tr, const index_t tc ) {
+    const index_t m = map->m, n = map->n;
+    const index_t ri = map->reach_i, rj = map->reach_j;
+    const index_t i0 = tr * TILE_SIZE, i1 = i0 + TILE_SIZE < m ? i0 + TILE_SIZE : m;
+    const index_t j0 = tc * TILE_SIZE, j1 = j0 + TILE_SIZE < n ? j0 + TILE_SIZE : n;
+    const int c = map->classes[ tr * map->cols + tc ];
+    if ( ( c != TILE_ZERO ) && ( c != TILE_ONE ) ) {
+        return -1;
+    }
+    const int v = c == TILE_ONE;
+    if ( v ) {
+        // nothing outside the image is a one
+        if ( ( i0 - ri < 0 ) || ( i1 + ri > m ) || ( j0 - rj < 0 ) || ( j1 + rj > n ) ) {
+            return -1;
+        }
+    } else if ( rj >= n ) {
+        return -1;
+    }
+    if ( !region_is ( img, i0 - ri, i0, j0 - rj, j1 + rj, v ) ||
+         !region_is ( img, i1, i1 + ri, j0 - rj, j1 + rj, v ) ||
+         !region_is ( img, i0, i1, j0 - rj, j0, v ) ||
+         !region_is ( img, i0, i1, j1, j1 + rj, v ) ) {
+        return -1;
+    }
+    //
+    // linear patches continue on the last columns of the previous row,
+    // and on the first columns of the next one
+    //
+    if ( ( j0 - rj < 0 ) && !region_is ( img, i0 - ri - 1, i1 + ri - 1, n + j0 - rj, n, v ) ) {
+        return -1;
+    }
+    if ( ( j1 + rj > n ) && !region_is ( img, i0 - ri + 1, i1 + ri + 1, 0, j1 + rj - n, v ) ) {
+        return -1;
+    }
+    return v;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+tile_map_t * create_tile_map ( const image_t * img, const index_t reach_i, const index_t reach_j ) {
+    const index_t m = img->info.height;
+    const index_t n = img->info.width;
+    tile_map_t * map = ( tile_map_t * ) malloc ( sizeof( tile_map_t ) );
+    map->m = m;
+    map->n = n;
+    map->rows = ( m + TILE_SIZE - 1 ) / TILE_SIZE;
+    map->cols = ( n + TILE_SIZE - 1 ) / TILE_SIZE;
+    map->reach_i = reach_i;
+    map->reach_j = reach_j;
+    map->classes = ( uint8_t * ) malloc ( map->rows * map->cols + 1 );
+    map->uniform = ( uint8_t * ) malloc ( map->rows * map->cols + 1 );
+    memset ( map->count, 0, sizeof( map->count ) );
+    map->nuniform = 0;
+    uint64_t * any = ( uint64_t * ) malloc ( ( map->cols + 1 ) * sizeof( uint64_t ) );
+    uint64_t * all = ( uint64_t * ) malloc ( ( map->cols + 1 ) * sizeof( uint64_t ) );
+    index_t * ones = ( index_t * ) malloc ( ( map->cols + 1 ) * sizeof( index_t ) );
+    for ( index_t tr = 0 ; tr < map->rows ; ++tr ) {
+        const index_t i0 = tr * TILE_SIZE;
+        const index_t i1 = i0 + TILE_SIZE < m ? i0 + TILE_SIZE : m;
+        for ( index_t tc = 0 ; tc < map->cols ; ++tc ) {
+            any[ tc ] = 0;
+            all[ tc ] = ~( uint64_t ) 0;
+            ones[ tc ] = 0;
+        }
+        for ( index_t i = i0 ; i < i1 ; ++i ) {
+            const pixel_t * x = img->pixels + i * n;
+            for ( index_t tc = 0 ; tc < map->cols ; ++tc ) {
+                const index_t j0 = tc * TILE_SIZE;
+                scan_span ( x + j0, tile_end ( map, j0 ) - j0, &any[ tc ], &all[ tc ], &ones[ tc ] );
+            }
+        }
+        for ( index_t tc = 0 ; tc < map->cols ; ++tc ) {
+            const index_t area = ( i1 - i0 ) * ( tile_end ( map, tc * TILE_SIZE ) - tc * TILE_SIZE );
+            const int binary = !( any[ tc ] & ~ONES4 );
+            tile_class_t c = TILE_MIXED;
+            if ( !any[ tc ] ) {
+                c = TILE_ZERO;
+            } else if ( binary && ( ( all[ tc ] & ONES4 ) == ONES4 ) ) {
+                c = TILE_ONE;
+            } else if ( binary && ( ones[ tc ] * SPECKLE_RATIO <= area ) ) {
+                c = TILE_SPECKLE;
+            }
+            map->classes[ tr * map->cols + tc ] = c;
+            map->count[ c ]++;
+        }
+    }
+    free ( ones );
+    free ( all );
+    free ( any );
+    for ( index_t tr = 0 ; tr < map->rows ; ++tr ) {
+        for ( index_t tc = 0 ; tc < map->cols ; ++tc ) {
+            const int v = uniform_tile ( map, img, tr, tc );
+            map->uniform[ tr * map->cols + tc ] = v + 1;
+            map->nuniform += v >= 0;
+        }
+    }
+    debug ( "tiles: %ld zero %ld one %ld speckle %ld mixed; %ld uniform within %ld x %ld\n",
+            map->count[ TILE_ZERO ], map->count[ TILE_ONE ], map->count[ TILE_SPECKLE ],
+            map->count[ TILE_MIXED ], map->nuniform, map->reach_i, map->reach_j );
+    return map;
+}
+
+/*---------------------------------------------------------------------------------------*/
+
+void free_tile_map ( tile_map_t * map ) {
+    if ( map ) {
+        free ( map->uniform );
+        free ( map->classes );
+        free ( map );
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * \file tile_map.h
+ * \brief Occupancy of the tiles of a binary image
+ *
+ * Scanned pages are mostly uniform background. The image is split into
+ * TILE_SIZE x TILE_SIZE tiles (smaller at the right and bottom borders),
+ * which are classified as all zeros, all ones, sparse speckle (a few ones
+ * on a zero background) or mixed, reading four pixels at a time.
+ *
+ * A tile is uniform within a reach (ri,rj) if every pixel closer than ri rows
+ * and rj columns to it has the value of the tile, both as get_patch and as
+ * get_linear_patch read them: pixels outside the image count as zeros, and
+ * so do those reached by wrapping around the left and right borders, which
+ * must then be zeros too. Any rule that only looks that far gives the same
+ * result for all the pixels of a uniform tile, which can thus be computed
+ * once per tile (or per row of the tile) instead of once per pixel.
+ */
+#ifndef TILE_MAP_H
+#define TILE_MAP_H
+
+#include <stdint.h>
+
+#include "image.h"
+#include "templates.h"
+
+#define TILE_SIZE 32
+
+typedef enum tile_class {
+    TILE_ZERO = 0,
+    TILE_ONE,
+    TILE_SPECKLE,
+    TILE_MIXED,
+    TILE_CLASSES
+} tile_class_t;
+
+typedef struct tile_map {
+    index_t m, n;
+    /** tiles per column and per row */
+    index_t rows, cols;
+    /** reach for which uniformity was checked */
+    index_t reach_i, reach_j;
+    /** class of each tile (rows x cols) */
+    uint8_t * classes;
+    /** 1 + value of each tile that is uniform within the reach, 0 for the rest */
+    uint8_t * uniform;
+    /** tiles of each class, and uniform ones */
+    index_t count[ TILE_CLASSES ];
+    index_t nuniform;
+} tile_map_t;
+
+/**
+ * classify the tiles of a binary image and find the ones uniform within
+ * the given reach
+ */
+tile_map_t * create_tile_map ( const image_t * img, const index_t reach_i, const index_t reach_j );
+
+void free_tile_map ( tile_map_t * map );
+
+/**
+ * reach of a template: largest absolute row and column offsets of its samples
+ */
+void template_reach ( const patch_template_t * tpl, index_t * reach_i, index_t * reach_j );
+
+/**
+ * value of the tile of row i that contains column j if it is uniform, -1 otherwise
+ */
+static inline int uniform_value ( const tile_map_t * map, const index_t i, const index_t j ) {
+    return ( int ) map->uniform[ ( i / TILE_SIZE ) * map->cols + j / TILE_SIZE ] - 1;
+}
+
+/**
+ * end of the part of a row that starts at column j and lies in the same tile
+ */
+static inline index_t tile_end ( const tile_map_t * map, const index_t j ) {
+    const index_t e = ( j / TILE_SIZE + 1 ) * TILE_SIZE;
+    return e < map->n ? e : map->n;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/**
+ * \file workspace.h
+ * \brief Carving of caller-owned work buffers
+ *
+ * The denoising methods do not allocate their working memory: the caller
+ * asks for the size of the workspace (*_workspace_size), allocates it however
+ * it sees fit, and hands it to the corresponding init function, which splits
+ * it into the buffers it needs. Nothing is kept in global variables, so that
+ * any number of contexts can be used at the same time from different threads.
+ */
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <stddef.h>
+
+/**
+ * buffers carved from a workspace are padded to this size, so that they
+ * are cache line aligned whenever the workspace itself is
+ */
+#define WORKSPACE_ALIGN 64
+
+/** bytes taken by a buffer of the given size, including padding */
+static inline size_t workspace_round ( const size_t bytes ) {
+    return ( bytes + WORKSPACE_ALIGN - 1 ) & ~( ( size_t ) WORKSPACE_ALIGN - 1 );
+}
+
+/**
+ * take a buffer of the given size from the workspace and
+ * advance the workspace position
+ */
+static inline void * workspace_take ( char* * pos, const size_t bytes ) {
+    void * p = *pos;
+    *pos += workspace_round ( bytes );
+    return p;
+}
+
+#endif
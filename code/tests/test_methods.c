@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pnm.h"
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+#include "context_sums.h"
+#include "template_kernels.h"
+#include "quorum.h"
+#include "median.h"
+#include "dude.h"
+#include "sweep.h"
+
+#define NCOPIES 4
+
+/**
+ * denoises the same image several times at once, each time with its own
+ * context and workspace, and checks that all the results are identical
+ * to the one obtained serially. With -DPARALLEL, the copies run concurrently.
+ */
+int main ( int argc, char* argv[] ) {
+    if ( argc < 3 ) {
+        fprintf ( stderr, "usage: %s <image> <template>.\n", argv[ 0 ] );
+        return RESULT_ERROR;
+    }
+    image_t* img = read_pnm ( argv[ 1 ] );
+    if ( img == NULL ) {
+        fprintf ( stderr, "error opening image %s.\n", argv[ 1 ] );
+        return RESULT_ERROR;
+    }
+    patch_template_t* tpl = read_template ( argv[ 2 ] );
+    if ( tpl == NULL ) {
+        fprintf ( stderr, "error reading template %s.\n", argv[ 2 ] );
+        return RESULT_ERROR;
+    }
+    sort_template ( tpl, 1 );
+    const int m = img->info.height;
+    const index_t npixels = ( index_t ) img->info.width * m;
+    const size_t nbytes = npixels * sizeof( pixel_t );
+    int failed = 0;
+    //
+    // context sums against the sums of the linear patches
+    //
+    {
+        void* work = malloc ( context_sums_workspace_size ( &img->info, tpl ) );
+        uint32_t* sums_row = ( uint32_t* ) malloc ( img->info.width * sizeof( uint32_t ) );
+        linear_template_t* ltpl = linearize_template ( tpl, m, img->info.width );
+        patch_t* p = alloc_patch ( tpl->k );
+        context_sums_t cs;
+        init_context_sums ( &cs, &img->info, tpl, work );
+        index_t wrong = 0;
+        for ( int i = 0 ; i < m ; ++i ) {
+            context_sums_row ( &cs, img, i, sums_row );
+            for ( int j = 0 ; j < img->info.width ; ++j ) {
+                get_linear_patch ( img, ltpl, i, j, p );
+                uint32_t a = 0;
+                for ( int r = 0 ; r < p->k ; ++r ) {
+                    a += p->values[ r ];
+                }
+                wrong += ( a != sums_row[ j ] );
+            }
+        }
+        if ( wrong ) {
+            fprintf ( stderr, "context sums: %ld pixels differ.\n", ( long ) wrong );
+            failed++;
+        }
+        free_patch ( p );
+        free_linear_template ( ltpl );
+        free ( sums_row );
+        free ( work );
+    }
+    //
+    // generated extractor, if the template has one, against get_patch
+    //
+    {
+        const patch_extractor_f extract = select_patch_extractor ( tpl );
+        patch_t* p = alloc_patch ( tpl->k );
+        patch_t* q = alloc_patch ( tpl->k );
+        index_t wrong = 0;
+        for ( int i = 0 ; i < m ; ++i ) {
+            for ( int j = 0 ; j < img->info.width ; ++j ) {
+                extract ( img, tpl, i, j, p );
+                get_patch ( img, tpl, i, j, q );
+                wrong += memcmp ( p->values, q->values, tpl->k * sizeof( pixel_t ) ) != 0;
+            }
+        }
+        if ( wrong ) {
+            fprintf ( stderr, "template kernel: %ld patches differ.\n", ( long ) wrong );
+            failed++;
+        }
+        free_patch ( q );
+        free_patch ( p );
+    }
+    //
+    // reference results, computed serially
+    //
+    image_t* ref_quorum = image_copy ( img );
+    image_t* ref_median = image_copy ( img );
+    image_t* ref_dude   = image_copy ( img );
+    {
+        quorum_params_t qpar = { .p01 = 0.025, .p10 = 0.025, .fused = 0, .auto_noise = 0 };
+        void* work = malloc ( quorum_workspace_size ( &img->info, tpl, &qpar ) );
+        quorum_ctx_t ctx;
+        init_quorum ( &ctx, &img->info, tpl, &qpar, work );
+        quorum_denoise ( &ctx, img, ref_quorum, 4 );
+        free ( work );
+
+        work = malloc ( median_workspace_size ( &img->info, tpl ) );
+        median_ctx_t mctx;
+        init_median ( &mctx, &img->info, tpl, work );
+        median_filter ( &mctx, img, ref_median );
+        free ( work );
+
+        dude_params_t dpar = { .p01 = 0.025, .p10 = 0.025, .auto_noise = 0 };
+        work = malloc ( dude_workspace_size ( tpl ) );
+        dude_ctx_t dctx;
+        init_dude ( &dctx, tpl, &dpar, work );
+        image_t* pre = image_copy ( img );
+        dude_denoise ( &dctx, img, pre, ref_dude, 1 );
+        pixels_free ( pre->pixels );
+        free ( pre );
+        free ( work );
+    }
+    //
+    // sweeps against single iterations of the denoisers
+    //
+    {
+        const sweep_point_t point = { 0.025, 0.025 };
+        image_t* ref = image_copy ( img );
+        quorum_params_t qpar = { .p01 = 0.025, .p10 = 0.025, .fused = 0, .auto_noise = 0 };
+        void* work = malloc ( quorum_workspace_size ( &img->info, tpl, &qpar ) );
+        quorum_ctx_t ctx;
+        init_quorum ( &ctx, &img->info, tpl, &qpar, work );
+        quorum_denoise ( &ctx, img, ref, 1 );
+        free ( work );
+        image_t* out = image_copy ( img );
+        for ( int method = SWEEP_QUORUM ; method <= SWEEP_DUDE ; ++method ) {
+            sweep_result_t res;
+            work = malloc ( sweep_workspace_size ( &img->info, tpl, ( sweep_method_t ) method ) );
+            sweep_ctx_t sctx;
+            init_sweep ( &sctx, &img->info, tpl, ( sweep_method_t ) method, work );
+            sweep_gather ( &sctx, img );
+            sweep_apply ( &sctx, &point, img, out, NULL, &res );
+            sweep_release ( &sctx );
+            free ( work );
+            if ( memcmp ( out->pixels, method == SWEEP_DUDE ? ref_dude->pixels : ref->pixels, nbytes ) ) {
+                fprintf ( stderr, "sweep: method %d differs.\n", method );
+                failed++;
+            }
+        }
+        pixels_free ( out->pixels );
+        free ( out );
+        pixels_free ( ref->pixels );
+        free ( ref );
+    }
+    //
+    // several images at once
+    //
+#ifdef PARALLEL
+    #pragma omp parallel for reduction(+:failed)
+#endif
+    for ( int c = 0 ; c < NCOPIES ; ++c ) {
+        image_t* out = image_copy ( img );
+        //
+        // odd copies recompute the sums instead of using the quorum map,
+        // and thus run all iterations in full instead of incrementally;
+        // copies 2 and 3 of every four do not skip uniform tiles
+        //
+        quorum_params_t qpar = { .p01 = 0.025, .p10 = 0.025, .fused = c & 1, .auto_noise = 0, .visit_all = c & 2 };
+        void* work = malloc ( quorum_workspace_size ( &img->info, tpl, &qpar ) );
+        quorum_ctx_t ctx;
+        init_quorum ( &ctx, &img->info, tpl, &qpar, work );
+        quorum_denoise ( &ctx, img, out, 4 );
+        free ( work );
+        if ( memcmp ( out->pixels, ref_quorum->pixels, nbytes ) ) {
+            fprintf ( stderr, "quorum: copy %d differs.\n", c );
+            failed++;
+        }
+
+        //
+        // dude, with the statistics in a tree and in a sorted table
+        //
+        for ( int sorted = 0 ; sorted < 2 ; ++sorted ) {
+            pixels_copyto ( out, img );
+            image_t* pre = image_copy ( img );
+            dude_params_t dpar = { .p01 = 0.025, .p10 = 0.025, .auto_noise = 0, .visit_all = c & 1, .sorted = sorted };
+            work = malloc ( dude_workspace_size ( tpl ) );
+            dude_ctx_t dctx;
+            init_dude ( &dctx, tpl, &dpar, work );
+            dude_denoise ( &dctx, img, pre, out, 1 );
+            free ( work );
+            if ( memcmp ( out->pixels, ref_dude->pixels, nbytes ) ) {
+                fprintf ( stderr, "dude%s: copy %d differs.\n", sorted ? " (sorted)" : "", c );
+                failed++;
+            }
+            pixels_free ( pre->pixels );
+            free ( pre );
+        }
+        pixels_free ( out->pixels );
+        free ( out );
+    }
+    //
+    // several tiles (bands of rows) of one image at once
+    //
+    image_t* out = image_copy ( img );
+#ifdef PARALLEL
+    #pragma omp parallel for
+#endif
+    for ( int c = 0 ; c < NCOPIES ; ++c ) {
+        void* work = malloc ( median_workspace_size ( &img->info, tpl ) );
+        median_ctx_t mctx;
+        init_median ( &mctx, &img->info, tpl, work );
+        median_filter_rows ( &mctx, img, out, ( c * m ) / NCOPIES, ( ( c + 1 ) * m ) / NCOPIES );
+        free ( work );
+    }
+    if ( memcmp ( out->pixels, ref_median->pixels, nbytes ) ) {
+        fprintf ( stderr, "median: banded result differs.\n" );
+        failed++;
+    }
+    printf ( "%s\n", failed ? "FAILED" : "OK" );
+
+    pixels_free ( out->pixels );
+    free ( out );
+    pixels_free ( ref_quorum->pixels );
+    free ( ref_quorum );
+    pixels_free ( ref_median->pixels );
+    free ( ref_median );
+    pixels_free ( ref_dude->pixels );
+    free ( ref_dude );
+    free_patch_template ( tpl );
+    pixels_free ( img->pixels );
+    free ( img );
+    return failed ? RESULT_ERROR : 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#elif defined( PARALLEL )
+#include <omp.h>
+#endif
+
+#include "pnm.h"
+#include "image.h"
+#include "templates.h"
+#include "patches.h"
+#include "stats.h"
+
+#define NTHREADS 8  // more than the cores, so that threads are preempted mid-insertion
+#define ROUNDS 4    // passes of all the threads over the pixels of the image
+#define TRIALS 5
+#define SKIPPED 77  // exit code of a test that could not run
+
+/** what each thread inserts into the shared tree */
+typedef struct worker {
+    const image_t * img;
+    const patch_template_t * tpl;
+    patch_node_t * tree;
+} worker_t;
+
+static void * insert_all ( void * arg ) {
+    const worker_t * w = ( const worker_t * ) arg;
+    const int m = w->img->info.height;
+    const int n = w->img->info.width;
+    stats_inserter_t ins = { NULL };
+    patch_t* ctx = alloc_patch ( w->tpl->k );
+    for ( int r = 0 ; r < ROUNDS ; ++r ) {
+        for ( int i = 0 ; i < m ; ++i ) {
+            for ( int j = 0 ; j < n ; ++j ) {
+                get_patch ( w->img, w->tpl, i, j, ctx );
+                update_patch_stats_shared ( ctx, get_pixel ( w->img, i, j ), w->tree, &ins );
+            }
+        }
+    }
+    gather_patch_stats_shared ( w->img, w->img, w->tpl, w->tree );
+    free_patch ( ctx );
+    release_stats_inserter ( &ins );
+    return NULL;
+}
+
+/**
+ * run insert_all in NTHREADS threads at once: POSIX threads, or OpenMP on
+ * Windows
+ * @return number of threads that ran
+ */
+static int run_workers ( worker_t * w ) {
+#ifndef _WIN32
+    pthread_t threads[ NTHREADS ];
+    int nthreads = 0;
+    for ( ; nthreads < NTHREADS ; ++nthreads ) {
+        if ( pthread_create ( &threads[ nthreads ], NULL, insert_all, w ) ) {
+            break;
+        }
+    }
+    for ( int t = 0 ; t < nthreads ; ++t ) {
+        pthread_join ( threads[ t ], NULL );
+    }
+    return nthreads;
+#elif defined( PARALLEL )
+    int nthreads = 0;
+    #pragma omp parallel num_threads ( NTHREADS )
+    {
+        #pragma omp single
+        nthreads = omp_get_num_threads ( );
+        insert_all ( w );
+    }
+    return nthreads;
+#else
+    ( void ) w;
+    return 0;
+#endif
+}
+
+/** 1 if both trees hold the same contexts with the same occurrences and counts */
+static int same_stats ( const patch_node_t * a, const patch_node_t * b ) {
+    if ( !a || !b ) {
+        return a == b;
+    }
+    if ( ( a->leaf != b->leaf ) || ( a->occu != b->occu ) || ( a->counts != b->counts ) ) {
+        return 0;
+    }
+    for ( int i = 0 ; i < ALPHA ; ++i ) {
+        if ( !same_stats ( a->children[ i ], b->children[ i ] ) ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * stress test of the concurrent insertion: all the threads insert the
+ * contexts of the same rows at the same time, so they race to create the
+ * same nodes, and then each gathers the whole image into the same tree.
+ * The result must be the tree gathered serially as many times.
+ */
+int main ( int argc, char* argv[] ) {
+
+    if ( argc < 3 ) {
+        fprintf ( stderr, "usage: %s <image> <template>.\n", argv[ 0 ] );
+        return RESULT_ERROR;
+    }
+    image_t* img = read_pnm ( argv[ 1 ] );
+    if ( ( img == NULL ) || ( img->info.result != RESULT_OK ) ) {
+        fprintf ( stderr, "error reading image %s.\n", argv[ 1 ] );
+        return RESULT_ERROR;
+    }
+    patch_template_t* tpl = read_template ( argv[ 2 ] );
+    for ( int t = 0 ; t < TRIALS ; ++t ) {
+        worker_t w = { img, tpl, create_stats ( ) };
+        patch_node_t* shared_tree = w.tree;
+        const int nthreads = run_workers ( &w );
+        if ( nthreads < 2 ) {
+            printf ( "SKIP: could not start several threads; the concurrent insertion was not tested.\n" );
+            free_node ( shared_tree );
+            return SKIPPED;
+        }
+        patch_node_t* serial_tree = NULL;
+        for ( int r = 0 ; r < nthreads * ( ROUNDS + 1 ) ; ++r ) {
+            serial_tree = gather_patch_stats ( img, img, tpl, NULL, serial_tree );
+        }
+        const int same = same_stats ( serial_tree, shared_tree );
+        index_t nshared = 0, nserial = 0, occu = 0, counts = 0;
+        summarize_stats ( shared_tree, &nshared, &occu, &counts );
+        summarize_stats ( serial_tree, &nserial, &occu, &counts );
+        printf ( "trial %d: %d threads, %ld contexts, %ld occurrences\n", t, nthreads, ( long ) nshared, ( long ) shared_tree->occu );
+        free_node ( serial_tree );
+        free_node ( shared_tree );
+        if ( !same ) {
+            fprintf ( stderr, "concurrent insertion differs from serial (%ld vs %ld contexts).\n",
+                      ( long ) nshared, ( long ) nserial );
+            return RESULT_ERROR;
+        }
+        if ( get_stats_memory ( ).nodes != 0 ) {
+            fprintf ( stderr, "%ld stats nodes not released.\n", ( long ) get_stats_memory ( ).nodes );
+            return RESULT_ERROR;
+        }
+    }
+    free_patch_template ( tpl );
+    pixels_free ( img->pixels );
+    free ( img );
+    return 0;
+}
@@ -1,11 +1,53 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pnm.h"
 #include "image.h"
 #include "templates.h"
 #include "patches.h"
 #include "stats.h"
+#include "hamming_index.h"
+#include "context_table.h"
+
+/** 1 if both trees hold the same contexts with the same occurrences and counts */
+static int same_stats ( const patch_node_t * a, const patch_node_t * b ) {
+    if ( !a || !b ) {
+        return a == b;
+    }
+    if ( ( a->leaf != b->leaf ) || ( a->occu != b->occu ) || ( a->counts != b->counts ) ) {
+        return 0;
+    }
+    for ( int i = 0 ; i < ALPHA ; ++i ) {
+        if ( !same_stats ( a->children[ i ], b->children[ i ] ) ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/** 1 if both files have the same bytes */
+static int same_files ( const char * fa, const char * fb ) {
+    FILE* a = fopen ( fa, "rb" ), * b = fopen ( fb, "rb" );
+    int ca = EOF, cb = EOF;
+    if ( a && b ) {
+        do {
+            ca = fgetc ( a );
+            cb = fgetc ( b );
+        } while ( ( ca == cb ) && ( ca != EOF ) );
+    }
+    if ( a ) fclose ( a );
+    if ( b ) fclose ( b );
+    return a && b && ( ca == cb );
+}
+
+/** 1 if both tables hold the same entries */
+static int same_tables ( const context_table_t * a, const context_table_t * b ) {
+    return a && b && ( a->k == b->k ) && ( a->n == b->n )
+        && !memcmp ( a->keys, b->keys, a->n * a->words * sizeof( uint64_t ) )
+        && !memcmp ( a->occu, b->occu, a->n * sizeof( index_t ) )
+        && !memcmp ( a->counts, b->counts, a->n * sizeof( index_t ) );
+}
 
 int main ( int argc, char* argv[] ) {
 
@@ -45,6 +87,27 @@ int main ( int argc, char* argv[] ) {
     printf("=================\n");
     print_stats_summary ( stats_tree, ">" );
     print_patch_stats( stats_tree, tpl->k );
+    //
+    // the contexts of uniform tiles are added in bulk: compare with
+    // the statistics gathered pixel by pixel
+    //
+    {
+        patch_t* ctx = alloc_patch ( tpl->k );
+        patch_node_t* ref_tree = create_stats ( );
+        for ( int i = 0 ; i < img->info.height ; ++i ) {
+            for ( int j = 0 ; j < img->info.width ; ++j ) {
+                get_patch ( img, tpl, i, j, ctx );
+                update_patch_stats ( ctx, get_pixel ( img, i, j ), ref_tree );
+            }
+        }
+        const int same = same_stats ( ref_tree, stats_tree );
+        free_node ( ref_tree );
+        free_patch ( ctx );
+        if ( !same ) {
+            fprintf ( stderr, "stats differ from those gathered pixel by pixel.\n" );
+            return RESULT_ERROR;
+        }
+    }
     save_stats ( "test.stats", stats_tree );
     patch_node_t* loaded_tree = NULL;
     loaded_tree = load_stats ( "test.stats" );
@@ -56,12 +119,251 @@ int main ( int argc, char* argv[] ) {
     merge_stats ( loaded_tree, stats_tree, 1 );
     printf("=================\n");
     print_stats_summary ( loaded_tree, ">" );
+    //
+    // merging stats files as streams gives the same file as merging in memory;
+    // the stats of the negative image add contexts the others do not have
+    //
+    {
+        image_t neg;
+        neg.info = img->info;
+        neg.pixels = pixels_copy ( &img->info, img->pixels );
+        for ( index_t li = 0 ; li < ( index_t ) img->info.width * img->info.height ; ++li ) {
+            neg.pixels[ li ] = 1 - neg.pixels[ li ];
+        }
+        patch_node_t* neg_tree = gather_patch_stats ( &neg, &neg, tpl, NULL, NULL );
+        save_stats ( "test3.stats", neg_tree );
+        patch_node_t* ref_tree = merge_stats ( loaded_tree, neg_tree, 0 );
+        save_stats ( "test4.stats", ref_tree );
+        const char* inputs[] = { "test.stats", "test3.stats", "test2.stats" };
+        int same = !merge_stats_files ( "test5.stats", inputs, 3 );
+        same = same && same_files ( "test4.stats", "test5.stats" );
+        if ( !same ) {
+            fprintf ( stderr, "stats files merged as streams differ from those merged in memory.\n" );
+            return RESULT_ERROR;
+        }
+        //
+        // context tables hold the same statistics as trees, in the same order
+        //
+        context_table_t* table = gather_context_table ( img, img, tpl );
+        if ( table ) {
+            context_table_t* neg_table = gather_context_table ( &neg, &neg, tpl );
+            context_table_t* twice = merge_context_tables ( table, table );
+            context_table_t* all = merge_context_tables ( twice, neg_table );
+            context_table_t* from_tree = stats_to_context_table ( stats_tree, tpl->k );
+            context_table_t* loaded = load_context_table ( "test.stats" );
+            patch_node_t* to_tree = context_table_to_stats ( table );
+            same = !save_context_table ( "test6.stats", table ) && same_files ( "test.stats", "test6.stats" )
+                && !save_context_table ( "test7.stats", all ) && same_files ( "test4.stats", "test7.stats" )
+                && same_tables ( table, from_tree ) && same_tables ( table, loaded )
+                && same_stats ( to_tree, stats_tree );
+            patch_t* ctx = alloc_patch ( tpl->k );
+            index_t found = 0; // contexts of all that are also in table
+            for ( index_t e = 0 ; e < all->n ; ++e ) {
+                context_table_patch ( all, e, ctx );
+                same = same && ( context_table_find ( all, ctx ) == e );
+                found += context_table_find ( table, ctx ) >= 0;
+            }
+            same = same && ( found == table->n );
+            free_patch ( ctx );
+            free_node ( to_tree );
+            free_context_table ( loaded );
+            free_context_table ( from_tree );
+            free_context_table ( all );
+            free_context_table ( twice );
+            free_context_table ( neg_table );
+            free_context_table ( table );
+            if ( !same ) {
+                fprintf ( stderr, "context tables differ from stats trees.\n" );
+                return RESULT_ERROR;
+            }
+        }
+        free_node ( ref_tree );
+        free_node ( neg_tree );
+        pixels_free ( neg.pixels );
+    }
     patch_node_t* merged_tree = merge_stats ( loaded_tree, stats_tree, 0 ); // not in place
     //
     // should yield everything doubled
     //
     print_stats_summary ( merged_tree, ">" );
     //
+    // memory accounting, and dropping rare contexts
+    //
+    stats_memory_t mem = get_stats_memory ( );
+    printf ( "stats memory: %ld nodes %ld bytes (peak %ld)\n", mem.nodes, mem.bytes, mem.peak_bytes );
+    index_t nleaves = 0, totoccu = 0, totcount = 0;
+    summarize_stats ( merged_tree, &nleaves, &totoccu, &totcount );
+    const index_t occu_before = totoccu;
+    const index_t root_before = merged_tree->occu;
+    const index_t removed = prune_rare_stats ( merged_tree, 4 );
+    nleaves = totoccu = totcount = 0;
+    summarize_stats ( merged_tree, &nleaves, &totoccu, &totcount );
+    printf ( "pruned contexts seen fewer than 4 times: %ld occurrences removed\n", removed );
+    print_stats_summary ( merged_tree, ">" );
+    if ( ( totoccu != occu_before - removed ) || ( merged_tree->occu != root_before - removed ) ) {
+        fprintf ( stderr, "occurrences do not add up after pruning.\n" );
+        return RESULT_ERROR;
+    }
+    if ( get_stats_memory ( ).nodes >= mem.nodes ) {
+        fprintf ( stderr, "pruning did not release any node.\n" );
+        return RESULT_ERROR;
+    }
+    //
+    // a budget only counts the bytes of its own tree, not those of the
+    // other trees alive here
+    //
+    {
+        stats_budget_t budget;
+        init_stats_budget ( &budget, 2 * stats_bytes ( stats_tree ), NULL );
+        patch_node_t* tree = gather_patch_stats_budget ( img, img, tpl, NULL, &budget );
+        int ok = !budget.dropped && same_stats ( tree, stats_tree ) && ( budget.used == stats_bytes ( tree ) );
+        free_node ( tree );
+        init_stats_budget ( &budget, stats_bytes ( stats_tree ) / 2, NULL );
+        tree = gather_patch_stats_budget ( img, img, tpl, NULL, &budget );
+        ok = ok && budget.dropped && ( budget.used == stats_bytes ( tree ) )
+            && ( tree->occu + budget.dropped == stats_tree->occu );
+        printf ( "budget of %ld bytes: %ld bytes used, %ld occurrences dropped\n",
+                 ( long ) budget.bytes, ( long ) budget.used, ( long ) budget.dropped );
+        free_node ( tree );
+        if ( !ok ) {
+            fprintf ( stderr, "stats budget not kept as expected.\n" );
+            return RESULT_ERROR;
+        }
+    }
+    //
+    // resuming from checkpoints: only those within the file list and of
+    // the template are taken, and removing them leaves nothing to resume
+    //
+    {
+        char name[ 1024 ];
+        for ( int done = 1 ; done <= 3 ; ++done ) { // a run over 3 entries
+            stats_checkpoint_name ( name, 1024, "testc.stats", 0, done );
+            save_stats ( name, stats_tree );
+        }
+        patch_node_t* resumed = create_stats ( );
+        patch_node_t* twice = merge_stats ( stats_tree, stats_tree, 0 );
+        // loaded trees only have the counts of their leaves: compare the files
+        int ok = ( resume_stats_checkpoints ( "testc.stats", 1, 2, tpl->k, &resumed ) == 2 )
+            && !save_stats ( "testc.stats", resumed ) && !save_stats ( "test8.stats", twice )
+            && same_files ( "testc.stats", "test8.stats" );
+        free_node ( twice );
+        free_node ( resumed );
+        remove_stats_checkpoints ( "testc.stats", 1 );
+        resumed = create_stats ( );
+        ok = ok && ( resume_stats_checkpoints ( "testc.stats", 1, 3, tpl->k, &resumed ) == 0 );
+        // a checkpoint with longer contexts
+        patch_t* ctx = alloc_patch ( tpl->k + 1 );
+        memset ( ctx->values, 0, ctx->k * sizeof( pixel_t ) );
+        patch_node_t* other = create_stats ( );
+        add_context_stats ( ctx, 1, 0, other );
+        stats_checkpoint_name ( name, 1024, "testc.stats", 1, 1 );
+        save_stats ( name, other );
+        ok = ok && ( resume_stats_checkpoints ( "testc.stats", 1, 3, tpl->k, &resumed ) == 0 )
+            && ( resumed->occu == 0 );
+        remove_stats_checkpoints ( "testc.stats", 1 );
+        FILE* f = fopen ( name, "rb" );
+        ok = ok && !f;
+        if ( f ) {
+            fclose ( f );
+        }
+        free_node ( other );
+        free_patch ( ctx );
+        free_node ( resumed );
+        if ( !ok ) {
+            fprintf ( stderr, "resuming from checkpoints not as expected.\n" );
+            return RESULT_ERROR;
+        }
+    }
+    //
+    // clustering: every context seen more than minoccu times is a cluster
+    //
+    {
+        const index_t minoccu = 8;
+        index_t nctx = 0, nseeds = 0, nclusters = 0, pos = 0;
+        totoccu = totcount = 0;
+        summarize_stats ( stats_tree, &nctx, &totoccu, &totcount );
+        patch_node_t* * leaves = ( patch_node_t* * ) malloc ( nctx * sizeof( patch_node_t* ) );
+        flatten_stats ( stats_tree, leaves, &pos );
+        for ( index_t l = 0 ; l < pos ; ++l ) {
+            nseeds += leaves[ l ]->occu > minoccu;
+        }
+        free ( leaves );
+        patch_node_t* clusters = cluster_stats ( stats_tree, tpl->k, 2, minoccu, nctx );
+        totoccu = totcount = 0;
+        summarize_stats ( clusters, &nclusters, &totoccu, &totcount );
+        //
+        // the cluster model file gives back the same clusters
+        //
+        const cluster_params_t cpar = { tpl->k, 2, minoccu, nctx };
+        cluster_params_t lpar;
+        save_clusters ( "test.model", clusters, &cpar );
+        patch_node_t* loaded = load_clusters ( "test.model", &lpar );
+        int same = loaded && same_stats ( clusters, loaded ) && !memcmp ( &cpar, &lpar, sizeof( cpar ) );
+        if ( same ) {
+            patch_node_t* * a = ( patch_node_t* * ) malloc ( 2 * nclusters * sizeof( patch_node_t* ) );
+            index_t na = 0, nb = nclusters;
+            flatten_stats ( clusters, a, &na );
+            flatten_stats ( loaded, a, &nb );
+            for ( index_t c = 0 ; same && ( c < nclusters ) ; ++c ) {
+                same = !memcmp ( a[ c ]->diff, a[ nclusters + c ]->diff, tpl->k * sizeof( index_t ) );
+            }
+            free ( a );
+        }
+        free_node ( loaded );
+        free_node ( clusters );
+        if ( !same ) {
+            fprintf ( stderr, "cluster model differs after loading.\n" );
+            return RESULT_ERROR;
+        }
+        printf ( "%ld contexts, %ld clusters\n", nctx, nclusters );
+        if ( ( pos != nctx ) || ( nclusters != nseeds ) ) {
+            fprintf ( stderr, "expected %ld clusters out of %ld contexts.\n", nseeds, pos );
+            return RESULT_ERROR;
+        }
+    }
+    //
+    // multi-index hashing finds the same neighbors as the tree, in the same order
+    //
+    hamming_index_t* index = create_hamming_index ( stats_tree, tpl->k );
+    if ( index ) {
+        hamming_query_t query;
+        void* query_work = malloc ( hamming_query_workspace_size ( index ) );
+        init_hamming_query ( &query, index, query_work );
+        patch_t* ctx = alloc_patch ( tpl->k );
+        const index_t npixels = ( index_t ) img->info.width * img->info.height;
+        for ( index_t li = 0 ; li < npixels ; li += 97 ) {
+            get_patch ( img, tpl, li / img->info.width, li % img->info.width, ctx );
+            for ( index_t d = 1 ; d <= 4 ; ++d ) {
+                neighbor_list_t ref = find_neighbors ( stats_tree, ctx, d );
+                const neighbor_list_t* found = hamming_search ( &query, ctx, 1, d );
+                int same = found->number == ref.number;
+                for ( index_t r = 0 ; same && ( r < ref.number ) ; ++r ) {
+                    same = ( found->neighbors[ r ].patch_node == ref.neighbors[ r ].patch_node ) &&
+                           ( found->neighbors[ r ].dist == ref.neighbors[ r ].dist );
+                }
+                // the nearest ones are those at the smallest distance in the list
+                index_t mind = d + 1, nmin = 0;
+                for ( index_t r = 0 ; r < ref.number ; ++r ) {
+                    if ( ref.neighbors[ r ].dist < mind ) {
+                        mind = ref.neighbors[ r ].dist;
+                        nmin = 0;
+                    }
+                    nmin += ref.neighbors[ r ].dist == mind;
+                }
+                found = hamming_nearest ( &query, ctx, 1, d );
+                same = same && ( found->number == nmin ) && ( !nmin || ( found->neighbors[ 0 ].dist == mind ) );
+                free ( ref.neighbors );
+                if ( !same ) {
+                    fprintf ( stderr, "hamming index: neighbors of pixel %ld within %ld differ.\n", li, d );
+                    return RESULT_ERROR;
+                }
+            }
+        }
+        free_patch ( ctx );
+        free ( query_work );
+        free_hamming_index ( index );
+    }
+    //
     // find neighbors
     //
     // by default, a patch is initialized to all-zeros
@@ -103,5 +405,9 @@ int main ( int argc, char* argv[] ) {
     free_patch_template ( tpl );
     pixels_free ( img->pixels );
     free ( img );
+    if ( get_stats_memory ( ).nodes != 0 ) {
+        fprintf ( stderr, "%ld stats nodes not released.\n", get_stats_memory ( ).nodes );
+        return RESULT_ERROR;
+    }
     return 0;
 }
@@ -11,6 +11,7 @@
 #include "logging.h"
 #include "pnm.h"
 #include "image.h"
+#include "noise.h"
 /**
  * Program options. These are filled in by the argument parser
  */
@@ -50,8 +51,6 @@ int main ( int argc, char* argv[] ) {
 
     out.info = img->info;
     out.pixels = pixels_copy ( &img->info, img->pixels );
-    const index_t n = img->info.width;
-    const index_t m = img->info.height;
     //
     // if only p01 is specified (p10=-1), the noise is assumed symmetric and split even between p01 and p10
     //
@@ -59,18 +58,9 @@ int main ( int argc, char* argv[] ) {
     const double p10 = cfg.p10 > 0 ? cfg.p10 : p01;
 
     fprintf ( stdout, "adding noise with p01=%6.4f p10=%6.4f and seed=%d.\n", p01, p10, cfg.seed );
-    srand48(cfg.seed);
-    for ( int i = 0, li = 0 ; i < m ; ++i ) {
-        for ( int j = 0 ; j < n ; ++j, ++li ) {
-            const int x = get_linear_pixel(img, li);
-            const double coin = drand48();
-	    if (!x && (coin < p01)) { // 0->1
-              set_linear_pixel ( &out, li, 1);
-	    } else if (x && (coin < p10)) {
-              set_linear_pixel ( &out, li, 0);
-	    }
-        }
-    }
+    rand48_t rng;
+    seed_rand48 ( &rng, cfg.seed );
+    add_channel_noise ( img, &out, p01, p10, &rng );
 
     //
     // second pass: using denoised contexts
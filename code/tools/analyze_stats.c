@@ -6,13 +6,13 @@
  *  see http://www.gnu.org/software/libc/manual/html_node/Argp.html
  */
 #include <stdlib.h>
-#include <time.h>                     // basic benchmarking
 #include <argp.h>                     // argument parsing
 #include <string.h>
 #include <assert.h>
 
 #include "stats.h"
 #include "logging.h"
+#include "instrument.h"            // basic benchmarking
 #include "patches.h"
 
 void scan_tree ( patch_node_t* node, patch_node_t* * node_list, index_t* pos ) {
@@ -81,8 +81,7 @@ static struct argp argp = { options, parse_opt, args_doc, program_doc, 0, 0, 0 }
  */
 int main ( int argc, char * * argv ) {
     config_st cfg; // command-line program configuration
-    time_t t0, t1;      // for benchmarking
-    t0 = clock( );
+    const uint64_t t0 = instrument_now ( ); // for benchmarking
 
     info ( "Setting default configuration...\n" );
 
@@ -167,8 +166,7 @@ int main ( int argc, char * * argv ) {
     free_patch ( aux );
     free_patch_template ( template );
     free_stats ( stats_tree );
-    t1 = clock( );
-    printf ( "Took %ld seconds.\n", t1 - t0 );
+    printf ( "Took %.3f seconds.\n", 1e-9 * ( double ) ( instrument_now ( ) - t0 ) );
     exit ( 0 );
 }
 
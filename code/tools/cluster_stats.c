@@ -1,60 +1,34 @@
 /**
- * \file gather_stats.c
- * \brief Gather patch statistics from a bunch of images
+ * \file cluster_stats.c
+ * \brief Cluster patch statistics into a cluster model for bin_nlm_tree
+ *
+ *  The model is what bin_nlm_tree would compute from the same statistics
+ *  before denoising each image; with -K it is loaded instead.
  *
  *  Uses GNU argp to parse arguments
  *  see http://www.gnu.org/software/libc/manual/html_node/Argp.html
  */
 #include <stdlib.h>
-#include <time.h>                     // basic benchmarking
 #include <argp.h>                     // argument parsing
 #include <string.h>
 #include <assert.h>
 
 #include "stats.h"
 #include "logging.h"
+#include "instrument.h"            // basic benchmarking
 #include "patches.h"
 
-void scan_tree ( patch_node_t* node, patch_node_t* * node_list, index_t* pos ) {
-    if ( node->leaf ) {
-        node_list[ ( *pos )++ ] = node;
-    } else {
-        for ( int i = 0 ; i < ALPHA ; ++i )
-            scan_tree ( node->children[ i ], node_list, pos );
-    }
-}
-
-int ascending = 0;
-
-static int compare_nodes_occu ( const void* va, const void* vb ) {
-    const patch_node_t* a = *( ( const patch_node_t* * ) va );
-    const patch_node_t* b = *( ( const patch_node_t* * ) vb );
-    const long res = ascending ? ( a->occu - b->occu ) : ( b->occu - a->occu );
-    return res > 0 ? 1 : ( res < 0 ? -1 : 0 );
-}
-
-static void print_node_list ( patch_node_t* * node_list, const index_t nnodes, const index_t totoccu, patch_t* aux ) {
-    index_t accu = 0;
-    for ( int i = 0 ; i < nnodes ; ++i ) {
-        printf ( "%06d | ", i );
-        get_leaf_patch ( aux, node_list[ i ] );
-        for ( int j = 0 ; j < aux->k ; ++j ) {
-            putchar ( '0' + aux->values[ j ] );
-        }
-        const patch_node_t* p = node_list[ i ];
-        const double P = ( ( double ) p->counts ) / ( ( double ) p->occu );
-        const double Q = ( ( double ) p->occu ) / ( ( double ) totoccu );
-        accu += p->occu;
-        const double F = ( ( double ) accu ) / ( ( double ) totoccu );
-        printf ( " | %12ld | %12.10f | %12.10f | %12ld | %12.10f\n", p->occu, Q, F, p->counts, P );
-    }
-}
 /**
  * These are the options that we can handle through the command line
  */
 static struct argp_option options[] = {
     {"verbose",        'v', 0, OPTION_ARG_OPTIONAL, "Produce verbose output", 0 },
     {"quiet",          'q', 0, OPTION_ARG_OPTIONAL, "Don't produce any output", 0 },
+    {"output",         'o', "filename", 0, "Save the cluster model to specified file.", 0 },
+    {"maxdist",        'd', "distance", 0, "maximum distance to a cluster center", 0 },
+    {"maxclusters",    'C', "number",   0, "maximum number of clusters", 0 },
+    {"minoccu",        'm', "number",   0, "minimum occurences for a patch to become a cluster center", 0 },
+    {"metrics",        'M', "file",     0, "append the time spent in each stage and event counts to file as a JSON line (- for stdout).", 0 },
     { 0 } // terminator
 };
 
@@ -64,6 +38,9 @@ static struct argp_option options[] = {
 typedef struct  {
     char * stats_file;
     char * template_file;
+    char * output_file;
+    char * metrics_file;
+    cluster_params_t par;
 } config_st;
 
 /**
@@ -75,7 +52,7 @@ static error_t parse_opt ( int key, char * arg, struct argp_state * state );
  * General description of what this program does; appears when calling with --help
  */
 static char program_doc[] =
-    "\n*** gather statistics from a list of images    ***\n";
+    "\n*** cluster patch statistics into a model for bin_nlm_tree ***\n";
 
 /**
  * A general description of the input arguments we accept; appears when calling with --help
@@ -92,25 +69,26 @@ static struct argp argp = { options, parse_opt, args_doc, program_doc, 0, 0, 0 }
  */
 int main ( int argc, char * * argv ) {
     config_st cfg; // command-line program configuration
-    time_t t0, t1;      // for benchmarking
-    t0 = clock( );
-
-    info ( "Setting default configuration...\n" );
+    const uint64_t t0 = instrument_now ( ); // for benchmarking
 
     /*
-     * Default program configuration
+     * Default program configuration; same as bin_nlm_tree
      */
     set_log_level ( LOG_INFO );
     set_log_stream ( stdout );
     cfg.stats_file = NULL;
     cfg.template_file = NULL;
-    info ( "Parsing arguments...\n" );
+    cfg.output_file = "clusters.model";
+    cfg.metrics_file = NULL;
+    cfg.par.maxd = 10;
+    cfg.par.maxclusters = 10000;
+    cfg.par.minoccu = 100;
     /*
      * call parser
      */
     argp_parse ( &argp, argc, argv, 0, 0, &cfg );
     /*
-     * load template
+     * load template; only its size matters
      */
     patch_template_t* template;
     template = read_template ( cfg.template_file );
@@ -118,11 +96,7 @@ int main ( int argc, char * * argv ) {
         error ( "Invalid template or missing template file.\n" );
         exit ( 1 );
     }
-    /*
-     * sort by distence to center
-     */
-    sort_template ( template, 1 );
-    print_template ( template );
+    cfg.par.k = template->k;
     /*
      * load stats
      */
@@ -131,37 +105,23 @@ int main ( int argc, char * * argv ) {
         error ( "Could not open file %s for reading.\n", cfg.stats_file );
         exit ( 1 );
     }
-    //
-    // scan
-    //
-    index_t nleaves = 0, totoccu = 0, totcount = 0;
-    summarize_stats ( stats_tree, &nleaves, &totoccu, &totcount );
-    //
-    // allocate analysis structure
-    //
-    index_t pos = 0;
-    patch_node_t* * node_list = ( patch_node_t* * ) calloc ( nleaves, sizeof( patch_node_t* ) );
-    scan_tree ( stats_tree, node_list, &pos );
-    printf ( " pos %ld nleaves %ld\n", pos, nleaves );
-    if ( nleaves != pos ) {
-        exit ( 1 );
-    }
-    patch_t* aux = alloc_patch ( template->k );
-    printf ( "sorting list\n" );
-    qsort ( node_list, nleaves, sizeof( patch_node_t* ), compare_nodes_occu );
-    printf ( "printing list\n" );
-    print_node_list ( node_list, nleaves, totoccu, aux );
+    info ( "clustering patches....\n" );
+    patch_node_t * clustered = cluster_stats ( stats_tree, cfg.par.k, cfg.par.maxd, cfg.par.minoccu, cfg.par.maxclusters );
+    index_t nclusters = 0, totoccu = 0, totcount = 0;
+    summarize_stats ( clustered, &nclusters, &totoccu, &totcount );
+    info ( "%ld clusters, %ld occurences.\n", nclusters, totoccu );
+    const int res = save_clusters ( cfg.output_file, clustered, &cfg.par );
     //
     // cleanup and go
     //
-    printf ( "cleanup\n" );
-    free_patch ( aux );
-    free ( node_list );
-    free_patch_template ( template );
+    free_node ( clustered );
     free_stats ( stats_tree );
-    t1 = clock( );
-    printf ( "Took %ld seconds.\n", t1 - t0 );
-    exit ( 0 );
+    free_patch_template ( template );
+    info ( "Took %.3f seconds.\n", 1e-9 * ( double ) ( instrument_now ( ) - t0 ) );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.stats_file ) != 0 ) ) {
+        error ( "error writing metrics to %s.\n", cfg.metrics_file );
+    }
+    exit ( res ? 1 : 0 );
 }
 
 
@@ -180,6 +140,21 @@ static error_t parse_opt ( int key, char * arg, struct argp_state * state ) {
     case 'v':
         set_log_level ( LOG_DEBUG );
         break;
+    case 'o':
+        cfg->output_file = arg;
+        break;
+    case 'd':
+        cfg->par.maxd = atoi ( arg );
+        break;
+    case 'C':
+        cfg->par.maxclusters = atoi ( arg );
+        break;
+    case 'm':
+        cfg->par.minoccu = atoi ( arg );
+        break;
+    case 'M':
+        cfg->metrics_file = arg;
+        break;
 
     case ARGP_KEY_ARG:
         switch ( state->arg_num ) {
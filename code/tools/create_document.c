@@ -0,0 +1,193 @@
+/**
+ * Generate a synthetic bilevel document page (PBM) from a seed: paragraphs of
+ * text-like glyphs, rules and halftone patches within the margins.
+ * The page is written a few rows at a time, so it can be as large as
+ * gigapixels, and the same options always give the same file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <argp.h>
+
+#include "pnm.h"
+#include "image.h"
+#include "synthetic.h"
+#include "logging.h"
+
+#define CHUNK_ROWS 256
+
+/**
+ * Program options. These are filled in by the argument parser
+ */
+typedef struct config {
+    const char * output_file;
+    int dpi;
+    int width;
+    int height;
+    double megapixels;
+    int xheight;
+    long seed;
+} config_t;
+
+config_t parse_opt ( int argc, char* * argv );
+
+
+int main ( int argc, char* argv[] ) {
+    config_t cfg = parse_opt ( argc, argv );
+
+    synth_params_t par;
+    default_synth_params ( &par, cfg.dpi );
+    par.seed = cfg.seed;
+    if ( cfg.xheight > 0 ) {
+        par.xheight = cfg.xheight;
+    }
+    if ( cfg.megapixels > 0 ) {
+        // keep the aspect of the page
+        const double aspect = ( double ) par.height / ( double ) par.width;
+        par.width = ( int ) sqrt ( 1e6 * cfg.megapixels / aspect );
+        par.height = ( int ) ( 1e6 * cfg.megapixels / par.width );
+    }
+    if ( cfg.width > 0 ) {
+        par.width = cfg.width;
+    }
+    if ( cfg.height > 0 ) {
+        par.height = cfg.height;
+    }
+    info ( "page %d x %d (%.1f MPix), x-height %d, seed %ld\n", par.width, par.height,
+           1e-6 * par.width * par.height, par.xheight, par.seed );
+
+    FILE * out = fopen ( cfg.output_file, "wb" );
+    if ( !out ) {
+        fprintf ( stderr, "error opening %s for writing.\n", cfg.output_file );
+        return RESULT_ERROR;
+    }
+    image_info_t info;
+    info.width = par.width;
+    info.height = par.height;
+    info.channels = 1;
+    info.type = 4;
+    info.depth = 1;
+    info.maxval = 1;
+    info.result = RESULT_OK;
+    info.encoding = PNM_BINARY;
+    pixel_t * rows = ( pixel_t * ) malloc ( ( size_t ) CHUNK_ROWS * par.width * sizeof( pixel_t ) );
+    void * workspace = malloc ( synth_workspace_size ( &par ) );
+    synth_page_t page;
+    init_synth_page ( &page, &par, workspace );
+    int res = write_pnm_info ( &info, out );
+    int nrows;
+    while ( ( res == RESULT_OK ) && ( ( nrows = synth_rows ( &page, CHUNK_ROWS, rows ) ) > 0 ) ) {
+        res = write_rows ( &info, nrows, rows, out );
+    }
+    if ( ( fclose ( out ) != 0 ) || ( res != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing %s.\n", cfg.output_file );
+        res = RESULT_ERROR;
+    }
+    free ( workspace );
+    free ( rows );
+    return res;
+}
+
+/**
+ * These are the options that we can handle through the command line
+ */
+static struct argp_option options[] = {
+    {"verbose",        'v', 0, OPTION_ARG_OPTIONAL, "Produce verbose output", 0 },
+    {"quiet",          'q', 0, OPTION_ARG_OPTIONAL, "Don't produce any output", 0 },
+    {"output",         'o', "file",   0, "output file (default synthetic.pbm)", 0 },
+    {"dpi",            'd', "dpi",    0, "resolution of an A4 page (default 300)", 0 },
+    {"megapixels",     'm', "mpix",   0, "scale the page to about this many megapixels", 0 },
+    {"width",          'W', "pixels", 0, "page width", 0 },
+    {"height",         'H', "pixels", 0, "page height", 0 },
+    {"xheight",        'x', "pixels", 0, "height of lower-case glyphs (default dpi/15)", 0 },
+    {"seed",           's', "seed",   0, "random seed (default 42)", 0 },
+    { 0 } // terminator
+};
+
+/**
+ * options handler
+ */
+static error_t _parse_opt ( int key, char * arg, struct argp_state * state );
+
+/**
+ * General description of what this program does; appears when calling with --help
+ */
+static char program_doc[] =
+    "\n*** generate a synthetic document page ***\n";
+
+/**
+ * A general description of the input arguments we accept; appears when calling with --help
+ */
+static char args_doc[] = "";
+
+/**
+ * argp configuration structure
+ */
+static struct argp argp = { options, _parse_opt, args_doc, program_doc, 0, 0, 0 };
+
+
+config_t parse_opt ( int argc, char* * argv ) {
+    config_t cfg;
+    cfg.output_file = "synthetic.pbm";
+    cfg.dpi = 300;
+    cfg.width = 0;
+    cfg.height = 0;
+    cfg.megapixels = 0;
+    cfg.xheight = 0;
+    cfg.seed = 42;
+    argp_parse ( &argp, argc, argv, 0, 0, &cfg );
+    return cfg;
+}
+
+/*
+ * argp callback for parsing a single option.
+ */
+static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
+    /* Get the input argument from argp_parse,
+     * which we know is a pointer to our arguments structure.
+     */
+    config_t * cfg = ( config_t* ) state->input;
+    switch ( key ) {
+    case 'q':
+        set_log_level ( LOG_ERROR );
+        break;
+    case 'v':
+        set_log_level ( LOG_DEBUG );
+        break;
+    case 'o':
+        cfg->output_file = arg;
+        break;
+    case 'd':
+        cfg->dpi = atoi ( arg );
+        if ( cfg->dpi < 30 ) {
+            error ( "resolution too low: %s\n", arg );
+            argp_usage ( state );
+        }
+        break;
+    case 'm':
+        cfg->megapixels = atof ( arg );
+        break;
+    case 'W':
+        cfg->width = atoi ( arg );
+        break;
+    case 'H':
+        cfg->height = atoi ( arg );
+        break;
+    case 'x':
+        cfg->xheight = atoi ( arg );
+        break;
+    case 's':
+        cfg->seed = atol ( arg );
+        break;
+
+    case ARGP_KEY_ARG:
+        /** too many arguments! */
+        error ( "Too many arguments!.\n" );
+        argp_usage ( state );
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
@@ -3,14 +3,14 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include <string.h> // for memcmp
 #include <argp.h>
 
 #include "pnm.h"
 #include "image.h"
 #include "templates.h"
-#include "patches.h"
+#include "context_sums.h"
+#include "noise.h"
 #include "logging.h"
 
 
@@ -35,6 +35,9 @@ typedef struct config {
     int template_norm;
     int maxs;
     double tol;
+    int sample;
+    double sample_tol;
+    unsigned long seed;
 } config_t;
 
 config_t parse_opt ( int argc, char* * argv );
@@ -55,18 +58,14 @@ static index_t patch_sums (
     const index_t n = img->info.width;
     const index_t m = img->info.height;
     index_t total = 0;
-    patch_t* p = alloc_patch ( tpl->k );
-    linear_template_t* ltpl = linearize_template ( tpl, m, n );
+    void* work = malloc ( context_sums_workspace_size ( &img->info, tpl ) );
+    uint32_t* sums_row = ( uint32_t* ) malloc ( n * sizeof( uint32_t ) );
+    context_sums_t sums;
+    init_context_sums ( &sums, &img->info, tpl, work );
     for ( int i = 0, li = 0 ; i < m ; ++i ) {
+        context_sums_row ( &sums, ctximg, i, sums_row );
         for ( int j = 0 ; j < n ; ++j, ++li ) {
-            get_linear_patch ( ctximg, ltpl, i, j, p );
-            //
-            // sum
-            //
-            index_t a = 0;
-            for ( int k = 0 ; k < ltpl->k ; ++k ) {
-                a += p->values[ k ];
-            }
+            const index_t a = sums_row[ j ];
             quorum_freq[ a ]++;
             if ( get_linear_pixel ( img, li ) ) {
                 quorum_freq_1[ a ]++;
@@ -74,66 +73,11 @@ static index_t patch_sums (
             total++;
         }
     }
-    free_linear_template ( ltpl );
-    free_patch ( p );
+    free ( sums_row );
+    free ( work );
     return total;
 }
 
-/**
- * @brief approximate log-likelihood of all-zeros patches w.r.t. noise parameter
- *        assuming ones are noise
- * @param ns   number of occurences of S=s
- * @param ns1  number of occurences of S=s,z=1
- * @param n    total length of signal
- * @param k    context size
- * @param maxs maximum number of terms
- * @param p0   noise parameter
- * @return double likelihood
- */
-static double loglik0(
-        const index_t* ns, 
-        const index_t* ns1, 
-        const index_t n, 
-        const index_t k, 
-        const index_t maxs, 
-        const double p0) {
-    const double logp = log10(p0);
-    const double log1mp = log10(1.0-p0);
-    double a = 0.0;
-    for ( int r = 0 ; r <= maxs  ; ++r ) {
-      a += ns[r]*(ns1[r]*logp + (ns[r]-ns1[r])*log1mp + r*logp + (k-r)*log1mp);
-    }
-    return -a/(double)n; // just a normalization
-}
-
-/**
- * @brief approximate log-likelihood of all-ONES patches w.r.t. noise parameter
- *        assuming ZEROS are noise
- * @param ns   number of occurences of S=s
- * @param ns1  number of occurences of S=s,z=1
- * @param n    total length of signal
- * @param k    context size
- * @param maxs maximum number of terms
- * @param p0   noise parameter
- * @return double likelihood
- */
-static double loglik1(
-        const index_t* ns, 
-        const index_t* ns1, 
-        const index_t n, 
-        const index_t k, 
-        const index_t maxs, 
-        const double p0) {
-    const double logp = log10(p0);
-    const double log1mp = log10(1.0-p0);
-    double a = 0.0;
-    for ( int r = k ; r >= (k-maxs)  ; --r ) {
-      a += ns[r]*((ns[r]-ns1[r])*logp + ns1[r]*log1mp + (k-r)*logp + r*log1mp);
-    }
-    return -a/(double)n; // just a normalization
-}
-
-
 static void estimate_noise (
     const image_t* in,
     const index_t k,
@@ -143,66 +87,51 @@ static void estimate_noise (
 
     const int m = in->info.height;
     const int n = in->info.width;
-    // compute p1 and p0 using maximum likelihood on the pairs of statistics (n_s, n_s1), s=0,...,k
-    // we cannot do this for the whole range s=0,...,k, otherwise we end up with a global estimate
-    // which is not what we want. WE only want to evaluate this on "very white" and "very black"
-    // contexts. So, assuming a maximum value of 0.2 (quite high), we can discard all terms above
-    // s=4 or so.    
-    //
-    // golden ratio search:
-    //
-    const double phi = (1.0+sqrt(5.0))/2.0;
-    const double r = 1.0/(1.0+phi);
-    const double tol = cfg->tol;
-    const double maxs = cfg->maxs;
+    double p01, p10;
+    estimate_noise_params ( quorum_freq, quorum_freq_1, m*n, k, 0, cfg->maxs, cfg->tol, &p01, &p10 );
+    info("P(0->1)=%f\n",p01);
+    info("P(1->0)=%f\n",p10);
+}
 
-    double left   = 0.0;
-    double right  = 0.5;
-    while ( (right-left) >= tol) {
-        double midleft    = left  + r*(right-left);
-        double midright   = right - r*(right-left); 
-        const double fmidleft   = loglik0(quorum_freq, quorum_freq_1, m*n, k, maxs, midleft);
-        const double fmidright  = loglik0(quorum_freq, quorum_freq_1, m*n, k, maxs, midright);
-        if (fmidleft < fmidright) {
-            right    = midright;
-            midright = midleft;
-            midleft  = left  + r*(right-left);
-            debug ( "left=%f right=%f p=%8.6f -log P()=%12.10f\n", left,right,midleft,fmidleft); 
-        } else {
-            left = midleft;
-            midleft  = midright;
-            midright = right - r*(right-left);
-            debug ( "left=%f right=%f p=%8.6f -log P()=%12.10f\n", left,right, midright,fmidright); 
-        }
-    }
-    info("P(0->1)=%f\n",(right+left)/2.0);
 
-    left   = 0.0;
-    right  = 0.5;
-    while ( (right-left) >= tol) {
-        double midleft    = left  + r*(right-left);
-        double midright   = right - r*(right-left); 
-        const double fmidleft   = loglik1(quorum_freq, quorum_freq_1, m*n, k, maxs, midleft);
-        const double fmidright  = loglik1(quorum_freq, quorum_freq_1, m*n, k, maxs, midright);
-        if (fmidleft < fmidright) {
-            right    = midright;
-            midright = midleft;
-            midleft  = left  + r*(right-left);
-            debug ( "left=%f right=%f p=%8.6f -log P()=%12.10f\n", left,right,midleft,fmidleft); 
-        } else {
-            left = midleft;
-            midleft  = midright;
-            midright = right - r*(right-left);
-            debug ( "left=%f right=%f p=%8.6f -log P()=%12.10f\n", left,right, midright,fmidright); 
-        }
+/**
+ * estimate from a random sample of tiles of a mapped PBM file
+ * @return RESULT_ERROR if the file cannot be mapped
+ */
+static int estimate_noise_from_sample ( const config_t* cfg ) {
+    mapped_pbm_t pbm;
+    if ( map_pbm ( cfg->input_file, &pbm ) != RESULT_OK ) {
+        return RESULT_ERROR;
     }
-    info("P(1->0)=%f\n",(right+left)/2.0);
+    const int exclude_center = 1;
+    patch_template_t* tpl = generate_ball_template(cfg->template_radius,cfg->template_norm,exclude_center);
+    noise_sampling_t sp;
+    sp.tile_size = NOISE_SAMPLE_TILE;
+    sp.batch = NOISE_SAMPLE_BATCH;
+    sp.rel_tol = cfg->sample_tol;
+    sp.floor = NOISE_SAMPLE_FLOOR;
+    sp.seed = cfg->seed;
+    double p01, p10;
+    const index_t ntiles = estimate_noise_sampled ( &pbm, tpl, cfg->maxs, cfg->tol, &sp, &p01, &p10 );
+    debug ( "used %ld tiles of %dx%d pixels.\n", ( long ) ntiles, ( int ) sp.tile_size, ( int ) sp.tile_size );
+    info("P(0->1)=%f\n",p01);
+    info("P(1->0)=%f\n",p10);
+    free_patch_template ( tpl );
+    unmap_pbm ( &pbm );
+    return RESULT_OK;
 }
 
 
 int main ( int argc, char* argv[] ) {
     config_t cfg = parse_opt ( argc, argv );
 
+    if ( cfg.sample ) {
+        if ( estimate_noise_from_sample ( &cfg ) == RESULT_OK ) {
+            return 0;
+        }
+        warn ( "%s is not a raw PBM file; using the whole image.\n", cfg.input_file );
+    }
+
     image_t* img = read_pnm ( cfg.input_file );
     if ( img == NULL ) {
         fprintf ( stderr, "error opening image %s.\n", cfg.input_file );
@@ -247,6 +176,9 @@ static struct argp_option options[] = {
     {"norm",           'n', "natural", 0, "patch norm", 0 },
     {"tol",            't', "tolerance", 0, "golden ratio search tolerance", 0 },
     {"maxs",           's', "terms", 0, "number of terms in approx. likelihood", 0 },
+    {"sample",         'm', 0, 0, "estimate from a random sample of tiles read from the (raw PBM) file", 0 },
+    {"sample-tol",     'e', "fraction", 0, "relative change of the estimates below which sampling stops", 0 },
+    {"seed",           'x', "seed", 0, "seed of the random tile order", 0 },
     { 0 } // terminator
 };
 
@@ -277,8 +209,11 @@ config_t parse_opt ( int argc, char* * argv ) {
     cfg.input_file  = NULL;
     cfg.template_radius = 3;
     cfg.template_norm = 2;
-    cfg.tol = 1e-6;
-    cfg.maxs = 5;
+    cfg.tol = NOISE_DEFAULT_TOL;
+    cfg.maxs = NOISE_DEFAULT_MAXS;
+    cfg.sample = 0;
+    cfg.sample_tol = NOISE_SAMPLE_REL_TOL;
+    cfg.seed = 1;
     argp_parse ( &argp, argc, argv, 0, 0, &cfg );
     return cfg;
 }
@@ -310,6 +245,15 @@ static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
     case 's':
         cfg->maxs = atoi(arg);
         break;
+    case 'm':
+        cfg->sample = 1;
+        break;
+    case 'e':
+        cfg->sample_tol = atof(arg);
+        break;
+    case 'x':
+        cfg->seed = strtoul(arg, NULL, 10);
+        break;
 
     case ARGP_KEY_ARG:
         switch ( state->arg_num ) {
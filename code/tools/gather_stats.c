@@ -6,15 +6,73 @@
  *  see http://www.gnu.org/software/libc/manual/html_node/Argp.html
  */
 #include <stdlib.h>
-#include <time.h>                     // basic benchmarking
 #include <argp.h>                     // argument parsing
 #include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 #include "templates.h"
 #include "stats.h"
 #include "logging.h"
+#include "instrument.h"            // basic benchmarking
 #include "pnm.h"
 
+/** images between checkpoints of the stats */
+#define CHECKPOINT_PERIOD 100
+
+#ifndef _WIN32
+/** process writing the last checkpoint, 0 if none */
+static pid_t checkpoint_writer = 0;
+#endif
+
+/**
+ * wait until the last checkpoint is written
+ * @return 0 if it was written without errors
+ */
+static int wait_checkpoint ( void ) {
+    int res = 0;
+#ifndef _WIN32
+    if ( checkpoint_writer > 0 ) {
+        int status = 0;
+        res = ( waitpid ( checkpoint_writer, &status, 0 ) < 0 ) || !WIFEXITED( status ) || WEXITSTATUS( status );
+        checkpoint_writer = 0;
+    }
+#endif
+    return res;
+}
+
+/**
+ * save a checkpoint. In the background, it does not stop the gathering: a
+ * child process writes the stats as they are now (its copy-on-write view of
+ * them), while this one goes on changing or freeing them. The file appears,
+ * under its name, only once it is complete.
+ */
+static void save_checkpoint ( const char * fname, const patch_node_t * stats, const int background ) {
+    char tmp[ 1040 ];
+    snprintf ( tmp, sizeof( tmp ), "%s.tmp", fname );
+    if ( wait_checkpoint ( ) ) { // one at a time
+        error ( "could not write the previous checkpoint.\n" );
+    }
+#ifndef _WIN32
+    const pid_t pid = background ? fork ( ) : -1;
+    if ( pid == 0 ) {
+        _exit ( ( save_stats ( tmp, stats ) || rename ( tmp, fname ) ) ? 1 : 0 );
+    }
+    if ( pid > 0 ) {
+        checkpoint_writer = pid;
+        return;
+    }
+    if ( background ) {
+        warn ( "could not start writing checkpoint %s in the background.\n", fname );
+    }
+#endif
+    if ( save_stats ( tmp, stats ) || rename ( tmp, fname ) ) {
+        error ( "could not write checkpoint %s.\n", fname );
+    }
+}
+
 /**
  * These are the options that we can handle through the command line
  */
@@ -23,6 +81,10 @@ static struct argp_option options[] = {
     {"quiet",          'q', 0, OPTION_ARG_OPTIONAL, "Don't produce any output", 0 },
     {"prefix",         'p', "path", 0,            "Prefix to append to file paths", 0 },
     {"stats",          's', "file", 0,             "Path to stats file. If it exists, merge with it.", 0 },
+    {"budget",         'b', "size", 0,             "Keep the statistics within about this many bytes (suffixes K, M, G) by dropping rare contexts. Checkpoints are then written without a background copy of the statistics, stopping the gathering meanwhile.", 0 },
+    {"metrics",        'M', "file", 0,             "Append per-stage timings and counters as a JSON line to file (- for stdout).", 0 },
+    {"resume",         'r', 0, 0,                  "Continue an interrupted run from the checkpoints of the stats file (otherwise they are removed).", 0 },
+    {"shared",         't', 0, 0,                  "Gather the images of a batch into one tree shared by the threads instead of one tree per thread (no effect with a budget).", 0 },
     { 0 } // terminator
 };
 
@@ -34,6 +96,10 @@ typedef struct  {
     char * prefix;
     char * template_file;
     char * stats_file;
+    char * metrics_file;
+    index_t budget;
+    int resume;
+    int shared;
 } config_st;
 
 /**
@@ -62,8 +128,7 @@ static struct argp argp = { options, parse_opt, args_doc, program_doc, 0, 0, 0 }
  */
 int main ( int argc, char * * argv ) {
     config_st cfg; // command-line program configuration
-    time_t t0, t1;      // for benchmarking
-    t0 = clock( );
+    const uint64_t t0 = instrument_now ( ); // for benchmarking
 
     info ( "Setting default configuration...\n" );
 
@@ -76,6 +141,10 @@ int main ( int argc, char * * argv ) {
     cfg.stats_file = "patch.stats";
     cfg.file_list_file = NULL;
     cfg.template_file = NULL;
+    cfg.metrics_file = NULL;
+    cfg.budget = 0;
+    cfg.resume = 0;
+    cfg.shared = 0;
     info ( "Parsing arguments...\n" );
     /*
      * call parser
@@ -96,7 +165,7 @@ int main ( int argc, char * * argv ) {
     sort_template ( template, 1 );
     print_template ( template );
     /*
-     * run stuff
+     * read the list of images
      */
     FILE* flist = fopen ( cfg.file_list_file, "r" );
     if ( !flist ) {
@@ -105,8 +174,8 @@ int main ( int argc, char * * argv ) {
     }
     char* line = NULL; // generous
     size_t n = 0;
-    patch_node_t* stats_tree = NULL;
-    int nimg = 0;
+    char* * paths = NULL;
+    int npaths = 0;
     while ( getline ( &line, &n, flist ) > 0 ) {
         char full_path[ 1024 ];
         // remove trailing and leading spaces from buf
@@ -117,39 +186,132 @@ int main ( int argc, char * * argv ) {
         }
         // assemble full path
         snprintf ( full_path, 1024, "%s/%s", cfg.prefix, line );
-        info ( "image %d path %s\n", nimg + 1, full_path );
-        // read image
-        image_t* img = read_pnm ( full_path );
-        if ( !img ) {
-            warn ( "Could not read image %s. Skipping\n", full_path );
-            continue;
+        paths = ( char* * ) realloc ( paths, ( npaths + 1 ) * sizeof( char* ) );
+        paths[ npaths++ ] = strdup ( full_path );
+    }
+    fclose ( flist );
+    /*
+     * run stuff: the images are gathered in batches of CHECKPOINT_PERIOD;
+     * with -DPARALLEL, the images of a batch are read and gathered by a pool
+     * of threads, each into its own tree, and the trees are merged at the
+     * end of the batch. Counts are added, so the result does not depend on
+     * the order. With -t, the threads insert into the batch tree itself
+     * instead (see update_patch_stats_shared), which saves the memory of
+     * the per-thread trees and the merge. Pruning to a budget needs all
+     * the stats in one tree, so with a budget the images are gathered one
+     * after the other.
+     *
+     * Each batch is gathered into a tree of its own, which is saved as a
+     * delta checkpoint and then added to the stats. With a budget, the
+     * images are gathered into the stats themselves, and the checkpoints
+     * are full copies of them. Checkpoints are written in the background by
+     * a forked process, except with a budget: the gathering would then
+     * modify and free the nodes of the very tree being written, and the
+     * copies of their pages could take the memory up to twice the budget,
+     * so those are written before going on, at the cost of that time.
+     * A run that does not resume removes the checkpoints of earlier runs
+     * first, and a resumed one only takes checkpoints within its own file
+     * list and of its own template.
+     */
+    patch_node_t* stats_tree = create_stats ( );
+    int first = 0;
+    if ( cfg.resume ) {
+        first = resume_stats_checkpoints ( cfg.stats_file, CHECKPOINT_PERIOD, npaths, template->k, &stats_tree );
+        info ( "resuming after %d images from the checkpoints of %s\n", first, cfg.stats_file );
+    } else {
+        remove_stats_checkpoints ( cfg.stats_file, CHECKPOINT_PERIOD );
+    }
+    stats_budget_t budget;
+    init_stats_budget ( &budget, cfg.budget, cfg.budget ? stats_tree : NULL );
+    const int shared = cfg.shared && !cfg.budget;
+    int nimg = 0;
+    for ( int b0 = first ; b0 < npaths ; b0 += CHECKPOINT_PERIOD ) {
+        const int b1 = b0 + CHECKPOINT_PERIOD < npaths ? b0 + CHECKPOINT_PERIOD : npaths;
+        patch_node_t* batch = cfg.budget ? stats_tree : create_stats ( );
+        int ngathered = 0;
+#ifdef PARALLEL
+        #pragma omp parallel if ( !cfg.budget ) reduction(+:ngathered)
+#endif
+        {
+#ifdef PARALLEL
+            patch_node_t* local = ( cfg.budget || shared ) ? batch : NULL;
+            #pragma omp for schedule(dynamic)
+#else
+            patch_node_t* local = batch;
+#endif
+            for ( int f = b0 ; f < b1 ; ++f ) {
+                info ( "image %d path %s\n", f + 1, paths[ f ] );
+                // read image
+                image_t* img = read_pnm ( paths[ f ] );
+                if ( !img ) {
+                    warn ( "Could not read image %s. Skipping\n", paths[ f ] );
+                    continue;
+                }
+                // update stats
+                if ( shared ) {
+                    gather_patch_stats_shared ( img, img, template, local );
+                } else if ( cfg.budget ) {
+                    local = gather_patch_stats_budget ( img, img, template, local, &budget );
+                } else {
+                    local = gather_patch_stats ( img, img, template, NULL, local );
+                }
+                pixels_free ( img->pixels );
+                free ( img );
+                ngathered++;
+            }
+            if ( local && ( local != batch ) ) {
+#ifdef PARALLEL
+                #pragma omp critical ( merge_stats )
+#endif
+                merge_stats ( batch, local, 1 );
+                free_stats ( local );
+            }
         }
-        // update stats
-        stats_tree = gather_patch_stats ( img, img, template, NULL, stats_tree );
-        print_stats_summary ( stats_tree, ">" );
-        pixels_free ( img->pixels );
-        free ( img );
-        nimg++;
-        //z
-        // save checkpoint
+        nimg += ngathered;
         //
-        if ( !( nimg % 100 ) ) {
-            snprintf ( full_path, 1024, "%s.checkpoint%07d", cfg.stats_file, nimg );
-            save_stats ( full_path, stats_tree );
+        // save checkpoint, named after the number of entries of the list done
+        //
+        if ( b1 - b0 == CHECKPOINT_PERIOD ) {
+            char full_path[ 1024 ];
+            stats_checkpoint_name ( full_path, 1024, cfg.stats_file, batch == stats_tree, b1 );
+            save_checkpoint ( full_path, batch, batch != stats_tree );
+        }
+        if ( batch != stats_tree ) {
+            merge_stats ( stats_tree, batch, 1 );
+            free_stats ( batch );
         }
+        //
+        // running totals, kept by the stats themselves
+        //
+        const stats_memory_t mem = get_stats_memory ( );
+        info ( "> images %6d totoccu %10ld nodes %10ld bytes %12ld\n",
+               nimg, ( long ) stats_tree->occu, ( long ) mem.nodes, ( long ) mem.bytes );
     }
+    if ( wait_checkpoint ( ) ) {
+        error ( "could not write the last checkpoint.\n" );
+    }
+    print_stats_summary ( stats_tree, ">" );
     /*
      * save results
      */
     save_stats ( cfg.stats_file, stats_tree );
+    const stats_memory_t mem = get_stats_memory ( );
+    info ( "stats memory: peak %ld bytes, %ld occurrences dropped; peak RSS %lu bytes\n",
+           ( long ) mem.peak_bytes, ( long ) budget.dropped, ( unsigned long ) peak_rss ( ) );
     /*
      * finish
      */
     free_patch_template ( template );
     free_stats ( stats_tree );
+    for ( int f = 0 ; f < npaths ; ++f ) {
+        free ( paths[ f ] );
+    }
+    free ( paths );
     free ( line );
-    t1 = clock( );
-    printf ( "Took %ld seconds.\n", t1 - t0 );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.file_list_file ) != RESULT_OK ) ) {
+        fprintf ( stderr, "error writing metrics to %s.\n", cfg.metrics_file );
+    }
+    printf ( "Took %.3f seconds.\n", 1e-9 * ( double ) ( instrument_now ( ) - t0 ) );
     exit ( 0 );
 }
 
@@ -175,6 +337,32 @@ static error_t parse_opt ( int key, char * arg, struct argp_state * state ) {
     case 's':
         cfg->stats_file = arg;
         break;
+    case 'M':
+        cfg->metrics_file = arg;
+        break;
+    case 'r':
+        cfg->resume = 1;
+        break;
+    case 't':
+        cfg->shared = 1;
+        break;
+    case 'b': {
+        char * end;
+        double size = strtod ( arg, &end );
+        switch ( *end ) {
+        case 'g': case 'G': size *= 1024.0;
+        /* fall through */
+        case 'm': case 'M': size *= 1024.0;
+        /* fall through */
+        case 'k': case 'K': size *= 1024.0;
+        }
+        if ( ( end == arg ) || ( size < 0.0 ) ) {
+            error ( "invalid memory budget %s\n", arg );
+            argp_usage ( state );
+        }
+        cfg->budget = ( index_t ) size;
+        break;
+    }
 
     case ARGP_KEY_ARG:
         switch ( state->arg_num ) {
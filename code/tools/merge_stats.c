@@ -0,0 +1,138 @@
+/**
+ * \file merge_stats.c
+ * \brief Merge stats files gathered separately, e.g. from shards of a corpus
+ *
+ *  The files are merged as streams, so the memory used does not depend on
+ *  their size; see merge_stats_files.
+ *
+ *  Uses GNU argp to parse arguments
+ *  see http://www.gnu.org/software/libc/manual/html_node/Argp.html
+ */
+#include <stdlib.h>
+#include <argp.h>                     // argument parsing
+#include <string.h>
+
+#include "stats.h"
+#include "logging.h"
+#include "instrument.h"            // basic benchmarking
+
+/**
+ * These are the options that we can handle through the command line
+ */
+static struct argp_option options[] = {
+    {"verbose",        'v', 0, OPTION_ARG_OPTIONAL, "Produce verbose output", 0 },
+    {"quiet",          'q', 0, OPTION_ARG_OPTIONAL, "Don't produce any output", 0 },
+    {"output",         'o', "file", 0,             "Path to the merged stats file.", 0 },
+    {"metrics",        'M', "file", 0,             "Append per-stage timings and counters as a JSON line to file (- for stdout).", 0 },
+    { 0 } // terminator
+};
+
+/**
+ * Program options. These are filled in by the argument parser
+ */
+typedef struct  {
+    char * output_file;
+    char * metrics_file;
+    const char * * input_files;
+    int ninputs;
+} config_st;
+
+/**
+ * options handler
+ */
+static error_t parse_opt ( int key, char * arg, struct argp_state * state );
+
+/**
+ * General description of what this program does; appears when calling with --help
+ */
+static char program_doc[] =
+    "\n*** merge stats files    ***\n";
+
+/**
+ * A general description of the input arguments we accept; appears when calling with --help
+ */
+static char args_doc[] = "[OPTIONS] <STATS_FILE> [<STATS_FILE> ...]";
+
+/**
+ * argp configuration structure
+ */
+static struct argp argp = { options, parse_opt, args_doc, program_doc, 0, 0, 0 };
+
+/**
+ * main function
+ */
+int main ( int argc, char * * argv ) {
+    config_st cfg; // command-line program configuration
+    const uint64_t t0 = instrument_now ( ); // for benchmarking
+
+    /*
+     * Default program configuration
+     */
+    set_log_level ( LOG_INFO );
+    set_log_stream ( stdout );
+    cfg.output_file = "patch.stats";
+    cfg.metrics_file = NULL;
+    cfg.input_files = ( const char * * ) calloc ( argc, sizeof( const char * ) );
+    cfg.ninputs = 0;
+    /*
+     * call parser
+     */
+    argp_parse ( &argp, argc, argv, 0, 0, &cfg );
+    for ( int f = 0 ; f < cfg.ninputs ; ++f ) {
+        if ( !strcmp ( cfg.input_files[ f ], cfg.output_file ) ) {
+            error ( "the output %s is also an input.\n", cfg.output_file );
+            exit ( 1 );
+        }
+    }
+    info ( "merging %d stats files into %s\n", cfg.ninputs, cfg.output_file );
+    const int res = merge_stats_files ( cfg.output_file, cfg.input_files, cfg.ninputs );
+    if ( res ) {
+        error ( "could not merge the stats files.\n" );
+    }
+    free ( cfg.input_files );
+    if ( cfg.metrics_file && ( save_instrument_json ( cfg.metrics_file, argv[ 0 ], cfg.output_file ) != 0 ) ) {
+        error ( "error writing metrics to %s.\n", cfg.metrics_file );
+    }
+    info ( "Took %.3f seconds.\n", 1e-9 * ( double ) ( instrument_now ( ) - t0 ) );
+    exit ( res ? 1 : 0 );
+}
+
+
+/*
+ * argp callback for parsing a single option.
+ */
+static error_t parse_opt ( int key, char * arg, struct argp_state * state ) {
+    /* Get the input argument from argp_parse,
+     * which we know is a pointer to our arguments structure.
+     */
+    config_st * cfg = ( config_st* ) state->input;
+    switch ( key ) {
+    case 'q':
+        set_log_level ( LOG_ERROR );
+        break;
+    case 'v':
+        set_log_level ( LOG_DEBUG );
+        break;
+    case 'o':
+        cfg->output_file = arg;
+        break;
+    case 'M':
+        cfg->metrics_file = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        cfg->input_files[ cfg->ninputs++ ] = arg;
+        break;
+    case ARGP_KEY_END:
+        if ( state->arg_num < 1 ) {
+            /* Not enough mandatory arguments! */
+            error ( "Too FEW arguments!\n" );
+            argp_usage ( state );
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
@@ -0,0 +1,428 @@
+/**
+ * Simulation harness: corrupts clean images with the binary asymmetric channel,
+ * denoises them with the selected methods and compares the results with the
+ * clean images, all in memory, for every combination of image, P(0->1), P(1->0),
+ * template and method. Writes one CSV row per combination with the confusion
+ * counts (as printed by compare) and the time spent in each stage.
+ *
+ * This replaces the add_noise -> denoiser -> compare loops of the scripts:
+ * the noisy images are the same as those produced by add_noise with the same
+ * seed, and the outputs the same as those of median, quorum_den and bin_dude.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+
+#include "pnm.h"
+#include "image.h"
+#include "templates.h"
+#include "noise.h"
+#include "median.h"
+#include "quorum.h"
+#include "dude.h"
+#include "logging.h"
+#include "instrument.h"
+
+#define MAX_VALUES 64
+
+typedef enum method {
+    METHOD_MEDIAN = 0,
+    METHOD_QUORUM,
+    METHOD_DUDE,
+    NMETHODS
+} method_t;
+
+static const char* method_names[] = { "median", "quorum", "dude" };
+
+/**
+ * Program options. These are filled in by the argument parser
+ */
+typedef struct config {
+    const char * input_files[ MAX_VALUES ];
+    int nimages;
+    const char * template_files[ MAX_VALUES ];
+    int ntemplates;
+    double p01[ MAX_VALUES ];
+    int np01;
+    double p10[ MAX_VALUES ];
+    int np10;
+    int methods[ NMETHODS ];
+    int iterations;
+    int seed;
+    const char * output_file;
+} config_t;
+
+config_t parse_opt ( int argc, char* * argv );
+
+/**
+ * outcome of one combination
+ */
+typedef struct sim_result {
+    index_t noisy01, noisy10;  // errors of the noisy image
+    index_t errors01, errors10; // errors of the denoised image
+    double t_noise, t_denoise, t_compare;
+    int done;
+} sim_result_t;
+
+
+/**
+ * pixels that are 0 in the clean image and 1 in img, and vice versa
+ */
+static void count_errors ( const image_t* clean, const image_t* img, index_t* e01, index_t* e10 ) {
+    const index_t npixels = ( index_t ) clean->info.width * clean->info.height;
+    index_t a = 0, b = 0;
+    for ( index_t li = 0 ; li < npixels ; ++li ) {
+        const pixel_t x = clean->pixels[ li ];
+        const pixel_t y = img->pixels[ li ];
+        a += ( !x && y );
+        b += ( x && !y );
+    }
+    *e01 = a;
+    *e10 = b;
+}
+
+
+/**
+ * denoise the noisy image with one method; out must be a copy of noisy
+ */
+static void denoise ( const method_t method, const patch_template_t* tpl, const config_t* cfg,
+                      const double p01, const double p10, const image_t* noisy, image_t* out ) {
+    void* work;
+    switch ( method ) {
+    case METHOD_MEDIAN: {
+        work = malloc ( median_workspace_size ( &noisy->info, tpl ) );
+        median_ctx_t ctx;
+        init_median ( &ctx, &noisy->info, tpl, work );
+        median_filter ( &ctx, noisy, out );
+        break;
+    }
+    case METHOD_QUORUM: {
+        quorum_params_t par = { .p01 = p01, .p10 = p10, .fused = 0, .auto_noise = 0, .visit_all = 0 };
+        work = malloc ( quorum_workspace_size ( &noisy->info, tpl, &par ) );
+        quorum_ctx_t ctx;
+        init_quorum ( &ctx, &noisy->info, tpl, &par, work );
+        quorum_denoise ( &ctx, noisy, out, cfg->iterations );
+        break;
+    }
+    default: {
+        dude_params_t par = { .p01 = p01, .p10 = p10, .auto_noise = 0, .visit_all = 0 };
+        work = malloc ( dude_workspace_size ( tpl ) );
+        dude_ctx_t ctx;
+        init_dude ( &ctx, tpl, &par, work );
+        image_t* pre = image_copy ( noisy );
+        dude_denoise ( &ctx, noisy, pre, out, cfg->iterations > 0 ? cfg->iterations : 1 );
+        pixels_free ( pre->pixels );
+        free ( pre );
+        break;
+    }
+    }
+    free ( work );
+}
+
+
+/**
+ * one image, channel and template: add the noise and run all the selected methods
+ */
+static void simulate ( const config_t* cfg, const image_t* clean, const patch_template_t* tpl,
+                       const double p01, const double p10, sim_result_t* res ) {
+    uint64_t t = instrument_now ( );
+    image_t* noisy = image_copy ( clean );
+    rand48_t rng;
+    seed_rand48 ( &rng, cfg->seed );
+    add_channel_noise ( clean, noisy, p01, p10, &rng );
+    const double t_noise = 1e-9 * ( double ) ( instrument_now ( ) - t );
+    index_t noisy01, noisy10;
+    count_errors ( clean, noisy, &noisy01, &noisy10 );
+    image_t* out = image_copy ( noisy );
+    for ( int method = 0 ; method < NMETHODS ; ++method ) {
+        if ( !cfg->methods[ method ] ) {
+            continue;
+        }
+        sim_result_t* r = &res[ method ];
+        r->t_noise = t_noise;
+        r->noisy01 = noisy01;
+        r->noisy10 = noisy10;
+        pixels_copyto ( out, noisy );
+        t = instrument_now ( );
+        denoise ( ( method_t ) method, tpl, cfg, p01, p10, noisy, out );
+        r->t_denoise = 1e-9 * ( double ) ( instrument_now ( ) - t );
+        t = instrument_now ( );
+        count_errors ( clean, out, &r->errors01, &r->errors10 );
+        r->t_compare = 1e-9 * ( double ) ( instrument_now ( ) - t );
+        r->done = 1;
+    }
+    pixels_free ( out->pixels );
+    free ( out );
+    pixels_free ( noisy->pixels );
+    free ( noisy );
+}
+
+
+int main ( int argc, char* argv[] ) {
+    config_t cfg = parse_opt ( argc, argv );
+    int res = RESULT_OK;
+
+    image_t* images[ MAX_VALUES ];
+    patch_template_t* templates[ MAX_VALUES ];
+    int nimages = 0, ntemplates = 0;
+    for ( ; nimages < cfg.nimages ; ++nimages ) {
+        images[ nimages ] = read_pnm ( cfg.input_files[ nimages ] );
+        if ( !images[ nimages ] || ( images[ nimages ]->info.result != RESULT_OK ) ||
+             ( images[ nimages ]->info.maxval > 1 ) ) {
+            fprintf ( stderr, "error reading binary image %s.\n", cfg.input_files[ nimages ] );
+            if ( images[ nimages ] ) {
+                pixels_free ( images[ nimages ]->pixels );
+                free ( images[ nimages ] );
+            }
+            res = RESULT_ERROR;
+            break;
+        }
+    }
+    for ( ; ( res == RESULT_OK ) && ( ntemplates < cfg.ntemplates ) ; ++ntemplates ) {
+        templates[ ntemplates ] = read_template ( cfg.template_files[ ntemplates ] );
+        if ( !templates[ ntemplates ] ) {
+            fprintf ( stderr, "missing or invalid template file %s.\n", cfg.template_files[ ntemplates ] );
+            res = RESULT_ERROR;
+            break;
+        }
+        sort_template ( templates[ ntemplates ], 1 );
+    }
+    FILE* csv = stdout;
+    if ( ( res == RESULT_OK ) && cfg.output_file ) {
+        csv = fopen ( cfg.output_file, "w" );
+        if ( !csv ) {
+            fprintf ( stderr, "error opening output file %s.\n", cfg.output_file );
+            res = RESULT_ERROR;
+        }
+    }
+    if ( res == RESULT_OK ) {
+        //
+        // one unit of work per image, channel and template; each unit runs all the methods
+        //
+        const int nunits = nimages * cfg.np01 * cfg.np10 * ntemplates;
+        sim_result_t* results = ( sim_result_t* ) calloc ( ( size_t ) nunits * NMETHODS, sizeof( sim_result_t ) );
+        const uint64_t t = instrument_now ( );
+#ifdef PARALLEL
+        #pragma omp parallel for schedule(dynamic)
+#endif
+        for ( int u = 0 ; u < nunits ; ++u ) {
+            const int c = u % ntemplates;
+            const int b = ( u / ntemplates ) % cfg.np10;
+            const int a = ( u / ( ntemplates * cfg.np10 ) ) % cfg.np01;
+            const int i = u / ( ntemplates * cfg.np10 * cfg.np01 );
+            simulate ( &cfg, images[ i ], templates[ c ], cfg.p01[ a ], cfg.p10[ b ], &results[ u * NMETHODS ] );
+            debug ( "%s p01=%g p10=%g %s done.\n", cfg.input_files[ i ], cfg.p01[ a ], cfg.p10[ b ],
+                    cfg.template_files[ c ] );
+        }
+        info ( "%d simulations in %f seconds.\n", nunits, 1e-9 * ( double ) ( instrument_now ( ) - t ) );
+
+        fprintf ( csv, "image,template,p01,p10,seed,method,noisy_01,noisy_10,noisy_rate,"
+                       "errors_01,errors_10,error_rate,t_noise,t_denoise,t_compare\n" );
+        for ( int u = 0 ; u < nunits ; ++u ) {
+            const int c = u % ntemplates;
+            const int b = ( u / ntemplates ) % cfg.np10;
+            const int a = ( u / ( ntemplates * cfg.np10 ) ) % cfg.np01;
+            const int i = u / ( ntemplates * cfg.np10 * cfg.np01 );
+            const double npixels = ( double ) images[ i ]->info.width * images[ i ]->info.height;
+            for ( int method = 0 ; method < NMETHODS ; ++method ) {
+                const sim_result_t* r = &results[ u * NMETHODS + method ];
+                if ( !r->done ) {
+                    continue;
+                }
+                fprintf ( csv, "%s,%s,%g,%g,%d,%s,%ld,%ld,%.6f,%ld,%ld,%.6f,%.6f,%.6f,%.6f\n",
+                          cfg.input_files[ i ], cfg.template_files[ c ], cfg.p01[ a ], cfg.p10[ b ],
+                          cfg.seed, method_names[ method ],
+                          ( long ) r->noisy01, ( long ) r->noisy10, ( r->noisy01 + r->noisy10 ) / npixels,
+                          ( long ) r->errors01, ( long ) r->errors10, ( r->errors01 + r->errors10 ) / npixels,
+                          r->t_noise, r->t_denoise, r->t_compare );
+            }
+        }
+        free ( results );
+        if ( csv != stdout ) {
+            fclose ( csv );
+        }
+    }
+
+    for ( int c = 0 ; c < ntemplates ; ++c ) {
+        free_patch_template ( templates[ c ] );
+    }
+    for ( int i = 0 ; i < nimages ; ++i ) {
+        pixels_free ( images[ i ]->pixels );
+        free ( images[ i ] );
+    }
+    return res;
+}
+
+/**
+ * These are the options that we can handle through the command line
+ */
+static struct argp_option options[] = {
+    {"verbose",        'v', 0, OPTION_ARG_OPTIONAL, "Produce verbose output", 0 },
+    {"quiet",          'q', 0, OPTION_ARG_OPTIONAL, "Don't produce any output", 0 },
+    {"template",       'T', "list", 0, "comma-separated template files", 0 },
+    {"pzero",          '0', "list", 0, "comma-separated values of P(0->1)", 0 },
+    {"pone",           '1', "list", 0, "comma-separated values of P(1->0)", 0 },
+    {"methods",        'm', "list", 0, "comma-separated methods among median, quorum and dude (default all)", 0 },
+    {"iterations",     'I', "number", 0, "iterations of quorum and dude. Default 1; 0 iterates quorum until nothing changes", 0 },
+    {"seed",           's', "seed", 0, "random seed of the channel, as in add_noise", 0 },
+    {"output",         'o', "file", 0, "CSV output file (default standard output)", 0 },
+    { 0 } // terminator
+};
+
+/**
+ * options handler
+ */
+static error_t _parse_opt ( int key, char * arg, struct argp_state * state );
+
+/**
+ * General description of what this program does; appears when calling with --help
+ */
+static char program_doc[] =
+    "\n*** add noise to clean images, denoise them and compare, in memory ***\n";
+
+/**
+ * A general description of the input arguments we accept; appears when calling with --help
+ */
+static char args_doc[] = "<CLEAN_FILE> [<CLEAN_FILE> ...]";
+
+/**
+ * argp configuration structure
+ */
+static struct argp argp = { options, _parse_opt, args_doc, program_doc, 0, 0, 0 };
+
+
+config_t parse_opt ( int argc, char* * argv ) {
+    config_t cfg;
+    cfg.nimages = 0;
+    cfg.ntemplates = 0;
+    cfg.p01[ 0 ] = 0.025;
+    cfg.np01 = 1;
+    cfg.p10[ 0 ] = 0.025;
+    cfg.np10 = 1;
+    for ( int method = 0 ; method < NMETHODS ; ++method ) {
+        cfg.methods[ method ] = 1;
+    }
+    cfg.iterations = 1;
+    cfg.seed = 42;
+    cfg.output_file = NULL;
+    //
+    // the denoisers report on every image; keep quiet unless asked
+    //
+    set_log_level ( LOG_QUIET );
+    argp_parse ( &argp, argc, argv, 0, 0, &cfg );
+    return cfg;
+}
+
+/**
+ * split a comma-separated list in place
+ * @return number of items
+ */
+static int split_list ( char * arg, const char * * items, struct argp_state * state ) {
+    int n = 0;
+    for ( char * s = strtok ( arg, "," ) ; s ; s = strtok ( NULL, "," ) ) {
+        if ( n == MAX_VALUES ) {
+            error ( "too many values in list.\n" );
+            argp_usage ( state );
+        }
+        items[ n++ ] = s;
+    }
+    return n;
+}
+
+/**
+ * parse a comma-separated list of probabilities
+ * @return number of values
+ */
+static int parse_probabilities ( char * arg, double * values, struct argp_state * state ) {
+    const char * items[ MAX_VALUES ];
+    const int n = split_list ( arg, items, state );
+    for ( int r = 0 ; r < n ; ++r ) {
+        char * end;
+        values[ r ] = strtod ( items[ r ], &end );
+        if ( *end || ( values[ r ] < 0.0 ) || ( values[ r ] >= 0.5 ) ) {
+            error ( "invalid probability %s\n", items[ r ] );
+            argp_usage ( state );
+        }
+    }
+    return n;
+}
+
+/*
+ * argp callback for parsing a single option.
+ */
+static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
+    /* Get the input argument from argp_parse,
+     * which we know is a pointer to our arguments structure.
+     */
+    config_t * cfg = ( config_t* ) state->input;
+    switch ( key ) {
+    case 'q':
+        set_log_level ( LOG_ERROR );
+        break;
+    case 'v':
+        set_log_level ( LOG_DEBUG );
+        break;
+    case 'T':
+        cfg->ntemplates = split_list ( arg, cfg->template_files, state );
+        break;
+    case '0':
+        cfg->np01 = parse_probabilities ( arg, cfg->p01, state );
+        break;
+    case '1':
+        cfg->np10 = parse_probabilities ( arg, cfg->p10, state );
+        break;
+    case 'm': {
+        const char * items[ MAX_VALUES ];
+        const int n = split_list ( arg, items, state );
+        for ( int method = 0 ; method < NMETHODS ; ++method ) {
+            cfg->methods[ method ] = 0;
+        }
+        for ( int r = 0 ; r < n ; ++r ) {
+            int method = 0;
+            while ( ( method < NMETHODS ) && strcmp ( items[ r ], method_names[ method ] ) ) {
+                method++;
+            }
+            if ( method == NMETHODS ) {
+                error ( "unknown method %s\n", items[ r ] );
+                argp_usage ( state );
+            }
+            cfg->methods[ method ] = 1;
+        }
+        break;
+    }
+    case 'I':
+        cfg->iterations = atoi ( arg );
+        break;
+    case 's':
+        cfg->seed = atoi ( arg );
+        break;
+    case 'o':
+        cfg->output_file = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        if ( cfg->nimages == MAX_VALUES ) {
+            /** too many arguments! */
+            error ( "Too many arguments!.\n" );
+            argp_usage ( state );
+        }
+        cfg->input_files[ cfg->nimages++ ] = arg;
+        break;
+    case ARGP_KEY_END:
+        if ( state->arg_num < 1 ) {
+            /* Not enough mandatory arguments! */
+            error ( "Too FEW arguments!\n" );
+            argp_usage ( state );
+        }
+        if ( !cfg->ntemplates ) {
+            error ( "at least one template is required.\n" );
+            argp_usage ( state );
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
@@ -0,0 +1,308 @@
+/**
+ * Denoise one image for a whole grid of channel parameters P(0->1) x P(1->0)
+ * with the quorum and DUDE rules, gathering the context statistics only once
+ * per method. Writes the denoised images and/or a table with the number of
+ * changed pixels and, given the clean image, the number of errors.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+
+#include "pnm.h"
+#include "image.h"
+#include "templates.h"
+#include "sweep.h"
+#include "logging.h"
+
+#define MAX_VALUES 64
+
+/**
+ * Program options. These are filled in by the argument parser
+ */
+typedef struct config {
+    const char * input_file;
+    const char * template_file;
+    const char * clean_file;
+    const char * output_prefix;
+    double p01[ MAX_VALUES ];
+    int np01;
+    double p10[ MAX_VALUES ];
+    int np10;
+    int quorum;
+    int dude;
+} config_t;
+
+config_t parse_opt ( int argc, char* * argv );
+
+static const char* method_names[] = { "quorum", "dude" };
+
+
+static image_t* read_binary_image ( const char* fname ) {
+    image_t* img = read_pnm ( fname );
+    if ( img == NULL ) {
+        fprintf ( stderr, "error opening image %s.\n", fname );
+        return NULL;
+    }
+    if ( ( img->info.result != RESULT_OK ) || ( img->info.maxval > 1 ) ) {
+        fprintf ( stderr, "error reading image %s: only binary images supported.\n", fname );
+        pixels_free ( img->pixels );
+        free ( img );
+        return NULL;
+    }
+    return img;
+}
+
+
+/**
+ * evaluate all the points of the grid for one method
+ */
+static int run_sweep ( const config_t* cfg, const sweep_method_t method, const patch_template_t* tpl,
+                       const image_t* img, const image_t* clean ) {
+    const int npoints = cfg->np01 * cfg->np10;
+    const index_t npixels = ( index_t ) img->info.width * img->info.height;
+    sweep_result_t* res = ( sweep_result_t* ) calloc ( npoints, sizeof( sweep_result_t ) );
+    void* workspace = malloc ( sweep_workspace_size ( &img->info, tpl, method ) );
+    sweep_ctx_t ctx;
+    init_sweep ( &ctx, &img->info, tpl, method, workspace );
+    info ( "%s: gathering statistics.\n", method_names[ method ] );
+    sweep_gather ( &ctx, img );
+    int failed = 0;
+#ifdef PARALLEL
+    #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+#endif
+    for ( int c = 0 ; c < npoints ; ++c ) {
+        sweep_point_t point;
+        point.p01 = cfg->p01[ c / cfg->np10 ];
+        point.p10 = cfg->p10[ c % cfg->np10 ];
+        image_t* out = NULL;
+        if ( cfg->output_prefix ) {
+            out = image_copy ( img );
+        }
+        sweep_apply ( &ctx, &point, img, out, clean, &res[ c ] );
+        if ( out ) {
+            char fname[ 1024 ];
+            snprintf ( fname, sizeof( fname ), "%s_p%g_q%g_%s.pbm",
+                       cfg->output_prefix, point.p01, point.p10, method_names[ method ] );
+            if ( write_pnm ( fname, out ) != RESULT_OK ) {
+                fprintf ( stderr, "error writing image %s.\n", fname );
+                failed++;
+            }
+            pixels_free ( out->pixels );
+            free ( out );
+        }
+    }
+    for ( int c = 0 ; c < npoints ; ++c ) {
+        printf ( "%-6s p01 %8.5f p10 %8.5f changed %9ld (%8.5f%%)",
+                 method_names[ method ], cfg->p01[ c / cfg->np10 ], cfg->p10[ c % cfg->np10 ],
+                 ( long ) res[ c ].changed, 100.0 * res[ c ].changed / npixels );
+        if ( clean ) {
+            printf ( " errors 0->1 %9ld 1->0 %9ld total %9ld (%8.5f%%)",
+                     ( long ) res[ c ].errors01, ( long ) res[ c ].errors10,
+                     ( long ) res[ c ].errors, 100.0 * res[ c ].errors / npixels );
+        }
+        printf ( "\n" );
+    }
+    sweep_release ( &ctx );
+    free ( workspace );
+    free ( res );
+    return failed ? RESULT_ERROR : RESULT_OK;
+}
+
+
+int main ( int argc, char* argv[] ) {
+    config_t cfg = parse_opt ( argc, argv );
+
+    image_t* img = read_binary_image ( cfg.input_file );
+    if ( img == NULL ) {
+        return RESULT_ERROR;
+    }
+    image_t* clean = NULL;
+    if ( cfg.clean_file ) {
+        clean = read_binary_image ( cfg.clean_file );
+        if ( clean == NULL ) {
+            pixels_free ( img->pixels );
+            free ( img );
+            return RESULT_ERROR;
+        }
+        if ( ( clean->info.width != img->info.width ) || ( clean->info.height != img->info.height ) ) {
+            fprintf ( stderr, "clean and noisy images differ in size.\n" );
+            pixels_free ( clean->pixels );
+            free ( clean );
+            pixels_free ( img->pixels );
+            free ( img );
+            return RESULT_ERROR;
+        }
+    }
+    patch_template_t* tpl = read_template ( cfg.template_file );
+    if ( !tpl ) {
+        fprintf ( stderr, "missing or invalid template file %s.\n", cfg.template_file );
+        if ( clean ) {
+            pixels_free ( clean->pixels );
+            free ( clean );
+        }
+        pixels_free ( img->pixels );
+        free ( img );
+        return RESULT_ERROR;
+    }
+    sort_template ( tpl, 1 );
+
+    int res = RESULT_OK;
+    if ( cfg.quorum && ( run_sweep ( &cfg, SWEEP_QUORUM, tpl, img, clean ) != RESULT_OK ) ) {
+        res = RESULT_ERROR;
+    }
+    if ( cfg.dude && ( run_sweep ( &cfg, SWEEP_DUDE, tpl, img, clean ) != RESULT_OK ) ) {
+        res = RESULT_ERROR;
+    }
+
+    free_patch_template ( tpl );
+    if ( clean ) {
+        pixels_free ( clean->pixels );
+        free ( clean );
+    }
+    pixels_free ( img->pixels );
+    free ( img );
+    return res;
+}
+
+/**
+ * These are the options that we can handle through the command line
+ */
+static struct argp_option options[] = {
+    {"verbose",        'v', 0, OPTION_ARG_OPTIONAL, "Produce verbose output", 0 },
+    {"quiet",          'q', 0, OPTION_ARG_OPTIONAL, "Don't produce any output", 0 },
+    {"template",       'T', "file", 0, "template file", 0 },
+    {"p01",            '0', "list", 0, "comma-separated values of P(0->1)", 0 },
+    {"p10",            '1', "list", 0, "comma-separated values of P(1->0)", 0 },
+    {"method",         'm', "method", 0, "quorum, dude or both (default)", 0 },
+    {"clean",          'c', "file", 0, "clean image; count the errors of each output", 0 },
+    {"output",         'o', "prefix", 0, "write each output to <prefix>_p<P(0->1)>_q<P(1->0)>_<method>.pbm", 0 },
+    { 0 } // terminator
+};
+
+/**
+ * options handler
+ */
+static error_t _parse_opt ( int key, char * arg, struct argp_state * state );
+
+/**
+ * General description of what this program does; appears when calling with --help
+ */
+static char program_doc[] =
+    "\n*** denoise an image for a grid of channel parameters ***\n";
+
+/**
+ * A general description of the input arguments we accept; appears when calling with --help
+ */
+static char args_doc[] = "<INPUT_FILE>";
+
+/**
+ * argp configuration structure
+ */
+static struct argp argp = { options, _parse_opt, args_doc, program_doc, 0, 0, 0 };
+
+
+config_t parse_opt ( int argc, char* * argv ) {
+    config_t cfg;
+    cfg.input_file  = NULL;
+    cfg.template_file = NULL;
+    cfg.clean_file = NULL;
+    cfg.output_prefix = NULL;
+    cfg.p01[ 0 ] = 0.025;
+    cfg.np01 = 1;
+    cfg.p10[ 0 ] = 0.025;
+    cfg.np10 = 1;
+    cfg.quorum = 1;
+    cfg.dude = 1;
+    argp_parse ( &argp, argc, argv, 0, 0, &cfg );
+    return cfg;
+}
+
+/**
+ * parse a comma-separated list of probabilities into values
+ * @return number of values
+ */
+static int parse_list ( const char * arg, double * values, struct argp_state * state ) {
+    int n = 0;
+    const char * s = arg;
+    while ( *s ) {
+        char * end;
+        const double v = strtod ( s, &end );
+        if ( ( end == s ) || ( v < 0.0 ) || ( v >= 0.5 ) || ( n == MAX_VALUES ) ) {
+            error ( "invalid list of probabilities: %s\n", arg );
+            argp_usage ( state );
+        }
+        values[ n++ ] = v;
+        s = ( *end == ',' ) ? end + 1 : end;
+    }
+    return n;
+}
+
+/*
+ * argp callback for parsing a single option.
+ */
+static error_t _parse_opt ( int key, char * arg, struct argp_state * state ) {
+    /* Get the input argument from argp_parse,
+     * which we know is a pointer to our arguments structure.
+     */
+    config_t * cfg = ( config_t* ) state->input;
+    switch ( key ) {
+    case 'q':
+        set_log_level ( LOG_ERROR );
+        break;
+    case 'v':
+        set_log_level ( LOG_DEBUG );
+        break;
+    case 'T':
+        cfg->template_file = arg;
+        break;
+    case '0':
+        cfg->np01 = parse_list ( arg, cfg->p01, state );
+        break;
+    case '1':
+        cfg->np10 = parse_list ( arg, cfg->p10, state );
+        break;
+    case 'm':
+        cfg->quorum = !strcmp ( arg, "quorum" ) || !strcmp ( arg, "both" );
+        cfg->dude   = !strcmp ( arg, "dude" )   || !strcmp ( arg, "both" );
+        if ( !cfg->quorum && !cfg->dude ) {
+            error ( "unknown method %s\n", arg );
+            argp_usage ( state );
+        }
+        break;
+    case 'c':
+        cfg->clean_file = arg;
+        break;
+    case 'o':
+        cfg->output_prefix = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        switch ( state->arg_num ) {
+        case 0:
+            cfg->input_file = arg;
+            break;
+        default:
+            /** too many arguments! */
+            error ( "Too many arguments!.\n" );
+            argp_usage ( state );
+            break;
+        }
+        break;
+    case ARGP_KEY_END:
+        if ( state->arg_num < 1 ) {
+            /* Not enough mandatory arguments! */
+            error ( "Too FEW arguments!\n" );
+            argp_usage ( state );
+        }
+        if ( !cfg->template_file ) {
+            error ( "a template is required.\n" );
+            argp_usage ( state );
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
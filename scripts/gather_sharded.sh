@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# gather the stats of a list of images in several shards, each one by a
+# separate gather_stats process, and merge them into one stats file
+#
+# usage: gather_sharded.sh <FILE_LIST> <TEMPLATE_FILE> <OUTPUT> [SHARDS] [PREFIX]
+#
+# the shards could as well run on different machines: only their stats
+# files need to be brought together for merge_stats
+#
+if [[ $# -lt 3 ]]
+then
+  echo "usage: $0 <FILE_LIST> <TEMPLATE_FILE> <OUTPUT> [SHARDS] [PREFIX]"
+  exit 1
+fi
+list=$1
+template=$2
+output=$3
+shards=${4:-4}
+prefix=${5:-.}
+bindir=${BINDIR:-build/tools}
+
+workdir=$(mktemp -d)
+split -n l/${shards} -d ${list} ${workdir}/shard
+pids=""
+for shard in ${workdir}/shard*
+do
+  ${bindir}/gather_stats -q -p ${prefix} -s ${shard}.stats ${shard} ${template} > ${shard}.log &
+  pids="${pids} $!"
+done
+failed=0
+for pid in ${pids}
+do
+  wait ${pid} || failed=1
+done
+if [[ ${failed} -eq 0 ]]
+then
+  ${bindir}/merge_stats -q -o ${output} ${workdir}/shard*.stats || failed=1
+fi
+rm -rf ${workdir}
+exit ${failed}
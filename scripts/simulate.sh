@@ -0,0 +1,14 @@
+#!/bin/bash
+#
+# same grid as run_sim.sh, run in memory by a single process:
+# add noise, denoise with median, quorum and DUDE, and compare against the clean image.
+# Build with -DPARALLEL=ON to run the configurations in parallel.
+#
+indir="data/luisa_sel"
+mkdir -p results
+build/tools/simulate --seed=42 \
+  --pzero=0.025,0.05,0.1 --pone=0.025,0.05,0.1 \
+  --template=tpl/n8.tpl,tpl/n8star.tpl,tpl/n8star3.tpl \
+  --methods=median,quorum,dude \
+  --output=results/simulate.csv \
+  ${indir}/r0566_0517.pbm ${indir}/r0566_0121.pbm ${indir}/r0566_0175.pbm ${indir}/r0566_0826.pbm